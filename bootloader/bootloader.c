@@ -7,6 +7,8 @@
 #include "stm32c0xx_hal_flash.h"
 #include "stm32c0xx_ll_crc.h"
 
+#include "lz.h"
+
 
 #pragma region Device configuration
 
@@ -23,6 +25,7 @@
 
 
 #define WRITE_SIZE 8
+#define LZ_BUFFER_SIZE 1024
 
 
 enum Model {
@@ -40,19 +43,53 @@ enum Model {
 #error NUM_PORTS must be defined as 1, 2, 3 or 4
 #endif
 
+// Router builds define BOOT_PROXY to forward pass packets between their ports. Other nodes with more
+// ports must not forward them, because each of them would put a copy on the destination bus.
+#if defined(BOOT_PROXY) && NUM_PORTS < 2
+#error BOOT_PROXY requires at least 2 ports
+#endif
+
 enum {
     BOOT_TYPE_PASS = 0,
     BOOT_TYPE_PASSED = 1,
     BOOT_TYPE_RESPONSE = 2,
 };
 
+enum {
+    CMD_INIT = 0,
+    CMD_ERASE = 1,
+    CMD_WRITE = 2,
+    CMD_READ = 3,
+    CMD_RESET = 4,
+    CMD_PING = 5,
+    CMD_PAGE_CRC = 6,
+    CMD_WRITE_LZ = 7,
+    CMD_MC_JOIN = 8,
+    CMD_MC_STATUS = 9,
+    CMD_SET_BAUD = 10,
+    CMD_LAST_ID = CMD_SET_BAUD,
+};
+
+#define BOOT_TYPE_MASK 0x0F
+#define BOOT_PORT_SHIFT 4 // Pass packets have destination port number in the upper bits of boot type
+
 #define BUFFER_SIZE (256 + 32) // TODO: May be smaller
 #define UUID_SIZE 13 // Includes model byte
 #define NETWORK_HEADER_SIZE 7
+#define MULTICAST_ID_SIZE 2 // Model byte and group, used instead of UUID
+#define MULTICAST_HEADER_SIZE (NETWORK_HEADER_SIZE + MULTICAST_ID_SIZE)
+#define MULTICAST_MAX_CHUNKS 256
+#define TICKS_PER_SECOND 100
+#define HIGH_SPEED_SILENCE_TIMEOUT (TICKS_PER_SECOND / 2) // Return to default baud rate after this time without valid packet
+#define HIGH_SPEED_ERROR_LIMIT 4 // or after this number of framing errors
+#define RELAY_TIMEOUT (TICKS_PER_SECOND / 10) // Stop relaying responses after this time without data
+#define BOOT_TYPE_INDEX 5
 #define ERROR_DATA -2
 #define NO_DATA -1
 #define ESC 0xFF
 #define END 0xFE
+#define MAX_PAYLOAD_SIZE 249
+#define RESPONSE_HEADER_SIZE (NETWORK_HEADER_SIZE + UUID_SIZE - 2 + 4) // Without ESC and mask, with command counter
 
 typedef struct PortState
 {
@@ -60,24 +97,57 @@ typedef struct PortState
     uint32_t rxIndex;
     uint8_t rxBuffer[BUFFER_SIZE];
     bool headerReceived;
+    bool multicast;
+    bool highSpeed;
+    uint8_t errorCount;
+    uint32_t defaultBrr;
+    uint32_t lastPacketTick;
+    uint32_t crc; // Running CRC of the received packet, valid when the port does not own the CRC unit
+    struct PortState *forwardTo; // Destination port of the pass packet being received
 } PortState;
 
+typedef struct Fifo {
+    struct PortState *port;
+    uint8_t head;
+    uint8_t tail;
+    uint8_t data[256]; // Indexes wrap naturally
+} Fifo;
+
 typedef struct DeviceInfo {
 	uint32_t loadAddress;
 	uint16_t totalPages;
 	uint8_t pageSizeLog2;
 	uint8_t writeSizeLog2;
 	uint8_t deviceModel;
+	uint8_t lzBufferSizeLog2;
 } DeviceInfo;
 
 __attribute__((aligned(4)))
 static uint8_t header[NETWORK_HEADER_SIZE + UUID_SIZE];
 static PortState portStates[NUM_PORTS];
-static uint8_t txBuffer[BUFFER_SIZE];
+static uint8_t txBuffers[2][BUFFER_SIZE]; // One is being sent while the other one is prepared
+static uint8_t *txBuffer = txBuffers[0];
 static int txSize = 0;
+static PortState *txPort = NULL;
+static const uint8_t *txPtr = NULL;
+static const uint8_t *txEnd = NULL;
+static PortState *crcOwner = NULL; // Port which state is currently in the CRC unit, NULL if none
+static Fifo forwardFifo; // Pass packet from the programmer to the destination port
+static Fifo relayFifo; // Response from the destination port back to the programmer
+static PortState *relaySource = NULL;
+static uint32_t relayTick = 0;
+static bool relayEscaped = false;
 static DeviceInfo deviceInfo;
+__attribute__((aligned(4)))
+static uint8_t lzBuffer[LZ_BUFFER_SIZE];
+
+static uint32_t ticks = 0;
+static uint8_t multicastGroup = 0;
+static uint8_t multicastChunks[MULTICAST_MAX_CHUNKS / 8];
+static uint8_t multicastChunkPages[MULTICAST_MAX_CHUNKS]; // Page erased or written by each marked chunk, low byte
 
 static void packetReceived(struct PortState *port, uint8_t *data, size_t length);
+static void multicastPacketReceived(uint8_t *data, size_t length);
 
 #pragma endregion
 
@@ -111,11 +181,29 @@ static inline void setUint32(void *data, uint32_t value)
 }
 
 
+static void crcSelect(PortState *port)
+{
+    // CRC unit is shared by all ports and calcCrc, so the running value is swapped on owner change.
+    if (crcOwner == port)
+    {
+        return;
+    }
+    if (crcOwner != NULL)
+    {
+        crcOwner->crc = LL_CRC_ReadData32(CRC);
+    }
+    LL_CRC_SetInitialData(CRC, port != NULL ? port->crc : 0xFFFFFFFF);
+    LL_CRC_ResetCRCCalculationUnit(CRC);
+    crcOwner = port;
+}
+
+
 static uint32_t calcCrc(const void *data, size_t length)
 {
     const uint8_t *ptr = data;
     const uint8_t *end = data + length;
 
+    crcSelect(NULL);
     LL_CRC_ResetCRCCalculationUnit(CRC);
 
     while (ptr < end)
@@ -162,13 +250,66 @@ static int rxReceive(USART_TypeDef *uart)
     }
 }
 
-static void txSendBuffer(USART_TypeDef *uart, const void *data, size_t length)
+static void txFlush()
 {
-    const uint8_t *ptr = data;
-    const uint8_t *end = ptr + length;
-    while (ptr < end)
+    // Send the rest of the pending response synchronously
+    while (txPtr < txEnd)
+    {
+        txSend(txPort->uart, *txPtr++);
+    }
+}
+
+static void txStart(PortState *port, const uint8_t *data, size_t length)
+{
+    // Only one response is sent at a time, it is continued from uartPoll by txContinue
+    txFlush();
+    txPort = port;
+    txPtr = data;
+    txEnd = data + length;
+}
+
+static void txContinue()
+{
+    if (txPtr < txEnd && LL_USART_IsActiveFlag_TXE(txPort->uart))
+    {
+        LL_USART_TransmitData8(txPort->uart, *txPtr++);
+    }
+}
+
+static void fifoFlush(Fifo *fifo)
+{
+    while (fifo->tail != fifo->head)
     {
-        txSend(uart, *ptr++);
+        txSend(fifo->port->uart, fifo->data[fifo->tail++]);
+    }
+}
+
+static void fifoStart(Fifo *fifo, PortState *port)
+{
+    // Finish the previous packet, it may go to a different port
+    if (fifo->port != NULL)
+    {
+        fifoFlush(fifo);
+    }
+    fifo->port = port;
+}
+
+static void fifoPut(Fifo *fifo, uint8_t byte)
+{
+    if ((uint8_t)(fifo->head + 1) == fifo->tail)
+    {
+        // Full, output port is slower than input. Make space synchronously.
+        txSend(fifo->port->uart, fifo->data[fifo->tail++]);
+    }
+    fifo->data[fifo->head++] = byte;
+}
+
+static void fifoContinue(Fifo *fifo)
+{
+    // Own response has priority, programmer does not send anything else before it receives it
+    if (fifo->tail != fifo->head && !(txPtr < txEnd && txPort == fifo->port) && LL_USART_IsActiveFlag_TXE(fifo->port->uart))
+    {
+        LL_USART_TransmitData8(fifo->port->uart, fifo->data[fifo->tail++]);
     }
 }
 
@@ -179,6 +320,63 @@ static int inline log2Aligned(uint32_t value)
 }
 
 
+static void setBrr(USART_TypeDef *uart, uint32_t brr)
+{
+    // Let the last response leave the port before changing the speed.
+    txFlush();
+    if (forwardFifo.port != NULL)
+    {
+        fifoFlush(&forwardFifo);
+    }
+    if (relayFifo.port != NULL)
+    {
+        fifoFlush(&relayFifo);
+    }
+    while (!LL_USART_IsActiveFlag_TC(uart));
+    LL_USART_Disable(uart);
+    uart->BRR = brr;
+    LL_USART_Enable(uart);
+}
+
+
+static uint32_t setHighSpeed(struct PortState *port, uint32_t baudRate)
+{
+    // USART is clocked from PCLK = SYSCLK with prescaler 1 and oversampling by 16, see AdditingNewTargets.md
+    uint32_t brr = baudRate > 0 ? (SystemCoreClock + baudRate / 2) / baudRate : 0;
+    if (brr < 16 || brr > 0xFFFF)
+    {
+        return 0;
+    }
+    setBrr(port->uart, brr);
+    port->highSpeed = true;
+    port->errorCount = 0;
+    port->lastPacketTick = ticks;
+    return SystemCoreClock / brr;
+}
+
+
+static void checkHighSpeed(struct PortState *port)
+{
+    // Programmer switches back after the same timeout, so both sides meet again at the default speed.
+    if (port->highSpeed && (ticks - port->lastPacketTick > HIGH_SPEED_SILENCE_TIMEOUT || port->errorCount >= HIGH_SPEED_ERROR_LIMIT))
+    {
+        setBrr(port->uart, port->defaultBrr);
+        port->highSpeed = false;
+        port->errorCount = 0;
+    }
+}
+
+
+static void updateTicks()
+{
+    // SysTick runs without interrupt, the flag is cleared on read.
+    if (SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk)
+    {
+        ticks++;
+    }
+}
+
+
 #pragma endregion
 
 
@@ -212,6 +410,16 @@ static void init()
     deviceInfo.loadAddress = bootloaderEndPage << pageSizeLog2;
     deviceInfo.totalPages = flashEndPage - bootloaderEndPage;
     deviceInfo.writeSizeLog2 = log2Aligned(WRITE_SIZE);
+    deviceInfo.lzBufferSizeLog2 = log2Aligned(LZ_BUFFER_SIZE);
+
+    for (int i = 0; i < NUM_PORTS; i++)
+    {
+        portStates[i].defaultBrr = portStates[i].uart->BRR;
+    }
+
+    SysTick->LOAD = SystemCoreClock / TICKS_PER_SECOND - 1;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
 }
 
 
@@ -224,6 +432,8 @@ static void init()
 static void switchToHeader(PortState *port)
 {
     port->headerReceived = false;
+    port->multicast = false;
+    port->forwardTo = NULL;
     port->rxIndex = 0;
     port->rxBuffer[1] = 0; // Reset mask
 }
@@ -235,6 +445,119 @@ static void switchToContent(PortState *port)
 }
 
 
+static void rxError(PortState *port)
+{
+    port->errorCount++;
+    switchToHeader(port);
+}
+
+
+static void rxStart(PortState *port)
+{
+    port->rxBuffer[1] = 0x00;
+    port->rxIndex = 1;
+    port->multicast = false;
+    port->forwardTo = NULL;
+    port->crc = 0xFFFFFFFF;
+    if (crcOwner == port)
+    {
+        crcOwner = NULL; // Force reload of the initial value
+    }
+}
+
+
+static void rxStore(PortState *port, uint8_t byte)
+{
+    // CRC covers everything after the mask. The last four bytes are held back, because they
+    // may be the received CRC, so the byte stored four positions earlier is fed now.
+    port->rxBuffer[port->rxIndex] = byte;
+    if (port->rxIndex >= 2 + 4)
+    {
+        crcSelect(port);
+        LL_CRC_FeedData8(CRC, port->rxBuffer[port->rxIndex - 4]);
+    }
+    port->rxIndex++;
+}
+
+
+static void rxValidPacket(PortState *port)
+{
+    port->errorCount = 0;
+    port->lastPacketTick = ticks;
+}
+
+
+static size_t headerSize(PortState *port)
+{
+    return port->multicast ? MULTICAST_HEADER_SIZE : sizeof(header);
+}
+
+
+static bool headerByteMatches(PortState *port, uint8_t byte)
+{
+    uint32_t index = port->rxIndex;
+    if (index == 1 || index == 3 || index == 4)
+    {
+        // Mask and source address are not checked, destination is checked with boot type
+        return true;
+    }
+#ifdef BOOT_PROXY
+    else if (index == BOOT_TYPE_INDEX && (byte & BOOT_TYPE_MASK) == BOOT_TYPE_PASS)
+    {
+        // Bootloader does not know its network address, so it forwards pass packets with any destination.
+        uint32_t destination = byte >> BOOT_PORT_SHIFT;
+        if (destination < NUM_PORTS && &portStates[destination] != port)
+        {
+            port->forwardTo = &portStates[destination];
+            return true;
+        }
+        return false;
+    }
+#endif
+    else if (index == BOOT_TYPE_INDEX && port->rxBuffer[4] != 0)
+    {
+        return false;
+    }
+    else if (index == NETWORK_HEADER_SIZE - 1 && byte == MULTICAST_ID_SIZE)
+    {
+        port->multicast = true;
+        return true;
+    }
+    else if (port->multicast && index == MULTICAST_HEADER_SIZE - 1)
+    {
+        // Group 0 is always the entire model
+        return byte == 0 || byte == multicastGroup;
+    }
+    return byte == header[index];
+}
+
+
+static void forwardStart(PortState *port)
+{
+    // Destination gets the packet as if it was sent directly by the programmer. Programmer
+    // calculates the CRC over this form, so the proxy can keep it unchanged.
+    uint8_t mask = port->rxBuffer[1];
+    port->rxBuffer[4] = 0;
+    port->rxBuffer[BOOT_TYPE_INDEX] = BOOT_TYPE_PASSED;
+    fifoStart(&forwardFifo, port->forwardTo);
+    fifoPut(&forwardFifo, ESC);
+    fifoPut(&forwardFifo, mask);
+    for (uint32_t i = 2; i < port->rxIndex; i++)
+    {
+        fifoPut(&forwardFifo, port->rxBuffer[i] ^ mask);
+    }
+}
+
+
+static void relayStart(PortState *source, PortState *destination)
+{
+    fifoStart(&relayFifo, destination);
+    relaySource = source;
+    relayTick = ticks;
+    relayEscaped = false;
+}
+
+
 static void receiveHeader(PortState *port)
 {
     int byte;
@@ -247,18 +570,20 @@ static void receiveHeader(PortState *port)
     }
     else if (byte == ERROR_DATA)
     {
-        switchToHeader(port);
+        rxError(port);
     }
     else if (byte == ESC)
     {
-    	port->rxBuffer[1] = 0x00;
-    	port->rxIndex = 1;
+        rxStart(port);
     }
-    else if ((byte ^ port->rxBuffer[1]) == header[port->rxIndex] || port->rxIndex == 1 || port->rxIndex == 3)
+    else if (headerByteMatches(port, byte ^ port->rxBuffer[1]))
     {
-        port->rxBuffer[port->rxIndex] = byte ^ port->rxBuffer[1];
-        port->rxIndex++;
-        if (port->rxIndex == sizeof(header))
+        rxStore(port, byte ^ port->rxBuffer[1]);
+        if (port->forwardTo != NULL)
+        {
+            forwardStart(port);
+        }
+        else if (port->rxIndex == headerSize(port))
         {
             switchToContent(port);
         }
@@ -270,14 +595,16 @@ static void receiveHeader(PortState *port)
 }
 
 
-static bool validatePacket(const uint8_t *data, size_t length)
+static bool validatePacket(PortState *port)
 {
-    if (length < 4) {
+    if (port->rxIndex < 2 + 4) {
         return false;
     }
 
-    uint32_t calculatedCrc = calcCrc(&data[2], length - 2 - 4);
-    uint32_t receivedCrc = getUint32(data + length - 4);
+    // All bytes except the received CRC are already in the CRC unit.
+    crcSelect(port);
+    uint32_t calculatedCrc = ~LL_CRC_ReadData32(CRC);
+    uint32_t receivedCrc = getUint32(port->rxBuffer + port->rxIndex - 4);
 
     return calculatedCrc == receivedCrc;
 }
@@ -295,14 +622,29 @@ static void receiveContent(PortState *port)
     }
     else if (byte == ERROR_DATA)
     {
-        switchToHeader(port);
+        rxError(port);
     }
     else if (byte == ESC)
     {
-        txSendBuffer(port->uart, txBuffer, txSize);
-        if (validatePacket(port->rxBuffer, port->rxIndex))
+        size_t offset = headerSize(port);
+        if (port->multicast)
         {
-            packetReceived(port, port->rxBuffer + sizeof(header), port->rxIndex - sizeof(header) - 4);
+            // Many nodes receive the same packet, so none of them responds.
+            if (validatePacket(port))
+            {
+                rxValidPacket(port);
+                multicastPacketReceived(port->rxBuffer + offset, port->rxIndex - offset - 4);
+            }
+        }
+        else
+        {
+            // Previous response goes out while this packet is executed, new one is prepared in the other buffer.
+            txStart(port, txBuffer, txSize);
+            if (validatePacket(port))
+            {
+                rxValidPacket(port);
+                packetReceived(port, port->rxBuffer + offset, port->rxIndex - offset - 4);
+            }
         }
         switchToHeader(port);
     }
@@ -311,7 +653,7 @@ static void receiveContent(PortState *port)
         byte ^= port->rxBuffer[1]; // Unmask byte
         if (port->rxIndex < sizeof(port->rxBuffer))
         {
-            port->rxBuffer[port->rxIndex++] = byte;
+            rxStore(port, byte);
         }
         else
         {
@@ -321,6 +663,79 @@ static void receiveContent(PortState *port)
 }
 
 
+static void receiveForward(PortState *port)
+{
+    // Bytes are passed to the destination port as they arrive, the closing ESC is sent without END,
+    // so the response of the destination node can be relayed back.
+    int byte;
+
+    byte = rxReceive(port->uart);
+
+    if (byte == NO_DATA)
+    {
+        // No data - nothing to do
+    }
+    else if (byte == ERROR_DATA)
+    {
+        rxError(port);
+    }
+    else if (byte == ESC)
+    {
+        fifoPut(&forwardFifo, ESC);
+        if (validatePacket(port))
+        {
+            rxValidPacket(port);
+        }
+        relayStart(port->forwardTo, port);
+        switchToHeader(port);
+    }
+    else if (port->rxIndex == sizeof(header) && port->rxBuffer[6] == UUID_SIZE && (byte ^ port->rxBuffer[1]) == CMD_SET_BAUD)
+    {
+        // Baud rate switching is point-to-point, the proxy would keep both its ports at the old speed.
+        // The destination drops the truncated packet and the programmer gets no response.
+        fifoPut(&forwardFifo, ESC);
+        switchToHeader(port);
+    }
+    else if (port->rxIndex < sizeof(port->rxBuffer))
+    {
+        // Content is also stored to verify CRC, the proxy is not interested in the content itself.
+        fifoPut(&forwardFifo, byte);
+        rxStore(port, byte ^ port->rxBuffer[1]);
+    }
+    else
+    {
+        switchToHeader(port);
+    }
+}
+
+
+static void receiveRelay(PortState *port)
+{
+    int byte;
+
+    byte = rxReceive(port->uart);
+
+    if (byte == NO_DATA)
+    {
+        if (ticks - relayTick > RELAY_TIMEOUT)
+        {
+            relaySource = NULL;
+        }
+    }
+    else if (byte != ERROR_DATA)
+    {
+        // Errors are not relayed, the programmer detects them with CRC.
+        fifoPut(&relayFifo, byte);
+        relayTick = ticks;
+        if (relayEscaped && byte == END)
+        {
+            relaySource = NULL;
+        }
+        relayEscaped = byte == ESC;
+    }
+}
+
+
 void uartPoll(USART_TypeDef *uart0, USART_TypeDef *uart1, USART_TypeDef *uart2, USART_TypeDef *uart3)
 {
     static bool initialized = false;
@@ -338,9 +753,28 @@ void uartPoll(USART_TypeDef *uart0, USART_TypeDef *uart1, USART_TypeDef *uart2,
         init();
         initialized = true;
     }
+    updateTicks();
+    txContinue();
+    if (forwardFifo.port != NULL)
+    {
+        fifoContinue(&forwardFifo);
+    }
+    if (relayFifo.port != NULL)
+    {
+        fifoContinue(&relayFifo);
+    }
     for (int i = 0; i < sizeof(portStates) / sizeof(portStates[0]); i++)
     {
-        if (portStates[i].headerReceived)
+        checkHighSpeed(&portStates[i]);
+        if (&portStates[i] == relaySource)
+        {
+            receiveRelay(&portStates[i]);
+        }
+        else if (portStates[i].forwardTo != NULL)
+        {
+            receiveForward(&portStates[i]);
+        }
+        else if (portStates[i].headerReceived)
         {
             receiveContent(&portStates[i]);
         }
@@ -360,6 +794,8 @@ void uartPoll(USART_TypeDef *uart0, USART_TypeDef *uart1, USART_TypeDef *uart2,
 
 static void txPrepare(PortState *port)
 {
+    // Current buffer may be still sent, so use the other one.
+    txBuffer = txBuffer == txBuffers[0] ? txBuffers[1] : txBuffers[0];
     copyBytes(txBuffer, header, sizeof(header));
     // txBuffer[0] = ESC unchanged
     // txBuffer[1] = mask tbd
@@ -442,15 +878,7 @@ static void txFinalize()
 #pragma region FLASH programming
 
 
-enum {
-    CMD_INIT = 0,
-    CMD_ERASE = 1,
-    CMD_WRITE = 2,
-    CMD_READ = 3,
-    CMD_RESET = 4,
-    CMD_PING = 5,
-    CMD_LAST_ID = CMD_PING,
-};
+#define MAX_PAGE_CRC_COUNT ((MAX_PAYLOAD_SIZE - RESPONSE_HEADER_SIZE) / 4)
 
 static void waitFlashReady()
 {
@@ -462,8 +890,38 @@ static void waitFlashReady()
     while (READ_BIT(FLASH->SR, FLASH_SR_CFGBSY));
 }
 
-static void pageErase(uint32_t pageNumber)
+static bool isFlashEqual(uint32_t address, const uint8_t *data, size_t length)
 {
+    const uint8_t *flash = (const uint8_t *)address;
+    const uint8_t *end = flash + length;
+    while (flash < end)
+    {
+        if (*flash++ != *data++)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool isFlashErased(uint32_t address, size_t length)
+{
+    const uint32_t *flash = (const uint32_t *)address;
+    const uint32_t *end = flash + length / 4;
+    while (flash < end)
+    {
+        if (*flash++ != 0xFFFFFFFF)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool pageErase(uint32_t pageNumber)
+{
+    // CPU stalls on flash access during the operation, so send pending response first.
+    txFlush();
     waitFlashReady();
     // 4. Set the PER bit and select the page to erase (PNB) in the FLASH control register (FLASH_CR).
     FLASH->CR = (FLASH->CR & ~FLASH_CR_PNB) | (pageNumber <<  FLASH_CR_PNB_Pos) | FLASH_CR_PER;
@@ -472,10 +930,12 @@ static void pageErase(uint32_t pageNumber)
     // 6. Wait until the CFGBSY bit of the FLASH status register (FLASH_SR) is cleared.
     waitFlashReady();
     CLEAR_BIT(FLASH->CR, FLASH_CR_PER);    
+    return isFlashErased(FLASH_BASE + (pageNumber << deviceInfo.pageSizeLog2), FLASH_PAGE_SIZE);
 }
 
-static void writeData(uint32_t address, const uint8_t *data, size_t length)
+static bool writeData(uint32_t address, const uint8_t *data, size_t length)
 {
+    txFlush();
     waitFlashReady();
     // 4. Set the PG bit of the FLASH control register (FLASH_CR).
     SET_BIT(FLASH->CR, FLASH_CR_PG);
@@ -502,6 +962,21 @@ static void writeData(uint32_t address, const uint8_t *data, size_t length)
     }
     // 8. Clear the PG bit of the FLASH control register (FLASH_CR) if there no more programming request anymore.
     CLEAR_BIT(FLASH->CR, FLASH_CR_PG);
+    return isFlashEqual(address, data, length);
+}
+
+static int decompress(uint32_t address, const uint8_t *data, size_t length, bool useHistory)
+{
+    // Flash content before the address is the decompression history, but only the application part.
+    size_t historySize = useHistory && address > deviceInfo.loadAddress ? address - deviceInfo.loadAddress : 0;
+    int size = lzDecompress(lzBuffer, sizeof(lzBuffer), (const uint8_t *)address, historySize, data, length);
+    return size > 0 && (size & (WRITE_SIZE - 1)) == 0 ? size : -1;
+}
+
+static bool writeCompressed(uint32_t address, const uint8_t *data, size_t length)
+{
+    int size = decompress(address, data, length, true);
+    return size > 0 && writeData(address, lzBuffer, size);
 }
 
 static void readData(struct PortState *port, uint32_t address, uint8_t length)
@@ -509,12 +984,79 @@ static void readData(struct PortState *port, uint32_t address, uint8_t length)
     txAppend(port, (const void *)address, length);
 }
 
+static void pageCrc(struct PortState *port, uint32_t firstPage, uint8_t count)
+{
+    // Page numbers are relative to the flash beginning, the same as for erase.
+    uint32_t flashPages = FLASH_SIZE >> deviceInfo.pageSizeLog2;
+    if (count == 0 || count > MAX_PAGE_CRC_COUNT)
+    {
+        count = MAX_PAGE_CRC_COUNT;
+    }
+    uint32_t endPage = firstPage + count;
+    if (endPage > flashPages)
+    {
+        endPage = flashPages;
+    }
+    for (uint32_t page = firstPage; page < endPage; page++)
+    {
+        uint32_t crc = calcCrc((const void *)(FLASH_BASE + (page << deviceInfo.pageSizeLog2)), FLASH_PAGE_SIZE);
+        txAppend(port, &crc, sizeof(crc));
+    }
+}
+
+static void appendPageBitmap(struct PortState *port, uint32_t offset, uint32_t size, bool erased)
+{
+    // Bit of a page is set if its range at the offset is erased or programmed, as requested.
+    // Bytes are sent as they are complete, FLASH_SIZE is not a constant on all devices.
+    uint8_t bits = 0;
+    for (uint32_t page = 0; page < deviceInfo.totalPages; page++)
+    {
+        uint32_t address = deviceInfo.loadAddress + (page << deviceInfo.pageSizeLog2) + offset;
+        if (isFlashErased(address, size) == erased)
+        {
+            bits |= 1 << (page % 8);
+        }
+        if (page % 8 == 7 || page + 1 == deviceInfo.totalPages)
+        {
+            txAppend(port, &bits, sizeof(bits));
+            bits = 0;
+        }
+    }
+}
+
 static void progInit(struct PortState *port)
 {
+    // Page state lets the programmer resume an interrupted update. Pages are programmed in ascending
+    // order, so a page with the last double word programmed was written up to its end.
     txAppend(port, &deviceInfo, sizeof(deviceInfo));
+    appendPageBitmap(port, 0, FLASH_PAGE_SIZE, true);
+    appendPageBitmap(port, FLASH_PAGE_SIZE - WRITE_SIZE, WRITE_SIZE, false);
     HAL_FLASH_Unlock();
 }
 
+static void multicastJoin(uint8_t group)
+{
+    multicastGroup = group;
+    for (size_t i = 0; i < sizeof(multicastChunks); i++)
+    {
+        multicastChunks[i] = 0;
+    }
+    HAL_FLASH_Unlock();
+}
+
+static void multicastStatus(struct PortState *port)
+{
+    txAppend(port, &multicastGroup, sizeof(multicastGroup));
+    txAppend(port, multicastChunks, sizeof(multicastChunks));
+}
+
+static void setBaudRate(struct PortState *port, uint32_t baudRate)
+{
+    // Response is sent with the next packet, so it already goes at the new speed.
+    uint32_t actualBaudRate = setHighSpeed(port, baudRate);
+    txAppend(port, &actualBaudRate, sizeof(actualBaudRate));
+}
+
 static void executeCommand(struct PortState *port, uint8_t cmd, const uint8_t *data, size_t length)
 {
     switch (cmd) {
@@ -531,11 +1073,27 @@ static void executeCommand(struct PortState *port, uint8_t cmd, const uint8_t *d
             readData(port, getUint32(data), data[4]);
             return;
         case CMD_RESET:
+            txFlush();
             NVIC_SystemReset();
             return;
         case CMD_PING:
             txAppend(port, data, length);
             return;
+        case CMD_PAGE_CRC:
+            pageCrc(port, getUint32(data), data[4]);
+            return;
+        case CMD_WRITE_LZ:
+            writeCompressed(getUint32(data), data + 4, length - 4);
+            return;
+        case CMD_MC_JOIN:
+            multicastJoin(data[0]);
+            return;
+        case CMD_MC_STATUS:
+            multicastStatus(port);
+            return;
+        case CMD_SET_BAUD:
+            setBaudRate(port, getUint32(data));
+            return;
         default:
             return;
     }
@@ -559,12 +1117,77 @@ static void packetReceived(struct PortState *port, uint8_t *data, size_t length)
 }
 
 
+static void multicastPacketReceived(uint8_t *data, size_t length)
+{
+    // Command counter field contains chunk index. Each node marks chunks that it successfully
+    // programmed. Programmer collects the bitmaps with CMD_MC_STATUS and resends missing chunks.
+    if (length < 1 + sizeof(uint32_t))
+    {
+        return;
+    }
+    uint8_t cmd = data[0];
+    uint32_t chunk = getUint32(&data[1]);
+    const uint8_t *args = &data[1 + sizeof(chunk)];
+    length -= 1 + sizeof(chunk);
+    uint32_t page = getUint32(args);
+    bool success;
+
+    switch (cmd) {
+        case CMD_MC_JOIN:
+            multicastJoin(args[0]);
+            return;
+        case CMD_ERASE:
+            success = pageErase(page);
+            if (success)
+            {
+                // Chunks written to the page before are gone
+                for (uint32_t i = 0; i < MULTICAST_MAX_CHUNKS; i++)
+                {
+                    if (multicastChunkPages[i] == (uint8_t)page)
+                    {
+                        multicastChunks[i / 8] &= ~(1 << (i % 8));
+                    }
+                }
+            }
+            break;
+        case CMD_WRITE:
+        case CMD_WRITE_LZ:
+        {
+            // Nodes may have different flash content, so LZ chunks do not use it as the history
+            // and the result is checked with CRC of the expected data before it is written.
+            uint32_t address = page;
+            const uint8_t *chunkData = args + 8;
+            int size = (int)length - 8;
+            page = (address - FLASH_BASE) >> deviceInfo.pageSizeLog2;
+            if (cmd == CMD_WRITE_LZ && size > 0)
+            {
+                size = decompress(address, chunkData, size, false);
+                chunkData = lzBuffer;
+            }
+            success = size > 0 && calcCrc(chunkData, size) == getUint32(args + 4) &&
+                      (isFlashEqual(address, chunkData, size) || writeData(address, chunkData, size));
+            break;
+        }
+        default:
+            return;
+    }
+
+    if (success && chunk < MULTICAST_MAX_CHUNKS)
+    {
+        multicastChunks[chunk / 8] |= 1 << (chunk % 8);
+        multicastChunkPages[chunk] = page;
+    }
+}
+
+
 #pragma endregion
 
 
 #pragma region Boot selection
 
 
+#ifndef BOOTLOADER_SIM // Simulator provides its own implementation
+
 __attribute__((naked))
 void startApplication(uint32_t stackPointer, uint32_t resetHandler)
 {
@@ -575,6 +1198,8 @@ void startApplication(uint32_t stackPointer, uint32_t resetHandler)
     );
 }
 
+#endif
+
 
 void bootSelect()
 {
@@ -622,11 +1247,15 @@ void bootSelect()
  *      flags = 0x21 (bootloader protocol, one destination node)
  *      src   = programmer address
  *      dst   = proxy address
- *      boot  = type: pass, port: N
+ *      boot  = type: pass (low nibble), port: N (high nibble)
  *      data...
- *      CRC32
+ *      CRC32 (calculated as if dst = 0 and boot = passed, see below)
  *      ESC
  *      END
+ *
+ *      Router bootloader forwards the packet byte by byte as it arrives, replacing dst and boot,
+ *      and relays the bytes coming back from port N until ESC END or 100 ms of silence.
+ *      Only builds with BOOT_PROXY forward, so there must be one router on the programmer bus.
  * 
  * Proxy -> destination port
  *      ESC
@@ -658,4 +1287,45 @@ void bootSelect()
  *      CRC32
  *      ESC
  *      END
+ *
+ * Programmer -> all nodes of the same model (multicast)
+ *      ESC
+ *      mask
+ *      flags = 0x21 (bootloader protocol, one destination node)
+ *      src   = programmer address
+ *      dst   = 0 (unknown device)
+ *      boot  = type: passed
+ *      2     (instead of UID length)
+ *      model
+ *      group (0 - all nodes of the model, other - nodes that joined the group)
+ *      cmd   (join, erase, write or compressed write)
+ *      chunk index (instead of cmd counter)
+ *      cmd arguments...  (write: address, CRC32 of the data, data; compressed write: address,
+ *                         CRC32 of the decompressed data, data compressed without history)
+ *      CRC32
+ *      ESC
+ *      END
+ *
+ *      No response is sent. Each node marks chunks programmed successfully, the programmer
+ *      reads the bitmap from each node with unicast MC_STATUS and resends missing chunks.
+ *      Erase clears the marks of the chunks written to the same page, so a chunk must not
+ *      cross a page boundary.
+ *
+ * Baud rate switching
+ *      Only between the programmer and the node on its bus. A proxy does not forward SET_BAUD, it sends
+ *      the destination an incomplete packet, which is dropped, and no response comes back.
+ *      Programmer sends SET_BAUD at default speed and switches its own port right after the packet.
+ *      The result (actual baud rate, 0 if rejected) is sent with the next packet at the new speed.
+ *      Port goes back to default speed after 0.5 s without a valid packet or after 4 framing errors.
+ *      Programmer does the same, so it retries at default speed when high speed does not work.
+ *
+ * Resuming an interrupted update
+ *      INIT result is the device info (12 bytes) followed by two bitmaps, one bit per application
+ *      page, bit 0 of the first byte is the page at load address:
+ *          erased pages  - page contains only 0xFF
+ *          written pages - last double word of the page is programmed
+ *      Pages that are neither erased nor written were interrupted while being programmed or erased.
+ *      The state comes from the flash content, so it survives reset and power loss. A written page
+ *      may still contain an older image, the programmer compares it with PAGE_CRC. Programmer writes
+ *      the first page (vector table) last, so the bootloader does not start an incomplete application.
  */
@@ -0,0 +1,107 @@
+
+#include "Frame.hh"
+#include "../../src/common/CRC32.hh"
+
+
+namespace Frame
+{
+
+void encode(const uint8_t* data, size_t size, bool end, std::vector<uint8_t>& output, const uint8_t* crcData)
+{
+    uint8_t content[MAX_DATA_SIZE + 4];
+    for (size_t i = 0; i < size; i++) {
+        content[i] = data[i];
+    }
+    uint32_t crc = CRC32::calculate(crcData != nullptr ? crcData : data, size);
+    for (size_t i = 0; i < 4; i++) {
+        content[size + i] = (uint8_t)(crc >> (8 * i));
+    }
+
+    // Mask is needed only if ESC occurs. It must not turn any byte into ESC, the same
+    // applies to the form used for CRC, and must not be ESC or END itself.
+    bool used[256] = {};
+    bool escaped = false;
+    for (size_t i = 0; i < size + 4; i++) {
+        used[content[i]] = true;
+        escaped = escaped || content[i] == ESC;
+        if (crcData != nullptr && i < size) {
+            used[crcData[i]] = true;
+        }
+    }
+    uint8_t mask = 0;
+    if (escaped) {
+        used[ESC ^ ESC] = true;
+        used[END ^ ESC] = true;
+        size_t symbol = 0;
+        while (used[symbol]) {
+            symbol++;
+        }
+        mask = (uint8_t)symbol ^ ESC;
+    }
+
+    output.push_back(ESC);
+    output.push_back(mask);
+    for (size_t i = 0; i < size + 4; i++) {
+        output.push_back(content[i] ^ mask);
+    }
+    output.push_back(ESC);
+    if (end) {
+        output.push_back(END);
+    }
+}
+
+
+bool Decoder::push(uint8_t byte)
+{
+    switch (state) {
+        case State::IDLE:
+            if (byte == ESC) {
+                state = State::ESCAPED;
+            }
+            return false;
+        case State::ESCAPED:
+            if (byte == END || byte == ESC) {
+                // Link is idle, or a repeated ESC, either way no frame started.
+                state = byte == ESC ? State::ESCAPED : State::IDLE;
+                return false;
+            }
+            mask = byte;
+            content.clear();
+            state = State::CONTENT;
+            return false;
+        case State::CONTENT:
+            if (byte == ESC) {
+                // Closing ESC may also begin the next frame
+                state = State::ESCAPED;
+                return finish();
+            }
+            if (content.size() >= MAX_DATA_SIZE + 4) {
+                errorCount++;
+                state = State::IDLE;
+                return false;
+            }
+            content.push_back(byte ^ mask);
+            return false;
+    }
+    return false;
+}
+
+
+bool Decoder::finish()
+{
+    if (content.size() < 4) {
+        errorCount++;
+        return false;
+    }
+    size_t size = content.size() - 4;
+    uint32_t crc = (uint32_t)content[size] | (uint32_t)content[size + 1] << 8 |
+                   (uint32_t)content[size + 2] << 16 | (uint32_t)content[size + 3] << 24;
+    if (crc != CRC32::calculate(content.data(), size)) {
+        errorCount++;
+        return false;
+    }
+    frame.assign(content.begin(), content.begin() + size);
+    return true;
+}
+
+}
@@ -0,0 +1,59 @@
+#ifndef FRAME_HH
+#define FRAME_HH
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/**
+ * Data link framing as used by the bootloader and the firmware:
+ *
+ *      ESC MASK DATA^MASK CRC32^MASK ESC [END]
+ *
+ * CRC is calculated with `CRC32` from `src/common`, the same as the STM32 CRC unit.
+ */
+namespace Frame
+{
+    constexpr uint8_t ESC = 0xFF;
+    constexpr uint8_t END = 0xFE;
+    constexpr size_t MAX_DATA_SIZE = 249;
+
+    /**
+     * Appends the framed `data` to `output`. The `crcData` is used for CRC calculation
+     * instead of `data` if given, it must have the same size. Pass packets need it,
+     * because their CRC covers the form received by the destination node.
+     */
+    void encode(const uint8_t* data, size_t size, bool end, std::vector<uint8_t>& output,
+                const uint8_t* crcData = nullptr);
+
+    /**
+     * Byte by byte decoder. Bytes outside frames are ignored, frames with wrong CRC are dropped.
+     */
+    class Decoder
+    {
+    public:
+        /**
+         * Returns true when the byte completed a valid frame, the frame data without CRC
+         * is available in `data()` until the next call.
+         */
+        bool push(uint8_t byte);
+
+        const std::vector<uint8_t>& data() const { return frame; }
+
+        /** Number of frames dropped because of wrong CRC or size since the construction. */
+        size_t errors() const { return errorCount; }
+
+    private:
+        enum class State { IDLE, ESCAPED, CONTENT };
+
+        State state = State::IDLE;
+        uint8_t mask = 0;
+        std::vector<uint8_t> content;
+        std::vector<uint8_t> frame;
+        size_t errorCount = 0;
+
+        bool finish();
+    };
+}
+
+#endif // FRAME_HH
@@ -0,0 +1,117 @@
+
+#include "LZCompressor.hh"
+#include "../lz.h"
+
+
+LZCompressor::LZCompressor(const uint8_t* image, size_t size, size_t historyBegin) :
+    image(image),
+    size(size),
+    historyBegin(historyBegin),
+    prev(size, -1)
+{
+    // Chain each position with the previous position having the same hash.
+    std::vector<int32_t> head(HASH_SIZE, -1);
+    for (size_t pos = 0; pos + LZ_MIN_MATCH <= size; pos++) {
+        auto h = hash(&image[pos]);
+        prev[pos] = head[h];
+        head[h] = (int32_t)pos;
+    }
+}
+
+uint32_t LZCompressor::hash(const uint8_t* data)
+{
+    return ((uint32_t)data[0] * 2654435761u ^ (uint32_t)data[1] * 40503u ^ (uint32_t)data[2]) % HASH_SIZE;
+}
+
+size_t LZCompressor::findMatch(size_t begin, size_t pos, size_t end, size_t& distance) const
+{
+    size_t bestLength = 0;
+    size_t maxLength = end - pos;
+    if (maxLength > LZ_MAX_MATCH) {
+        maxLength = LZ_MAX_MATCH;
+    }
+    if (maxLength < LZ_MIN_MATCH) {
+        return 0;
+    }
+    auto candidate = prev[pos];
+    for (int i = 0; i < MAX_CHAIN && candidate >= 0; i++, candidate = prev[candidate]) {
+        auto src = (size_t)candidate;
+        if (pos - src > LZ_WINDOW_SIZE) {
+            break;
+        }
+        if (src < begin && src < historyBegin) {
+            // Not programmed when this chunk is decompressed, older candidates are also before.
+            break;
+        }
+        size_t length = 0;
+        while (length < maxLength && image[src + length] == image[pos + length]) {
+            length++;
+        }
+        if (length > bestLength) {
+            bestLength = length;
+            distance = pos - src;
+            if (length == maxLength) {
+                break;
+            }
+        }
+    }
+    return bestLength >= LZ_MIN_MATCH ? bestLength : 0;
+}
+
+size_t LZCompressor::compress(size_t begin, size_t maxOutputSize, size_t maxCompressedSize, size_t align,
+                              std::vector<uint8_t>& compressed) const
+{
+    size_t end = begin + maxOutputSize < size ? begin + maxOutputSize : size;
+    size_t pos = begin;
+    int runHeader = -1;
+
+    // Last position where the chunk can be cut.
+    size_t cutPos = begin;
+    size_t cutCompressedSize = 0;
+    int cutRunHeader = -1;
+    uint8_t cutRunToken = 0;
+
+    compressed.clear();
+
+    while (pos < end) {
+        size_t distance = 0;
+        size_t length = findMatch(begin, pos, end, distance);
+        if (length > 0) {
+            if (compressed.size() + 2 > maxCompressedSize) {
+                break;
+            }
+            compressed.push_back(0x80 | ((length - LZ_MIN_MATCH) << 3) | ((distance - 1) >> 8));
+            compressed.push_back((distance - 1) & 0xFF);
+            runHeader = -1;
+            pos += length;
+        } else {
+            if (runHeader >= 0 && compressed[runHeader] < LZ_MAX_LITERALS - 1) {
+                if (compressed.size() + 1 > maxCompressedSize) {
+                    break;
+                }
+                compressed[runHeader]++;
+            } else {
+                if (compressed.size() + 2 > maxCompressedSize) {
+                    break;
+                }
+                runHeader = (int)compressed.size();
+                compressed.push_back(0);
+            }
+            compressed.push_back(image[pos]);
+            pos++;
+        }
+        if (pos % align == 0 || pos == size) {
+            cutPos = pos;
+            cutCompressedSize = compressed.size();
+            cutRunHeader = runHeader;
+            cutRunToken = runHeader >= 0 ? compressed[runHeader] : 0;
+        }
+    }
+
+    compressed.resize(cutCompressedSize);
+    if (cutRunHeader >= 0) {
+        compressed[cutRunHeader] = cutRunToken;
+    }
+
+    return cutPos - begin;
+}
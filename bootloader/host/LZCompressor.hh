@@ -0,0 +1,46 @@
+#ifndef LZCOMPRESSOR_HH
+#define LZCOMPRESSOR_HH
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/**
+ * Host side compressor producing the stream decoded by `lzDecompress()` from
+ * `bootloader/lz.h`. The image is compressed in chunks, one chunk per CMD_WRITE_LZ.
+ * Matches may refer to image bytes before the chunk, because the bootloader reads
+ * them back from flash.
+ */
+class LZCompressor
+{
+public:
+    /**
+     * The `image` must stay valid for the compressor lifetime. Bytes before
+     * `historyBegin` are never referenced from other chunks, e.g. because they
+     * are programmed at the very end.
+     */
+    LZCompressor(const uint8_t* image, size_t size, size_t historyBegin = 0);
+
+    /**
+     * Compress a chunk starting at `begin`. The chunk decompresses to at most
+     * `maxOutputSize` bytes, takes at most `maxCompressedSize` bytes, and its
+     * decompressed size is a multiple of `align` (or it ends at the image end).
+     * Returns the decompressed size of the chunk, zero if nothing fits.
+     */
+    size_t compress(size_t begin, size_t maxOutputSize, size_t maxCompressedSize, size_t align,
+                    std::vector<uint8_t>& compressed) const;
+
+private:
+    static constexpr size_t HASH_SIZE = 4096;
+    static constexpr int MAX_CHAIN = 256;
+
+    const uint8_t* image;
+    size_t size;
+    size_t historyBegin;
+    std::vector<int32_t> prev;
+
+    static uint32_t hash(const uint8_t* data);
+    size_t findMatch(size_t begin, size_t pos, size_t end, size_t& distance) const;
+};
+
+#endif // LZCOMPRESSOR_HH
@@ -0,0 +1,427 @@
+
+#include "Programmer.hh"
+#include "../../src/common/CRC32.hh"
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdexcept>
+
+
+static void appendUint32(std::vector<uint8_t>& data, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        data.push_back((uint8_t)(value >> (8 * i)));
+    }
+}
+
+static uint32_t getUint32(const uint8_t* data)
+{
+    return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+
+Programmer::Programmer(SerialPort& port, const uint8_t uid[UID_SIZE], size_t window) :
+    port(port),
+    window(window < 2 ? 2 : window)
+{
+    memcpy(this->uid, uid, UID_SIZE);
+}
+
+uint64_t Programmer::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool Programmer::hasResult(uint8_t cmd)
+{
+    return cmd == CMD_INIT || cmd == CMD_READ || cmd == CMD_PING || cmd == CMD_PAGE_CRC || cmd == CMD_SET_BAUD ||
+           cmd == CMD_MC_STATUS;
+}
+
+size_t Programmer::resultSize(const Command& command)
+{
+    switch (command.cmd) {
+        case CMD_INIT:
+            return DEVICE_INFO_SIZE;
+        case CMD_READ:
+            return command.args.size() > 4 ? command.args[4] : 0;
+        case CMD_PING:
+            return command.args.size();
+        case CMD_PAGE_CRC:
+            return command.args.size() > 4 ? command.args[4] * 4 : MAX_RESULT_SIZE;
+        case CMD_SET_BAUD:
+            return 4;
+        case CMD_MC_STATUS:
+            return 1 + MULTICAST_MAX_CHUNKS / 8;
+        default:
+            return 0;
+    }
+}
+
+Programmer::Command Programmer::erase(uint32_t page)
+{
+    Command command = { CMD_ERASE, {}, FLASH_ERASE_US, 0 };
+    appendUint32(command.args, page);
+    return command;
+}
+
+Programmer::Command Programmer::write(uint32_t address, const uint8_t* data, size_t size)
+{
+    Command command = { CMD_WRITE, {}, (uint32_t)((size + 7) / 8) * FLASH_WRITE_US, 0 };
+    appendUint32(command.args, address);
+    command.args.insert(command.args.end(), data, data + size);
+    return command;
+}
+
+Programmer::Command Programmer::writeCompressed(uint32_t address, const std::vector<uint8_t>& compressed,
+                                                size_t outputSize)
+{
+    // Decompression is negligible compared to the flash programming
+    Command command = { CMD_WRITE_LZ, {}, (uint32_t)((outputSize + 7) / 8) * FLASH_WRITE_US, 0 };
+    appendUint32(command.args, address);
+    command.args.insert(command.args.end(), compressed.begin(), compressed.end());
+    return command;
+}
+
+Programmer::Command Programmer::pageCrc(uint32_t firstPage, uint8_t count, uint32_t pageSize)
+{
+    Command command = { CMD_PAGE_CRC, {}, (uint32_t)(count * pageSize / 1024 * CRC_US_PER_KB), 0 };
+    appendUint32(command.args, firstPage);
+    command.args.push_back(count);
+    return command;
+}
+
+Programmer::Command Programmer::multicastWrite(uint32_t address, const uint8_t* data, size_t size)
+{
+    Command command = { CMD_WRITE, {}, (uint32_t)((size + 7) / 8) * FLASH_WRITE_US, 0 };
+    appendUint32(command.args, address);
+    appendUint32(command.args, CRC32::calculate(data, size));
+    command.args.insert(command.args.end(), data, data + size);
+    return command;
+}
+
+Programmer::Command Programmer::multicastWriteCompressed(uint32_t address, const std::vector<uint8_t>& compressed,
+                                                         const uint8_t* data, size_t size)
+{
+    Command command = { CMD_WRITE_LZ, {}, (uint32_t)((size + 7) / 8) * FLASH_WRITE_US, 0 };
+    appendUint32(command.args, address);
+    appendUint32(command.args, CRC32::calculate(data, size));
+    command.args.insert(command.args.end(), compressed.begin(), compressed.end());
+    return command;
+}
+
+void Programmer::send(const Command& command, uint32_t counter)
+{
+    uint8_t data[Frame::MAX_DATA_SIZE];
+    size_t size = 0;
+    data[size++] = PROTOCOL_FLAGS;
+    data[size++] = OWN_ADDRESS;
+    data[size++] = 0; // Unknown device, the UID selects it
+    data[size++] = BOOT_TYPE_PASSED;
+    data[size++] = UID_SIZE;
+    memcpy(&data[size], uid, UID_SIZE);
+    size += UID_SIZE;
+    data[size++] = command.cmd;
+    for (int i = 0; i < 4; i++) {
+        data[size++] = (uint8_t)(counter >> (8 * i));
+    }
+    if (command.args.size() > MAX_ARGS_SIZE) {
+        throw std::runtime_error("Command arguments too long");
+    }
+    memcpy(&data[size], command.args.data(), command.args.size());
+    size += command.args.size();
+    transmit(data, size, command, true);
+}
+
+void Programmer::sendMulticast(const Command& command, uint8_t model, uint8_t group, uint32_t chunk)
+{
+    uint8_t data[Frame::MAX_DATA_SIZE];
+    size_t size = 0;
+    data[size++] = PROTOCOL_FLAGS;
+    data[size++] = OWN_ADDRESS;
+    data[size++] = 0; // Unknown device, the model and group select the nodes
+    data[size++] = BOOT_TYPE_PASSED;
+    data[size++] = 2;
+    data[size++] = model;
+    data[size++] = group;
+    data[size++] = command.cmd;
+    for (int i = 0; i < 4; i++) {
+        data[size++] = (uint8_t)(chunk >> (8 * i));
+    }
+    if (command.args.size() > MULTICAST_MAX_ARGS_SIZE) {
+        throw std::runtime_error("Command arguments too long");
+    }
+    memcpy(&data[size], command.args.data(), command.args.size());
+    size += command.args.size();
+    while (now() < readyAt) {
+        usleep((readyAt - now()) / 1000 + 1);
+    }
+    transmit(data, size, command, false);
+}
+
+void Programmer::transmit(const uint8_t* data, size_t size, const Command& command, bool hasResponse)
+{
+    std::vector<uint8_t> frame;
+    Frame::encode(data, size, false, frame);
+    port.write(frame.data(), frame.size());
+
+    // Bootloader stops receiving while it is busy, e.g. CPU stalls during flash operations. It sends
+    // the previous response before that, so the next packet must start after both. Multicast packets
+    // do not trigger the response, it stays pending for the next unicast packet.
+    auto time = now();
+    lineFreeAt = (lineFreeAt > time ? lineFreeAt : time) + port.byteTime(frame.size());
+    readyAt = lineFreeAt;
+    if (command.busyUs > 0) {
+        if (hasResponse) {
+            readyAt += port.byteTime(2 + RESPONSE_HEADER_SIZE + pendingResultSize + 6);
+        }
+        readyAt += (command.busyUs + GUARD_US) * 1000ULL;
+    }
+    if (hasResponse) {
+        pendingResultSize = resultSize(command);
+    }
+
+    if (command.switchBaudRate != 0) {
+        // The packet must leave at the old speed
+        while (now() < lineFreeAt) {
+            usleep((lineFreeAt - now()) / 1000 + 1);
+        }
+        port.setBaudRate(command.switchBaudRate);
+        lineFreeAt = now();
+    }
+}
+
+bool Programmer::parseResponse(const std::vector<uint8_t>& data, uint32_t& counter, std::vector<uint8_t>& result) const
+{
+    if (data.size() < RESPONSE_HEADER_SIZE || data[0] != PROTOCOL_FLAGS || data[2] != OWN_ADDRESS ||
+        (data[3] & 0x0F) != BOOT_TYPE_RESPONSE || data[4] != UID_SIZE || memcmp(&data[5], uid, UID_SIZE) != 0) {
+        return false;
+    }
+    counter = getUint32(&data[RESPONSE_HEADER_SIZE - 4]);
+    result.assign(data.begin() + RESPONSE_HEADER_SIZE, data.end());
+    return true;
+}
+
+bool Programmer::receive(uint32_t timeoutUs, uint32_t& counter, std::vector<uint8_t>& result)
+{
+    uint64_t deadline = now() + timeoutUs * 1000ULL;
+    while (true) {
+        while (rxPos < rxCount) {
+            if (decoder.push(rxBuffer[rxPos++]) && parseResponse(decoder.data(), counter, result)) {
+                return true;
+            }
+        }
+        uint64_t time = now();
+        rxCount = port.read(rxBuffer, sizeof(rxBuffer), time < deadline ? (uint32_t)((deadline - time) / 1000) : 0);
+        rxPos = 0;
+        if (rxCount == 0 && now() >= deadline) {
+            return false;
+        }
+    }
+}
+
+void Programmer::connect(uint32_t timeoutUs)
+{
+    // Counter 0xFFFFFFFF is always accepted. The response is for the state before the ping, and there
+    // is none right after the start, so the ping is repeated until something comes back.
+    uint64_t deadline = now() + timeoutUs * 1000ULL;
+    Command ping = { CMD_PING, {}, 0, 0 };
+    while (now() < deadline) {
+        send(ping, 0xFFFFFFFF);
+        uint32_t counter;
+        std::vector<uint8_t> result;
+        if (receive(responseTimeoutUs, counter, result)) {
+            nextCounter = counter + 2;
+            return;
+        }
+    }
+    throw std::runtime_error("Bootloader does not respond");
+}
+
+std::vector<std::vector<uint8_t>> Programmer::run(const std::vector<Command>& commands)
+{
+    // Response comes with the next packet, so a ping at the end brings the result of the last command.
+    std::vector<Command> all(commands);
+    all.push_back({ CMD_PING, {}, 0, 0 });
+    std::vector<std::vector<uint8_t>> results(commands.size());
+    std::vector<bool> received(commands.size(), false);
+    uint32_t base = nextCounter;
+    size_t sent = 0;        // Next command to send
+    size_t sentHigh = 0;    // Number of commands sent at least once
+    size_t executed = 0;    // Number of commands confirmed by the bootloader
+    size_t expected = 0;    // Minimal executed count in the next response if no packet was lost
+    size_t timeouts = 0;
+    uint32_t counter;
+    std::vector<uint8_t> result;
+
+    // Returns false if the response shows that a packet was lost
+    auto handleResponse = [&]() {
+        int32_t reported = (int32_t)(counter + 1 - base);
+        if (reported < 0 || (size_t)reported > sentHigh) {
+            // Counter is out of sync, e.g. the final ping of the previous run was lost
+            base = counter + 1;
+            executed = 0;
+            return false;
+        }
+        if (reported > 0 && (size_t)reported <= commands.size()) {
+            results[reported - 1] = result;
+            received[reported - 1] = true;
+        }
+        if ((size_t)reported > executed) {
+            executed = reported;
+        }
+        if ((size_t)reported < expected) {
+            return false;
+        }
+        // Each response is triggered by the next packet. The bootloader may be ahead if responses
+        // were lost or the packets after a restart were already executed, so they are not resent.
+        expected++;
+        if (sent < executed) {
+            sent = executed;
+        }
+        return true;
+    };
+
+    // Lets the packets already sent pass, collects their responses and continues from the first unexecuted command
+    auto restart = [&]() {
+        retryCount++;
+        uint64_t until = readyAt + port.byteTime(2 + RESPONSE_HEADER_SIZE + MAX_RESULT_SIZE + 6) + responseTimeoutUs * 1000ULL / 4;
+        for (uint64_t time = now(); time < until; time = now()) {
+            if (receive((uint32_t)((until - time) / 1000), counter, result)) {
+                handleResponse();
+            }
+        }
+        sent = executed;
+        expected = executed;
+    };
+
+    while (executed < commands.size()) {
+        bool windowOpen = sent < all.size() && sent < executed + window;
+        uint64_t time = now();
+        if (windowOpen && time >= readyAt) {
+            send(all[sent], base + sent);
+            sent++;
+            sentHigh = sent > sentHigh ? sent : sentHigh;
+            continue;
+        }
+        uint32_t timeoutUs = windowOpen ? (uint32_t)((readyAt - time) / 1000) : responseTimeoutUs;
+        if (!receive(timeoutUs, counter, result)) {
+            if (windowOpen) {
+                continue;
+            }
+            // Nothing came back, the last packets or their responses were lost
+            if (++timeouts > maxTimeouts) {
+                throw std::runtime_error("Bootloader does not respond");
+            }
+            restart();
+            continue;
+        }
+        timeouts = 0;
+        if (!handleResponse()) {
+            restart();
+        }
+    }
+    nextCounter = base + all.size();
+
+    // A lost response takes the result with it, so commands that return something are repeated.
+    // They only read the device state, which is the same after the rest of the commands.
+    std::vector<Command> missing;
+    std::vector<size_t> missingIndexes;
+    for (size_t i = 0; i < commands.size(); i++) {
+        if (!received[i] && hasResult(commands[i].cmd)) {
+            missing.push_back(commands[i]);
+            missingIndexes.push_back(i);
+        }
+    }
+    if (!missing.empty()) {
+        auto repeated = run(missing);
+        for (size_t i = 0; i < missing.size(); i++) {
+            results[missingIndexes[i]] = repeated[i];
+        }
+    }
+    return results;
+}
+
+Programmer::DeviceInfo Programmer::init()
+{
+    // Page count is not known yet, so the busy time assumes the largest flash the response can describe
+    size_t maxPages = (MAX_RESULT_SIZE - DEVICE_INFO_SIZE) / 2 * 8;
+    auto result = run({ { CMD_INIT, {}, (uint32_t)(maxPages * INIT_US_PER_PAGE), 0 } })[0];
+    if (result.size() < DEVICE_INFO_SIZE) {
+        throw std::runtime_error("Invalid INIT response");
+    }
+    DeviceInfo info;
+    info.loadAddress = getUint32(&result[0]);
+    info.totalPages = (uint16_t)(result[4] | result[5] << 8);
+    info.pageSizeLog2 = result[6];
+    info.writeSizeLog2 = result[7];
+    info.deviceModel = result[8];
+    info.lzBufferSizeLog2 = result[9];
+    // Older bootloaders do not report the page state, all pages look interrupted then
+    size_t bitmapSize = (info.totalPages + 7) / 8;
+    bool hasBitmaps = result.size() >= DEVICE_INFO_SIZE + 2 * bitmapSize;
+    for (size_t page = 0; page < info.totalPages; page++) {
+        auto bit = [&](size_t offset) {
+            return hasBitmaps && (result[offset + page / 8] & (1 << (page % 8))) != 0;
+        };
+        info.erasedPages.push_back(bit(DEVICE_INFO_SIZE));
+        info.writtenPages.push_back(bit(DEVICE_INFO_SIZE + bitmapSize));
+    }
+    return info;
+}
+
+bool Programmer::setBaudRate(uint32_t baudRate)
+{
+    uint32_t defaultBaudRate = port.baudRate();
+    size_t defaultMaxTimeouts = maxTimeouts;
+    Command command = { CMD_SET_BAUD, {}, SET_BAUD_US, baudRate };
+    appendUint32(command.args, baudRate);
+    maxTimeouts = 2;
+    try {
+        auto result = run({ command })[0];
+        maxTimeouts = defaultMaxTimeouts;
+        if (result.size() >= 4 && getUint32(result.data()) != 0) {
+            return true;
+        }
+    } catch (const std::runtime_error&) {
+        maxTimeouts = defaultMaxTimeouts;
+    }
+    // Bootloader goes back to the default speed after a while without valid packets
+    port.setBaudRate(defaultBaudRate);
+    usleep(HIGH_SPEED_FALLBACK_US);
+    port.flush();
+    connect();
+    return false;
+}
+
+void Programmer::multicastJoin(uint8_t group)
+{
+    run({ { CMD_MC_JOIN, { group }, 0, 0 } });
+}
+
+std::vector<bool> Programmer::multicastStatus(uint8_t& group)
+{
+    auto result = run({ { CMD_MC_STATUS, {}, 0, 0 } })[0];
+    if (result.size() < 1 + MULTICAST_MAX_CHUNKS / 8) {
+        throw std::runtime_error("Invalid MC_STATUS response");
+    }
+    group = result[0];
+    std::vector<bool> chunks;
+    for (size_t chunk = 0; chunk < MULTICAST_MAX_CHUNKS; chunk++) {
+        chunks.push_back((result[1 + chunk / 8] & (1 << (chunk % 8))) != 0);
+    }
+    return chunks;
+}
+
+void Programmer::reset()
+{
+    // Bootloader sends the pending response and resets right after the packet, nothing comes back.
+    send({ CMD_RESET, {}, 0, 0 }, nextCounter++);
+    while (now() < lineFreeAt) {
+        usleep((lineFreeAt - now()) / 1000 + 1);
+    }
+    port.flush();
+}
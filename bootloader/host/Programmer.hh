@@ -0,0 +1,151 @@
+#ifndef PROGRAMMER_HH
+#define PROGRAMMER_HH
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "Frame.hh"
+#include "SerialPort.hh"
+
+/**
+ * Bootloader protocol client, see the protocol description at the end of `bootloader.c`.
+ *
+ * Commands are pipelined: the next packet is sent as soon as the bootloader is able to
+ * receive it, without waiting for the response. The response to each packet carries the
+ * last valid command counter and its result, so a lost packet shows up as a counter that
+ * stops advancing, and the programmer resends everything from the first unexecuted command.
+ */
+class Programmer
+{
+public:
+    enum : uint8_t {
+        CMD_INIT = 0,
+        CMD_ERASE = 1,
+        CMD_WRITE = 2,
+        CMD_READ = 3,
+        CMD_RESET = 4,
+        CMD_PING = 5,
+        CMD_PAGE_CRC = 6,
+        CMD_WRITE_LZ = 7,
+        CMD_MC_JOIN = 8,
+        CMD_MC_STATUS = 9,
+        CMD_SET_BAUD = 10,
+    };
+
+    static constexpr size_t UID_SIZE = 13; // Model byte and 12 bytes of the MCU UID
+    static constexpr size_t MAX_ARGS_SIZE = Frame::MAX_DATA_SIZE - 5 - UID_SIZE - 5;
+    static constexpr size_t MAX_RESULT_SIZE = Frame::MAX_DATA_SIZE - 5 - UID_SIZE - 4;
+    static constexpr size_t DEFAULT_WINDOW = 8;
+    static constexpr size_t MULTICAST_MAX_ARGS_SIZE = Frame::MAX_DATA_SIZE - 5 - 2 - 5;
+    static constexpr size_t MULTICAST_MAX_CHUNKS = 256;
+
+    struct Command
+    {
+        uint8_t cmd;
+        std::vector<uint8_t> args;
+        uint32_t busyUs; // Time the bootloader does not receive after the packet, e.g. because of flash stall
+        uint32_t switchBaudRate; // Baud rate to switch to after the packet is sent, 0 to keep it
+    };
+
+    struct DeviceInfo
+    {
+        uint32_t loadAddress;
+        uint16_t totalPages;
+        uint8_t pageSizeLog2;
+        uint8_t writeSizeLog2;
+        uint8_t deviceModel;
+        uint8_t lzBufferSizeLog2;
+        std::vector<bool> erasedPages; // Page contains only 0xFF
+        std::vector<bool> writtenPages; // Last double word of the page is programmed
+    };
+
+    /**
+     * Up to `window` packets are sent ahead of the last confirmed command. Each response needs one
+     * more packet, so the window must be at least 2.
+     */
+    Programmer(SerialPort& port, const uint8_t uid[UID_SIZE], size_t window = DEFAULT_WINDOW);
+
+    /** Synchronizes the command counter with the bootloader, retries until it responds. */
+    void connect(uint32_t timeoutUs = 5000000);
+
+    /** Executes the commands in order and returns their results. Throws if the bootloader stops responding. */
+    std::vector<std::vector<uint8_t>> run(const std::vector<Command>& commands);
+
+    /** Switches both sides to the baud rate. Returns false if it does not work, the default speed is kept then. */
+    bool setBaudRate(uint32_t baudRate);
+
+    /** Unlocks the flash and returns the device info with the state of each application page. */
+    DeviceInfo init();
+
+    static Command erase(uint32_t page);
+    static Command write(uint32_t address, const uint8_t* data, size_t size);
+    static Command writeCompressed(uint32_t address, const std::vector<uint8_t>& compressed, size_t outputSize);
+    static Command pageCrc(uint32_t firstPage, uint8_t count, uint32_t pageSize);
+
+    /** Multicast write, the nodes check the data with its CRC. */
+    static Command multicastWrite(uint32_t address, const uint8_t* data, size_t size);
+
+    /** Multicast compressed write, the chunk must be compressed without history. */
+    static Command multicastWriteCompressed(uint32_t address, const std::vector<uint8_t>& compressed,
+                                            const uint8_t* data, size_t size);
+
+    /** Sets the multicast group of this node and clears its chunk marks. */
+    void multicastJoin(uint8_t group);
+
+    /** Returns the chunks marked by this node as programmed and its multicast group. */
+    std::vector<bool> multicastStatus(uint8_t& group);
+
+    /**
+     * Sends the command to all nodes of the model in the group (0 - all nodes of the model) without
+     * waiting for anything. The nodes mark the chunk index when the command succeeds.
+     */
+    void sendMulticast(const Command& command, uint8_t model, uint8_t group, uint32_t chunk);
+
+    /** Resets the device without waiting, the application starts if it is valid. */
+    void reset();
+
+    /** Number of times the pipeline was restarted because of a lost packet or response. */
+    size_t retries() const { return retryCount; }
+
+    uint32_t responseTimeoutUs = 200000;
+    size_t maxTimeouts = 10;
+
+private:
+    static constexpr uint8_t PROTOCOL_FLAGS = 0x21; // Bootloader protocol, one destination
+    static constexpr uint8_t OWN_ADDRESS = 0x88;
+    static constexpr uint8_t BOOT_TYPE_PASSED = 1;
+    static constexpr uint8_t BOOT_TYPE_RESPONSE = 2;
+    static constexpr size_t RESPONSE_HEADER_SIZE = 5 + UID_SIZE + 4;
+    static constexpr size_t DEVICE_INFO_SIZE = 12; // With padding, page bitmaps follow
+    static constexpr uint32_t INIT_US_PER_PAGE = 60; // Erased check reads the whole page
+    static constexpr uint32_t FLASH_ERASE_US = 40000; // Maximum page erase time from the datasheet
+    static constexpr uint32_t FLASH_WRITE_US = 125; // Maximum double word programming time
+    static constexpr uint32_t CRC_US_PER_KB = 200; // CRC unit fed byte by byte at 48 MHz, with margin
+    static constexpr uint32_t SET_BAUD_US = 2000; // Time to reconfigure the USART
+    static constexpr uint32_t GUARD_US = 2000; // Packet may leave later than estimated, e.g. because of USB latency
+    static constexpr uint32_t HIGH_SPEED_FALLBACK_US = 600000; // Bootloader returns to the default speed after 0.5 s
+
+    SerialPort& port;
+    uint8_t uid[UID_SIZE];
+    size_t window;
+    uint32_t nextCounter = 0xFFFFFFFF;
+    size_t retryCount = 0;
+    uint64_t lineFreeAt = 0; // Estimated time when the last written byte leaves the UART
+    uint64_t readyAt = 0; // Time when the bootloader can receive the next packet
+    size_t pendingResultSize = 0; // Result size of the last sent command, its response goes out with the next packet
+    Frame::Decoder decoder;
+    uint8_t rxBuffer[256];
+    size_t rxCount = 0;
+    size_t rxPos = 0;
+
+    static uint64_t now();
+    static bool hasResult(uint8_t cmd);
+    static size_t resultSize(const Command& command);
+    void send(const Command& command, uint32_t counter);
+    void transmit(const uint8_t* data, size_t size, const Command& command, bool hasResponse);
+    bool receive(uint32_t timeoutUs, uint32_t& counter, std::vector<uint8_t>& result);
+    bool parseResponse(const std::vector<uint8_t>& data, uint32_t& counter, std::vector<uint8_t>& result) const;
+};
+
+#endif // PROGRAMMER_HH
@@ -0,0 +1,119 @@
+
+#include "SerialPort.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <string>
+
+
+static std::runtime_error systemError(const std::string& what)
+{
+    return std::runtime_error(what + ": " + strerror(errno));
+}
+
+
+SerialPort::SerialPort(const char* path, uint32_t baudRate)
+{
+    fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        throw systemError(path);
+    }
+    try {
+        setBaudRate(baudRate);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    tcflush(fd, TCIOFLUSH);
+}
+
+SerialPort::~SerialPort()
+{
+    close(fd);
+}
+
+void SerialPort::setBaudRate(uint32_t baudRate)
+{
+    static const struct { uint32_t baudRate; speed_t speed; } speeds[] = {
+        { 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+        { 230400, B230400 }, { 460800, B460800 }, { 500000, B500000 }, { 576000, B576000 },
+        { 921600, B921600 }, { 1000000, B1000000 }, { 1500000, B1500000 }, { 2000000, B2000000 },
+        { 3000000, B3000000 }, { 4000000, B4000000 },
+    };
+    const speed_t* speed = nullptr;
+    for (auto& entry : speeds) {
+        if (entry.baudRate == baudRate) {
+            speed = &entry.speed;
+        }
+    }
+    if (speed == nullptr) {
+        throw std::runtime_error("Unsupported baud rate " + std::to_string(baudRate));
+    }
+
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0) {
+        throw systemError("tcgetattr");
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag |= CSTOPB | CLOCAL | CREAD;
+    tio.c_cflag &= ~(PARENB | CRTSCTS);
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, *speed);
+    cfsetospeed(&tio, *speed);
+    // Bytes already written go out at the old speed
+    if (tcsetattr(fd, TCSADRAIN, &tio) != 0) {
+        throw systemError("tcsetattr");
+    }
+    currentBaudRate = baudRate;
+}
+
+uint64_t SerialPort::byteTime(size_t count) const
+{
+    return (uint64_t)count * BITS_PER_BYTE * 1000000000ULL / currentBaudRate;
+}
+
+void SerialPort::write(const uint8_t* data, size_t size)
+{
+    while (size > 0) {
+        auto written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                throw systemError("write");
+            }
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            poll(&pfd, 1, 100);
+            continue;
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+size_t SerialPort::read(uint8_t* buffer, size_t size, uint32_t timeoutUs)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    struct timespec timeout = { (time_t)(timeoutUs / 1000000), (long)(timeoutUs % 1000000) * 1000 };
+    if (ppoll(&pfd, 1, &timeout, nullptr) < 0 && errno != EINTR) {
+        throw systemError("poll");
+    }
+    auto count = ::read(fd, buffer, size);
+    if (count < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+        throw systemError("read");
+    }
+    return (size_t)count;
+}
+
+void SerialPort::flush()
+{
+    tcdrain(fd);
+    tcflush(fd, TCIFLUSH);
+}
@@ -0,0 +1,42 @@
+#ifndef SERIALPORT_HH
+#define SERIALPORT_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Linux serial port in raw mode, 8 data bits, 2 stop bits, no parity, the same as the bootloader.
+ * Errors are reported with `std::runtime_error`.
+ */
+class SerialPort
+{
+public:
+    SerialPort(const char* path, uint32_t baudRate);
+    ~SerialPort();
+
+    SerialPort(const SerialPort&) = delete;
+    SerialPort& operator=(const SerialPort&) = delete;
+
+    void setBaudRate(uint32_t baudRate);
+    uint32_t baudRate() const { return currentBaudRate; }
+
+    /** Nanoseconds needed to transmit `count` bytes at the current baud rate. */
+    uint64_t byteTime(size_t count) const;
+
+    /** Writes all bytes, blocks while the driver buffer is full. */
+    void write(const uint8_t* data, size_t size);
+
+    /** Reads available bytes, waits up to `timeoutUs` if there are none. Returns the number of bytes read. */
+    size_t read(uint8_t* buffer, size_t size, uint32_t timeoutUs);
+
+    /** Waits until all written bytes are transmitted and discards the received ones. */
+    void flush();
+
+private:
+    static constexpr uint32_t BITS_PER_BYTE = 11;
+
+    int fd;
+    uint32_t currentBaudRate = 0;
+};
+
+#endif // SERIALPORT_HH
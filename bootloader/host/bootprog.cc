@@ -0,0 +1,450 @@
+// Command line programmer for the bootloader over a Linux serial port.
+//
+// Usage: bootprog [-b baud] [-s baud] [-u uid]... [-m group] [-w window] [-z] [-r] [-f] port image.bin
+//   -b  default baud rate of the bootloader port (default: 57600)
+//   -s  switch to this baud rate for programming, only for a node on the same bus (not through a proxy)
+//   -u  model byte and 12 UID bytes as 26 hex digits (default: 01000102030405060708090A0B),
+//       repeated for each node in the multicast mode
+//   -m  program all nodes given by -u at once using this multicast group (1..255)
+//   -w  number of packets sent ahead of the last confirmed one (default: 8)
+//   -z  send compressed data
+//   -r  reset after programming, so the application starts
+//   -f  erase and write all pages, do not resume an interrupted update
+//
+// The image is written at the load address reported by the bootloader and verified with page CRCs.
+// Pages that already match the image are skipped, so running it again after a failure resumes the update.
+// Works with the simulator PTYs the same way as with real hardware, see bootloader/sim.
+//
+// In the multicast mode, the nodes join the group and each chunk of the image is sent once to all of
+// them. The bitmaps of the chunks programmed by each node are collected and the missing chunks are sent
+// again. All pages are erased and written, the mode does not resume and does not switch the baud rate.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "../../src/common/CRC32.hh"
+#include "LZCompressor.hh"
+#include "Programmer.hh"
+
+
+static constexpr uint32_t FLASH_BASE = 0x08000000;
+static constexpr size_t WRITE_CHUNK = Programmer::MAX_ARGS_SIZE - 4 - (Programmer::MAX_ARGS_SIZE - 4) % 8;
+static constexpr size_t MAX_PAGE_CRC_COUNT = Programmer::MAX_RESULT_SIZE / 4;
+static constexpr size_t MULTICAST_WRITE_CHUNK = Programmer::MULTICAST_MAX_ARGS_SIZE - 8 -
+                                                (Programmer::MULTICAST_MAX_ARGS_SIZE - 8) % 8;
+static constexpr int MULTICAST_MAX_ROUNDS = 10;
+
+typedef std::array<uint8_t, Programmer::UID_SIZE> Uid;
+
+
+static double seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static std::vector<uint8_t> readFile(const char* path)
+{
+    std::vector<uint8_t> data;
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) {
+        perror(path);
+        exit(1);
+    }
+    uint8_t buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        data.insert(data.end(), buffer, buffer + count);
+    }
+    fclose(file);
+    return data;
+}
+
+static void parseUid(const char* text, uint8_t uid[Programmer::UID_SIZE])
+{
+    for (size_t i = 0; i < Programmer::UID_SIZE; i++) {
+        unsigned int byte;
+        if (sscanf(text + 2 * i, "%2x", &byte) != 1) {
+            fprintf(stderr, "UID must have %zu hex digits\n", 2 * Programmer::UID_SIZE);
+            exit(1);
+        }
+        uid[i] = (uint8_t)byte;
+    }
+}
+
+static uint32_t getUint32(const uint8_t* data)
+{
+    return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static bool isErased(const uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Appends commands writing the image bytes from `begin` to `end`
+static void writeCommands(const std::vector<uint8_t>& image, size_t begin, size_t end, uint32_t loadAddress,
+                          const Programmer::DeviceInfo& info, const LZCompressor* compressor,
+                          std::vector<Programmer::Command>& commands)
+{
+    size_t align = (size_t)1 << info.writeSizeLog2;
+    size_t maxOutput = (size_t)1 << info.lzBufferSizeLog2;
+    for (size_t offset = begin; offset < end;) {
+        size_t size = end - offset < WRITE_CHUNK ? end - offset : WRITE_CHUNK;
+        if (compressor == nullptr) {
+            commands.push_back(Programmer::write(loadAddress + offset, &image[offset], size));
+        } else {
+            std::vector<uint8_t> compressed;
+            size_t limit = end - offset < maxOutput ? end - offset : maxOutput;
+            size = compressor->compress(offset, limit, Programmer::MAX_ARGS_SIZE - 4, align, compressed);
+            if (size == 0) {
+                throw std::runtime_error("Compression failed");
+            }
+            commands.push_back(Programmer::writeCompressed(loadAddress + offset, compressed, size));
+        }
+        offset += size;
+    }
+}
+
+// Appends commands reading CRC of the pages, returns index of the first one
+static size_t crcCommands(uint32_t firstPage, size_t pages, size_t pageSize, std::vector<Programmer::Command>& commands)
+{
+    size_t index = commands.size();
+    for (size_t page = 0; page < pages; page += MAX_PAGE_CRC_COUNT) {
+        size_t count = pages - page < MAX_PAGE_CRC_COUNT ? pages - page : MAX_PAGE_CRC_COUNT;
+        commands.push_back(Programmer::pageCrc(firstPage + page, (uint8_t)count, pageSize));
+    }
+    return index;
+}
+
+static uint32_t pageCrcResult(const std::vector<std::vector<uint8_t>>& results, size_t index, size_t page)
+{
+    auto& result = results[index + page / MAX_PAGE_CRC_COUNT];
+    size_t offset = page % MAX_PAGE_CRC_COUNT * 4;
+    return result.size() >= offset + 4 ? getUint32(&result[offset]) : 0;
+}
+
+// Programs all nodes at once, returns the exit code
+static int programMulticast(SerialPort& port, const std::vector<Uid>& uids, uint8_t group, size_t window,
+                            std::vector<uint8_t> image, bool compress, bool reset)
+{
+    struct Chunk {
+        Programmer::Command command;
+        size_t page;
+    };
+
+    double start = seconds();
+    std::vector<std::unique_ptr<Programmer>> nodes;
+    Programmer::DeviceInfo info;
+    for (auto& uid : uids) {
+        nodes.emplace_back(new Programmer(port, uid.data(), window));
+        nodes.back()->connect();
+        auto nodeInfo = nodes.back()->init();
+        if (nodes.size() == 1) {
+            info = nodeInfo;
+        } else if (nodeInfo.loadAddress != info.loadAddress || nodeInfo.totalPages != info.totalPages ||
+                   nodeInfo.pageSizeLog2 != info.pageSizeLog2 || nodeInfo.writeSizeLog2 != info.writeSizeLog2 ||
+                   nodeInfo.deviceModel != info.deviceModel || nodeInfo.lzBufferSizeLog2 != info.lzBufferSizeLog2) {
+            fprintf(stderr, "Node %zu is a different device than node 1\n", nodes.size());
+            return 1;
+        }
+        nodes.back()->multicastJoin(group);
+    }
+
+    size_t pageSize = (size_t)1 << info.pageSizeLog2;
+    size_t alignedSize = (image.size() + pageSize - 1) & ~(pageSize - 1);
+    image.resize(alignedSize, 0xFF);
+    size_t pages = alignedSize / pageSize;
+    if (pages > info.totalPages) {
+        fprintf(stderr, "Image does not fit: %zu pages, %u available\n", pages, info.totalPages);
+        return 1;
+    }
+    uint32_t firstPage = (info.loadAddress - FLASH_BASE) >> info.pageSizeLog2;
+
+    // Vector table goes last, as in the unicast mode. Compressed chunks are self-contained, because
+    // the nodes may have different flash content before the chunk.
+    std::vector<Chunk> chunks;
+    for (size_t page = 0; page < pages; page++) {
+        chunks.push_back({ Programmer::erase(firstPage + page), page });
+    }
+    LZCompressor compressor(image.data(), image.size(), image.size());
+    size_t align = (size_t)1 << info.writeSizeLog2;
+    size_t maxOutput = (size_t)1 << info.lzBufferSizeLog2;
+    for (size_t i = 1; i <= pages; i++) {
+        size_t page = i % pages;
+        size_t end = (page + 1) * pageSize;
+        if (isErased(&image[page * pageSize], pageSize)) {
+            continue;
+        }
+        for (size_t offset = page * pageSize; offset < end;) {
+            size_t size = end - offset < MULTICAST_WRITE_CHUNK ? end - offset : MULTICAST_WRITE_CHUNK;
+            uint32_t address = info.loadAddress + offset;
+            if (!compress) {
+                chunks.push_back({ Programmer::multicastWrite(address, &image[offset], size), page });
+            } else {
+                std::vector<uint8_t> compressed;
+                size_t limit = end - offset < maxOutput ? end - offset : maxOutput;
+                size = compressor.compress(offset, limit, Programmer::MULTICAST_MAX_ARGS_SIZE - 8, align, compressed);
+                if (size == 0) {
+                    throw std::runtime_error("Compression failed");
+                }
+                chunks.push_back({ Programmer::multicastWriteCompressed(address, compressed, &image[offset], size),
+                                   page });
+            }
+            offset += size;
+        }
+    }
+    if (chunks.size() > Programmer::MULTICAST_MAX_CHUNKS) {
+        fprintf(stderr, "Image needs %zu chunks, at most %zu can be sent at once\n", chunks.size(),
+                Programmer::MULTICAST_MAX_CHUNKS);
+        return 1;
+    }
+
+    std::vector<bool> missing(chunks.size(), true);
+    size_t packets = 0;
+    int round = 0;
+    for (; round < MULTICAST_MAX_ROUNDS; round++) {
+        for (size_t chunk = 0; chunk < chunks.size(); chunk++) {
+            if (missing[chunk]) {
+                nodes[0]->sendMulticast(chunks[chunk].command, info.deviceModel, group, chunk);
+                packets++;
+            }
+        }
+        std::fill(missing.begin(), missing.end(), false);
+        bool complete = true;
+        for (auto& node : nodes) {
+            uint8_t nodeGroup;
+            auto marked = node->multicastStatus(nodeGroup);
+            if (nodeGroup != group) {
+                // Node was reset, it starts again
+                node->multicastJoin(group);
+                marked.assign(marked.size(), false);
+            }
+            for (size_t chunk = 0; chunk < chunks.size(); chunk++) {
+                if (!marked[chunk]) {
+                    missing[chunk] = true;
+                    complete = false;
+                }
+            }
+        }
+        if (complete) {
+            break;
+        }
+        // Erase clears the marks of the page, so everything written to it goes again
+        for (size_t chunk = 0; chunk < chunks.size(); chunk++) {
+            if (missing[chunk] && chunks[chunk].command.cmd == Programmer::CMD_ERASE) {
+                for (size_t other = chunk + 1; other < chunks.size(); other++) {
+                    missing[other] = missing[other] || chunks[other].page == chunks[chunk].page;
+                }
+            }
+        }
+    }
+
+    std::vector<uint32_t> expected;
+    for (size_t page = 0; page < pages; page++) {
+        expected.push_back(CRC32::calculate(&image[page * pageSize], pageSize));
+    }
+    size_t failedNodes = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        std::vector<Programmer::Command> commands;
+        auto crcFirst = crcCommands(firstPage, pages, pageSize, commands);
+        auto results = nodes[i]->run(commands);
+        size_t failed = 0;
+        for (size_t page = 0; page < pages; page++) {
+            failed += pageCrcResult(results, crcFirst, page) != expected[page];
+        }
+        if (failed != 0) {
+            printf("Node %zu: %zu pages FAILED\n", i + 1, failed);
+            failedNodes++;
+        }
+    }
+    double elapsed = seconds() - start;
+    printf("%zu bytes to %zu nodes in %.2f s, %zu chunks, %zu packets in %d rounds, verification %s\n",
+           alignedSize, nodes.size(), elapsed, chunks.size(), packets, round + (round < MULTICAST_MAX_ROUNDS),
+           failedNodes == 0 ? "passed" : "FAILED");
+    if (failedNodes != 0) {
+        return 1;
+    }
+    if (reset) {
+        for (auto& node : nodes) {
+            node->reset();
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t baudRate = 57600;
+    uint32_t highSpeed = 0;
+    uint8_t uid[Programmer::UID_SIZE] = { 1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+    std::vector<Uid> uids;
+    uint8_t group = 0;
+    size_t window = Programmer::DEFAULT_WINDOW;
+    bool compress = false;
+    bool reset = false;
+    bool force = false;
+    int option;
+
+    while ((option = getopt(argc, argv, "b:s:u:m:w:zrf")) != -1) {
+        switch (option) {
+            case 'b':
+                baudRate = strtoul(optarg, nullptr, 0);
+                break;
+            case 's':
+                highSpeed = strtoul(optarg, nullptr, 0);
+                break;
+            case 'u':
+                parseUid(optarg, uid);
+                uids.emplace_back();
+                std::copy(uid, uid + Programmer::UID_SIZE, uids.back().begin());
+                break;
+            case 'm':
+                group = (uint8_t)strtoul(optarg, nullptr, 0);
+                if (group == 0) {
+                    fprintf(stderr, "Multicast group must be 1..255\n");
+                    return 1;
+                }
+                break;
+            case 'w':
+                window = strtoul(optarg, nullptr, 0);
+                break;
+            case 'z':
+                compress = true;
+                break;
+            case 'r':
+                reset = true;
+                break;
+            case 'f':
+                force = true;
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-b baud] [-s baud] [-u uid]... [-m group] [-w window] [-z] [-r] [-f] port image.bin\n",
+                argv[0]);
+        return 1;
+    }
+    if (uids.size() > 1 && group == 0) {
+        fprintf(stderr, "Several nodes can be programmed only in the multicast mode (-m)\n");
+        return 1;
+    }
+
+    try {
+        auto image = readFile(argv[optind + 1]);
+        SerialPort port(argv[optind], baudRate);
+        if (group != 0) {
+            if (uids.empty()) {
+                uids.emplace_back();
+                std::copy(uid, uid + Programmer::UID_SIZE, uids.back().begin());
+            }
+            return programMulticast(port, uids, group, window, image, compress, reset);
+        }
+        Programmer programmer(port, uid, window);
+
+        double start = seconds();
+        programmer.connect();
+        auto info = programmer.init();
+        if (highSpeed != 0 && !programmer.setBaudRate(highSpeed)) {
+            fprintf(stderr, "Baud rate %u does not work, staying at %u\n", highSpeed, baudRate);
+        }
+
+        size_t pageSize = (size_t)1 << info.pageSizeLog2;
+        size_t alignedSize = (image.size() + pageSize - 1) & ~(pageSize - 1);
+        image.resize(alignedSize, 0xFF);
+        size_t pages = alignedSize / pageSize;
+        if (pages > info.totalPages) {
+            fprintf(stderr, "Image does not fit: %zu pages, %u available\n", pages, info.totalPages);
+            return 1;
+        }
+        uint32_t firstPage = (info.loadAddress - FLASH_BASE) >> info.pageSizeLog2;
+        std::vector<uint32_t> expected;
+        for (size_t page = 0; page < pages; page++) {
+            expected.push_back(CRC32::calculate(&image[page * pageSize], pageSize));
+        }
+
+        // Pages left from an interrupted update are kept if they already contain this image.
+        // Erased pages only need writing, the rest is erased first.
+        std::vector<bool> upToDate(pages, false);
+        std::vector<Programmer::Command> commands;
+        if (!force) {
+            auto crcFirst = crcCommands(firstPage, pages, pageSize, commands);
+            auto results = programmer.run(commands);
+            for (size_t page = 0; page < pages; page++) {
+                upToDate[page] = pageCrcResult(results, crcFirst, page) == expected[page];
+            }
+            commands.clear();
+        }
+        size_t interrupted = 0;
+        for (size_t page = 0; page < pages && !force; page++) {
+            interrupted += !info.erasedPages[page] && !info.writtenPages[page] && !upToDate[page];
+        }
+        if (interrupted != 0) {
+            printf("%zu pages were interrupted while being programmed\n", interrupted);
+        }
+        size_t skipped = 0;
+        for (size_t page = 0; page < pages; page++) {
+            if (upToDate[page]) {
+                skipped++;
+            } else if (force || !info.erasedPages[page]) {
+                commands.push_back(Programmer::erase(firstPage + page));
+            }
+        }
+
+        // Vector table goes last, so an interrupted update never leaves a startable application.
+        // Compressed chunks must not refer to it for the same reason.
+        std::unique_ptr<LZCompressor> compressor;
+        if (compress) {
+            compressor.reset(new LZCompressor(image.data(), image.size(), pageSize));
+        }
+        for (size_t i = 1; i <= pages; i++) {
+            size_t page = i % pages;
+            const uint8_t* data = &image[page * pageSize];
+            if (!upToDate[page] && !isErased(data, pageSize)) {
+                writeCommands(image, page * pageSize, (page + 1) * pageSize, info.loadAddress, info,
+                              compressor.get(), commands);
+            }
+        }
+        auto crcFirst = crcCommands(firstPage, pages, pageSize, commands);
+        auto results = programmer.run(commands);
+
+        size_t failed = 0;
+        for (size_t page = 0; page < pages; page++) {
+            if (pageCrcResult(results, crcFirst, page) != expected[page]) {
+                failed++;
+            }
+        }
+        double elapsed = seconds() - start;
+        size_t written = (pages - skipped) * pageSize;
+        printf("%zu bytes in %.2f s, %.0f B/s at %u baud, %zu of %zu pages up to date, %zu packets, "
+               "%zu retries, verification %s\n",
+               written, elapsed, written / elapsed, port.baudRate(), skipped, pages, commands.size(),
+               programmer.retries(), failed == 0 ? "passed" : "FAILED");
+        if (failed != 0) {
+            return 1;
+        }
+        if (reset) {
+            programmer.reset();
+        }
+    } catch (const std::runtime_error& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
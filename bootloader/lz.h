@@ -0,0 +1,75 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Compressed stream used by CMD_WRITE_LZ. It is a sequence of tokens:
+ *
+ *      0LLLLLLL                literal run, L + 1 bytes follow (1..128)
+ *      1LLLLDDD DDDDDDDD       match, copy L + 3 bytes (3..18) from D + 1 bytes back (1..2048)
+ *
+ * Match may reach before the beginning of the output. In that case, the bytes
+ * are taken from the history which ends exactly where the output starts. The
+ * bootloader uses the flash content preceding the write address as the history,
+ * so the programmer must not refer to data that is not programmed yet.
+ */
+
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 15)
+#define LZ_MAX_LITERALS 128
+#define LZ_WINDOW_SIZE 2048
+
+
+/**
+ * Decompresses the stream. Returns number of decompressed bytes or -1 if
+ * the stream is malformed, does not fit in the output or refers outside history.
+ */
+static int lzDecompress(uint8_t *output, size_t outputSize, const uint8_t *historyEnd, size_t historySize,
+                        const uint8_t *input, size_t inputSize)
+{
+    const uint8_t *end = input + inputSize;
+    size_t pos = 0;
+
+    while (input < end)
+    {
+        uint8_t token = *input++;
+        size_t count;
+        if (token & 0x80)
+        {
+            if (input >= end)
+            {
+                return -1;
+            }
+            size_t distance = ((((size_t)token & 0x07) << 8) | *input++) + 1;
+            count = ((token >> 3) & 0x0F) + LZ_MIN_MATCH;
+            if (distance > pos + historySize || count > outputSize - pos)
+            {
+                return -1;
+            }
+            while (count--)
+            {
+                output[pos] = distance > pos ? historyEnd[(ptrdiff_t)pos - (ptrdiff_t)distance] : output[pos - distance];
+                pos++;
+            }
+        }
+        else
+        {
+            count = (size_t)token + 1;
+            if (count > (size_t)(end - input) || count > outputSize - pos)
+            {
+                return -1;
+            }
+            while (count--)
+            {
+                output[pos++] = *input++;
+            }
+        }
+    }
+
+    return (int)pos;
+}
+
+
+#endif // LZ_H
@@ -0,0 +1,194 @@
+"""
+End-to-end programming benchmark for the bootloader simulator.
+
+Programs a random (or given) image through a serial port, verifies it with page CRCs
+and prints the throughput. Works with the simulator PTY as well as with real hardware.
+
+    make && ./bootsim -b -l /tmp/boot &
+    python3 bench.py /tmp/boot0 --baud 57600
+
+It waits for each response before sending the next command. See bootloader/host/bootprog.cc
+for the pipelined programmer.
+"""
+
+import argparse
+import os
+import random
+import struct
+import termios
+import time
+
+
+ESC = 0xFF
+STOP = 0xFE
+MAX_DATA_LEN = 249
+
+PROTOCOL_BOOT = 0x02
+BOOT_TYPE_PASSED = 1
+UNKNOWN_DEVICE_ADDRESS = 0x00
+OWN_ADDRESS = 0x88
+
+CMD_INIT = 0
+CMD_ERASE = 1
+CMD_WRITE = 2
+CMD_PING = 5
+CMD_PAGE_CRC = 6
+
+# Time the bootloader does not receive after the response, the CPU stalls during flash operations
+BUSY_TIME = {CMD_ERASE: 0.042, CMD_WRITE: 0.004}
+
+FLASH_BASE = 0x08000000
+WRITE_CHUNK = 216  # Largest multiple of 8 that fits in the packet with 13 byte UID
+
+
+def crc32_stm32(data: bytes) -> int:
+    """CRC32 as calculated by the STM32 CRC unit in default configuration"""
+    crc = 0xFFFFFFFF
+    for byte in data:
+        crc ^= byte << 24
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x04C11DB7 if crc & 0x80000000 else crc << 1) & 0xFFFFFFFF
+    return crc ^ 0xFFFFFFFF
+
+
+def encode_packet(data: bytes, end_with_stop: bool) -> bytes:
+    """Data link frame: ESC MASK DATA^MASK CRC32^MASK ESC [STOP]"""
+    if len(data) > MAX_DATA_LEN:
+        raise ValueError(f"Data too long: {len(data)} > {MAX_DATA_LEN}")
+    content = bytes(data) + struct.pack('<I', crc32_stm32(data))
+    mask = 0
+    if ESC in content:
+        used = set(content) | {0x00, 0x01}
+        mask = next(x for x in range(256) if x not in used) ^ ESC
+    return bytes([ESC, mask]) + bytes(b ^ mask for b in content) + bytes([ESC] + ([STOP] if end_with_stop else []))
+
+
+class Programmer:
+
+    def __init__(self, path: str, baud: int, uid: bytes, timeout: float):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        attrs = termios.tcgetattr(self.fd)
+        attrs[0] = attrs[1] = attrs[3] = 0
+        attrs[2] = termios.CS8 | termios.CREAD | termios.CLOCAL | termios.CSTOPB
+        speed = getattr(termios, f'B{baud}')
+        attrs[4] = attrs[5] = speed
+        attrs[6][termios.VMIN] = 0
+        attrs[6][termios.VTIME] = 0
+        termios.tcsetattr(self.fd, termios.TCSANOW, attrs)
+        termios.tcflush(self.fd, termios.TCIOFLUSH)
+        self.uid = uid
+        self.timeout = timeout
+        self.counter = 0xFFFFFFFF
+        self.retries = 0
+        self.header_size = 5 + len(uid) + 4  # Network header, UID and counter
+
+    def _packet(self, cmd: int, counter: int, args: bytes) -> bytes:
+        data = bytes([PROTOCOL_BOOT << 4 | 1, OWN_ADDRESS, UNKNOWN_DEVICE_ADDRESS, BOOT_TYPE_PASSED, len(self.uid)])
+        data += self.uid + bytes([cmd]) + struct.pack('<I', counter) + args
+        return encode_packet(data, False)
+
+    def _read_response(self) -> bytes | None:
+        """Reads one response frame and returns its content without CRC"""
+        buffer = bytearray()
+        deadline = time.monotonic() + self.timeout
+        while time.monotonic() < deadline:
+            chunk = os.read(self.fd, 512)
+            if not chunk:
+                time.sleep(0.0002)
+                continue
+            buffer += chunk
+            end = buffer.find(bytes([ESC, STOP]))
+            if end >= 0:
+                start = buffer.rfind(bytes([ESC]), 0, end)
+                frame = buffer[start + 2:end]
+                mask = buffer[start + 1]
+                content = bytes(b ^ mask for b in frame)
+                if len(content) >= 4 and crc32_stm32(content[:-4]) == struct.unpack('<I', content[-4:])[0]:
+                    return content[:-4]
+                return None
+        return None
+
+    def connect(self) -> bytes:
+        """Sends INIT and returns its result. Counter 0xFFFFFFFF is always accepted."""
+        os.write(self.fd, self._packet(CMD_INIT, 0xFFFFFFFF, b''))
+        self._read_response()
+        while True:
+            os.write(self.fd, self._packet(CMD_PING, 0xFFFFFFFF, b''))
+            response = self._read_response()
+            if response is not None:
+                break
+        counter = struct.unpack('<I', response[self.header_size - 4:self.header_size])[0]
+        self.counter = (counter + 1) & 0xFFFFFFFF
+        return response[self.header_size:]
+
+    def run(self, commands: list[tuple[int, bytes]]) -> list[bytes]:
+        """
+        Executes commands and returns their results. Response to each packet carries the result of
+        the previous command and the last accepted counter, so lost packets are detected and resent.
+        """
+        commands = commands + [(CMD_PING, b'')]
+        results = [b''] * len(commands)
+        i = 0
+        while i < len(commands):
+            cmd, args = commands[i]
+            os.write(self.fd, self._packet(cmd, (self.counter + 1 + i) & 0xFFFFFFFF, args))
+            response = self._read_response()
+            time.sleep(BUSY_TIME.get(cmd, 0))
+            if response is None:
+                self.retries += 1
+                continue
+            counter = struct.unpack('<I', response[self.header_size - 4:self.header_size])[0]
+            executed = (counter - self.counter) & 0xFFFFFFFF
+            if executed == 0xFFFFFFFF:
+                # Final ping of the previous run was lost
+                self.counter = counter
+                self.retries += 1
+            elif executed == i:
+                if i > 0:
+                    results[i - 1] = response[self.header_size:]
+                i += 1
+            else:
+                self.retries += 1
+                i = executed
+        self.counter = (self.counter + len(commands)) & 0xFFFFFFFF
+        return results[:-1]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('port', help='serial port or simulator PTY')
+    parser.add_argument('--baud', type=int, default=57600)
+    parser.add_argument('--uid', default='01000102030405060708090A0B', help='model byte followed by 12 UID bytes')
+    parser.add_argument('--image', help='binary image, random 16 KB if not given')
+    parser.add_argument('--timeout', type=float, default=0.3)
+    args = parser.parse_args()
+
+    image = open(args.image, 'rb').read() if args.image else random.randbytes(16 * 1024)
+    image += b'\xFF' * (-len(image) % 8)
+    prog = Programmer(args.port, args.baud, bytes.fromhex(args.uid), args.timeout)
+
+    start = time.monotonic()
+    load_address, total_pages, page_size_log2 = struct.unpack('<IHB', prog.connect()[:7])
+    page_size = 1 << page_size_log2
+    first_page = (load_address - FLASH_BASE) >> page_size_log2
+    pages = (len(image) + page_size - 1) // page_size
+    if pages > total_pages:
+        raise SystemExit(f'Image does not fit: {pages} pages, {total_pages} available')
+
+    commands = [(CMD_ERASE, struct.pack('<I', first_page + page)) for page in range(pages)]
+    for offset in range(0, len(image), WRITE_CHUNK):
+        commands.append((CMD_WRITE, struct.pack('<I', load_address + offset) + image[offset:offset + WRITE_CHUNK]))
+    commands.append((CMD_PAGE_CRC, struct.pack('<IB', first_page, pages)))
+    crcs = struct.unpack(f'<{pages}I', prog.run(commands)[-1][:4 * pages])
+    elapsed = time.monotonic() - start
+
+    padded = image + b'\xFF' * (pages * page_size - len(image))
+    expected = tuple(crc32_stm32(padded[i * page_size:(i + 1) * page_size]) for i in range(pages))
+    print(f'{len(image)} bytes in {elapsed:.2f} s, {len(image) / elapsed:.0f} B/s, '
+          f'{prog.retries} retries, verification {"passed" if crcs == expected else "FAILED"}')
+    if crcs != expected:
+        raise SystemExit(1)
+
+
+if __name__ == '__main__':
+    main()
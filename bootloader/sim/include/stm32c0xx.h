@@ -0,0 +1,2 @@
+// Simulator replacement of the STM32Cube header, see sim.h
+#include "sim.h"
@@ -0,0 +1,196 @@
+// Linux build of the bootloader with simulated flash, CRC unit and UARTs connected to PTYs.
+//
+// Usage: bootsim [-f flash.bin] [-u uid] [-l link] [-b] [-c] [-v]
+//   -f  flash image file, created as erased flash if it does not exist (default: flash.bin)
+//   -u  UID as 24 hex digits (default: 000102030405060708090A0B)
+//   -l  create symbolic links <link>0, <link>1, ... to the port PTYs
+//   -b  stay in the bootloader, do not start the application
+//   -c  deliver framing errors when the PTY baud rate set by the programmer does not match
+//   -v  print flash operations and UART overruns
+//
+// The flash image persists across runs and resets. Reset restarts the process, the PTYs stay open.
+
+#define _GNU_SOURCE
+#include "sim.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+
+#define PORTS_ENV "BOOTSIM_PORTS"
+
+void uartPoll(USART_TypeDef *uart0, USART_TypeDef *uart1, USART_TypeDef *uart2, USART_TypeDef *uart3);
+void bootSelect(void);
+
+static char **arguments;
+static USART_TypeDef uarts[NUM_PORTS];
+
+
+static void openPty(int *master, int *slave, const char *link, int index)
+{
+    *master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (*master < 0 || grantpt(*master) != 0 || unlockpt(*master) != 0)
+    {
+        perror("posix_openpt");
+        exit(1);
+    }
+    const char *name = ptsname(*master);
+    *slave = open(name, O_RDWR | O_NOCTTY);
+    if (*slave < 0)
+    {
+        perror(name);
+        exit(1);
+    }
+    // Programmer may change the settings, but raw mode is a reasonable start
+    struct termios tio;
+    tcgetattr(*slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(*slave, TCSANOW, &tio);
+    printf("Port %d: %s, %u baud\n", index, name, simConfig.baudRates[index]);
+    if (link != NULL)
+    {
+        char path[256];
+        snprintf(path, sizeof(path), "%s%d", link, index);
+        unlink(path);
+        if (symlink(name, path) != 0)
+        {
+            perror(path);
+        }
+    }
+}
+
+
+static void openPorts(const char *link)
+{
+    // After reset the PTYs are inherited from the previous process
+    const char *inherited = getenv(PORTS_ENV);
+    char value[128] = "";
+    for (int i = 0; i < NUM_PORTS; i++)
+    {
+        int master, slave;
+        if (inherited != NULL)
+        {
+            int consumed;
+            if (sscanf(inherited, "%d,%d,%n", &master, &slave, &consumed) != 2)
+            {
+                fprintf(stderr, "Invalid " PORTS_ENV "\n");
+                exit(1);
+            }
+            inherited += consumed;
+        }
+        else
+        {
+            openPty(&master, &slave, link, i);
+        }
+        simOpenPort(&uarts[i], i, master, slave);
+        snprintf(value + strlen(value), sizeof(value) - strlen(value), "%d,%d,", master, slave);
+    }
+    setenv(PORTS_ENV, value, 1);
+    fflush(stdout);
+}
+
+
+static void parseUid(const char *text, uint8_t uid[12])
+{
+    for (int i = 0; i < 12; i++)
+    {
+        unsigned int byte;
+        if (sscanf(text + 2 * i, "%2x", &byte) != 1)
+        {
+            fprintf(stderr, "UID must have 24 hex digits\n");
+            exit(1);
+        }
+        uid[i] = byte;
+    }
+}
+
+
+void NVIC_SystemReset(void)
+{
+    simFlushPorts();
+    if (simConfig.verbose)
+    {
+        fprintf(stderr, "Reset\n");
+    }
+    execv("/proc/self/exe", arguments);
+    perror("execv");
+    exit(1);
+}
+
+
+void startApplication(uint32_t stackPointer, uint32_t resetHandler)
+{
+    printf("Application started, SP = 0x%08X, reset handler = 0x%08X\n", stackPointer, resetHandler);
+    exit(0);
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *flashFile = "flash.bin";
+    const char *link = NULL;
+    uint8_t uid[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+    bool stayInBootloader = false;
+    int option;
+
+    arguments = argv;
+    simConfig.ports = NUM_PORTS;
+    simConfig.baudRates[0] = PORT0_BAUDRATE;
+#if NUM_PORTS > 1
+    simConfig.baudRates[1] = PORT1_BAUDRATE;
+#endif
+#if NUM_PORTS > 2
+    simConfig.baudRates[2] = PORT2_BAUDRATE;
+#endif
+#if NUM_PORTS > 3
+    simConfig.baudRates[3] = PORT3_BAUDRATE;
+#endif
+
+    while ((option = getopt(argc, argv, "f:u:l:bcv")) != -1)
+    {
+        switch (option)
+        {
+            case 'f':
+                flashFile = optarg;
+                break;
+            case 'u':
+                parseUid(optarg, uid);
+                break;
+            case 'l':
+                link = optarg;
+                break;
+            case 'b':
+                stayInBootloader = true;
+                break;
+            case 'c':
+                simConfig.checkTerminalBaudRate = true;
+                break;
+            case 'v':
+                simConfig.verbose = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-f flash.bin] [-u uid] [-l link] [-b] [-c] [-v]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    simInit(flashFile, uid);
+    openPorts(link);
+
+    if (!stayInBootloader)
+    {
+        bootSelect();
+    }
+
+    while (1)
+    {
+        uartPoll(&uarts[0],
+            NUM_PORTS > 1 ? &uarts[NUM_PORTS > 1 ? 1 : 0] : NULL,
+            NUM_PORTS > 2 ? &uarts[NUM_PORTS > 2 ? 2 : 0] : NULL,
+            NUM_PORTS > 3 ? &uarts[NUM_PORTS > 3 ? 3 : 0] : NULL);
+    }
+}
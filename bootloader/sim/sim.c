@@ -0,0 +1,557 @@
+#include "sim.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#pragma region Time and core
+
+
+#define PAGE_ERASE_TIME_NS 22000000ULL // Typical values from STM32C011 datasheet
+#define DOUBLE_WORD_PROGRAM_TIME_NS 85000ULL
+#define BITS_PER_BYTE 11 // Start bit, 8 data bits, 2 stop bits
+#define HOST_STALL_NS 20000ULL
+
+uint32_t SystemCoreClock = 48000000;
+SCB_Type simScb;
+SimConfig simConfig;
+
+static SysTick_Type sysTickRegs;
+static uint64_t sysTickLast = 0;
+static uint32_t uid[3];
+
+static void updatePorts(uint64_t time);
+
+
+static uint64_t now()
+{
+    // Simulated time stops while the host does not run the process. The bootloader calls the
+    // simulated peripherals every few microseconds, so a longer gap is a host scheduling delay,
+    // which would otherwise look like UART overruns.
+    static uint64_t last = 0;
+    static uint64_t stalled = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t time = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (last != 0 && time - last > HOST_STALL_NS)
+    {
+        stalled += time - last;
+    }
+    last = time;
+    return time - stalled;
+}
+
+
+SysTick_Type *simSysTick(void)
+{
+    // Each register access calls this function, so COUNTFLAG is cleared on every read as on hardware.
+    uint64_t time = now();
+    sysTickRegs.CTRL &= ~SysTick_CTRL_COUNTFLAG_Msk;
+    if (sysTickRegs.CTRL & SysTick_CTRL_ENABLE_Msk)
+    {
+        uint64_t period = (uint64_t)(sysTickRegs.LOAD + 1) * 1000000000ULL / SystemCoreClock;
+        if (sysTickLast == 0)
+        {
+            sysTickLast = time;
+        }
+        else if (period > 0 && time - sysTickLast >= period)
+        {
+            sysTickLast += (time - sysTickLast) / period * period;
+            sysTickRegs.CTRL |= SysTick_CTRL_COUNTFLAG_Msk;
+        }
+    }
+    return &sysTickRegs;
+}
+
+
+uint32_t HAL_GetUIDw0(void)
+{
+    return uid[0];
+}
+
+
+uint32_t HAL_GetUIDw1(void)
+{
+    return uid[1];
+}
+
+
+uint32_t HAL_GetUIDw2(void)
+{
+    return uid[2];
+}
+
+
+#pragma endregion
+
+
+#pragma region Flash
+
+
+// Bootloader writes SR only to clear flags. Reads do not change the reserved bit 31,
+// so its absence means that the register was written since the last access.
+#define SR_UNTOUCHED_MARKER (1UL << 31)
+
+static FLASH_TypeDef flashRegs = { .CR = FLASH_CR_LOCK, .SR = SR_UNTOUCHED_MARKER };
+static uint32_t flashStatus = 0;
+static uint64_t flashBusyUntil = 0;
+static uint8_t flashShadow[FLASH_SIZE]; // Last programmed content, memory differences are new writes
+static uint8_t *const flashMemory = (uint8_t *)FLASH_BASE;
+
+
+static void flashStartOperation(uint64_t time, uint64_t duration)
+{
+    // Operations issued while busy are queued, CPU would stall on the flash bus.
+    flashBusyUntil = (flashBusyUntil > time ? flashBusyUntil : time) + duration;
+    flashStatus |= FLASH_SR_EOP;
+}
+
+
+static void flashProgram(uint64_t time)
+{
+    if (memcmp(flashMemory, flashShadow, FLASH_SIZE) == 0)
+    {
+        return;
+    }
+    for (uint32_t offset = 0; offset < FLASH_SIZE; offset += 8)
+    {
+        if (memcmp(flashMemory + offset, flashShadow + offset, 8) == 0)
+        {
+            continue;
+        }
+        static const uint8_t erased[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+        if ((flashRegs.CR & FLASH_CR_LOCK) || !(flashRegs.CR & FLASH_CR_PG))
+        {
+            fprintf(stderr, "Flash write at 0x%08lX without PG bit or while locked\n", FLASH_BASE + offset);
+            flashStatus |= FLASH_SR_PGSERR;
+            memcpy(flashMemory + offset, flashShadow + offset, 8);
+        }
+        else if (memcmp(flashShadow + offset, erased, 8) != 0)
+        {
+            fprintf(stderr, "Flash write at 0x%08lX to not erased double word\n", FLASH_BASE + offset);
+            flashStatus |= FLASH_SR_PROGERR;
+            memcpy(flashMemory + offset, flashShadow + offset, 8);
+        }
+        else
+        {
+            memcpy(flashShadow + offset, flashMemory + offset, 8);
+            flashStartOperation(time, DOUBLE_WORD_PROGRAM_TIME_NS);
+        }
+    }
+}
+
+
+static void flashErase(uint64_t time)
+{
+    uint32_t page = (flashRegs.CR & FLASH_CR_PNB) >> FLASH_CR_PNB_Pos;
+    flashRegs.CR &= ~FLASH_CR_STRT;
+    if ((flashRegs.CR & FLASH_CR_LOCK) || !(flashRegs.CR & FLASH_CR_PER))
+    {
+        flashStatus |= FLASH_SR_PGSERR;
+        return;
+    }
+    if (simConfig.verbose)
+    {
+        fprintf(stderr, "Flash erase page %u\n", page);
+    }
+    memset(flashMemory + page * FLASH_PAGE_SIZE, 0xFF, FLASH_PAGE_SIZE);
+    memset(flashShadow + page * FLASH_PAGE_SIZE, 0xFF, FLASH_PAGE_SIZE);
+    flashStartOperation(time, PAGE_ERASE_TIME_NS);
+}
+
+
+FLASH_TypeDef *simFlash(void)
+{
+    uint64_t time = now();
+    updatePorts(time);
+    if (!(flashRegs.SR & SR_UNTOUCHED_MARKER))
+    {
+        flashStatus &= ~(flashRegs.SR & (FLASH_FLAG_SR_ERROR | FLASH_SR_EOP));
+    }
+    flashProgram(time);
+    if (flashRegs.CR & FLASH_CR_STRT)
+    {
+        flashErase(time);
+    }
+    uint32_t status = flashStatus;
+    if (time < flashBusyUntil)
+    {
+        status |= FLASH_SR_BSY1 | FLASH_SR_CFGBSY;
+    }
+    flashRegs.SR = status | SR_UNTOUCHED_MARKER;
+    return &flashRegs;
+}
+
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+{
+    flashRegs.CR &= ~FLASH_CR_LOCK;
+    return HAL_OK;
+}
+
+
+#pragma endregion
+
+
+#pragma region CRC
+
+
+CRC_TypeDef simCrc = { .DR = 0xFFFFFFFF, .INIT = 0xFFFFFFFF };
+
+
+void LL_CRC_ResetCRCCalculationUnit(CRC_TypeDef *CRCx)
+{
+    CRCx->DR = CRCx->INIT;
+}
+
+
+void LL_CRC_SetInitialData(CRC_TypeDef *CRCx, uint32_t InitCrc)
+{
+    CRCx->INIT = InitCrc;
+}
+
+
+void LL_CRC_FeedData8(CRC_TypeDef *CRCx, uint8_t InData)
+{
+    // Default configuration: polynomial 0x04C11DB7, no input or output reversal
+    uint32_t crc = CRCx->DR ^ ((uint32_t)InData << 24);
+    for (int i = 0; i < 8; i++)
+    {
+        crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+    }
+    CRCx->DR = crc;
+}
+
+
+uint32_t LL_CRC_ReadData32(const CRC_TypeDef *CRCx)
+{
+    return CRCx->DR;
+}
+
+
+#pragma endregion
+
+
+#pragma region USART
+
+
+typedef struct RxByte
+{
+    uint64_t time; // When the stop bit was received
+    uint8_t value;
+    bool framingError;
+} RxByte;
+
+typedef struct SimPort
+{
+    USART_TypeDef *uart;
+    int master; // PTY master, the programmer opens the slave
+    int slave; // Kept open, so the master does not report EOF when programmer disconnects
+    bool enabled;
+    bool tdrFull;
+    uint8_t tdr;
+    uint64_t tdrTime;
+    bool shifting;
+    uint8_t shift;
+    uint64_t shiftEnd;
+    bool rdrFull;
+    uint8_t rdr;
+    bool framingError;
+    uint64_t lastRxEnd;
+    uint32_t rxHead;
+    uint32_t rxTail;
+    RxByte rxQueue[4096];
+} SimPort;
+
+static SimPort ports[4];
+
+
+static uint64_t byteTime(USART_TypeDef *uart)
+{
+    return (uint64_t)BITS_PER_BYTE * uart->BRR * 1000000000ULL / SystemCoreClock;
+}
+
+
+static uint32_t terminalBaudRate(int fd)
+{
+    static const struct { speed_t speed; uint32_t baudRate; } speeds[] = {
+        { B9600, 9600 }, { B19200, 19200 }, { B38400, 38400 }, { B57600, 57600 }, { B115200, 115200 },
+        { B230400, 230400 }, { B460800, 460800 }, { B500000, 500000 }, { B576000, 576000 },
+        { B921600, 921600 }, { B1000000, 1000000 }, { B1500000, 1500000 }, { B2000000, 2000000 },
+        { B3000000, 3000000 }, { B4000000, 4000000 },
+    };
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0)
+    {
+        return 0;
+    }
+    speed_t speed = cfgetospeed(&tio);
+    for (size_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+    {
+        if (speeds[i].speed == speed)
+        {
+            return speeds[i].baudRate;
+        }
+    }
+    return 0;
+}
+
+
+static bool baudRateMismatch(USART_TypeDef *uart)
+{
+    if (!simConfig.checkTerminalBaudRate)
+    {
+        return false;
+    }
+    uint32_t expected = SystemCoreClock / uart->BRR;
+    uint32_t actual = terminalBaudRate(ports[uart->index].slave);
+    uint32_t difference = actual > expected ? actual - expected : expected - actual;
+    return actual != 0 && difference > expected / 32;
+}
+
+
+static void emitByte(USART_TypeDef *uart, uint8_t byte)
+{
+    // Bytes sent at a wrong baud rate are not decodable, the programmer gets nothing.
+    SimPort *port = &ports[uart->index];
+    if (port->enabled && !baudRateMismatch(uart))
+    {
+        if (write(port->master, &byte, 1) != 1 && simConfig.verbose)
+        {
+            fprintf(stderr, "Port %d: output overflow\n", uart->index);
+        }
+    }
+}
+
+
+static void updateTx(USART_TypeDef *uart, uint64_t time)
+{
+    SimPort *port = &ports[uart->index];
+    if (port->shifting && time >= port->shiftEnd)
+    {
+        emitByte(uart, port->shift);
+        port->shifting = false;
+    }
+    if (!port->shifting && port->tdrFull)
+    {
+        // Next byte starts right after the previous one if it was written in time
+        uint64_t start = port->tdrTime > port->shiftEnd ? port->tdrTime : port->shiftEnd;
+        port->shift = port->tdr;
+        port->tdrFull = false;
+        port->shifting = true;
+        port->shiftEnd = start + byteTime(uart);
+    }
+}
+
+
+static void receiveBytes(USART_TypeDef *uart, uint64_t time)
+{
+    SimPort *port = &ports[uart->index];
+    uint8_t buffer[256];
+    ssize_t count = read(port->master, buffer, sizeof(buffer));
+    bool framingError = count > 0 && baudRateMismatch(uart);
+    for (ssize_t i = 0; i < count; i++)
+    {
+        // Bytes written at once by the programmer arrive one byte time apart
+        if (port->rxHead - port->rxTail >= sizeof(port->rxQueue) / sizeof(port->rxQueue[0]))
+        {
+            break;
+        }
+        RxByte *byte = &port->rxQueue[port->rxHead % (sizeof(port->rxQueue) / sizeof(port->rxQueue[0]))];
+        port->lastRxEnd = (port->lastRxEnd > time ? port->lastRxEnd : time) + byteTime(uart);
+        byte->time = port->lastRxEnd;
+        byte->value = buffer[i];
+        byte->framingError = framingError;
+        port->rxHead++;
+    }
+}
+
+
+static void updatePorts(uint64_t time)
+{
+    // Transmission continues and bytes keep arriving while the bootloader waits for something else,
+    // e.g. for the flash. Bytes that arrive during the wait are lost the same way as on real hardware.
+    for (int i = 0; i < simConfig.ports; i++)
+    {
+        if (ports[i].uart != NULL)
+        {
+            updateTx(ports[i].uart, time);
+            receiveBytes(ports[i].uart, time);
+        }
+    }
+}
+
+
+static void updateRx(USART_TypeDef *uart, uint64_t time)
+{
+    SimPort *port = &ports[uart->index];
+    while (port->rxTail != port->rxHead)
+    {
+        RxByte *byte = &port->rxQueue[port->rxTail % (sizeof(port->rxQueue) / sizeof(port->rxQueue[0]))];
+        if (byte->time > time)
+        {
+            break;
+        }
+        // Overrun detection is disabled, so a new byte overwrites the unread one.
+        if (port->rdrFull && simConfig.verbose)
+        {
+            fprintf(stderr, "Port %d: overrun\n", uart->index);
+        }
+        port->rdr = byte->value;
+        port->framingError = byte->framingError;
+        port->rdrFull = port->enabled;
+        port->rxTail++;
+    }
+}
+
+
+uint32_t LL_USART_IsActiveFlag_TXE(USART_TypeDef *USARTx)
+{
+    updateTx(USARTx, now());
+    return !ports[USARTx->index].tdrFull;
+}
+
+
+uint32_t LL_USART_IsActiveFlag_TC(USART_TypeDef *USARTx)
+{
+    updateTx(USARTx, now());
+    return !ports[USARTx->index].tdrFull && !ports[USARTx->index].shifting;
+}
+
+
+uint32_t LL_USART_IsActiveFlag_RXNE(USART_TypeDef *USARTx)
+{
+    uint64_t time = now();
+    updatePorts(time);
+    updateRx(USARTx, time);
+    return ports[USARTx->index].rdrFull;
+}
+
+
+uint32_t LL_USART_IsActiveFlag_FE(USART_TypeDef *USARTx)
+{
+    return ports[USARTx->index].rdrFull && ports[USARTx->index].framingError;
+}
+
+
+void LL_USART_ClearFlag_FE(USART_TypeDef *USARTx)
+{
+    ports[USARTx->index].framingError = false;
+}
+
+
+void LL_USART_TransmitData8(USART_TypeDef *USARTx, uint8_t Value)
+{
+    SimPort *port = &ports[USARTx->index];
+    uint64_t time = now();
+    updateTx(USARTx, time);
+    port->tdr = Value;
+    port->tdrFull = true;
+    port->tdrTime = time;
+    updateTx(USARTx, time);
+}
+
+
+uint8_t LL_USART_ReceiveData8(USART_TypeDef *USARTx)
+{
+    ports[USARTx->index].rdrFull = false;
+    return ports[USARTx->index].rdr;
+}
+
+
+void LL_USART_Enable(USART_TypeDef *USARTx)
+{
+    ports[USARTx->index].enabled = true;
+}
+
+
+void LL_USART_Disable(USART_TypeDef *USARTx)
+{
+    SimPort *port = &ports[USARTx->index];
+    port->enabled = false;
+    port->tdrFull = false;
+    port->shifting = false;
+    port->rdrFull = false;
+}
+
+
+#pragma endregion
+
+
+#pragma region Simulator
+
+
+void simInit(const char *flashFile, const uint8_t uidBytes[12])
+{
+    memcpy(uid, uidBytes, sizeof(uid));
+
+    int fd = open(flashFile, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        perror(flashFile);
+        exit(1);
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < FLASH_SIZE)
+    {
+        // New or short image is padded as erased flash
+        static uint8_t erased[FLASH_SIZE];
+        memset(erased, 0xFF, sizeof(erased));
+        if (pwrite(fd, erased, FLASH_SIZE - size, size) != FLASH_SIZE - size)
+        {
+            perror(flashFile);
+            exit(1);
+        }
+    }
+    void *flash = mmap((void *)FLASH_BASE, FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    void *sram = mmap((void *)SRAM_BASE, 0x2000, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (flash != (void *)FLASH_BASE || sram != (void *)SRAM_BASE)
+    {
+        fprintf(stderr, "Cannot map flash and SRAM at their STM32 addresses\n");
+        exit(1);
+    }
+    close(fd);
+    memcpy(flashShadow, flashMemory, FLASH_SIZE);
+}
+
+
+void simOpenPort(USART_TypeDef *uart, int index, int master, int slave)
+{
+    uart->index = index;
+    uart->BRR = (SystemCoreClock + simConfig.baudRates[index] / 2) / simConfig.baudRates[index];
+    ports[index].uart = uart;
+    ports[index].master = master;
+    ports[index].slave = slave;
+    ports[index].enabled = true;
+}
+
+
+void simFlushPorts(void)
+{
+    // Used before reset, so the last response is not lost
+    for (int i = 0; i < simConfig.ports; i++)
+    {
+        SimPort *port = &ports[i];
+        if (port->shifting && write(port->master, &port->shift, 1) != 1)
+        {
+            // Nothing to do, the programmer will retry
+        }
+        if (port->tdrFull && write(port->master, &port->tdr, 1) != 1)
+        {
+            // Nothing to do, the programmer will retry
+        }
+        port->shifting = false;
+        port->tdrFull = false;
+    }
+    msync(flashMemory, FLASH_SIZE, MS_SYNC);
+}
+
+
+#pragma endregion
@@ -0,0 +1,179 @@
+#ifndef BOOTLOADER_SIM_H
+#define BOOTLOADER_SIM_H
+
+// Replacement of the STM32C0 CMSIS, HAL and LL subset used by bootloader.c.
+// Registers that have side effects are accessed through functions that update the simulated state.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+
+#pragma region Core
+
+
+#define __IO volatile
+#define __ASM __asm__
+#define __STATIC_INLINE static inline
+#define __ISB() __sync_synchronize()
+#define __DMB() __sync_synchronize()
+
+#define SET_BIT(REG, BIT) ((REG) |= (BIT))
+#define CLEAR_BIT(REG, BIT) ((REG) &= ~(BIT))
+#define READ_BIT(REG, BIT) ((REG) & (BIT))
+
+typedef enum
+{
+    HAL_OK = 0x00U,
+    HAL_ERROR = 0x01U,
+    HAL_BUSY = 0x02U,
+    HAL_TIMEOUT = 0x03U,
+} HAL_StatusTypeDef;
+
+typedef struct
+{
+    __IO uint32_t CTRL;
+    __IO uint32_t LOAD;
+    __IO uint32_t VAL;
+} SysTick_Type;
+
+typedef struct
+{
+    __IO uint32_t VTOR;
+} SCB_Type;
+
+#define SysTick_CTRL_ENABLE_Msk (1UL << 0)
+#define SysTick_CTRL_CLKSOURCE_Msk (1UL << 2)
+#define SysTick_CTRL_COUNTFLAG_Msk (1UL << 16)
+
+#define SysTick simSysTick()
+#define SCB (&simScb)
+
+extern uint32_t SystemCoreClock;
+extern SCB_Type simScb;
+
+SysTick_Type *simSysTick(void);
+__attribute__((noreturn)) void NVIC_SystemReset(void);
+uint32_t HAL_GetUIDw0(void);
+uint32_t HAL_GetUIDw1(void);
+uint32_t HAL_GetUIDw2(void);
+
+
+#pragma endregion
+
+
+#pragma region Memory
+
+
+#define FLASH_BASE 0x08000000UL
+#define FLASH_SIZE 0x8000U
+#define FLASH_PAGE_SIZE 0x800U
+#define SRAM_BASE 0x20000000UL
+#define SRAM_SIZE 0x1800U
+
+#define FLASH_SR_EOP (1UL << 0)
+#define FLASH_SR_OPERR (1UL << 1)
+#define FLASH_SR_PROGERR (1UL << 3)
+#define FLASH_SR_WRPERR (1UL << 4)
+#define FLASH_SR_PGAERR (1UL << 5)
+#define FLASH_SR_SIZERR (1UL << 6)
+#define FLASH_SR_PGSERR (1UL << 7)
+#define FLASH_SR_MISERR (1UL << 8)
+#define FLASH_SR_FASTERR (1UL << 9)
+#define FLASH_SR_RDERR (1UL << 14)
+#define FLASH_SR_OPTVERR (1UL << 15)
+#define FLASH_SR_BSY1 (1UL << 16)
+#define FLASH_SR_CFGBSY (1UL << 18)
+#define FLASH_FLAG_SR_ERROR (FLASH_SR_OPERR | FLASH_SR_PROGERR | FLASH_SR_WRPERR | FLASH_SR_PGAERR | FLASH_SR_SIZERR | \
+                             FLASH_SR_PGSERR | FLASH_SR_MISERR | FLASH_SR_FASTERR | FLASH_SR_RDERR | FLASH_SR_OPTVERR)
+
+#define FLASH_CR_PG (1UL << 0)
+#define FLASH_CR_PER (1UL << 1)
+#define FLASH_CR_PNB_Pos 3U
+#define FLASH_CR_PNB (0xFUL << FLASH_CR_PNB_Pos)
+#define FLASH_CR_STRT (1UL << 16)
+#define FLASH_CR_LOCK (1UL << 31)
+
+typedef struct
+{
+    __IO uint32_t CR;
+    __IO uint32_t SR;
+} FLASH_TypeDef;
+
+#define FLASH simFlash()
+
+FLASH_TypeDef *simFlash(void);
+HAL_StatusTypeDef HAL_FLASH_Unlock(void);
+
+
+#pragma endregion
+
+
+#pragma region CRC
+
+
+typedef struct
+{
+    __IO uint32_t DR;
+    __IO uint32_t INIT;
+} CRC_TypeDef;
+
+#define CRC (&simCrc)
+
+extern CRC_TypeDef simCrc;
+
+void LL_CRC_ResetCRCCalculationUnit(CRC_TypeDef *CRCx);
+void LL_CRC_SetInitialData(CRC_TypeDef *CRCx, uint32_t InitCrc);
+void LL_CRC_FeedData8(CRC_TypeDef *CRCx, uint8_t InData);
+uint32_t LL_CRC_ReadData32(const CRC_TypeDef *CRCx);
+
+
+#pragma endregion
+
+
+#pragma region USART
+
+
+typedef struct
+{
+    __IO uint32_t BRR;
+    int index; // Simulated port number, the rest of the state is in sim.c
+} USART_TypeDef;
+
+uint32_t LL_USART_IsActiveFlag_TXE(USART_TypeDef *USARTx);
+uint32_t LL_USART_IsActiveFlag_TC(USART_TypeDef *USARTx);
+uint32_t LL_USART_IsActiveFlag_RXNE(USART_TypeDef *USARTx);
+uint32_t LL_USART_IsActiveFlag_FE(USART_TypeDef *USARTx);
+void LL_USART_ClearFlag_FE(USART_TypeDef *USARTx);
+void LL_USART_TransmitData8(USART_TypeDef *USARTx, uint8_t Value);
+uint8_t LL_USART_ReceiveData8(USART_TypeDef *USARTx);
+void LL_USART_Enable(USART_TypeDef *USARTx);
+void LL_USART_Disable(USART_TypeDef *USARTx);
+
+
+#pragma endregion
+
+
+#pragma region Simulator
+
+
+typedef struct SimConfig
+{
+    int ports;
+    uint32_t baudRates[4];
+    bool checkTerminalBaudRate; // Deliver framing errors if the PTY baud rate does not match the simulated one
+    bool verbose;
+} SimConfig;
+
+extern SimConfig simConfig;
+
+void simInit(const char *flashFile, const uint8_t uid[12]);
+void simOpenPort(USART_TypeDef *uart, int index, int master, int slave);
+void simFlushPorts(void);
+void startApplication(uint32_t stackPointer, uint32_t resetHandler);
+
+
+#pragma endregion
+
+
+#endif // BOOTLOADER_SIM_H
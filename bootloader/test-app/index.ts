@@ -199,11 +199,12 @@ main();
 const ESC = 0xFF;
 const STOP = 0xFE;
 
-function createDLLPacket(data: Uint8Array, keepAlive: boolean = false) {
+function createDLLPacket(data: Uint8Array, keepAlive: boolean = false, crcData: Uint8Array = data) {
+    // crcData is different from data if a proxy modifies the packet without recalculating CRC.
     if (data.length > 249) {
         throw new Error('Data too long for Link Layer packet');
     }
-    let crc = crc32(data);
+    let crc = crc32(crcData);
     console.log('CRC of: ', bytesToHexString(data), crc.toString(16));
     let packet = new Uint8Array(2 + data.length + 4 + 1 + (keepAlive ? 0 : 1));
     // Set BEGIN sequence
@@ -224,6 +225,9 @@ function createDLLPacket(data: Uint8Array, keepAlive: boolean = false) {
     for (let i = 2; i < 2 + data.length + 4; i++) {
         byteMap[packet[i]] = true;
     }
+    for (let byte of crcData) {
+        byteMap[byte] = true;
+    }
     // If ESC is present in data or CRC, we need to mask the packet
     console.log('DLL Packet: ', bytesToHexString(packet));
     if (byteMap[ESC]) {
@@ -248,10 +252,11 @@ const UNKNOWN_DEVICE_ADDRESS = 0x00;
 const BOOT_TYPE_PASS = 0;
 const BOOT_TYPE_PASSED = 1;
 const BOOT_TYPE_RESPONSE = 2;
+const BOOT_PORT_SHIFT = 4;
 
 let ownAddress = 0x88;
 
-function createNLPacket(payload: Uint8Array, protocol: number, dstAddreses: number[], keepAlive: boolean = false) {
+function createNLData(payload: Uint8Array, protocol: number, dstAddreses: number[]) {
     let packet = new Uint8Array(1 + 1 + dstAddreses.length + payload.length);
     if (dstAddreses.length > 15) {
         throw new Error('Too many destination addresses for Network Layer packet');
@@ -260,7 +265,11 @@ function createNLPacket(payload: Uint8Array, protocol: number, dstAddreses: numb
     packet[1] = ownAddress;
     packet.set(dstAddreses, 2);
     packet.set(payload, 2 + dstAddreses.length);
-    return createDLLPacket(packet, keepAlive);
+    return packet;
+}
+
+function createNLPacket(payload: Uint8Array, protocol: number, dstAddreses: number[], keepAlive: boolean = false) {
+    return createDLLPacket(createNLData(payload, protocol, dstAddreses), keepAlive);
 }
 
 const PROTOCOL_BOOT = 0x02;
@@ -272,9 +281,14 @@ const CMD_WRITE = 2;
 const CMD_READ = 3;
 const CMD_RESET = 4;
 const CMD_PING = 5;
+const CMD_PAGE_CRC = 6;
+const CMD_WRITE_LZ = 7;
+const CMD_MC_JOIN = 8;
+const CMD_MC_STATUS = 9;
+const CMD_SET_BAUD = 10;
 
 interface BootDestination {
-    uuid: Uint8Array;
+    uuid: Uint8Array; // Use [model, group] to send multicast packet
     proxyAddress?: number;
     proxyPort?: number;
 };
@@ -283,7 +297,7 @@ function createBootPacket(dst: BootDestination, command: number, commandCounter:
     let direct = !dst.proxyAddress;
     let payload = new Uint8Array(2 + dst.uuid.length + 1 + 4 + (args ? args.length : 0));
     let view = new DataView(payload.buffer);
-    payload[0] = direct ? BOOT_TYPE_PASSED : BOOT_TYPE_PASS;
+    payload[0] = direct ? BOOT_TYPE_PASSED : BOOT_TYPE_PASS | ((dst.proxyPort ?? 0) << BOOT_PORT_SHIFT);
     payload[1] = dst.uuid.length;
     payload.set(dst.uuid, 2);
     payload[2 + dst.uuid.length] = command;
@@ -291,7 +305,15 @@ function createBootPacket(dst: BootDestination, command: number, commandCounter:
     if (args) {
         payload.set(args, 2 + dst.uuid.length + 1 + 4);
     }
-    return createNLPacket(payload, PROTOCOL_BOOT, [direct ? UNKNOWN_DEVICE_ADDRESS : dst.proxyAddress!], direct);
+    if (direct) {
+        return createNLPacket(payload, PROTOCOL_BOOT, [UNKNOWN_DEVICE_ADDRESS], true);
+    }
+    // Proxy forwards the packet with dst = 0 and boot = passed without recalculating CRC.
+    let packet = createNLData(payload, PROTOCOL_BOOT, [dst.proxyAddress!]);
+    let forwarded = packet.slice();
+    forwarded[2] = UNKNOWN_DEVICE_ADDRESS;
+    forwarded[3] = BOOT_TYPE_PASSED;
+    return createDLLPacket(packet, false, forwarded);
 }
 
 function createBootInit(dst: BootDestination, commandCounter: number = -1) {
@@ -311,6 +333,14 @@ function createBootWrite(dst: BootDestination, address: number, data: Uint8Array
     return createBootPacket(dst, CMD_WRITE, commandCounter, args);
 }
 
+function createBootWriteCompressed(dst: BootDestination, address: number, compressed: Uint8Array, commandCounter: number = -1) {
+    // Data compressed in chunks by bootloader/host/LZCompressor, see bootloader/lz.h for format.
+    let args = new Uint8Array(4 + compressed.length);
+    new DataView(args.buffer).setUint32(0, address, true);
+    args.set(compressed, 4);
+    return createBootPacket(dst, CMD_WRITE_LZ, commandCounter, args);
+}
+
 function createBootRead(dst: BootDestination, address: number, length: number, commandCounter: number = -1) {
     let args = new Uint8Array(5);
     let view = new DataView(args.buffer);
@@ -326,3 +356,61 @@ function createBootReset(dst: BootDestination, commandCounter: number = -1) {
 function createBootPing(dst: BootDestination, data: Uint8Array, commandCounter: number = -1) {
     return createBootPacket(dst, CMD_PING, commandCounter, data);
 }
+
+function createBootPageCrc(dst: BootDestination, firstPage: number, count: number = 0, commandCounter: number = -1) {
+    let args = new Uint8Array(5);
+    let view = new DataView(args.buffer);
+    view.setUint32(0, firstPage, true);
+    view.setUint8(4, count);
+    return createBootPacket(dst, CMD_PAGE_CRC, commandCounter, args);
+}
+
+function getChangedPages(image: Uint8Array, imagePageOffset: number, pageSize: number, deviceCrcs: number[]) {
+    // Returns flash page numbers that have to be erased and written again.
+    // Image is padded with 0xFF to page size, the same as erased flash.
+    let changed: number[] = [];
+    let pageCount = Math.ceil(image.length / pageSize);
+    for (let i = 0; i < pageCount; i++) {
+        let page = new Uint8Array(pageSize).fill(0xFF);
+        page.set(image.subarray(i * pageSize, (i + 1) * pageSize));
+        if (deviceCrcs[i] !== crc32(page)) {
+            changed.push(imagePageOffset + i);
+        }
+    }
+    return changed;
+}
+
+function createMulticastDestination(model: number, group: number = 0): BootDestination {
+    // Multicast packets use chunk index instead of command counter and are never answered.
+    return { uuid: new Uint8Array([model, group]) };
+}
+
+function createBootJoin(dst: BootDestination, group: number, commandCounter: number = -1) {
+    return createBootPacket(dst, CMD_MC_JOIN, commandCounter, new Uint8Array([group]));
+}
+
+function createBootMulticastStatus(dst: BootDestination, commandCounter: number = -1) {
+    return createBootPacket(dst, CMD_MC_STATUS, commandCounter);
+}
+
+function createBootSetBaud(dst: BootDestination, baudRate: number, commandCounter: number = -1) {
+    // Response (actual baud rate or 0 if rejected) comes with the next packet already at the new speed.
+    // Device goes back to default speed after 0.5 second without a valid packet or after a burst of framing errors.
+    if (dst.proxyAddress) {
+        // Proxy keeps its ports at the old speed, so it does not forward SET_BAUD.
+        throw new Error('Baud rate can be switched only on the same bus, not through a proxy');
+    }
+    let args = new Uint8Array(4);
+    new DataView(args.buffer).setUint32(0, baudRate, true);
+    return createBootPacket(dst, CMD_SET_BAUD, commandCounter, args);
+}
+
+function getMissingChunks(statusBitmap: Uint8Array, chunkCount: number) {
+    let missing: number[] = [];
+    for (let i = 0; i < chunkCount; i++) {
+        if (!(statusBitmap[i >> 3] & (1 << (i & 7)))) {
+            missing.push(i);
+        }
+    }
+    return missing;
+}
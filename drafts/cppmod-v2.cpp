@@ -5,7 +5,7 @@
 
 extern "C" 
 {
-	// Imports (pointers in Flash at known location)
+	// Imports (pointers in Flash at known location, ModuleApi in src/common/ModuleLoader.hh)
 	bool (*const configureOutput)(int port, int type, bool initialValue);
 	void (*const setOutput)(int port, bool value);
 	void (*const setRelay)(int port, bool value);
@@ -14,20 +14,15 @@ extern "C"
 	void (*const setLEDPower)(int port, int powerUA);
 	uint8_t (*const getMyAddress)();
 
-	// Exports (pointers at the beginning of application segment)
+	// Exports (pointers at the beginning of application segment, ModuleHeader in src/common/ModuleLoader.hh)
+	// The loader runs constructors itself, so _start only needs to call main()
 	void _start(); // Calls constructors and main()
 	void _stop(); // Calls destructors
 	void recvCallback(uint8_t srcAddress, uint8_t* data, int size);
 	void updateCallback(uint32_t ticks);
 }
 
-template<typename T>
-struct TypeInfo { };
-
-enum {
-	OBJECT_KIND_DATA = 0,
-	OBJECT_KIND_SIGNAL = 1,
-};
+#include "../src/common/StateLayout.hh"
 
 enum {
 	UPDATE_NEXT_TIME = 0,
@@ -35,33 +30,6 @@ enum {
 	UPDATE_WITH_REPEAT = 3,
 };
 
-template<>
-struct TypeInfo<bool> {
-    static constexpr uint8_t id = 1;
-    static constexpr uint8_t bits = 1;
-    static void setState(size_t pos, bool value, size_t bits);
-};
-
-
-struct NameRegistryItemBase
-{
-    struct NameRegistryItemBase* next = nullptr;
-    const char* name;
-    const void* data;
-    const size_t size;
-};
-
-struct NameRegistryItem : public NameRegistryItemBase
-{
-public:
-template<typename T>
-    NameRegistryItem(const char* name, const T& data) :
-        NameRegistryItemBase{ name, &data, sizeof(T) }
-    {
-        registerNameItem(this);
-    }
-};
-
 struct StateEntryInfo
 {
 	uint16_t location;
@@ -69,35 +37,41 @@ struct StateEntryInfo
     uint8_t typeId;
 };
 
-uint16_t stateBits = 0;
+// Layout of the state and the export name table are computed at compile time and stay in flash
+constexpr ExportTable exports({
+	exportData<bool>("light-switch"),
+	exportData<bool>("light-output"),
+	exportSignal("room-cloud-switch"),
+});
 
+enum {
+	LIGHT_SWITCH,
+	LIGHT_OUTPUT,
+	CLOUD_SWITCH,
+};
 
-template<typename T>
+StateTable state(TABLE_ID, exports.bits);
+
+
+template<const auto& TABLE, size_t INDEX, typename T>
 class Exported {
 private:
-
-	T value;
-	StateEntryInfo info;
-    NameRegistryItem registryItem;
+	using Field = StateField<TABLE, INDEX, T>;
 
 public:
-	Exported(const char* name, T initialValue, int bits = -1) :
-		value(initialValue),
-		info{stateBits, bits < 0 ? TypeInfo<T>::bits : bits, typeId}
+	Exported(T initialValue)
 	{
-        TypeInfo<T>::setState(info.location, info.bits, value);
-        registryItem.register(name, OBJECT_KIND_DATA, info);
+		Field::set(state, initialValue);
 	}
 
     operator T() {
-        return value;
+        return Field::get(state);
     }
 
     void operator=(T x) {
-        if (value != x) {
-            value = x;
-            TypeInfo<T>::setState(info.location, info.bits, value);
-			updateState(UPDATE_NOW);
+        if (Field::get(state) != x) {
+            Field::set(state, x);
+			updateState(UPDATE_NOW); // STATE_DELTA with the changed bytes, STATE stays on the periodic timer
         }
     }
 };
@@ -122,7 +96,13 @@ public:
 		valid(false),
 		ready(false)
 	{
-		registry.register(name, info);
+		// Resolution saved before reset is used until the provider's STATE shows other tableId
+		auto cached = importCache.find(name);
+		if (cached != nullptr) {
+			registry.useCached(cached);
+		} else {
+			registry.register(name, info); // Broadcasts IMPORT, EXPORT response goes to importCache.resolved()
+		}
 		registerUpdateCallback(this, Imported::update);
 		registerStateUpdateCallback(this, Imported::update);
 	}
@@ -135,6 +115,9 @@ private:
 
 	void updateState(const IncomingState& state)
 	{
+		if (importCache.stateReceived(state.address, state.tableId)) {
+			registry.resolveAgain();
+		}
 		if (registry.valid && state.address == registry.address) {
 			value = TypeInfo<T>::getField(state, info.location, info.bits);
 			valid = true;
@@ -153,12 +136,12 @@ private:
 	}
 };
 
-Exported<bool> lightSwExported("light-switch", false);
+Exported<exports, LIGHT_SWITCH, bool> lightSwExported(false);
 DigitalInput lightSw(4);
 
 Imported<bool> remoteSw("room-some-switch", false);
 DigitalOutput lightOutput(2);
-Exported<bool> lightOutputExported("light-output", false);
+Exported<exports, LIGHT_OUTPUT, bool> lightOutputExported(false);
 
 Signal<bool> cloudSwitch("room-cloud-switch");
 
@@ -187,4 +170,29 @@ void update(uint32_t ticks)
 	stairsLight(lightSw, remoteSw, lightOutput, cloudSwitch);
 	lightSwExported = lightSw;
 	lightOutputExported = lightOutput;
-}
\ No newline at end of file
+}
+
+// The same logic with DataFlow (src/common/DataFlow.hh), update() is not needed:
+// the inputs, imports and signals set their nodes when they change and only the rules
+// depending on them are evaluated, outputs get the final value once per pass.
+//
+// DataFlow flow;
+// int lightSwNode = flow.addNode(false);           // lightSw.changed() -> flow.set(lightSwNode, value)
+// int remoteSwNode = flow.addNode(false);          // remoteSw STATE -> flow.set(remoteSwNode, value)
+// int cloudSwitchNode = flow.addNode(false);       // cloudSwitch received -> flow.trigger(cloudSwitchNode, value)
+// int lightOutputNode = flow.addNode(false, [](DataFlow*, int, int32_t value) {
+// 	lightOutput = value;
+// 	lightOutputExported = value;
+// });
+//
+// void stairsRule(DataFlow* flow, int rule)
+// {
+// 	if (flow->changed(lightSwNode) || flow->changed(remoteSwNode)) {
+// 		flow->set(lightOutputNode, flow->get(lightSwNode) ^ flow->get(remoteSwNode));
+// 	} else if (flow->changed(cloudSwitchNode)) {
+// 		flow->set(lightOutputNode, flow->get(cloudSwitchNode));
+// 	}
+// }
+//
+// int stairsInputs[] = { lightSwNode, remoteSwNode, cloudSwitchNode };
+// flow.addRule(stairsRule, stairsInputs, 3);
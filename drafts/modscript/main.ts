@@ -1,6 +1,6 @@
 
 
-import { readFileSync } from 'node:fs';
+import { readFileSync, writeFileSync } from 'node:fs';
 
 import { LooseParser } from 'acorn-loose';
 import * as acorn from 'acorn';
@@ -24,7 +24,10 @@ let options: acorn.Options = {
     locations: true,
 };
 
-let tree = LooseParser.parse(readFileSync('experiments/test1.js', 'utf-8'), options);
+// Usage: main.ts [source.js] [module output.msb]
+let [inputFile = 'experiments/test1.js', compiledModule, outputFile] = process.argv.slice(2);
+
+let tree = LooseParser.parse(readFileSync(inputFile, 'utf-8'), options);
 
 class CompileError extends Error {
     constructor(message: string, public readonly node?: any) {
@@ -345,10 +348,366 @@ function dumpObj(obj: Func | System, ind: string = ''): void {
     }
 }
 
+
+/*
+ * Code generation for the bytecode interpreter in src/common/ScriptVM.hh. Variables of all functions are
+ * allocated statically in the VM memory, registers hold only parameters and temporary values.
+ * Objects are not supported yet.
+ */
+
+const OP = {
+    LOADK: 0, LOADKH: 1, MOVE: 2, LOAD: 3, STORE: 4,
+    ADD: 5, SUB: 6, MUL: 7, DIV: 8, MOD: 9, AND: 10, OR: 11, XOR: 12, SHL: 13, SHR: 14, SHRU: 15,
+    EQ: 16, NE: 17, LT: 18, LE: 19, LTU: 20, LEU: 21, NOT: 22, NEG: 23, INV: 24,
+    JMP: 25, JZ: 26, JNZ: 27, CALL: 28, NATIVE: 29, RET: 30,
+} as const;
+
+const VM_VERSION = 1;
+const MAX_REGISTERS = 16;
+const MAX_MEMORY = 256;
+const NO_FUNCTION = 0xFF;
+
+const typeCodes: Dictionary<number> = { bool: 0, uint8: 1, int8: 2, uint16: 3, int16: 4, uint32: 5, int32: 6 };
+
+// Indexes in the native function table of the firmware
+const natives: Dictionary<number> = { __io_read: 0, __io_write: 1, __adc_read: 2 };
+
+const binaryOps: Dictionary<[number, number, boolean]> = { // signed op, unsigned op, swap operands
+    '+': [OP.ADD, OP.ADD, false], '-': [OP.SUB, OP.SUB, false], '*': [OP.MUL, OP.MUL, false],
+    '/': [OP.DIV, OP.DIV, false], '%': [OP.MOD, OP.MOD, false], '&': [OP.AND, OP.AND, false],
+    '|': [OP.OR, OP.OR, false], '^': [OP.XOR, OP.XOR, false], '<<': [OP.SHL, OP.SHL, false],
+    '>>': [OP.SHR, OP.SHRU, false], '>>>': [OP.SHRU, OP.SHRU, false],
+    '==': [OP.EQ, OP.EQ, false], '===': [OP.EQ, OP.EQ, false], '!=': [OP.NE, OP.NE, false], '!==': [OP.NE, OP.NE, false],
+    '<': [OP.LT, OP.LTU, false], '<=': [OP.LE, OP.LEU, false], '>': [OP.LT, OP.LTU, true], '>=': [OP.LE, OP.LEU, true],
+};
+
+interface Value {
+    register: number;
+    unsigned: boolean; // uint32, other types fit in int32
+}
+
+interface Loop {
+    breaks: number[];
+    continues: number[];
+}
+
+function findVariable(start: Func, name: string, node: any): Variable {
+    for (let func: Func | undefined = start; func; func = func.parent) {
+        if (func.variableByName[name]) {
+            let variable = func.variableByName[name];
+            ca(variable.varType in typeCodes, `Objects are not supported by the bytecode yet.`, node);
+            return variable;
+        }
+    }
+    throw new CompileError(`Variable '${name}' not found.`, node);
+}
+
+class FunctionCode {
+    code: [number, number, number, number][] = [];
+    paramCount: number;
+    nextRegister: number;
+    registerCount: number;
+    loops: Loop[] = [];
+
+    constructor(public generator: CodeGenerator, public func: Func) {
+        this.paramCount = Object.keys(func.paramByName).length;
+        this.nextRegister = this.paramCount;
+        this.registerCount = Math.max(1, this.paramCount);
+    }
+
+    emit(op: number, a: number = 0, b: number = 0, imm: number = 0): number {
+        this.code.push([op, a, b, imm & 0xFFFF]);
+        return this.code.length - 1;
+    }
+
+    jump(op: number, a: number, target: number) {
+        this.emit(op, a, 0, target - this.code.length - 1);
+    }
+
+    patch(at: number, target: number = this.code.length) {
+        this.code[at][3] = (target - at - 1) & 0xFFFF;
+    }
+
+    allocate(node: any): number {
+        ca(this.nextRegister < MAX_REGISTERS, 'Expression is too complex.', node);
+        this.registerCount = Math.max(this.registerCount, this.nextRegister + 1);
+        return this.nextRegister++;
+    }
+
+    location(variable: Variable, node: any): number {
+        let bit = this.generator.memoryBase(variable.func) * 8 + variable.bitOffset;
+        ca(bit < 0x10000, 'Variable is outside of the memory.', node);
+        return bit;
+    }
+
+    generate() {
+        for (let variable of Object.values(this.func.paramByName)) {
+            ca(variable.varType in typeCodes, `Objects are not supported by the bytecode yet.`, variable.node);
+            this.emit(OP.STORE, variable.paramIndex, typeCodes[variable.varType], this.location(variable, variable.node));
+        }
+        for (let statement of this.func.bodyStatements) {
+            this.statement(statement);
+        }
+        let r = this.allocate(this.func);
+        this.emit(OP.LOADK, r, 0, 0);
+        this.emit(OP.RET, r);
+    }
+
+    statement(node: any) {
+        let mark = this.nextRegister;
+        switch (node.type) {
+            case 'EmptyStatement':
+                break;
+            case 'BlockStatement':
+                for (let statement of node.body) {
+                    this.statement(statement);
+                }
+                break;
+            case 'ExpressionStatement':
+                this.expression(node.expression);
+                break;
+            case 'IfStatement': {
+                let skip = this.emit(OP.JZ, this.expression(node.test).register);
+                this.nextRegister = mark;
+                this.statement(node.consequent);
+                if (node.alternate) {
+                    let end = this.emit(OP.JMP);
+                    this.patch(skip);
+                    this.statement(node.alternate);
+                    this.patch(end);
+                } else {
+                    this.patch(skip);
+                }
+                break;
+            }
+            case 'WhileStatement':
+            case 'ForStatement': {
+                if (node.init) {
+                    this.expression(node.init);
+                    this.nextRegister = mark;
+                }
+                let start = this.code.length;
+                let exit = node.test ? this.emit(OP.JZ, this.expression(node.test).register) : -1;
+                this.nextRegister = mark;
+                let loop: Loop = { breaks: [], continues: [] };
+                this.loops.push(loop);
+                this.statement(node.body);
+                this.loops.pop();
+                loop.continues.forEach(at => this.patch(at));
+                if (node.update) {
+                    this.expression(node.update);
+                    this.nextRegister = mark;
+                }
+                this.jump(OP.JMP, 0, start);
+                if (exit >= 0) {
+                    this.patch(exit);
+                }
+                loop.breaks.forEach(at => this.patch(at));
+                break;
+            }
+            case 'BreakStatement':
+            case 'ContinueStatement': {
+                ca(this.loops.length > 0 && !node.label, `Invalid ${node.type}.`, node);
+                let loop = this.loops[this.loops.length - 1];
+                (node.type === 'BreakStatement' ? loop.breaks : loop.continues).push(this.emit(OP.JMP));
+                break;
+            }
+            case 'ReturnStatement': {
+                let r = node.argument ? this.expression(node.argument).register : this.constant(0, this.allocate(node));
+                this.emit(OP.RET, r);
+                break;
+            }
+            default:
+                throw new CompileError(`${node.type} is not supported.`, node);
+        }
+        this.nextRegister = mark;
+    }
+
+    constant(value: number, r: number): number {
+        value = value | 0;
+        if (value >= -0x8000 && value < 0x8000) {
+            this.emit(OP.LOADK, r, 0, value);
+        } else {
+            this.emit(OP.LOADK, r, 0, value);
+            this.emit(OP.LOADKH, r, 0, value >>> 16);
+        }
+        return r;
+    }
+
+    /* Result is in a newly allocated register, the caller frees it by resetting nextRegister */
+    expression(node: any): Value {
+        switch (node.type) {
+            case 'Literal': {
+                ca(typeof node.value === 'number' || typeof node.value === 'boolean', 'Invalid constant.', node);
+                return { register: this.constant(Number(node.value), this.allocate(node)), unsigned: false };
+            }
+            case 'Identifier': {
+                let variable = findVariable(this.func, node.name, node);
+                let r = this.allocate(node);
+                this.emit(OP.LOAD, r, typeCodes[variable.varType], this.location(variable, node));
+                return { register: r, unsigned: variable.varType === 'uint32' };
+            }
+            case 'UnaryExpression': {
+                let value = this.expression(node.argument);
+                let op = ({ '!': OP.NOT, '-': OP.NEG, '~': OP.INV } as Dictionary<number>)[node.operator];
+                ca(op !== undefined || node.operator === '+', `Operator ${node.operator} is not supported.`, node);
+                if (op !== undefined) {
+                    this.emit(op, value.register, value.register);
+                }
+                return { register: value.register, unsigned: value.unsigned && node.operator !== '!' };
+            }
+            case 'BinaryExpression': {
+                let info = binaryOps[node.operator];
+                ca(!!info, `Operator ${node.operator} is not supported.`, node);
+                let left = this.expression(node.left);
+                let right = this.expression(node.right);
+                let unsigned = left.unsigned || right.unsigned;
+                let [a, b] = info[2] ? [right, left] : [left, right];
+                this.emit(unsigned ? info[1] : info[0], left.register, a.register, b.register);
+                this.nextRegister = left.register + 1;
+                return { register: left.register, unsigned: unsigned && info[0] < OP.EQ };
+            }
+            case 'LogicalExpression': {
+                ca(node.operator === '&&' || node.operator === '||', `Operator ${node.operator} is not supported.`, node);
+                let left = this.expression(node.left);
+                let end = this.emit(node.operator === '&&' ? OP.JZ : OP.JNZ, left.register);
+                this.into(node.right, left.register);
+                this.patch(end);
+                return { register: left.register, unsigned: false };
+            }
+            case 'ConditionalExpression': {
+                let r = this.expression(node.test).register;
+                let otherwise = this.emit(OP.JZ, r);
+                this.into(node.consequent, r);
+                let end = this.emit(OP.JMP);
+                this.patch(otherwise);
+                this.into(node.alternate, r);
+                this.patch(end);
+                return { register: r, unsigned: false };
+            }
+            case 'AssignmentExpression': {
+                ca(node.left.type === 'Identifier', 'Only variables can be assigned.', node.left);
+                let variable = findVariable(this.func, node.left.name, node.left);
+                let value: Value;
+                if (node.operator === '=') {
+                    value = this.expression(node.right);
+                } else {
+                    value = this.expression({ ...node, type: 'BinaryExpression', operator: node.operator.slice(0, -1) });
+                }
+                this.emit(OP.STORE, value.register, typeCodes[variable.varType], this.location(variable, node));
+                return value;
+            }
+            case 'UpdateExpression': {
+                ca(node.argument.type === 'Identifier', 'Only variables can be updated.', node.argument);
+                let variable = findVariable(this.func, node.argument.name, node.argument);
+                let old = this.expression(node.argument);
+                let updated = this.constant(1, this.allocate(node));
+                this.emit(node.operator === '++' ? OP.ADD : OP.SUB, updated, old.register, updated);
+                this.emit(OP.STORE, updated, typeCodes[variable.varType], this.location(variable, node));
+                if (node.prefix) {
+                    this.emit(OP.MOVE, old.register, updated);
+                }
+                this.nextRegister = old.register + 1;
+                return old;
+            }
+            case 'CallExpression': {
+                ca(node.callee.type === 'Identifier', 'Only functions can be called.', node.callee);
+                let base = this.nextRegister;
+                for (let arg of node.arguments) {
+                    this.into(arg, this.allocate(arg));
+                }
+                if (node.arguments.length === 0) {
+                    this.allocate(node);
+                }
+                if (node.callee.name in natives) {
+                    this.emit(OP.NATIVE, base, node.arguments.length, natives[node.callee.name]);
+                } else {
+                    let callee = findFunction(this.func, node.callee.name, node.callee);
+                    ca(node.arguments.length === Object.keys(callee.paramByName).length, 'Wrong number of arguments.', node);
+                    this.emit(OP.CALL, base, node.arguments.length, this.generator.functionIndex(callee));
+                }
+                this.nextRegister = base + 1;
+                return { register: base, unsigned: false };
+            }
+            default:
+                throw new CompileError(`${node.type} is not supported.`, node);
+        }
+    }
+
+    /* Evaluates the expression into the register below nextRegister */
+    into(node: any, r: number) {
+        let value = this.expression(node);
+        if (value.register !== r) {
+            this.emit(OP.MOVE, r, value.register);
+        }
+        this.nextRegister = r + 1;
+    }
+}
+
+class CodeGenerator {
+    functions: FunctionCode[] = [];
+    memoryBases = new Map<Func, number>();
+    memorySize: number = 0;
+
+    constructor(public system: System) {
+    }
+
+    functionIndex(func: Func): number {
+        let index = this.functions.findIndex(code => code.func === func);
+        if (index < 0) {
+            ca(this.functions.length < NO_FUNCTION, 'Too many functions.', func);
+            index = this.functions.length;
+            this.functions.push(new FunctionCode(this, func));
+        }
+        return index;
+    }
+
+    /* Byte offset of the function variables in the VM memory, a nested function may use variables of its parents */
+    memoryBase(func: Func): number {
+        if (!this.memoryBases.has(func)) {
+            this.memorySize = (this.memorySize + func.memoryAlign - 1) & ~(func.memoryAlign - 1);
+            this.memoryBases.set(func, this.memorySize);
+            this.memorySize += func.memorySize;
+        }
+        return this.memoryBases.get(func)!;
+    }
+
+    /* Image with the module function as the update function and the functions it calls */
+    generate(module: Module): Uint8Array {
+        this.functionIndex(module.func);
+        // Generation adds called functions at the end
+        for (let i = 0; i < this.functions.length; i++) {
+            this.functions[i].generate();
+        }
+        ca(this.memorySize <= MAX_MEMORY, `Variables need ${this.memorySize} bytes, only ${MAX_MEMORY} available.`);
+        let bytes = ['M'.charCodeAt(0), 'S'.charCodeAt(0), VM_VERSION, this.functions.length,
+            this.memorySize & 0xFF, this.memorySize >> 8, NO_FUNCTION, 0];
+        let first = 0;
+        for (let code of this.functions) {
+            bytes.push(first & 0xFF, first >> 8, code.code.length & 0xFF, code.code.length >> 8,
+                code.registerCount, code.paramCount);
+            first += code.code.length;
+        }
+        for (let code of this.functions) {
+            for (let [op, a, b, imm] of code.code) {
+                bytes.push(op, a | (b << 4), imm & 0xFF, imm >> 8);
+            }
+        }
+        return new Uint8Array(bytes);
+    }
+}
+
 let system = new System(tree);
 system.resolveTypes();
 system.allocateVariables();
-dumpObj(system);
+if (compiledModule) {
+    ca(!!system.moduleByName[compiledModule], `Module '${compiledModule}' not found.`);
+    let image = new CodeGenerator(system).generate(system.moduleByName[compiledModule]);
+    writeFileSync(outputFile ?? `${compiledModule}.msb`, image);
+    console.log(`${compiledModule}: ${image.length} bytes`);
+} else {
+    dumpObj(system);
+}
 
 /*
 Stages:
@@ -356,7 +715,7 @@ Stages:
 2. Resolve variable types
 3. Allocate variables and parameters in memory
 4. Resolve all identifiers and collect usage information
-5. Generate code for each function
+5. Generate code for each function (CodeGenerator, bytecode of src/common/ScriptVM.hh)
 
 
 Identifiers scopes:
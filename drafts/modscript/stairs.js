@@ -0,0 +1,22 @@
+// stairsLight from ../cppmod-v2.cpp with primitive variables only, so it compiles to the bytecode:
+//
+//     main.ts stairs.js stairs stairs.msb
+//
+// The image is checked in as the stairsLight test of test/test_ScriptVM.cc.
+
+stairs: {
+    in1: bool;
+    in2: bool;
+    last1: bool;
+    last2: bool;
+    out: bool;
+
+    in1 = __io_read(0);
+    in2 = __io_read(1);
+    if (in1 != last1 || in2 != last2) {
+        out = in1 != in2;
+    }
+    last1 = in1;
+    last2 = in2;
+    __io_write(2, out);
+}
@@ -0,0 +1,44 @@
+
+#include "BroadcastPhase.hh"
+
+
+BroadcastPhase::BroadcastPhase(uint32_t period) :
+    period(period),
+    arrivalCount(0),
+    nextArrival(0),
+    lastShift(0)
+{
+}
+
+void BroadcastPhase::received(uint32_t time)
+{
+    arrivals[nextArrival] = time;
+    nextArrival = (nextArrival + 1) % MAX_ARRIVALS;
+    if (arrivalCount < MAX_ARRIVALS) {
+        arrivalCount++;
+    }
+}
+
+uint32_t BroadcastPhase::sent(uint32_t time)
+{
+    // Nearest neighbours after and before the own phase within the last period
+    uint32_t next = period;
+    uint32_t previous = 0;
+    for (int i = 0; i < arrivalCount; i++) {
+        uint32_t age = time - arrivals[i];
+        if (age >= period) {
+            continue;
+        }
+        uint32_t offset = (period - age) % period;
+        next = offset < next ? offset : next;
+        previous = offset > previous ? offset : previous;
+    }
+    lastShift = 0;
+    if (next < period) {
+        // Middle of the gap between them, which is the largest one when the phases are spread evenly
+        int32_t shift = ((int32_t)next + (int32_t)previous - (int32_t)period) / 2;
+        int32_t maxStep = period / MAX_STEP_DIVIDER;
+        lastShift = shift > maxStep ? maxStep : shift < -maxStep ? -maxStep : shift;
+    }
+    return time + period + lastShift;
+}
@@ -0,0 +1,45 @@
+#ifndef BROADCASTPHASE_HH
+#define BROADCASTPHASE_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/**
+ * Phase of the periodic STATE broadcast, moved away from the broadcasts of the neighbours.
+ *
+ * Devices powered up at the same time would send their periodic broadcasts at the same time and collide
+ * in each period. Arrival times of the periodic frames from the last period are recorded, and each own
+ * broadcast schedules the next one towards the middle of the gap between the nearest neighbours before and
+ * after it. Devices repeating that end up evenly spread, so each one is in the middle of the largest gap.
+ * Aiming at the largest gap anywhere in the period would move devices sharing a phase together.
+ *
+ * The phase moves by at most MAX_STEP_DIVIDER-th of the period at a time, so neighbours that move too do not
+ * overshoot. Only the last MAX_ARRIVALS frames are taken into account.
+ */
+class BroadcastPhase
+{
+public:
+    static constexpr int MAX_ARRIVALS = 16;
+    static constexpr uint32_t MAX_STEP_DIVIDER = 16;
+
+private:
+    uint32_t period;
+    uint32_t arrivals[MAX_ARRIVALS];
+    int arrivalCount;
+    int nextArrival;
+
+public:
+    int32_t lastShift; // Statistics only
+
+    BroadcastPhase(uint32_t period);
+
+    /** Periodic broadcast of other device received at the time. */
+    void received(uint32_t time);
+
+    /** Own periodic broadcast was sent at the time. Returns the time of the next one. */
+    uint32_t sent(uint32_t time);
+};
+
+
+#endif // BROADCASTPHASE_HH
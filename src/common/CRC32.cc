@@ -1,10 +1,25 @@
-
 #include "CRC32.hh"
 
 
+// CRC-32 with the STM32 CRC unit default settings: polynomial 0x04C11DB7, MSB first,
+// initial value 0xFFFFFFFF and inverted result. Nibble table keeps the flash usage small.
+static const uint32_t nibbleTable[16] = {
+    0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9, 0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005,
+    0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61, 0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD,
+};
+
 uint32_t CRC32::calculate(const void* data, size_t size) {
-    (void)data;
-    (void)size;
-    return 0;
+    auto ptr = (const uint8_t*)data;
+    uint32_t crc = INITIAL;
+    for (size_t i = 0; i < size; i++) {
+        crc = update(crc, ptr[i]);
+    }
+    return ~crc;
 }
 
+uint32_t CRC32::update(uint32_t crc, uint8_t byte) {
+    crc ^= (uint32_t)byte << 24;
+    crc = (crc << 4) ^ nibbleTable[crc >> 28];
+    crc = (crc << 4) ^ nibbleTable[crc >> 28];
+    return crc;
+}
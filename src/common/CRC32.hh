@@ -6,7 +6,24 @@
 
 class CRC32 {
 public:
+    static constexpr uint32_t INITIAL = 0xFFFFFFFF;
+
     static uint32_t calculate(const void* data, size_t size);
+
+    /** Adds a byte to the running CRC started with INITIAL. The final CRC is the inverted result. */
+    static uint32_t update(uint32_t crc, uint8_t byte);
+
+    /** Same as calculate(), bit by bit, so it can be used at compile time. */
+    static constexpr uint32_t calculateConstant(const char* data, size_t size) {
+        uint32_t crc = INITIAL;
+        for (size_t i = 0; i < size; i++) {
+            crc ^= (uint32_t)(uint8_t)data[i] << 24;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+            }
+        }
+        return ~crc;
+    }
 };
 
 #endif // CRC_HH
\ No newline at end of file
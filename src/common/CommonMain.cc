@@ -7,6 +7,7 @@
 #include "UART.hh"
 #include "Time.hh"
 #include "WorkQueue.hh"
+#include "ModuleLoader.hh"
 
 
 IdleWork demo([](IdleWork*) {
@@ -18,10 +19,91 @@ IdleWork demo([](IdleWork*) {
 
 UART uart(&huart2);
 
+extern "C" uint8_t _module_flash_start[], _module_flash_size[], _module_ram_start[], _module_ram_size[];
+
+ModuleLoader module({ _module_flash_start, (size_t)_module_flash_size }, { _module_ram_start, (size_t)_module_ram_size });
+
+// Address of this node, UNKNOWN_ADDRESS (0x00) until the address assignment is implemented
+static uint8_t myAddress = 0x00;
+
+/*
+ * Outputs, relays, LEDs and sending are not implemented by the firmware yet. The stubs keep
+ * the table complete, so a module linked against it does not jump to an erased flash.
+ */
+static bool stubConfigureOutput(int port, int type, bool initialValue) { return false; }
+static void stubSetOutput(int port, bool value) { }
+static void stubSetRelay(int port, bool value) { }
+static bool stubGetInput(int port) { return false; }
+static bool stubSend(const void* data, int length) { return false; }
+static void stubSetLEDPower(int port, int powerUA) { }
+static uint8_t getMyAddress() { return myAddress; }
+
+static_assert(sizeof(ModuleApi) <= ModuleApi::MAX_SIZE, "MODULE_API region in the linker script is too small");
+
+__attribute__((used, section(".module_api")))
+extern const ModuleApi moduleApi = {
+    stubConfigureOutput,
+    stubSetOutput,
+    stubSetRelay,
+    stubGetInput,
+    stubSend,
+    stubSetLEDPower,
+    getMyAddress,
+};
+
+// | FLAGS | SRC | DST[] | DATA |, lower 4 bits of FLAGS is DST_COUNT, bits 4..6 is the protocol
+static constexpr uint8_t DST_COUNT_MASK = 0x0F;
+static constexpr uint8_t PROTOCOL_SHIFT = 4;
+static constexpr uint8_t PROTOCOL_MASK = 0x07;
+static constexpr uint8_t PROTOCOL_APPLICATION = 1;
+
+static bool isForMe(const uint8_t* packet)
+{
+    size_t dstCount = packet[0] & DST_COUNT_MASK;
+    for (size_t i = 0; i < dstCount; i++) {
+        if (packet[2 + i] == myAddress) {
+            return true;
+        }
+    }
+    return dstCount == 0;
+}
+
+Work receiveWork([](Work*) {
+    uint8_t* data;
+    int size;
+    while ((size = uart.rxQueue.peek(data)) != PacketInQueue::NO_PACKET) {
+        if (size == PacketInQueue::END_MARKER) {
+            continue;
+        }
+        if (size >= 2 && ((data[0] >> PROTOCOL_SHIFT) & PROTOCOL_MASK) == PROTOCOL_APPLICATION) {
+            size_t dataIndex = 2 + (data[0] & DST_COUNT_MASK);
+            if (dataIndex < (size_t)size && isForMe(data)) {
+                module.receive(data[1], &data[dataIndex], size - dataIndex);
+            }
+        }
+        uart.rxQueue.drop(data, size);
+    }
+});
+
+static constexpr int32_t MODULE_UPDATE_MS = 10;
+static uint32_t moduleUpdateTime;
+
+DelayedWork moduleUpdateWork([](DelayedWork* work) {
+    auto now = Time::get32();
+    module.update(now - moduleUpdateTime);
+    moduleUpdateTime = now;
+    work->run(MODULE_UPDATE_MS);
+});
+
 extern "C"
 void commonMain()
 {
+    uart.receiveWork = &receiveWork;
     uart.init();
+    if (module.load() == ModuleLoader::OK) {
+        moduleUpdateTime = Time::get32();
+        moduleUpdateWork.run(MODULE_UPDATE_MS);
+    }
     //demo.run();
     Work::mainLoop();
 }
@@ -0,0 +1,118 @@
+
+#include "DataFlow.hh"
+#include "Utils.hh"
+#include <cstring>
+
+
+DataFlow::DataFlow(Work::Priority priority) :
+    nodeCount(0),
+    ruleCount(0),
+    pending(0),
+    changedNodes(0),
+    outputNodes(0),
+    processing(false),
+    work(workCallback, priority),
+    passes(0),
+    evaluations(0),
+    outputUpdates(0)
+{
+    std::memset(nodes, 0, sizeof(nodes));
+    std::memset(rules, 0, sizeof(rules));
+}
+
+void DataFlow::workCallback(Work* work)
+{
+    CONTAINER_OF(work, DataFlow, work)->process();
+}
+
+int DataFlow::addNode(int32_t value, OutputCallback output)
+{
+    if (nodeCount >= MAX_NODES) {
+        return NO_NODE;
+    }
+    auto& node = nodes[nodeCount];
+    node.value = value;
+    node.sent = value;
+    node.rules = 0;
+    node.output = output;
+    return nodeCount++;
+}
+
+int DataFlow::addRule(RuleCallback callback, const int* inputs, int count)
+{
+    if (ruleCount >= MAX_RULES) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (inputs[i] < 0 || inputs[i] >= nodeCount) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        nodes[inputs[i]].rules |= 1u << ruleCount;
+    }
+    rules[ruleCount] = callback;
+    return ruleCount++;
+}
+
+void DataFlow::markChanged(int node)
+{
+    changedNodes |= 1ull << node;
+    if (nodes[node].output != nullptr) {
+        outputNodes |= 1ull << node;
+    }
+    pending |= nodes[node].rules;
+    // The running pass picks the changes itself
+    if (!processing && (nodes[node].rules != 0 || nodes[node].output != nullptr)) {
+        work.run();
+    }
+}
+
+void DataFlow::schedule(int rule)
+{
+    pending |= 1u << rule;
+    if (!processing) {
+        work.run();
+    }
+}
+
+void DataFlow::process()
+{
+    passes++;
+    processing = true;
+    uint32_t evaluated = 0;
+    uint32_t next;
+    while ((next = pending & ~evaluated) != 0) {
+        // The lowest index first, so the rules run in the order they were added
+        int rule = __builtin_ctz(next);
+        pending &= ~(1u << rule);
+        evaluated |= 1u << rule;
+        evaluations++;
+        rules[rule](this, rule);
+    }
+
+    // Each output gets only the final value of the pass
+    while (outputNodes != 0) {
+        int index = __builtin_ctzll(outputNodes);
+        outputNodes &= ~(1ull << index);
+        auto& node = nodes[index];
+        if (node.value != node.sent) {
+            node.sent = node.value;
+            outputUpdates++;
+            node.output(this, index, node.value);
+        }
+    }
+
+    // Changes stay visible to the rules which run in the next pass
+    uint64_t keep = 0;
+    for (int i = 0; pending != 0 && i < nodeCount; i++) {
+        if (nodes[i].rules & pending) {
+            keep |= 1ull << i;
+        }
+    }
+    changedNodes &= keep;
+    processing = false;
+    if (pending != 0) {
+        work.run();
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef DATAFLOW_HH
+#define DATAFLOW_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "WorkQueue.hh"
+
+
+/**
+ * Automation logic as a graph, so only the rules affected by a change are evaluated.
+ *
+ * Inputs, imports, signals and outputs are nodes holding a value, rules are edges from their input nodes.
+ * Setting a node to a new value (or triggering a signal node) schedules the rules depending on it and
+ * runs the work. The work evaluates each scheduled rule once, rules may write other nodes and schedule
+ * more rules in the same pass. Rules added in the dataflow order (producers before consumers) see all
+ * upstream changes of the pass. A rule scheduled again after it ran in the pass (a cycle) runs in the next one.
+ *
+ * Output callbacks are called at the end of the pass, once for each node whose value differs from
+ * the last one sent to the output, so several writes in one pass end up as one output update.
+ *
+ * Nothing runs while nothing changes, so CPU time depends on the activity, not on the rule count.
+ */
+class DataFlow
+{
+public:
+    static constexpr int MAX_NODES = 64;
+    static constexpr int MAX_RULES = 32;
+    static constexpr int NO_NODE = -1;
+
+    /** Evaluates the rule, it should read the values with get() and changed() and write with set(). */
+    typedef void (*RuleCallback)(DataFlow* flow, int rule);
+    typedef void (*OutputCallback)(DataFlow* flow, int node, int32_t value);
+
+private:
+    struct Node {
+        int32_t value;
+        int32_t sent; // Last value passed to the output
+        uint32_t rules; // Depending on the node
+        OutputCallback output;
+    };
+
+    Node nodes[MAX_NODES];
+    RuleCallback rules[MAX_RULES];
+    int nodeCount;
+    int ruleCount;
+    uint32_t pending; // Rules to evaluate
+    uint64_t changedNodes; // Since the rules depending on them were evaluated
+    uint64_t outputNodes; // Changed nodes with the output
+    bool processing;
+    Work work;
+
+    static void workCallback(Work* work);
+    void markChanged(int node);
+    void process();
+
+public:
+    uint32_t passes; // Statistics only
+    uint32_t evaluations; // Statistics only
+    uint32_t outputUpdates; // Statistics only
+
+    DataFlow(Work::Priority priority = Work::NORMAL);
+
+    /** Adds node with the initial value, the output is called when a rule changes it. Returns NO_NODE if full. */
+    int addNode(int32_t value, OutputCallback output = nullptr);
+
+    /** Adds rule evaluated when one of the input nodes changes. Returns -1 if full. */
+    int addRule(RuleCallback callback, const int* inputs, int count);
+
+    /** Sets the node value, the depending rules are scheduled if it differs. */
+    void set(int node, int32_t value) { if (nodes[node].value != value) { nodes[node].value = value; markChanged(node); } }
+
+    /** Sets the node value and schedules the depending rules even if the value is the same, used by signals. */
+    void trigger(int node, int32_t value) { nodes[node].value = value; markChanged(node); }
+
+    int32_t get(int node) const { return nodes[node].value; }
+
+    /** Whether the node changed or was triggered since the rules depending on it were evaluated. */
+    bool changed(int node) const { return changedNodes & (1ull << node); }
+
+    /** Schedules the rule even if its inputs did not change, e.g. to evaluate everything after init. */
+    void schedule(int rule);
+};
+
+
+#endif // DATAFLOW_HH
@@ -0,0 +1,22 @@
+#ifndef FLASHAREA_HH
+#define FLASHAREA_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/**
+ * Memory mapped flash pages used for data storage. Writes can only clear bits, so a double word
+ * must be erased before it is written.
+ */
+struct FlashArea {
+    uint8_t* base;
+    size_t pageSize;
+    /** Erases one page. */
+    void (*erase)(uint8_t* page, size_t size);
+    /** Writes a double word to the erased and aligned address. */
+    void (*write)(uint8_t* address, uint64_t value);
+};
+
+
+#endif // FLASHAREA_HH
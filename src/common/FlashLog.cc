@@ -0,0 +1,106 @@
+
+#include "FlashLog.hh"
+#include "CRC32.hh"
+#include <cstring>
+
+
+FlashLog::FlashLog(const FlashArea& flash, uint16_t magic, size_t snapshotSize, size_t recordSize) :
+    flash(flash),
+    magic(magic),
+    snapshotSize(snapshotSize),
+    recordSize(recordSize),
+    activePage(NO_PAGE),
+    sequence(0),
+    writeOffset(0),
+    erases(0)
+{
+}
+
+uint64_t FlashLog::readWord(const uint8_t* address)
+{
+    uint64_t word;
+    std::memcpy(&word, address, sizeof(word));
+    return word;
+}
+
+uint32_t FlashLog::headerCrc(uint16_t sequence, const uint8_t* snapshot) const
+{
+    // The sequence is covered too, so a partially erased header cannot look newer
+    auto crc = CRC32::update(CRC32::update(CRC32::INITIAL, sequence), sequence >> 8);
+    for (size_t i = 0; i < snapshotSize; i++) {
+        crc = CRC32::update(crc, snapshot[i]);
+    }
+    return ~crc;
+}
+
+bool FlashLog::validHeader(int index, uint16_t& pageSequence) const
+{
+    auto header = readWord(page(index));
+    pageSequence = header >> 16;
+    return (uint16_t)header == magic &&
+           (uint32_t)(header >> 32) == headerCrc(pageSequence, page(index) + HEADER_SIZE);
+}
+
+bool FlashLog::erased(const uint8_t* record) const
+{
+    for (size_t i = 0; i < recordSize; i++) {
+        if (record[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void FlashLog::write(uint8_t* address, const uint8_t* data, size_t size)
+{
+    for (size_t offset = 0; offset < size; offset += WRITE_SIZE) {
+        flash.write(address + offset, readWord(data + offset));
+    }
+}
+
+bool FlashLog::open()
+{
+    activePage = NO_PAGE;
+    for (int i = 0; i < PAGE_COUNT; i++) {
+        uint16_t pageSequence;
+        // The sequence wraps around, the newer page is ahead by less than half of its range
+        if (validHeader(i, pageSequence) && (activePage == NO_PAGE || (int16_t)(pageSequence - sequence) > 0)) {
+            activePage = i;
+            sequence = pageSequence;
+        }
+    }
+    if (activePage == NO_PAGE) {
+        return false;
+    }
+    writeOffset = logOffset();
+    while (writeOffset + recordSize <= flash.pageSize && !erased(page(activePage) + writeOffset)) {
+        // Records are appended in order, so the rest of the page is free
+        writeOffset += recordSize;
+    }
+    return true;
+}
+
+void FlashLog::append(const uint8_t* record)
+{
+    write(page(activePage) + writeOffset, record, recordSize);
+    writeOffset += recordSize;
+}
+
+void FlashLog::begin(const uint8_t* snapshot)
+{
+    // The active page stays valid until the header of the new one is written
+    activePage = activePage == NO_PAGE ? 0 : (activePage + 1) % PAGE_COUNT;
+    auto base = page(activePage);
+    flash.erase(base, flash.pageSize);
+    erases++;
+    write(base + HEADER_SIZE, snapshot, snapshotSize);
+    writeOffset = logOffset();
+}
+
+void FlashLog::commit()
+{
+    sequence++;
+    auto header = magic | (uint32_t)sequence << 16 |
+                  (uint64_t)headerCrc(sequence, page(activePage) + HEADER_SIZE) << 32;
+    flash.write(page(activePage), header);
+}
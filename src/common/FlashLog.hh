@@ -0,0 +1,80 @@
+#ifndef FLASHLOG_HH
+#define FLASHLOG_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "FlashArea.hh"
+
+
+/**
+ * Append-only log of fixed size records kept in two flash pages, so a store does not erase a page
+ * for each change.
+ *
+ * The active page starts with a header and an optional snapshot followed by the records. When the page
+ * is full, the store writes its current content to the other page with begin(), append() and commit(),
+ * which alternates the erases between the pages. The header is written last, so a power loss at any
+ * moment leaves either the old or the new page active.
+ *
+ *      header: | magic (2) | sequence (2) | CRC32 of sequence and snapshot (4) |
+ *
+ * Records are multiples of the double word (the flash write unit) and the first erased one ends the log.
+ * Their content is not checked here, the store must recognize a record left by an interrupted write.
+ */
+class FlashLog
+{
+public:
+    static constexpr size_t WRITE_SIZE = 8;
+    static constexpr size_t HEADER_SIZE = WRITE_SIZE;
+
+private:
+    static constexpr int PAGE_COUNT = 2;
+    static constexpr int NO_PAGE = -1;
+
+    FlashArea flash;
+    uint16_t magic;
+    size_t snapshotSize;
+    size_t recordSize;
+    int activePage;
+    uint16_t sequence;
+    size_t writeOffset; // Next free record in the active page
+
+    uint8_t* page(int index) const { return flash.base + index * flash.pageSize; }
+    size_t logOffset() const { return HEADER_SIZE + snapshotSize; }
+    static uint64_t readWord(const uint8_t* address);
+    uint32_t headerCrc(uint16_t sequence, const uint8_t* snapshot) const;
+    bool validHeader(int index, uint16_t& pageSequence) const;
+    bool erased(const uint8_t* record) const;
+    void write(uint8_t* address, const uint8_t* data, size_t size);
+
+public:
+    size_t erases; // Statistics only
+
+    FlashLog(const FlashArea& flash, uint16_t magic, size_t snapshotSize, size_t recordSize);
+
+    /** Selects the newest valid page and finds the end of its log. Returns false if there is none. */
+    bool open();
+
+    /** Snapshot of the active page. */
+    const uint8_t* snapshot() const { return page(activePage) + HEADER_SIZE; }
+
+    /** Number of records in the active page. */
+    size_t count() const { return activePage == NO_PAGE ? 0 : (writeOffset - logOffset()) / recordSize; }
+
+    const uint8_t* record(size_t index) const { return page(activePage) + logOffset() + index * recordSize; }
+
+    /** Number of records that still fit into the active page, 0 if there is none. */
+    size_t space() const { return activePage == NO_PAGE ? 0 : (flash.pageSize - writeOffset) / recordSize; }
+
+    /** Writes the record to the end of the active page, space() must not be 0. */
+    void append(const uint8_t* record);
+
+    /** Erases the other page and writes the snapshot to it. The records appended then go to that page. */
+    void begin(const uint8_t* snapshot);
+
+    /** Writes the header of the page started by begin(), which makes it the active one. */
+    void commit();
+};
+
+
+#endif // FLASHLOG_HH
@@ -0,0 +1,165 @@
+
+#include "ImportCache.hh"
+#include "CRC32.hh"
+#include "StateLayout.hh"
+#include <cstring>
+
+
+ImportCache::ImportCache(const FlashArea& flash) :
+    log(flash, MAGIC, 0, RECORD_SIZE)
+{
+    std::memset(entries, 0, sizeof(entries));
+}
+
+uint16_t ImportCache::nameCheck(const char* name)
+{
+    // FNV-1a, it does not collide together with CRC32
+    uint32_t hash = 2166136261u;
+    for (; *name != 0; name++) {
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
+    }
+    return hash ^ hash >> 16;
+}
+
+ImportCache::Entry* ImportCache::findName(uint32_t nameHash, uint16_t nameCheck)
+{
+    for (auto& entry : entries) {
+        if (entry.state != EMPTY && entry.nameHash == nameHash && entry.nameCheck == nameCheck) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+void ImportCache::load()
+{
+    std::memset(entries, 0, sizeof(entries));
+    log.open();
+    for (size_t i = 0; i < log.count(); i++) {
+        uint8_t record[RECORD_SIZE];
+        std::memcpy(record, log.record(i), RECORD_SIZE);
+        uint64_t first;
+        uint64_t second;
+        std::memcpy(&first, &record[0], sizeof(first));
+        std::memcpy(&second, &record[8], sizeof(second));
+        // Interrupted write does not match its CRC
+        if ((uint32_t)(second >> 32) != CRC32::calculate(record, 12)) {
+            continue;
+        }
+        Entry entry;
+        entry.nameHash = (uint32_t)first;
+        entry.address = first >> 32;
+        entry.tableId = first >> 40;
+        entry.location = first >> 48;
+        entry.bits = second;
+        entry.typeId = second >> 8;
+        entry.nameCheck = second >> 16;
+        entry.state = CACHED;
+        apply(entry);
+    }
+}
+
+void ImportCache::apply(const Entry& record)
+{
+    auto entry = findName(record.nameHash, record.nameCheck);
+    if (record.address == NO_ADDRESS) {
+        if (entry != nullptr) {
+            entry->state = EMPTY;
+        }
+        return;
+    }
+    for (int i = 0; entry == nullptr && i < MAX_ENTRIES; i++) {
+        if (entries[i].state == EMPTY) {
+            entry = &entries[i];
+        }
+    }
+    if (entry != nullptr) {
+        *entry = record;
+    }
+}
+
+void ImportCache::append(const Entry& entry)
+{
+    if (log.space() == 0) {
+        // Entries in RAM are up to date, so they replace the log
+        compact();
+    } else {
+        write(entry);
+    }
+}
+
+void ImportCache::write(const Entry& entry)
+{
+    uint8_t record[RECORD_SIZE];
+    uint64_t first = entry.nameHash | (uint64_t)entry.address << 32 | (uint64_t)entry.tableId << 40 |
+                     (uint64_t)entry.location << 48;
+    uint64_t second = entry.bits | entry.typeId << 8 | (uint32_t)entry.nameCheck << 16;
+    std::memcpy(&record[0], &first, sizeof(first));
+    std::memcpy(&record[8], &second, sizeof(second));
+    second |= (uint64_t)CRC32::calculate(record, 12) << 32;
+    std::memcpy(&record[8], &second, sizeof(second));
+    log.append(record);
+}
+
+void ImportCache::compact()
+{
+    log.begin(nullptr);
+    for (auto& entry : entries) {
+        if (entry.state != EMPTY && log.space() > 0) {
+            write(entry);
+        }
+    }
+    log.commit();
+}
+
+const ImportCache::Entry* ImportCache::find(const char* name)
+{
+    return findName(nameHash(name), nameCheck(name));
+}
+
+bool ImportCache::resolved(const char* name, uint8_t address, uint8_t tableId, uint16_t location, uint8_t bits,
+                           uint8_t typeId)
+{
+    Entry resolution = { nameHash(name), nameCheck(name), address, tableId, location, bits, typeId, VERIFIED };
+    auto entry = findName(resolution.nameHash, resolution.nameCheck);
+    if (entry != nullptr && entry->address == address && entry->tableId == tableId &&
+        entry->location == location && entry->bits == bits && entry->typeId == typeId) {
+        entry->state = VERIFIED;
+        return true;
+    }
+    apply(resolution);
+    entry = findName(resolution.nameHash, resolution.nameCheck);
+    if (entry == nullptr) {
+        return false;
+    }
+    append(*entry);
+    return true;
+}
+
+bool ImportCache::stateReceived(uint8_t address, uint8_t tableId)
+{
+    bool dropped = false;
+    for (auto& entry : entries) {
+        if (entry.state == EMPTY || entry.address != address) {
+            continue;
+        }
+        if (entry.tableId == tableId) {
+            entry.state = VERIFIED;
+        } else {
+            // Application of the provider was updated, its exports may have moved
+            entry.state = EMPTY;
+            append({ entry.nameHash, entry.nameCheck, NO_ADDRESS, 0, 0, 0, 0, EMPTY });
+            dropped = true;
+        }
+    }
+    return dropped;
+}
+
+void ImportCache::invalidate(const char* name)
+{
+    auto entry = findName(nameHash(name), nameCheck(name));
+    if (entry != nullptr) {
+        entry->state = EMPTY;
+        append({ entry->nameHash, entry->nameCheck, NO_ADDRESS, 0, 0, 0, 0, EMPTY });
+    }
+}
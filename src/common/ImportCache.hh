@@ -0,0 +1,84 @@
+#ifndef IMPORTCACHE_HH
+#define IMPORTCACHE_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "FlashLog.hh"
+
+
+/**
+ * Name resolutions of the imported objects kept in a flash page, so the device does not need
+ * to broadcast IMPORT for each of them after reset.
+ *
+ * Loaded entries are not trusted until STATE with the same tableId comes from the provider,
+ * entries of a provider that reports other tableId are dropped and must be resolved again.
+ *
+ * The entries are kept as a FlashLog of 16 byte records without a snapshot, the last record of a name wins:
+ *      record: | name hash (4) | address | tableId | location (2) | bits | typeId | name check (2) | CRC32 of 12 bytes |
+ * Address 0 removes the name. When the log is full, the valid entries are written to the other page.
+ * A page should fit many more records than MAX_ENTRIES, so the pages are not erased too often.
+ *
+ * Names are identified by their CRC32 (nameHash(), as in EXPORT) and a 16 bit check computed
+ * differently, so two names with the same hash do not share the resolution. Names matching in both
+ * are still taken as the same one.
+ */
+class ImportCache
+{
+public:
+    static constexpr int MAX_ENTRIES = 32;
+    static constexpr uint8_t NO_ADDRESS = 0x00;
+
+    enum State: uint8_t {
+        EMPTY = 0,
+        CACHED = 1, // Loaded from flash, not confirmed yet
+        VERIFIED = 2, // Provider sent STATE with the same tableId or it was just resolved
+    };
+
+    struct Entry {
+        uint32_t nameHash;
+        uint16_t nameCheck;
+        uint8_t address;
+        uint8_t tableId;
+        uint16_t location;
+        uint8_t bits;
+        uint8_t typeId;
+        State state;
+    };
+
+private:
+    static constexpr uint16_t MAGIC = 0x4943;
+    static constexpr size_t RECORD_SIZE = 16;
+
+    FlashLog log;
+    Entry entries[MAX_ENTRIES];
+
+    static uint16_t nameCheck(const char* name);
+    Entry* findName(uint32_t nameHash, uint16_t nameCheck);
+    void apply(const Entry& record);
+    void append(const Entry& entry);
+    void write(const Entry& entry);
+    void compact();
+
+public:
+    ImportCache(const FlashArea& flash); // Two pages
+
+    /** Reads the entries saved before reset. */
+    void load();
+
+    /** Returns the resolution of the name or nullptr, then IMPORT must be sent. */
+    const Entry* find(const char* name);
+
+    /** Saves resolution from EXPORT. Returns false if the cache is full. */
+    bool resolved(const char* name, uint8_t address, uint8_t tableId, uint16_t location, uint8_t bits,
+                  uint8_t typeId);
+
+    /** Validates entries of the STATE source. Returns true if some were dropped because tableId changed. */
+    bool stateReceived(uint8_t address, uint8_t tableId);
+
+    /** Drops the name, e.g. when the provider does not send STATE anymore or reports tableId mismatch. */
+    void invalidate(const char* name);
+};
+
+
+#endif // IMPORTCACHE_HH
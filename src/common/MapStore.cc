@@ -0,0 +1,81 @@
+
+#include "MapStore.hh"
+#include <cstring>
+
+
+MapStore::MapStore(const Flash& flash) :
+    log(flash, MAGIC, MAP_SIZE, RECORD_SIZE),
+    entriesWritten(0)
+{
+    std::memset(saved, 0, sizeof(saved));
+}
+
+uint8_t MapStore::getEntry(const uint8_t* map, uint8_t address)
+{
+    return (map[address >> 2] >> ((address & 3) * 2)) & 3;
+}
+
+void MapStore::setEntry(uint8_t* map, uint8_t address, uint8_t value)
+{
+    auto shift = (address & 3) * 2;
+    map[address >> 2] = (map[address >> 2] & ~(3 << shift)) | (value << shift);
+}
+
+bool MapStore::load(uint8_t* map)
+{
+    bool found = log.open();
+    if (found) {
+        replay();
+    } else {
+        std::memset(saved, 0, sizeof(saved));
+    }
+    std::memcpy(map, saved, MAP_SIZE);
+    return found;
+}
+
+void MapStore::replay()
+{
+    std::memcpy(saved, log.snapshot(), MAP_SIZE);
+    for (size_t i = 0; i < log.count(); i++) {
+        uint32_t entry;
+        uint32_t inverted;
+        std::memcpy(&entry, log.record(i), sizeof(entry));
+        std::memcpy(&inverted, log.record(i) + 4, sizeof(inverted));
+        // An interrupted write leaves some bits unprogrammed, so both halves are no longer inverted
+        if (inverted == ~entry && (entry & 0xFF) == TAG && (entry >> 16) <= 3) {
+            setEntry(saved, entry >> 8, entry >> 16);
+        }
+    }
+}
+
+void MapStore::save(const uint8_t* map)
+{
+    size_t changes = 0;
+    for (int address = 0; address < 256; address++) {
+        changes += getEntry(map, address) != getEntry(saved, address);
+    }
+    if (changes == 0) {
+        return;
+    }
+    if (log.space() < changes) {
+        compact(map);
+        return;
+    }
+    for (int address = 0; address < 256; address++) {
+        auto value = getEntry(map, address);
+        if (value != getEntry(saved, address)) {
+            uint32_t entry = TAG | address << 8 | value << 16;
+            uint64_t record = (uint64_t)~entry << 32 | entry;
+            log.append((const uint8_t*)&record);
+            setEntry(saved, address, value);
+            entriesWritten++;
+        }
+    }
+}
+
+void MapStore::compact(const uint8_t* map)
+{
+    log.begin(map);
+    log.commit();
+    std::memcpy(saved, map, MAP_SIZE);
+}
@@ -0,0 +1,54 @@
+#ifndef MAPSTORE_HH
+#define MAPSTORE_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "FlashLog.hh"
+
+
+/**
+ * Router address map kept in two flash pages, so the router does not need to relearn it by
+ * flooding after reset.
+ *
+ * The map is the snapshot of a FlashLog followed by the log of changed map entries. When the log is
+ * full, the whole map becomes the snapshot of the other page. Each entry is written after the data it
+ * describes, so a power loss at any moment leaves either the previous or the new state of each entry.
+ *
+ *      snapshot: 8 double words, the map
+ *      record:   | TAG | address | value | 0 | inverted first 4 bytes |
+ */
+class MapStore
+{
+public:
+    static constexpr size_t MAP_SIZE = 256 * 2 / 8;
+
+    typedef FlashArea Flash; // Two pages
+
+private:
+    static constexpr uint16_t MAGIC = 0x4D52;
+    static constexpr uint8_t TAG = 0x5A;
+    static constexpr size_t RECORD_SIZE = 8;
+
+    FlashLog log;
+    uint8_t saved[MAP_SIZE]; // Map as it is stored in the flash
+
+    static uint8_t getEntry(const uint8_t* map, uint8_t address);
+    static void setEntry(uint8_t* map, uint8_t address, uint8_t value);
+    void replay();
+    void compact(const uint8_t* map);
+
+public:
+    size_t entriesWritten; // Statistics only
+
+    MapStore(const Flash& flash);
+
+    /** Reads the stored map. Returns false if there is none, the map is cleared then. */
+    bool load(uint8_t* map);
+
+    /** Stores the entries that differ from the stored map. Should be called some time after the map changes. */
+    void save(const uint8_t* map);
+};
+
+
+#endif // MAPSTORE_HH
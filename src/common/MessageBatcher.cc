@@ -0,0 +1,163 @@
+
+#include "MessageBatcher.hh"
+#include "Time.hh"
+#include "Utils.hh"
+#include <cstring>
+
+
+MessageBatcher::MessageBatcher(SendCallback sendCallback, ReceiveCallback receiveCallback, uint32_t window) :
+    sendCallback(sendCallback),
+    receiveCallback(receiveCallback),
+    window(window),
+    flushWork(flushCallback),
+    messages(0),
+    frames(0)
+{
+    std::memset(batches, 0, sizeof(batches));
+}
+
+void MessageBatcher::flushCallback(DelayedWork* work)
+{
+    CONTAINER_OF(work, MessageBatcher, flushWork)->flushExpired();
+}
+
+MessageBatcher::Batch* MessageBatcher::find(const uint8_t* destinations, int count)
+{
+    for (auto& batch : batches) {
+        if (batch.messageCount > 0 && batch.destinationCount == count &&
+            std::memcmp(batch.destinations, destinations, count) == 0) {
+            return &batch;
+        }
+    }
+    return nullptr;
+}
+
+bool MessageBatcher::send(const uint8_t* destinations, int count, const uint8_t* message, size_t size)
+{
+    if (size == 0 || message[0] == TYPE_BATCH || count < 0 || size > capacity(count)) {
+        return false;
+    }
+    messages++;
+    if (count > MAX_DESTINATIONS) {
+        frames++;
+        sendCallback(this, destinations, count, message, size);
+        return true;
+    }
+
+    // Order of the destinations does not matter
+    uint8_t sorted[MAX_DESTINATIONS];
+    for (int i = 0; i < count; i++) {
+        int j = i;
+        for (; j > 0 && sorted[j - 1] > destinations[i]; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = destinations[i];
+    }
+
+    auto batch = find(sorted, count);
+    if (batch != nullptr && batch->size + 1 + size > capacity(count)) {
+        flush(*batch);
+    }
+    if (batch == nullptr || batch->messageCount == 0) {
+        if (batch == nullptr) {
+            // Free one or the one waiting the longest
+            batch = &batches[0];
+            for (auto& other : batches) {
+                if (other.messageCount == 0) {
+                    batch = &other;
+                    break;
+                } else if ((int32_t)(other.deadline - batch->deadline) < 0) {
+                    batch = &other;
+                }
+            }
+            if (batch->messageCount > 0) {
+                flush(*batch);
+            }
+        }
+        std::memcpy(batch->destinations, sorted, count);
+        batch->destinationCount = count;
+        batch->data[0] = TYPE_BATCH;
+        batch->size = 1;
+        batch->deadline = Time::get32() + window;
+    }
+    batch->data[batch->size] = size;
+    std::memcpy(&batch->data[batch->size + 1], message, size);
+    batch->size += 1 + size;
+    batch->messageCount++;
+    schedule();
+    return true;
+}
+
+void MessageBatcher::flush(Batch& batch)
+{
+    frames++;
+    if (batch.messageCount == 1) {
+        sendCallback(this, batch.destinations, batch.destinationCount, &batch.data[2], batch.size - 2);
+    } else {
+        sendCallback(this, batch.destinations, batch.destinationCount, batch.data, batch.size);
+    }
+    batch.messageCount = 0;
+}
+
+void MessageBatcher::flush()
+{
+    for (auto& batch : batches) {
+        if (batch.messageCount > 0) {
+            flush(batch);
+        }
+    }
+    schedule();
+}
+
+void MessageBatcher::flushExpired()
+{
+    auto now = Time::get32();
+    for (auto& batch : batches) {
+        if (batch.messageCount > 0 && (int32_t)(batch.deadline - now) <= 0) {
+            flush(batch);
+        }
+    }
+    schedule();
+}
+
+void MessageBatcher::schedule()
+{
+    Batch* first = nullptr;
+    for (auto& batch : batches) {
+        if (batch.messageCount > 0 && (first == nullptr || (int32_t)(batch.deadline - first->deadline) < 0)) {
+            first = &batch;
+        }
+    }
+    if (first == nullptr) {
+        flushWork.cancel();
+    } else {
+        int32_t delay = first->deadline - Time::get32();
+        flushWork.run(delay < 0 ? 0 : delay);
+    }
+}
+
+bool MessageBatcher::receive(uint8_t source, const uint8_t* data, size_t size)
+{
+    if (size == 0) {
+        return false;
+    } else if (data[0] != TYPE_BATCH) {
+        receiveCallback(this, source, data, size);
+        return true;
+    }
+    // Whole batch is checked first, so a malformed one is not delivered partially
+    size_t offset = 1;
+    while (offset < size) {
+        size_t length = data[offset];
+        if (length == 0 || offset + 1 + length > size || data[offset + 1] == TYPE_BATCH) {
+            return false;
+        }
+        offset += 1 + length;
+    }
+    if (size == 1) {
+        return false;
+    }
+    for (offset = 1; offset < size; offset += 1 + data[offset]) {
+        receiveCallback(this, source, &data[offset + 1], data[offset]);
+    }
+    return true;
+}
@@ -0,0 +1,78 @@
+#ifndef MESSAGEBATCHER_HH
+#define MESSAGEBATCHER_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "WorkQueue.hh"
+
+
+/**
+ * Several application layer messages packed into one frame, so they share the frame overhead.
+ *
+ *      BATCH: | Type = 9 | length | message | length | message | ... |
+ *
+ * Each frame costs about 20 bytes of the data link layer and the network header, which is more than
+ * a typical STATE_DELTA, SIGNAL or SIGNAL_ACK. Messages for the same set of destinations (no destinations
+ * is broadcast) are collected for WINDOW_MS after the first one, or until the next one does not fit
+ * into the frame. A batch of one message is sent as it is. Messages to the same destinations keep their
+ * order, messages to different destinations may be reordered by up to the window.
+ */
+class MessageBatcher
+{
+public:
+    static constexpr uint8_t TYPE_BATCH = 9;
+    static constexpr size_t MAX_FRAME_SIZE = 249; // Network layer content
+    static constexpr size_t NETWORK_HEADER_SIZE = 2; // FLAGS and SRC, then destination addresses
+    static constexpr int MAX_DESTINATIONS = 4; // Messages to more destinations are not batched
+    static constexpr int MAX_BATCHES = 4;
+    static constexpr uint32_t WINDOW_MS = 2;
+
+    /** Sends the application layer message to the destinations, or broadcast if count is 0. */
+    typedef void (*SendCallback)(MessageBatcher* batcher, const uint8_t* destinations, int count,
+                                 const uint8_t* data, size_t size);
+
+    /** Application layer message received, batches are already unpacked. */
+    typedef void (*ReceiveCallback)(MessageBatcher* batcher, uint8_t source, const uint8_t* data, size_t size);
+
+private:
+    struct Batch {
+        uint8_t destinations[MAX_DESTINATIONS]; // Sorted
+        uint8_t destinationCount;
+        uint8_t messageCount;
+        uint8_t size;
+        uint32_t deadline;
+        uint8_t data[MAX_FRAME_SIZE];
+    };
+
+    SendCallback sendCallback;
+    ReceiveCallback receiveCallback;
+    uint32_t window;
+    Batch batches[MAX_BATCHES];
+    DelayedWork flushWork;
+
+    static void flushCallback(DelayedWork* work);
+    static size_t capacity(int destinationCount) { return MAX_FRAME_SIZE - NETWORK_HEADER_SIZE - destinationCount; }
+    Batch* find(const uint8_t* destinations, int count);
+    void flush(Batch& batch);
+    void flushExpired();
+    void schedule();
+
+public:
+    uint32_t messages; // Statistics only
+    uint32_t frames; // Statistics only
+
+    MessageBatcher(SendCallback sendCallback, ReceiveCallback receiveCallback, uint32_t window = WINDOW_MS);
+
+    /** Queues the message, returns false if it is empty or it does not fit into a frame. */
+    bool send(const uint8_t* destinations, int count, const uint8_t* message, size_t size);
+
+    /** Sends all queued messages now. */
+    void flush();
+
+    /** Passes the received message or messages of the batch to the receive callback. Malformed batches are dropped. */
+    bool receive(uint8_t source, const uint8_t* data, size_t size);
+};
+
+
+#endif // MESSAGEBATCHER_HH
@@ -0,0 +1,97 @@
+
+#include "ModuleLoader.hh"
+#include "CRC32.hh"
+#include <cstring>
+
+
+ModuleLoader::ModuleLoader(const Region& flash, const Region& ram) :
+    flash(flash),
+    ram(ram),
+    started(false),
+    stop(nullptr),
+    recvCallback(nullptr),
+    updateCallback(nullptr)
+{
+}
+
+bool ModuleLoader::inside(const Region& region, const void* start, const void* end) const
+{
+    auto base = (uintptr_t)region.base;
+    return (uintptr_t)start <= (uintptr_t)end && (uintptr_t)start >= base &&
+           (uintptr_t)end <= base + region.size && (uintptr_t)start % sizeof(uint32_t) == 0 &&
+           (uintptr_t)end % sizeof(uint32_t) == 0;
+}
+
+bool ModuleLoader::isCode(const Region& image, uintptr_t function) const
+{
+    // Thumb functions have the lowest bit set
+    auto address = function & ~(uintptr_t)1;
+    auto base = (uintptr_t)image.base;
+    return address >= base + sizeof(ModuleHeader) && address < base + image.size;
+}
+
+ModuleLoader::Result ModuleLoader::check(const ModuleHeader& header) const
+{
+    if (flash.size < sizeof(ModuleHeader) || header.magic != ModuleHeader::MAGIC) {
+        return NO_MODULE;
+    } else if (header.abiVersion != ModuleApi::ABI_VERSION || header.headerSize != sizeof(ModuleHeader)) {
+        return BAD_ABI;
+    } else if (header.size < sizeof(ModuleHeader) || header.size > flash.size) {
+        return BAD_SIZE;
+    }
+    size_t crcEnd = offsetof(ModuleHeader, crc) + sizeof(header.crc);
+    if (CRC32::calculate(flash.base + crcEnd, header.size - crcEnd) != header.crc) {
+        return BAD_CRC;
+    }
+    // Image is complete, but its addresses may be from a build for other regions
+    Region image = { flash.base, header.size };
+    auto dataSize = (const uint8_t*)header.dataEnd - (const uint8_t*)header.dataStart;
+    if (!inside(ram, header.dataStart, header.dataEnd) || !inside(ram, header.bssStart, header.bssEnd) ||
+        !inside(image, header.dataLoad, (const uint8_t*)header.dataLoad + dataSize) ||
+        !inside(image, header.initArrayStart, header.initArrayEnd)) {
+        return BAD_LAYOUT;
+    }
+    // Everything called by the firmware must be the module's own code
+    if ((header.stop != nullptr && !isCode(image, (uintptr_t)header.stop)) ||
+        (header.recvCallback != nullptr && !isCode(image, (uintptr_t)header.recvCallback)) ||
+        (header.updateCallback != nullptr && !isCode(image, (uintptr_t)header.updateCallback))) {
+        return BAD_LAYOUT;
+    }
+    for (auto constructor = header.initArrayStart; constructor < header.initArrayEnd; constructor++) {
+        if (!isCode(image, (uintptr_t)*constructor)) {
+            return BAD_LAYOUT;
+        }
+    }
+    return OK;
+}
+
+ModuleLoader::Result ModuleLoader::load()
+{
+    unload();
+    auto& header = *(const ModuleHeader*)flash.base;
+    auto result = check(header);
+    if (result != OK) {
+        return result;
+    }
+    std::memcpy(header.dataStart, header.dataLoad, (uint8_t*)header.dataEnd - (uint8_t*)header.dataStart);
+    std::memset(header.bssStart, 0, (uint8_t*)header.bssEnd - (uint8_t*)header.bssStart);
+    for (auto constructor = header.initArrayStart; constructor < header.initArrayEnd; constructor++) {
+        (*constructor)();
+    }
+    stop = header.stop;
+    recvCallback = header.recvCallback;
+    updateCallback = header.updateCallback;
+    started = true;
+    return OK;
+}
+
+void ModuleLoader::unload()
+{
+    recvCallback = nullptr;
+    updateCallback = nullptr;
+    if (started && stop != nullptr) {
+        stop();
+    }
+    stop = nullptr;
+    started = false;
+}
@@ -0,0 +1,113 @@
+#ifndef MODULELOADER_HH
+#define MODULELOADER_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/**
+ * Firmware functions called by the application module, see drafts/cppmod-v2.cpp. The firmware keeps
+ * one constant table in the .module_api section, which the linker script places at _module_api_start.
+ * The module is linked with that address, so a change of this structure must change ABI_VERSION.
+ */
+struct ModuleApi {
+    static constexpr uint16_t ABI_VERSION = 1;
+    static constexpr size_t MAX_SIZE = 64; // MODULE_API region of the linker script
+
+    bool (*configureOutput)(int port, int type, bool initialValue);
+    void (*setOutput)(int port, bool value);
+    void (*setRelay)(int port, bool value);
+    bool (*getInput)(int port);
+    bool (*send)(const void* data, int length);
+    void (*setLEDPower)(int port, int powerUA);
+    uint8_t (*getMyAddress)();
+};
+
+/**
+ * Header at the start of the module flash region, written by the module's linker script.
+ * Addresses are absolute, the module is linked for the module flash and RAM regions.
+ */
+struct ModuleHeader {
+    static constexpr uint32_t MAGIC = 0x4C444F4D; // "MODL"
+
+    uint32_t magic;
+    uint16_t abiVersion; // ModuleApi::ABI_VERSION the module was linked with
+    uint16_t headerSize; // sizeof(ModuleHeader)
+    uint32_t size; // Whole image, including the header
+    uint32_t crc; // CRC32 of the image after this field
+    const uint32_t* dataLoad; // Initial values of .data
+    uint32_t* dataStart;
+    uint32_t* dataEnd;
+    uint32_t* bssStart;
+    uint32_t* bssEnd;
+    void (*const* initArrayStart)(); // Constructors
+    void (*const* initArrayEnd)();
+    void (*stop)(); // Optional, called before the module is replaced
+    void (*recvCallback)(uint8_t srcAddress, const uint8_t* data, size_t size); // Optional
+    void (*updateCallback)(uint32_t ticks); // Optional
+};
+
+/**
+ * Starts the application module kept in its own flash region, so the user logic can be updated without
+ * rewriting the firmware.
+ *
+ * The image is checked before anything of it runs: header, ABI version, CRC, that .data and .bss are
+ * inside the module RAM region and that the callbacks and constructors point into the image. Then .data
+ * is copied, .bss is cleared and the constructors run.
+ * Callbacks are copied from the header, so receive() and update() are just indirect calls.
+ */
+class ModuleLoader
+{
+public:
+    struct Region {
+        uint8_t* base;
+        size_t size;
+    };
+
+    enum Result: uint8_t {
+        OK = 0,
+        NO_MODULE = 1, // Erased or other data in the region
+        BAD_ABI = 2,
+        BAD_SIZE = 3,
+        BAD_CRC = 4,
+        BAD_LAYOUT = 5,
+    };
+
+private:
+    Region flash;
+    Region ram;
+    bool started;
+    void (*stop)();
+    void (*recvCallback)(uint8_t srcAddress, const uint8_t* data, size_t size);
+    void (*updateCallback)(uint32_t ticks);
+
+    bool inside(const Region& region, const void* start, const void* end) const;
+    bool isCode(const Region& image, uintptr_t function) const;
+    Result check(const ModuleHeader& header) const;
+
+public:
+    ModuleLoader(const Region& flash, const Region& ram);
+
+    /** Checks and starts the module. Nothing of the module runs if the result is not OK. */
+    Result load();
+
+    /** Stops the module before its region is rewritten. */
+    void unload();
+
+    bool loaded() const { return started; }
+
+    void receive(uint8_t srcAddress, const uint8_t* data, size_t size) {
+        if (recvCallback != nullptr) {
+            recvCallback(srcAddress, data, size);
+        }
+    }
+
+    void update(uint32_t ticks) {
+        if (updateCallback != nullptr) {
+            updateCallback(ticks);
+        }
+    }
+};
+
+
+#endif // MODULELOADER_HH
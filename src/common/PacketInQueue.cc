@@ -11,6 +11,9 @@ static constexpr uint8_t END = 0xFF; // End character
 PacketInQueue::PacketInQueue() :
     writePos(0),
     readPos(0),
+    written(0),
+    markWrite(0),
+    markRead(0),
     overrunBytes(0),
     invalidPackets(0)
 {
@@ -21,6 +24,7 @@ bool PacketInQueue::write(const uint8_t *data, size_t size)
     auto writePos = this->writePos;
     auto readPos = this->readPos;
     auto needNotify = false;
+    auto dataBegin = data;
     auto dataEnd = data + size;
     while (data < dataEnd) {
         int next = (writePos + 1) & MASK;
@@ -28,6 +32,15 @@ bool PacketInQueue::write(const uint8_t *data, size_t size)
             overrunBytes = (overrunBytes + (dataEnd - data)) | 0x80000000;
             buffer[(writePos - 2) & MASK] = ESC;
             buffer[(writePos - 1) & MASK] = END;
+            uint32_t newWritten = written + (data - dataBegin);
+            // Marks of the truncated and dropped packets must not match any packet stored later,
+            // moving them to the END just written keeps them in order
+            for (uint8_t i = markRead; i != markWrite; i++) {
+                if ((int32_t)(marks[i % MAX_MARKS] - newWritten) >= -1) {
+                    marks[i % MAX_MARKS] = newWritten - 1;
+                }
+            }
+            this->written = newWritten;
             this->writePos = writePos;
             return true;
         }
@@ -38,22 +51,54 @@ bool PacketInQueue::write(const uint8_t *data, size_t size)
         writePos = next;
         data++;
     }
+    this->written = written + size;
     this->writePos = writePos;
     return needNotify;
 }
 
-int PacketInQueue::peek(uint8_t* &data)
+void PacketInQueue::mark(size_t offset)
+{
+    if (!marksFull()) {
+        marks[markWrite % MAX_MARKS] = written + offset;
+        markWrite = markWrite + 1;
+    }
+}
+
+int PacketInQueue::peek(uint8_t* &data, bool &marked)
 {
     int res;
+    uint32_t end;
     do {
-        res = peekInner(data);
+        res = peekInner(data, end);
     } while (res == INVALID);
+    marked = false;
+    if (res < 0) {
+        return res;
+    }
+    // Marks of the packets before this one were not returned, their packets were dropped
+    while (markRead != markWrite) {
+        int32_t distance = marks[markRead % MAX_MARKS] - end;
+        if (distance > 0) {
+            break;
+        }
+        markRead = markRead + 1;
+        if (distance == 0) {
+            marked = true;
+            break;
+        }
+    }
     return res;
 }
 
-int PacketInQueue::peekInner(uint8_t* &data)
+int PacketInQueue::peekInner(uint8_t* &data, uint32_t &end)
 {
-    auto writePos = this->writePos;
+    size_t writePos;
+    uint32_t written;
+    {
+        IRQ::Guard guard;
+        writePos = this->writePos;
+        written = this->written;
+    }
     auto readPos = this->readPos;
     // Return if no data
     if (readPos == writePos) {
@@ -145,6 +190,8 @@ int PacketInQueue::peekInner(uint8_t* &data)
         invalidPackets = (invalidPackets + 1) | 0x80000000;
         return INVALID;
     }
+    // Moving a wrapped packet keeps its closing ESC in place
+    end = written - ((writePos - dataEnd) & MASK);
 
     return contentSize;
 }
@@ -11,6 +11,7 @@ class PacketInQueue
 public:
     static constexpr int NO_PACKET = -1;
     static constexpr int END_MARKER = -2;
+    static constexpr int MAX_MARKS = 8;
 
 private:
     static constexpr int INVALID = -3;
@@ -20,6 +21,10 @@ private:
     uint8_t buffer[SIZE];
     volatile size_t writePos;
     volatile size_t readPos;
+    volatile uint32_t written; // Bytes stored so far, stream position of writePos
+    uint32_t marks[MAX_MARKS]; // Stream positions of the ESC closing the marked packets
+    volatile uint8_t markWrite;
+    volatile uint8_t markRead;
 
 public:
     size_t overrunBytes; // This is only for statistics, so write races are acceptable (no need for volatile or atomic).
@@ -31,13 +36,26 @@ public:
     bool write(const uint8_t *data, size_t size);
 
     /** Peek single packet. Returns packet size or negative status code. The packet remains in the queue. */
-    int peek(uint8_t* &data);
+    int peek(uint8_t* &data) { bool marked; return peek(data, marked); }
+
+    /** Same as peek(), also tells if the packet was marked by mark(). */
+    int peek(uint8_t* &data, bool &marked);
+
+    /**
+     * Marks the packet closed by the offset-th byte of the next write(), e.g. a packet already forwarded
+     * while it was received. Called from IRQ before the write. Marks of packets dropped by an overrun
+     * are never returned.
+     */
+    void mark(size_t offset);
+
+    /** Returns true if mark() would have no space. */
+    bool marksFull() const { return (uint8_t)(markWrite - markRead) >= MAX_MARKS; }
 
     /** Remove packet recently peeked from the queue. */
     void drop(uint8_t* data, int size);
 
 private:
-    int peekInner(uint8_t* &data);
+    int peekInner(uint8_t* &data, uint32_t &end);
 };
 
 
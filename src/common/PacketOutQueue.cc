@@ -0,0 +1,91 @@
+
+#include "PacketOutQueue.hh"
+#include "IRQ.hh"
+
+
+PacketOutQueue::PacketOutQueue(PacketPool& pool) :
+    pool(pool),
+    count(0),
+    transmitting(NOT_TRANSMITTING),
+    droppedPackets(0)
+{
+    for (auto& ring : rings) {
+        ring.writePos = 0;
+        ring.readPos = 0;
+    }
+}
+
+bool PacketOutQueue::dropNewest(int priority)
+{
+    auto& ring = rings[priority];
+    if (ring.readPos == ring.writePos) {
+        return false;
+    }
+    auto last = (ring.writePos - 1) & MASK;
+    if (transmitting == priority && ring.readPos == last) {
+        // Already on the wire
+        return false;
+    }
+    pool.release(ring.items[last]);
+    ring.writePos = last;
+    count--;
+    droppedPackets++;
+    return true;
+}
+
+bool PacketOutQueue::dropBelow(Priority priority)
+{
+    IRQ::Guard guard;
+    for (int lower = PRIORITY_COUNT - 1; lower > priority; lower--) {
+        if (dropNewest(lower)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool PacketOutQueue::push(PacketPool::Buffer* buffer, Priority priority)
+{
+    IRQ::Guard guard;
+    if (count >= LIMIT && !dropBelow(priority)) {
+        droppedPackets++;
+        return false;
+    }
+    auto& ring = rings[priority];
+    pool.addRef(buffer);
+    ring.items[ring.writePos] = buffer;
+    ring.writePos = (ring.writePos + 1) & MASK;
+    count++;
+    return true;
+}
+
+PacketPool::Buffer* PacketOutQueue::peek()
+{
+    IRQ::Guard guard;
+    if (transmitting != NOT_TRANSMITTING) {
+        auto& ring = rings[transmitting];
+        return ring.items[ring.readPos];
+    }
+    for (int priority = 0; priority < PRIORITY_COUNT; priority++) {
+        auto& ring = rings[priority];
+        if (ring.readPos != ring.writePos) {
+            transmitting = priority;
+            return ring.items[ring.readPos];
+        }
+    }
+    return nullptr;
+}
+
+void PacketOutQueue::pop()
+{
+    IRQ::Guard guard;
+    if (transmitting == NOT_TRANSMITTING) {
+        return;
+    }
+    auto& ring = rings[transmitting];
+    auto buffer = ring.items[ring.readPos];
+    ring.readPos = (ring.readPos + 1) & MASK;
+    count--;
+    transmitting = NOT_TRANSMITTING;
+    pool.release(buffer);
+}
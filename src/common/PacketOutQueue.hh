@@ -0,0 +1,70 @@
+#ifndef PACKETOUTQUEUE_HH
+#define PACKETOUTQUEUE_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "PacketPool.hh"
+
+
+/**
+ * Packets waiting for transmission on one port. The queue holds references to the pool buffers,
+ * the data itself is not copied. The link layer framing is done by the transmitter.
+ *
+ * Packets have one of the priority classes, the highest one is sent first. When the queue is full,
+ * the newest packet of a lower class than the pushed one is dropped to make space for it.
+ */
+class PacketOutQueue
+{
+public:
+    enum Priority: uint8_t {
+        MANAGEMENT = 0, // Network management
+        SIGNAL = 1, // Signals, acknowledgements, name resolution, bootloader
+        STATE = 2, // State broadcasts, the next one replaces a lost one
+        PRIORITY_COUNT = 3,
+    };
+
+    static constexpr size_t LIMIT = 5; // Total number of packets in all classes, less than the pool has
+                                       // so one congested port does not take all the buffers
+
+private:
+    static constexpr size_t SIZE = 8; // Each ring can hold LIMIT packets
+    static constexpr size_t MASK = (SIZE - 1);
+    static constexpr int NOT_TRANSMITTING = -1;
+
+    struct Ring {
+        PacketPool::Buffer* items[SIZE];
+        volatile size_t writePos;
+        volatile size_t readPos;
+    };
+
+    PacketPool& pool;
+    Ring rings[PRIORITY_COUNT];
+    volatile size_t count;
+    volatile int transmitting; // Class of the packet returned by peek()
+
+    bool dropNewest(int priority);
+
+public:
+    size_t droppedPackets; // Statistics only, rejected and replaced packets
+
+    PacketOutQueue(PacketPool& pool);
+
+    /** Adds the packet to the queue with a new reference. Returns false if there is no space for it. */
+    bool push(PacketPool::Buffer* buffer, Priority priority);
+
+    /** Drops the newest packet of the lowest class below the priority. Returns false if there is none. */
+    bool dropBelow(Priority priority);
+
+    /** Returns the packet to transmit or nullptr if the queue is empty. The packet remains in the queue. */
+    PacketPool::Buffer* peek();
+
+    /** Removes the packet recently peeked after its transmission and releases the reference. Can be called from IRQ. */
+    void pop();
+
+    /** Number of packets waiting, including the one being transmitted. */
+    size_t size() const { return count; }
+};
+
+
+#endif // PACKETOUTQUEUE_HH
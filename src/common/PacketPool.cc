@@ -0,0 +1,54 @@
+
+#include "PacketPool.hh"
+#include "IRQ.hh"
+#include <cstring>
+
+
+PacketPool::PacketPool() :
+    freeMask((1u << COUNT) - 1),
+    allocationFailures(0)
+{
+}
+
+PacketPool::Buffer* PacketPool::allocate(const uint8_t* data, size_t size, bool useReserved)
+{
+    if (size > MAX_SIZE) {
+        return nullptr;
+    }
+    int index;
+    {
+        IRQ::Guard guard;
+        bool lastFree = (freeMask & (freeMask - 1)) == 0;
+        if (freeMask == 0 || (lastFree && !useReserved)) {
+            allocationFailures++;
+            return nullptr;
+        }
+        index = __builtin_ctz(freeMask);
+        freeMask &= ~(1u << index);
+    }
+    auto buffer = &buffers[index];
+    buffer->refCount = 1;
+    buffer->size = size;
+    std::memcpy(buffer->data, data, size);
+    return buffer;
+}
+
+void PacketPool::addRef(Buffer* buffer)
+{
+    IRQ::Guard guard;
+    buffer->refCount++;
+}
+
+void PacketPool::release(Buffer* buffer)
+{
+    IRQ::Guard guard;
+    buffer->refCount--;
+    if (buffer->refCount == 0) {
+        freeMask |= 1u << (buffer - buffers);
+    }
+}
+
+int PacketPool::freeCount() const
+{
+    return __builtin_popcount(freeMask);
+}
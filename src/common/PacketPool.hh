@@ -0,0 +1,50 @@
+#ifndef PACKETPOOL_HH
+#define PACKETPOOL_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/**
+ * Fixed number of packet buffers shared by all ports. A packet forwarded to several ports is stored
+ * once, each port holds a reference and the buffer returns to the pool after the last one is released.
+ */
+class PacketPool
+{
+public:
+    static constexpr size_t MAX_SIZE = 249; // Network layer content without CRC
+    static constexpr int COUNT = 8;
+
+    struct Buffer {
+        volatile uint8_t refCount;
+        uint8_t size;
+        uint8_t data[MAX_SIZE];
+    };
+
+private:
+    Buffer buffers[COUNT];
+    volatile uint32_t freeMask;
+
+public:
+    size_t allocationFailures; // Statistics only
+
+    PacketPool();
+
+    /**
+     * Copies the packet to a free buffer with one reference. Returns nullptr if all buffers are used.
+     * The last free buffer is reserved for network management, e.g. to report that the pool is full.
+     */
+    Buffer* allocate(const uint8_t* data, size_t size, bool useReserved = false);
+
+    /** Adds a reference to the buffer. */
+    void addRef(Buffer* buffer);
+
+    /** Removes a reference, the buffer is free when it was the last one. Can be called from IRQ. */
+    void release(Buffer* buffer);
+
+    /** Number of free buffers. */
+    int freeCount() const;
+};
+
+
+#endif // PACKETPOOL_HH
@@ -0,0 +1,371 @@
+
+#include "Router.hh"
+#include "CRC32.hh"
+#include "Time.hh"
+#include <cstring>
+
+
+Router::Router(PacketInQueue* const rxQueues[], PacketOutQueue* const txQueues[], int portCount, PacketPool& pool,
+               TransmitCallback transmit) :
+    portCount(portCount),
+    pool(pool),
+    transmit(transmit),
+    streamingPorts(0),
+    lastLostNoticeTime(0),
+    lostNoticeSent(false),
+    nextRecentFlood(0),
+    address(UNKNOWN_ADDRESS),
+    mapChanged(false),
+    forwardedPackets(0),
+    floodedPackets(0),
+    droppedPackets(0),
+    cutThroughPackets(0),
+    abortedPackets(0),
+    lostNotices(0),
+    duplicatePackets(0)
+{
+    std::memset(map, 0, sizeof(map));
+    std::memset(cutThrough, 0, sizeof(cutThrough));
+    std::memset(recentFloods, 0, sizeof(recentFloods));
+    for (int i = 0; i < portCount; i++) {
+        this->rxQueues[i] = rxQueues[i];
+        this->txQueues[i] = txQueues[i];
+    }
+}
+
+void Router::learn(uint8_t address, int port)
+{
+    if (address == UNKNOWN_ADDRESS || lookup(address) == port) {
+        return;
+    }
+    auto shift = (address & 3) * 2;
+    auto& entry = map[address >> 2];
+    entry = (entry & ~(3 << shift)) | ((port + 1) << shift);
+    mapChanged = true;
+}
+
+void Router::forget()
+{
+    std::memset(map, 0, sizeof(map));
+    mapChanged = true;
+}
+
+void Router::setMap(const uint8_t* savedMap)
+{
+    std::memcpy(map, savedMap, sizeof(map));
+    mapChanged = false;
+}
+
+uint32_t Router::portMask(int ingress, const uint8_t* packet, bool& flooded) const
+{
+    // | FLAGS | SRC | DST[] | DATA |, lower 4 bits of FLAGS is DST_COUNT
+    size_t dstCount = packet[0] & DST_COUNT_MASK;
+    uint32_t otherPorts = ((1u << portCount) - 1) & ~(1u << ingress);
+    uint32_t mask = dstCount == 0 ? otherPorts : 0;
+    flooded = false;
+    for (auto dst = &packet[2]; dst < &packet[2 + dstCount]; dst++) {
+        auto port = lookup(*dst);
+        if (port == UNKNOWN_PORT) {
+            // Flooding covers all the remaining destinations
+            flooded = true;
+            mask = otherPorts;
+            break;
+        }
+        mask |= 1u << port;
+    }
+    // Destinations on the ingress port already got the packet
+    return mask & ~(1u << ingress);
+}
+
+uint32_t Router::route(int ingress, const uint8_t* packet, size_t size)
+{
+    if (size < 2 + (size_t)(packet[0] & DST_COUNT_MASK)) {
+        droppedPackets++;
+        return 0;
+    }
+    bool flooded;
+    auto mask = portMask(ingress, packet, flooded);
+    bool broadcast = (packet[0] & DST_COUNT_MASK) == 0;
+    if (broadcast && mask != 0 && isDuplicate(packet, size)) {
+        // The copy came back through other router, so the source is not necessarily on this port
+        duplicatePackets++;
+        return 0;
+    }
+    learn(packet[1], ingress);
+    floodedPackets += flooded;
+    if (mask != 0) {
+        forwardedPackets++;
+    }
+    return mask;
+}
+
+bool Router::isDuplicate(const uint8_t* packet, size_t size)
+{
+    auto hash = CRC32::calculate(packet, size) | 1; // Zero marks an empty entry
+    auto now = Time::get32();
+    for (auto& entry : recentFloods) {
+        if (entry.hash == hash && now - entry.time < DUPLICATE_WINDOW_MS) {
+            return true;
+        }
+    }
+    auto& entry = recentFloods[nextRecentFlood];
+    nextRecentFlood = (nextRecentFlood + 1) % RECENT_FLOOD_COUNT;
+    entry.hash = hash;
+    entry.time = now;
+    return false;
+}
+
+void Router::process()
+{
+    bool received;
+    do {
+        // One packet from each port at a time, so a busy port does not starve the others
+        received = false;
+        for (int ingress = 0; ingress < portCount; ingress++) {
+            uint8_t* data;
+            bool alreadyForwarded;
+            int size = rxQueues[ingress]->peek(data, alreadyForwarded);
+            if (size == PacketInQueue::NO_PACKET) {
+                continue;
+            }
+            received = true;
+            if (size == PacketInQueue::END_MARKER) {
+                continue;
+            }
+            if (size < 2) {
+                droppedPackets++;
+            } else if (alreadyForwarded) {
+                learn(data[1], ingress);
+            } else {
+                forward(ingress, data, size);
+            }
+            rxQueues[ingress]->drop(data, size);
+        }
+    } while (received);
+}
+
+PacketOutQueue::Priority Router::priority(const uint8_t* packet, size_t size)
+{
+    auto protocol = (packet[0] >> PROTOCOL_SHIFT) & PROTOCOL_MASK;
+    size_t dataIndex = 2 + (packet[0] & DST_COUNT_MASK);
+    if (protocol == PROTOCOL_MANAGEMENT) {
+        return PacketOutQueue::MANAGEMENT;
+    } else if (protocol == PROTOCOL_APPLICATION && dataIndex < size && packet[dataIndex] == TYPE_STATE) {
+        return PacketOutQueue::STATE;
+    } else {
+        return PacketOutQueue::SIGNAL;
+    }
+}
+
+void Router::forward(int ingress, const uint8_t* packet, size_t size)
+{
+    auto mask = route(ingress, packet, size);
+    if (mask == 0) {
+        return;
+    }
+    auto packetPriority = priority(packet, size);
+    bool useReserved = packetPriority == PacketOutQueue::MANAGEMENT;
+    auto buffer = pool.allocate(packet, size, useReserved);
+    // Lower priority packets waiting in any queue give their buffers up
+    for (int port = 0; buffer == nullptr && port < portCount; port++) {
+        while (buffer == nullptr && txQueues[port]->dropBelow(packetPriority)) {
+            buffer = pool.allocate(packet, size, useReserved);
+        }
+    }
+    if (buffer == nullptr) {
+        droppedPackets++;
+        packetLost(ingress, packet, size, LOST_NO_BUFFER);
+        return;
+    }
+    bool queueFull = false;
+    for (int port = 0; port < portCount; port++) {
+        if ((mask & (1u << port)) && !txQueues[port]->push(buffer, packetPriority)) {
+            queueFull = true;
+        }
+    }
+    pool.release(buffer);
+    if (queueFull) {
+        packetLost(ingress, packet, size, LOST_QUEUE_FULL);
+    }
+}
+
+void Router::packetLost(int ingress, const uint8_t* packet, size_t size, LostReason reason)
+{
+    // | FLAGS | SRC | DST | Type = PACKET_LOST | reason |
+    auto source = packet[1];
+    size_t dataIndex = 2 + (packet[0] & DST_COUNT_MASK);
+    bool isLostNotice = ((packet[0] >> PROTOCOL_SHIFT) & PROTOCOL_MASK) == PROTOCOL_MANAGEMENT &&
+                        dataIndex < size && packet[dataIndex] == TYPE_PACKET_LOST;
+    if (source == UNKNOWN_ADDRESS || isLostNotice) {
+        // A new device cannot be addressed and notices about notices could multiply
+        return;
+    }
+    auto now = Time::get32();
+    if (lostNoticeSent && now - lastLostNoticeTime < PACKET_LOST_INTERVAL_MS) {
+        return;
+    }
+    const uint8_t notice[] = { PROTOCOL_MANAGEMENT << PROTOCOL_SHIFT | 1, address, source, TYPE_PACKET_LOST, reason };
+    auto buffer = pool.allocate(notice, sizeof(notice), true);
+    if (buffer == nullptr) {
+        return;
+    }
+    // The source is behind the port the packet came from
+    if (txQueues[ingress]->push(buffer, PacketOutQueue::MANAGEMENT)) {
+        lostNotices++;
+        lostNoticeSent = true;
+        lastLostNoticeTime = now;
+    }
+    pool.release(buffer);
+}
+
+void Router::received(int ingress, const uint8_t* data, size_t size)
+{
+    if (transmit == nullptr) {
+        return;
+    }
+    for (size_t i = 0; i < size; i++) {
+        if (receivedByte(ingress, data[i])) {
+            // The same bytes are written to the queue next, so process() knows the frame was forwarded
+            rxQueues[ingress]->mark(i);
+        }
+    }
+}
+
+bool Router::receivedByte(int ingress, uint8_t byte)
+{
+    auto& state = cutThrough[ingress];
+    if (byte == ESC) {
+        bool forwarded = false;
+        if (state.state == CutThrough::CONTENT) {
+            // The closing ESC may also begin the next frame
+            forwarded = frameEnded(state, state.size >= 4 && state.size <= MAX_CONTENT_SIZE);
+        } else if (state.state == CutThrough::SKIP) {
+            frameEnded(state, false);
+        }
+        state.state = CutThrough::ESCAPED;
+        return forwarded;
+    }
+    switch (state.state) {
+        case CutThrough::IDLE:
+        case CutThrough::SKIP:
+            return false;
+        case CutThrough::ESCAPED:
+            if (byte == END) {
+                state.state = CutThrough::IDLE;
+            } else {
+                frameStarted(state, byte);
+            }
+            return false;
+        case CutThrough::CONTENT:
+            break;
+    }
+    if (state.size >= MAX_CONTENT_SIZE) {
+        // Too long, PacketInQueue drops it too
+        state.state = CutThrough::SKIP;
+        if (state.egress != 0) {
+            streamEnded(state, true);
+        }
+        return false;
+    }
+    if (state.egress != 0) {
+        for (int port = 0; port < portCount; port++) {
+            if (state.egress & (1u << port)) {
+                transmit(this, port, &byte, 1);
+            }
+        }
+    }
+    // The CRC covers everything except the last 4 bytes, so it lags 4 bytes behind
+    auto content = byte ^ state.mask;
+    auto tailIndex = state.size & 3;
+    if (state.size >= 4) {
+        state.crc = CRC32::update(state.crc, state.tail[tailIndex]);
+    }
+    state.tail[tailIndex] = content;
+    if (state.size < MAX_HEADER_SIZE) {
+        state.header[state.size] = content;
+    }
+    state.size++;
+    if (state.size >= 2 && state.size == 2 + (size_t)(state.header[0] & DST_COUNT_MASK)) {
+        headerReceived(ingress, state);
+    }
+    return false;
+}
+
+void Router::frameStarted(CutThrough& state, uint8_t mask)
+{
+    state.state = CutThrough::CONTENT;
+    state.mask = mask;
+    state.size = 0;
+    state.crc = CRC32::INITIAL;
+    state.egress = 0;
+}
+
+void Router::headerReceived(int ingress, CutThrough& state)
+{
+    // The map is not updated until the CRC confirms the source address
+    bool flooded;
+    auto mask = portMask(ingress, state.header, flooded);
+    bool broadcast = (state.header[0] & DST_COUNT_MASK) == 0;
+    if (mask == 0 || (mask & streamingPorts) != 0 || flooded || broadcast || rxQueues[ingress]->marksFull()) {
+        // Nothing to forward, some egress port is busy, it goes to all ports or the frame could not
+        // be marked as forwarded, so process() handles it
+        return;
+    }
+    for (int port = 0; port < portCount; port++) {
+        if ((mask & (1u << port)) && txQueues[port]->size() != 0) {
+            // The port is transmitting a queued packet, the frame would be mixed into it
+            return;
+        }
+    }
+    streamingPorts |= mask;
+    state.egress = mask;
+    uint8_t begin[2 + MAX_HEADER_SIZE] = { ESC, state.mask };
+    for (size_t i = 0; i < state.size; i++) {
+        begin[2 + i] = state.header[i] ^ state.mask;
+    }
+    for (int port = 0; port < portCount; port++) {
+        if (mask & (1u << port)) {
+            transmit(this, port, begin, 2 + state.size);
+        }
+    }
+}
+
+bool Router::frameEnded(CutThrough& state, bool valid)
+{
+    if (valid) {
+        auto& tail = state.tail;
+        auto first = state.size & 3;
+        uint32_t crc = (uint32_t)tail[first] |
+                       (uint32_t)tail[(first + 1) & 3] << 8 |
+                       (uint32_t)tail[(first + 2) & 3] << 16 |
+                       (uint32_t)tail[(first + 3) & 3] << 24;
+        valid = ~state.crc == crc;
+    }
+    bool forwarded = state.egress != 0;
+    if (forwarded) {
+        streamEnded(state, !valid);
+        if (valid) {
+            forwardedPackets++;
+            cutThroughPackets++;
+        }
+    }
+    return forwarded && valid;
+}
+
+void Router::streamEnded(CutThrough& state, bool aborted)
+{
+    // Receivers verify the same CRC, so a corrupted frame is dropped by them anyway. An aborted
+    // frame is closed by a BEGIN with an empty content, which can never pass the CRC check.
+    static const uint8_t endSequence[] = { ESC, END };
+    static const uint8_t abortSequence[] = { ESC, 0x00, ESC, END };
+    const uint8_t* sequence = aborted ? abortSequence : endSequence;
+    size_t size = aborted ? sizeof(abortSequence) : sizeof(endSequence);
+    for (int port = 0; port < portCount; port++) {
+        if (state.egress & (1u << port)) {
+            transmit(this, port, sequence, size);
+        }
+    }
+    abortedPackets += aborted;
+    streamingPorts &= ~state.egress;
+    state.egress = 0;
+}
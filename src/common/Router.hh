@@ -0,0 +1,171 @@
+#ifndef ROUTER_HH
+#define ROUTER_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "PacketInQueue.hh"
+#include "PacketOutQueue.hh"
+#include "PacketPool.hh"
+
+
+/**
+ * Network layer packet forwarding between the ports of a router.
+ *
+ * The router learns on which port each address is available from the source addresses of the
+ * received packets. The map has 2 bits per address: 0 - unknown, 1..3 - port index + 1.
+ * Packets for unknown destinations, for address 0x00 and broadcasts go to all ports except
+ * the one they came from.
+ *
+ * Packets are forwarded when they are complete and their CRC is valid (store-and-forward) or
+ * while they are still arriving (cut-through), which saves a frame time of latency on each hop.
+ *
+ * Packets carry no sequence number or TTL, so with two routers bridging the same buses a broadcast
+ * would circulate forever. Broadcasts (DISCOVERY, STATE) are remembered for DUPLICATE_WINDOW_MS and
+ * the copies coming back are dropped. Unicast packets are not checked, because a retransmission has
+ * the same bytes as the lost packet, even if its destination is unknown and it is flooded. Redundant
+ * routers learn the destinations from their broadcasts first. Cut-through is used only for unicast
+ * to known destinations, so the whole packet is known before it is flooded.
+ */
+class Router
+{
+public:
+    static constexpr int MAX_PORTS = 3;
+    static constexpr int UNKNOWN_PORT = -1;
+    static constexpr uint8_t UNKNOWN_ADDRESS = 0x00;
+    static constexpr size_t MAP_SIZE = 256 * 2 / 8;
+    static constexpr uint32_t PACKET_LOST_INTERVAL_MS = 50; // At most one PACKET_LOST notice in this time
+    static constexpr uint32_t DUPLICATE_WINDOW_MS = 100; // Same broadcast is dropped in this time
+    static constexpr int RECENT_FLOOD_COUNT = 8;
+
+    enum LostReason: uint8_t {
+        LOST_UNKNOWN = 0,
+        LOST_QUEUE_FULL = 1, // Egress queue full, "output FIFO full"
+        LOST_NO_BUFFER = 2, // Packet pool exhausted
+    };
+
+    /** Appends raw frame bytes to the port output. Called from the UART receive path, possibly in IRQ. */
+    typedef void (*TransmitCallback)(Router* router, int port, const uint8_t* data, size_t size);
+
+private:
+    static constexpr uint8_t DST_COUNT_MASK = 0x0F;
+    static constexpr uint8_t ESC = 0xAA; // Framing as in PacketInQueue
+    static constexpr uint8_t END = 0xFF;
+    static constexpr size_t MAX_CONTENT_SIZE = 249 + 4;
+    static constexpr size_t MAX_HEADER_SIZE = 2 + DST_COUNT_MASK;
+    static constexpr uint8_t PROTOCOL_SHIFT = 4;
+    static constexpr uint8_t PROTOCOL_MASK = 0x07;
+    static constexpr uint8_t PROTOCOL_MANAGEMENT = 0;
+    static constexpr uint8_t PROTOCOL_APPLICATION = 1;
+    static constexpr uint8_t TYPE_PACKET_LOST = 6; // Network management
+    static constexpr uint8_t TYPE_STATE = 4; // Application layer
+
+    /* Receive state of a port for the cut-through forwarding */
+    struct CutThrough {
+        enum : uint8_t {
+            IDLE = 0,    // Waiting for ESC
+            ESCAPED = 1, // After ESC, waiting for the mask or END
+            CONTENT = 2, // Receiving the frame content
+            SKIP = 3,    // Invalid frame, waiting for the next ESC
+        } state;
+        uint8_t mask;
+        uint8_t header[MAX_HEADER_SIZE];
+        uint8_t tail[4]; // Last 4 content bytes, CRC when the frame ends
+        size_t size; // Content bytes received so far
+        uint32_t crc; // Running CRC of the content without the tail
+        uint32_t egress; // Ports the frame is streamed to
+    };
+
+    /* Broadcast remembered to drop its copies */
+    struct RecentFlood {
+        uint32_t hash; // CRC32 of the packet, 0 if the entry is empty
+        uint32_t time;
+    };
+
+    uint8_t map[MAP_SIZE];
+    PacketInQueue* rxQueues[MAX_PORTS];
+    PacketOutQueue* txQueues[MAX_PORTS];
+    int portCount;
+    PacketPool& pool;
+    TransmitCallback transmit;
+    CutThrough cutThrough[MAX_PORTS];
+    uint32_t streamingPorts; // Ports transmitting a cut through frame
+    uint32_t lastLostNoticeTime;
+    bool lostNoticeSent;
+    RecentFlood recentFloods[RECENT_FLOOD_COUNT];
+    uint8_t nextRecentFlood; // Oldest entry, replaced next
+
+public:
+    uint8_t address; // Source address of the packets created by the router
+    bool mapChanged; // Set when the map needs to be saved to the non-volatile memory, cleared by the caller.
+    size_t forwardedPackets; // Statistics only
+    size_t floodedPackets;
+    size_t droppedPackets;
+    size_t cutThroughPackets;
+    size_t abortedPackets;
+    size_t lostNotices;
+    size_t duplicatePackets;
+
+    /** Cut-through forwarding is enabled when transmit callback is provided and received() is called by UART. */
+    Router(PacketInQueue* const rxQueues[], PacketOutQueue* const txQueues[], int portCount, PacketPool& pool,
+           TransmitCallback transmit = nullptr);
+
+    /** Returns port index where the address is available or UNKNOWN_PORT. */
+    int lookup(uint8_t address) const {
+        return ((map[address >> 2] >> ((address & 3) * 2)) & 3) - 1;
+    }
+
+    /** Remembers that the address is available on the port. Address 0x00 is never remembered. */
+    void learn(uint8_t address, int port);
+
+    /** Clears the map, e.g. on DISCOVERY with "forget routing map" flag. */
+    void forget();
+
+    /** Map of MAP_SIZE bytes to be saved to the non-volatile memory. */
+    const uint8_t* getMap() const { return map; }
+
+    /** Restores the map saved before reset. */
+    void setMap(const uint8_t* savedMap);
+
+    /**
+     * Learns from the packet received on the ingress port and returns mask of ports where it should be sent.
+     * Copies of a recent broadcast are not learned from and get an empty mask.
+     */
+    uint32_t route(int ingress, const uint8_t* packet, size_t size);
+
+    /** Egress queue priority class of the packet. */
+    static PacketOutQueue::Priority priority(const uint8_t* packet, size_t size);
+
+    /**
+     * Forwards all complete packets waiting in the receive queues, except the ones already cut through.
+     * Each packet is copied once to the pool and all its egress queues refer to the same buffer.
+     * Source of a packet that cannot be queued gets a rate-limited PACKET_LOST notice.
+     */
+    void process();
+
+    /**
+     * Raw bytes received on the port, must be called before they are written to its rxQueue.
+     * A unicast frame is streamed to the egress ports as soon as its FLAGS, SRC and DST[] are known,
+     * if none of them is transmitting other cut through frame or a queued packet. Otherwise, process()
+     * forwards it later.
+     * Forwarded frames are marked in the rxQueue, so process() does not send them again.
+     */
+    void received(int ingress, const uint8_t* data, size_t size);
+
+    /** Returns true while a cut through frame is streamed to the port, its txQueue must not be started until then. */
+    bool isStreaming(int port) const { return (streamingPorts & (1u << port)) != 0; }
+
+private:
+    uint32_t portMask(int ingress, const uint8_t* packet, bool& flooded) const;
+    bool isDuplicate(const uint8_t* packet, size_t size);
+    void forward(int ingress, const uint8_t* packet, size_t size);
+    void packetLost(int ingress, const uint8_t* packet, size_t size, LostReason reason);
+    bool receivedByte(int ingress, uint8_t byte);
+    void frameStarted(CutThrough& state, uint8_t mask);
+    void headerReceived(int ingress, CutThrough& state);
+    bool frameEnded(CutThrough& state, bool valid);
+    void streamEnded(CutThrough& state, bool aborted);
+};
+
+
+#endif // ROUTER_HH
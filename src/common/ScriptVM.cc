@@ -0,0 +1,241 @@
+
+#include "ScriptVM.hh"
+#include <cstring>
+
+
+static const uint8_t typeBits[ScriptVM::TYPE_COUNT] = { 1, 8, 8, 16, 16, 32, 32 };
+
+ScriptVM::ScriptVM(const Native* natives, int nativeCount) :
+    natives(natives),
+    nativeCount(nativeCount),
+    image(nullptr),
+    code(nullptr),
+    functionCount(0),
+    initFunction(NO_FUNCTION),
+    updateFunction(NO_FUNCTION),
+    memorySize(0),
+    budget(DEFAULT_BUDGET),
+    executed(0)
+{
+    std::memset(memory, 0, sizeof(memory));
+}
+
+ScriptVM::Function ScriptVM::function(uint8_t index) const
+{
+    auto entry = &image[HEADER_SIZE + index * FUNCTION_SIZE];
+    return { (uint16_t)(entry[0] | entry[1] << 8), (uint16_t)(entry[2] | entry[3] << 8), entry[4], entry[5] };
+}
+
+bool ScriptVM::check(const Function& function, const uint8_t* instruction, int index) const
+{
+    uint8_t a = instruction[1] & 0x0F;
+    uint8_t b = instruction[1] >> 4;
+    uint16_t imm = instruction[2] | instruction[3] << 8;
+    int target = index + 1 + (int16_t)imm;
+    bool aValid = a < function.registers;
+    switch (instruction[0]) {
+        case OP_LOADK:
+        case OP_LOADKH:
+        case OP_RET:
+            return aValid;
+        case OP_MOVE:
+        case OP_NOT:
+        case OP_NEG:
+        case OP_INV:
+            return aValid && b < function.registers;
+        case OP_LOAD:
+        case OP_STORE:
+            return aValid && b < TYPE_COUNT && imm % typeBits[b] == 0 && imm + typeBits[b] <= memorySize * 8;
+        case OP_JMP:
+            return target >= 0 && target < function.count;
+        case OP_JZ:
+        case OP_JNZ:
+            return aValid && target >= 0 && target < function.count;
+        case OP_CALL:
+            return imm < functionCount && this->function(imm).params == b &&
+                   a + (b > 0 ? b : 1) <= function.registers;
+        case OP_NATIVE:
+            return imm < nativeCount && a + (b > 0 ? b : 1) <= function.registers;
+        default:
+            // Binary operations
+            return instruction[0] >= OP_ADD && instruction[0] <= OP_LEU && aValid && b < function.registers &&
+                   imm < function.registers;
+    }
+}
+
+ScriptVM::Result ScriptVM::load(const uint8_t* image, size_t size)
+{
+    this->image = nullptr;
+    if (size < HEADER_SIZE || image[0] != 'M' || image[1] != 'S' || image[2] != VERSION) {
+        return BAD_IMAGE;
+    }
+    functionCount = image[3];
+    memorySize = image[4] | image[5] << 8;
+    initFunction = image[6];
+    updateFunction = image[7];
+    size_t codeOffset = HEADER_SIZE + functionCount * FUNCTION_SIZE;
+    if (memorySize > MAX_MEMORY || size < codeOffset || (size - codeOffset) % INSTRUCTION_SIZE != 0 ||
+        functionCount == NO_FUNCTION) {
+        return BAD_IMAGE;
+    }
+    this->image = image;
+    code = image + codeOffset;
+    size_t instructionCount = (size - codeOffset) / INSTRUCTION_SIZE;
+    bool valid = (initFunction == NO_FUNCTION || (initFunction < functionCount && function(initFunction).params == 0)) &&
+                 (updateFunction == NO_FUNCTION ||
+                  (updateFunction < functionCount && function(updateFunction).params <= 1));
+    for (int i = 0; valid && i < functionCount; i++) {
+        auto function = this->function(i);
+        valid = function.count > 0 && function.first + function.count <= instructionCount &&
+                function.registers > 0 && function.registers <= MAX_REGISTERS && function.params <= function.registers;
+        for (int j = 0; valid && j < function.count; j++) {
+            valid = check(function, &code[(function.first + j) * INSTRUCTION_SIZE], j);
+        }
+        // Execution cannot run past the end of the function
+        uint8_t last = valid ? code[(function.first + function.count - 1) * INSTRUCTION_SIZE] : 0;
+        valid = valid && (last == OP_JMP || last == OP_RET);
+    }
+    if (!valid) {
+        this->image = nullptr;
+        return BAD_IMAGE;
+    }
+    std::memset(memory, 0, sizeof(memory));
+    return OK;
+}
+
+ScriptVM::Result ScriptVM::init()
+{
+    if (image == nullptr) {
+        return NOT_LOADED;
+    } else if (initFunction == NO_FUNCTION) {
+        return OK;
+    }
+    return call(initFunction, nullptr, 0);
+}
+
+ScriptVM::Result ScriptVM::update(uint32_t ticks)
+{
+    if (image == nullptr) {
+        return NOT_LOADED;
+    } else if (updateFunction == NO_FUNCTION) {
+        return OK;
+    }
+    int32_t param = ticks;
+    return call(updateFunction, &param, function(updateFunction).params);
+}
+
+int32_t ScriptVM::load(Type type, uint16_t bit) const
+{
+    const uint8_t* data = &memory[bit / 8];
+    switch (type) {
+        case TYPE_BOOL:
+            return (data[0] >> (bit % 8)) & 1;
+        case TYPE_UINT8:
+            return data[0];
+        case TYPE_INT8:
+            return (int8_t)data[0];
+        case TYPE_UINT16:
+            return (uint16_t)(data[0] | data[1] << 8);
+        case TYPE_INT16:
+            return (int16_t)(data[0] | data[1] << 8);
+        default:
+            return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+    }
+}
+
+void ScriptVM::store(Type type, uint16_t bit, int32_t value)
+{
+    uint8_t* data = &memory[bit / 8];
+    if (type == TYPE_BOOL) {
+        data[0] = (data[0] & ~(1 << (bit % 8))) | (value != 0) << (bit % 8);
+        return;
+    }
+    for (int i = 0; i < typeBits[type] / 8; i++) {
+        data[i] = (uint32_t)value >> (8 * i);
+    }
+}
+
+ScriptVM::Result ScriptVM::call(uint8_t index, const int32_t* params, int count, int32_t* returned)
+{
+    if (image == nullptr) {
+        return NOT_LOADED;
+    } else if (index >= functionCount || function(index).params != count) {
+        return BAD_IMAGE;
+    }
+    int depth = 0;
+    Frame* frame = &frames[0];
+    std::memset(frame->registers, 0, sizeof(frame->registers));
+    for (int i = 0; i < count; i++) {
+        frame->registers[i] = params[i];
+    }
+    int32_t* r = frame->registers;
+    const uint8_t* pc = &code[function(index).first * INSTRUCTION_SIZE];
+    for (executed = 0; executed < budget; executed++) {
+        uint8_t op = pc[0];
+        uint8_t a = pc[1] & 0x0F;
+        uint8_t b = pc[1] >> 4;
+        uint16_t imm = pc[2] | pc[3] << 8;
+        uint8_t c = imm;
+        pc += INSTRUCTION_SIZE;
+        switch (op) {
+            case OP_LOADK: r[a] = (int16_t)imm; break;
+            case OP_LOADKH: r[a] = (r[a] & 0xFFFF) | (uint32_t)imm << 16; break;
+            case OP_MOVE: r[a] = r[b]; break;
+            case OP_LOAD: r[a] = load((Type)b, imm); break;
+            case OP_STORE: store((Type)b, imm, r[a]); break;
+            case OP_ADD: r[a] = (uint32_t)r[b] + (uint32_t)r[c]; break;
+            case OP_SUB: r[a] = (uint32_t)r[b] - (uint32_t)r[c]; break;
+            case OP_MUL: r[a] = (uint32_t)r[b] * (uint32_t)r[c]; break;
+            case OP_DIV: r[a] = r[c] == 0 || (r[c] == -1 && r[b] == INT32_MIN) ? 0 : r[b] / r[c]; break;
+            case OP_MOD: r[a] = r[c] == 0 || r[c] == -1 ? 0 : r[b] % r[c]; break;
+            case OP_AND: r[a] = r[b] & r[c]; break;
+            case OP_OR: r[a] = r[b] | r[c]; break;
+            case OP_XOR: r[a] = r[b] ^ r[c]; break;
+            case OP_SHL: r[a] = (uint32_t)r[b] << (r[c] & 31); break;
+            case OP_SHR: r[a] = r[b] >> (r[c] & 31); break;
+            case OP_SHRU: r[a] = (uint32_t)r[b] >> (r[c] & 31); break;
+            case OP_EQ: r[a] = r[b] == r[c]; break;
+            case OP_NE: r[a] = r[b] != r[c]; break;
+            case OP_LT: r[a] = r[b] < r[c]; break;
+            case OP_LE: r[a] = r[b] <= r[c]; break;
+            case OP_LTU: r[a] = (uint32_t)r[b] < (uint32_t)r[c]; break;
+            case OP_LEU: r[a] = (uint32_t)r[b] <= (uint32_t)r[c]; break;
+            case OP_NOT: r[a] = !r[b]; break;
+            case OP_NEG: r[a] = -(uint32_t)r[b]; break;
+            case OP_INV: r[a] = ~r[b]; break;
+            case OP_JMP: pc += (int16_t)imm * (int)INSTRUCTION_SIZE; break;
+            case OP_JZ: pc += r[a] == 0 ? (int16_t)imm * (int)INSTRUCTION_SIZE : 0; break;
+            case OP_JNZ: pc += r[a] != 0 ? (int16_t)imm * (int)INSTRUCTION_SIZE : 0; break;
+            case OP_NATIVE: r[a] = natives[imm](this, &r[a], b); break;
+            case OP_CALL: {
+                if (depth + 1 >= MAX_FRAMES) {
+                    return STACK_OVERFLOW;
+                }
+                frame->pc = (pc - code) / INSTRUCTION_SIZE;
+                frame->result = a;
+                frame = &frames[++depth];
+                std::memset(frame->registers, 0, sizeof(frame->registers));
+                std::memcpy(frame->registers, &r[a], b * sizeof(int32_t));
+                r = frame->registers;
+                pc = &code[function(imm).first * INSTRUCTION_SIZE];
+                break;
+            }
+            default: { // OP_RET
+                int32_t value = r[a];
+                if (depth == 0) {
+                    executed++;
+                    if (returned != nullptr) {
+                        *returned = value;
+                    }
+                    return OK;
+                }
+                frame = &frames[--depth];
+                r = frame->registers;
+                r[frame->result] = value;
+                pc = &code[frame->pc * INSTRUCTION_SIZE];
+                break;
+            }
+        }
+    }
+    return OUT_OF_BUDGET;
+}
@@ -0,0 +1,145 @@
+#ifndef SCRIPTVM_HH
+#define SCRIPTVM_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/**
+ * Interpreter of the bytecode compiled from modscript (drafts/modscript), so automation logic can be
+ * sent over the bus as a few hundred bytes instead of reflashing the module.
+ *
+ * Image (little endian):
+ *      header:    | 'M' | 'S' | VERSION | function count | memory size (2) | init function | update function |
+ *      functions: | first instruction (2) | instruction count (2) | register count | param count | ...
+ *      code:      4 byte instructions | op | A (bits 3-0), B (bits 7-4) | immediate (2) |
+ *
+ * Each call gets a frame with its own registers from a fixed pool of MAX_FRAMES, parameters are passed
+ * in the first registers. Variables live in the memory at bit offsets assigned by the compiler, typed
+ * loads and stores convert them to and from 32-bit registers.
+ *
+ * The whole image is checked by load(), so the interpreter loop does not check registers, jumps
+ * or memory ranges. Each call runs at most the budget of instructions, which bounds the cost of an update.
+ */
+class ScriptVM
+{
+public:
+    static constexpr uint8_t VERSION = 1;
+    static constexpr int MAX_FRAMES = 6;
+    static constexpr int MAX_REGISTERS = 16;
+    static constexpr size_t MAX_MEMORY = 256;
+    static constexpr uint8_t NO_FUNCTION = 0xFF;
+    static constexpr uint32_t DEFAULT_BUDGET = 1000; // Instructions per call
+
+    enum Op: uint8_t {
+        OP_LOADK = 0, // A = (int16)imm
+        OP_LOADKH = 1, // A = A & 0xFFFF | imm << 16
+        OP_MOVE = 2, // A = B
+        OP_LOAD = 3, // A = memory at bit imm of type B
+        OP_STORE = 4, // memory at bit imm of type B = A
+        OP_ADD = 5, // A = B op C, C is in bits 3-0 of imm
+        OP_SUB = 6,
+        OP_MUL = 7,
+        OP_DIV = 8, // Division by zero gives 0
+        OP_MOD = 9,
+        OP_AND = 10,
+        OP_OR = 11,
+        OP_XOR = 12,
+        OP_SHL = 13,
+        OP_SHR = 14,
+        OP_SHRU = 15,
+        OP_EQ = 16,
+        OP_NE = 17,
+        OP_LT = 18,
+        OP_LE = 19,
+        OP_LTU = 20,
+        OP_LEU = 21,
+        OP_NOT = 22, // A = !B
+        OP_NEG = 23, // A = -B
+        OP_INV = 24, // A = ~B
+        OP_JMP = 25, // Jump by (int16)imm instructions after this one
+        OP_JZ = 26, // Jump if A == 0
+        OP_JNZ = 27,
+        OP_CALL = 28, // A = function imm with B params from A, A + 1, ...
+        OP_NATIVE = 29, // A = native function imm with B params from A, A + 1, ...
+        OP_RET = 30, // Returns A
+        OP_COUNT,
+    };
+
+    enum Type: uint8_t {
+        TYPE_BOOL = 0,
+        TYPE_UINT8 = 1,
+        TYPE_INT8 = 2,
+        TYPE_UINT16 = 3,
+        TYPE_INT16 = 4,
+        TYPE_UINT32 = 5,
+        TYPE_INT32 = 6,
+        TYPE_COUNT,
+    };
+
+    enum Result: uint8_t {
+        OK = 0,
+        BAD_IMAGE = 1, // Rejected by load()
+        NOT_LOADED = 2,
+        OUT_OF_BUDGET = 3,
+        STACK_OVERFLOW = 4,
+    };
+
+    /** Firmware function called by OP_NATIVE, e.g. __io_read, __io_write. */
+    typedef int32_t (*Native)(ScriptVM* vm, const int32_t* params, int count);
+
+private:
+    static constexpr size_t HEADER_SIZE = 8;
+    static constexpr size_t FUNCTION_SIZE = 6;
+    static constexpr size_t INSTRUCTION_SIZE = 4;
+
+    struct Function {
+        uint16_t first;
+        uint16_t count;
+        uint8_t registers;
+        uint8_t params;
+    };
+
+    struct Frame {
+        uint16_t pc; // Return address when it calls other function
+        uint8_t result; // Register of the call result
+        int32_t registers[MAX_REGISTERS];
+    };
+
+    const Native* natives;
+    int nativeCount;
+    const uint8_t* image;
+    const uint8_t* code;
+    uint8_t functionCount;
+    uint8_t initFunction;
+    uint8_t updateFunction;
+    size_t memorySize;
+    Frame frames[MAX_FRAMES];
+
+    Function function(uint8_t index) const;
+    bool check(const Function& function, const uint8_t* instruction, int index) const;
+    int32_t load(Type type, uint16_t bit) const;
+    void store(Type type, uint16_t bit, int32_t value);
+
+public:
+    uint8_t memory[MAX_MEMORY]; // Variables, natives may access them
+    uint32_t budget;
+    uint32_t executed; // Statistics only, instructions in the last call
+
+    ScriptVM(const Native* natives, int nativeCount);
+
+    /** Checks the image, which must stay valid while it is loaded, and clears the memory. */
+    Result load(const uint8_t* image, size_t size);
+
+    /** Runs the init function of the image, if any. */
+    Result init();
+
+    /** Runs the update function of the image with the ticks parameter, if any. */
+    Result update(uint32_t ticks);
+
+    /** Runs the function. Memory changes made before the budget ran out are kept. */
+    Result call(uint8_t function, const int32_t* params, int count, int32_t* returned = nullptr);
+};
+
+
+#endif // SCRIPTVM_HH
@@ -0,0 +1,288 @@
+
+#include "SignalTransport.hh"
+#include "Time.hh"
+#include "Utils.hh"
+#include <stddef.h>
+#include <cstring>
+
+
+SignalTransport::SignalTransport(uint8_t tableId, SendCallback sendCallback, SignalCallback signalCallback,
+                                 FailedCallback failedCallback) :
+    tableId(tableId),
+    sendCallback(sendCallback),
+    signalCallback(signalCallback),
+    failedCallback(failedCallback),
+    retransmitWork(retransmitCallback),
+    ackWork(ackCallback),
+    retransmissions(0),
+    duplicates(0),
+    acksSent(0)
+{
+    std::memset(destinations, 0, sizeof(destinations));
+    std::memset(sources, 0, sizeof(sources));
+}
+
+void SignalTransport::retransmitCallback(DelayedWork* work)
+{
+    CONTAINER_OF(work, SignalTransport, retransmitWork)->retransmit();
+}
+
+void SignalTransport::ackCallback(DelayedWork* work)
+{
+    CONTAINER_OF(work, SignalTransport, ackWork)->sendAcks();
+}
+
+SignalTransport::Destination* SignalTransport::destination(uint8_t address)
+{
+    Destination* unused = nullptr;
+    for (auto& destination : destinations) {
+        if (destination.address == address) {
+            return &destination;
+        }
+        bool idle = true;
+        for (auto& pending : destination.pending) {
+            idle = idle && !pending.used;
+        }
+        if (idle && unused == nullptr) {
+            unused = &destination;
+        }
+    }
+    if (unused != nullptr) {
+        // The new destination may remember other sequences of this device
+        unused->address = address;
+        unused->synced = false;
+    }
+    return unused;
+}
+
+int SignalTransport::inFlight(uint8_t address) const
+{
+    int count = 0;
+    for (auto& destination : destinations) {
+        for (int i = 0; destination.address == address && i < WINDOW; i++) {
+            count += destination.pending[i].used;
+        }
+    }
+    return count;
+}
+
+bool SignalTransport::send(uint8_t address, uint8_t destinationTableId, uint8_t id, const uint8_t* params,
+                           size_t size)
+{
+    if (address == NO_ADDRESS || size > MAX_PARAMS_SIZE) {
+        return false;
+    }
+    auto destination = this->destination(address);
+    if (destination == nullptr || (!destination->synced && inFlight(address) > 0)) {
+        // Signals after SYNC wait for its ACK
+        return false;
+    }
+    Pending* pending = nullptr;
+    for (int i = 0; pending == nullptr && i < WINDOW; i++) {
+        if (!destination->pending[i].used) {
+            pending = &destination->pending[i];
+        }
+    }
+    if (pending == nullptr) {
+        return false;
+    }
+    uint8_t sequence = destination->nextSequence;
+    destination->nextSequence = (sequence + 1) & SEQUENCE_MASK;
+    pending->message[0] = TYPE_SIGNAL;
+    pending->message[1] = destinationTableId;
+    pending->message[2] = id;
+    pending->message[3] = sequence | (destination->synced ? 0 : SYNC);
+    std::memcpy(&pending->message[HEADER_SIZE], params, size);
+    pending->size = HEADER_SIZE + size;
+    pending->used = true;
+    pending->retries = 0;
+    pending->sentTime = Time::get32();
+    sendCallback(this, address, pending->message, pending->size);
+    scheduleRetransmit();
+    return true;
+}
+
+void SignalTransport::scheduleRetransmit()
+{
+    auto now = Time::get32();
+    bool any = false;
+    int32_t delay = RETRANSMIT_MS;
+    for (auto& destination : destinations) {
+        for (auto& pending : destination.pending) {
+            if (pending.used) {
+                int32_t left = RETRANSMIT_MS - (now - pending.sentTime);
+                delay = left < delay ? left : delay;
+                any = true;
+            }
+        }
+    }
+    if (!any) {
+        retransmitWork.cancel();
+    } else {
+        retransmitWork.run(delay < 0 ? 0 : delay);
+    }
+}
+
+void SignalTransport::retransmit()
+{
+    auto now = Time::get32();
+    for (auto& destination : destinations) {
+        for (auto& pending : destination.pending) {
+            if (!pending.used || now - pending.sentTime < RETRANSMIT_MS) {
+                continue;
+            }
+            if (pending.retries >= MAX_RETRIES) {
+                pending.used = false;
+                if (failedCallback != nullptr) {
+                    failedCallback(this, destination.address, pending.message[2], STATUS_NO_ACK);
+                }
+                continue;
+            }
+            pending.retries++;
+            pending.sentTime = now;
+            retransmissions++;
+            sendCallback(this, destination.address, pending.message, pending.size);
+        }
+    }
+    scheduleRetransmit();
+}
+
+bool SignalTransport::receive(uint8_t address, const uint8_t* message, size_t size)
+{
+    if (size < 1) {
+        return false;
+    } else if (message[0] == TYPE_SIGNAL) {
+        receivedSignal(address, message, size);
+        return true;
+    } else if (message[0] == TYPE_SIGNAL_ACK) {
+        receivedAck(address, message, size);
+        return true;
+    }
+    return false;
+}
+
+SignalTransport::Source* SignalTransport::source(uint8_t address)
+{
+    for (auto& source : sources) {
+        if (source.address == address) {
+            return &source;
+        }
+    }
+    return nullptr;
+}
+
+void SignalTransport::receivedSignal(uint8_t address, const uint8_t* message, size_t size)
+{
+    if (size < HEADER_SIZE || address == NO_ADDRESS) {
+        return;
+    }
+    auto now = Time::get32();
+    uint8_t sequence = message[3] & SEQUENCE_MASK;
+    bool sync = message[3] & SYNC;
+    auto source = this->source(address);
+    bool isNew = true;
+    if (source == nullptr) {
+        // The least recently used one is replaced
+        source = &sources[0];
+        for (auto& other : sources) {
+            if (other.address == NO_ADDRESS || (int32_t)(other.lastTime - source->lastTime) < 0) {
+                source = &other;
+                if (other.address == NO_ADDRESS) {
+                    break;
+                }
+            }
+        }
+        source->address = address;
+        source->highest = sequence;
+        source->history = 1;
+        source->ackPending = false;
+        source->mismatch = false;
+    } else if (sync && !(source->highest == sequence && (source->history & 1))) {
+        // Sender was reset
+        source->highest = sequence;
+        source->history = 1;
+    } else {
+        int distance = (sequence - source->highest) & SEQUENCE_MASK;
+        distance = distance > SEQUENCE_MASK / 2 ? distance - (SEQUENCE_MASK + 1) : distance;
+        if (distance > 0) {
+            source->history = distance >= HISTORY_SIZE ? 1 : source->history << distance | 1;
+            source->highest = sequence;
+        } else if (-distance < HISTORY_SIZE) {
+            isNew = !(source->history & (1u << -distance));
+            source->history |= 1u << -distance;
+        } else {
+            // Too old to be in any window, so the sender must have started again
+            source->highest = sequence;
+            source->history = 1;
+        }
+    }
+    source->lastTime = now;
+    if (message[1] != tableId) {
+        source->mismatch = true;
+    } else if (!isNew) {
+        duplicates++;
+    } else if (signalCallback != nullptr) {
+        signalCallback(this, address, message[2], &message[HEADER_SIZE], size - HEADER_SIZE);
+    }
+    // Signals received until it runs are acknowledged together
+    source->ackPending = true;
+    ackWork.run(ACK_DELAY_MS, false);
+}
+
+void SignalTransport::sendAcks()
+{
+    for (auto& source : sources) {
+        if (!source.ackPending) {
+            continue;
+        }
+        uint8_t ack[] = {
+            TYPE_SIGNAL_ACK,
+            source.highest,
+            (uint8_t)source.history,
+            (uint8_t)(source.history >> 8),
+            (uint8_t)(source.history >> 16),
+            (uint8_t)(source.history >> 24),
+            source.mismatch ? STATUS_TABLE_MISMATCH : STATUS_OK,
+            tableId,
+        };
+        source.ackPending = false;
+        source.mismatch = false;
+        acksSent++;
+        sendCallback(this, source.address, ack, sizeof(ack));
+    }
+}
+
+void SignalTransport::receivedAck(uint8_t address, const uint8_t* message, size_t size)
+{
+    if (size < ACK_SIZE) {
+        return;
+    }
+    Destination* destination = nullptr;
+    for (auto& other : destinations) {
+        if (other.address == address) {
+            destination = &other;
+        }
+    }
+    if (destination == nullptr) {
+        return;
+    }
+    uint8_t highest = message[1] & SEQUENCE_MASK;
+    uint32_t history = message[2] | message[3] << 8 | message[4] << 16 | (uint32_t)message[5] << 24;
+    auto status = (Status)message[6];
+    uint8_t receiverTableId = message[7];
+    for (auto& pending : destination->pending) {
+        int distance = (highest - pending.message[3]) & SEQUENCE_MASK;
+        if (!pending.used || distance >= HISTORY_SIZE || !(history & (1u << distance))) {
+            continue;
+        }
+        pending.used = false;
+        destination->synced = true;
+        // Signals of the same ACK with the receiver's tableId were delivered
+        bool delivered = status == STATUS_OK ||
+                         (status == STATUS_TABLE_MISMATCH && pending.message[1] == receiverTableId);
+        if (!delivered && failedCallback != nullptr) {
+            failedCallback(this, address, pending.message[2], status);
+        }
+    }
+    scheduleRetransmit();
+}
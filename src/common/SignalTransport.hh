@@ -0,0 +1,132 @@
+#ifndef SIGNALTRANSPORT_HH
+#define SIGNALTRANSPORT_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "WorkQueue.hh"
+
+
+/**
+ * Reliable delivery of SIGNAL messages with a window of signals in flight to each destination.
+ *
+ *      SIGNAL:     | Type = 5 | tableId | id | SYNC (bit 7), sequence (bits 6-0) | signal params ... |
+ *      SIGNAL_ACK: | Type = 6 | highest sequence | history (4, LE) | status | tableId |
+ *
+ * Each destination has its own 7-bit sequence. Receiver remembers the highest sequence of each source
+ * and which of the 32 sequences up to it were received (bit 0 - the highest). Repeated signals are not
+ * delivered again. Signals received within ACK_DELAY_MS are acknowledged by one SIGNAL_ACK with that
+ * history, so a scene of several signals needs one round trip. Unacknowledged signals are sent again
+ * every RETRANSMIT_MS.
+ *
+ * A signal sent with other tableId than the receiver's one is acknowledged, but not delivered. The ACK then
+ * has STATUS_TABLE_MISMATCH and the receiver's tableId, so the sender fails only the signals it sent with
+ * other tableId, the rest of the same ACK were delivered.
+ *
+ * After a reset, the sender does not know which sequences the destination remembers, so the first
+ * signal has the SYNC flag, which restarts the history of the receiver. Other signals wait for its ACK.
+ */
+class SignalTransport
+{
+public:
+    static constexpr int WINDOW = 4; // Signals in flight to one destination
+    static constexpr int MAX_DESTINATIONS = 4;
+    static constexpr int MAX_SOURCES = 8;
+    static constexpr size_t MAX_PARAMS_SIZE = 8;
+    static constexpr uint32_t ACK_DELAY_MS = 2;
+    static constexpr uint32_t RETRANSMIT_MS = 50;
+    static constexpr int MAX_RETRIES = 5;
+    static constexpr uint8_t TYPE_SIGNAL = 5;
+    static constexpr uint8_t TYPE_SIGNAL_ACK = 6;
+    static constexpr uint8_t NO_ADDRESS = 0x00;
+
+    enum Status: uint8_t {
+        STATUS_OK = 0,
+        STATUS_TABLE_MISMATCH = 1, // Signal had other tableId, the sender must resolve its name again
+        STATUS_NO_ACK = 2, // Local only, no ACK after MAX_RETRIES
+    };
+
+    /** Sends the application layer message as unicast. */
+    typedef void (*SendCallback)(SignalTransport* transport, uint8_t address, const uint8_t* data, size_t size);
+
+    /** Signal received for the first time. */
+    typedef void (*SignalCallback)(SignalTransport* transport, uint8_t source, uint8_t id, const uint8_t* params,
+                                   size_t size);
+
+    /** Signal was not delivered. */
+    typedef void (*FailedCallback)(SignalTransport* transport, uint8_t address, uint8_t id, Status status);
+
+private:
+    static constexpr uint8_t SYNC = 0x80;
+    static constexpr uint8_t SEQUENCE_MASK = 0x7F;
+    static constexpr int HISTORY_SIZE = 32;
+    static constexpr size_t HEADER_SIZE = 4;
+    static constexpr size_t ACK_SIZE = 8;
+
+    struct Pending {
+        bool used;
+        uint8_t retries;
+        uint8_t size;
+        uint32_t sentTime;
+        uint8_t message[HEADER_SIZE + MAX_PARAMS_SIZE];
+    };
+
+    struct Destination {
+        uint8_t address;
+        uint8_t nextSequence;
+        bool synced; // Some ACK was received, so the destination knows the sequence
+        Pending pending[WINDOW];
+    };
+
+    struct Source {
+        uint8_t address;
+        uint8_t highest;
+        uint32_t history;
+        uint32_t lastTime;
+        bool ackPending;
+        bool mismatch; // Some signal since the last ACK had other tableId
+    };
+
+    uint8_t tableId;
+    SendCallback sendCallback;
+    SignalCallback signalCallback;
+    FailedCallback failedCallback;
+    Destination destinations[MAX_DESTINATIONS];
+    Source sources[MAX_SOURCES];
+    DelayedWork retransmitWork;
+    DelayedWork ackWork;
+
+    static void retransmitCallback(DelayedWork* work);
+    static void ackCallback(DelayedWork* work);
+    void retransmit();
+    void sendAcks();
+    void scheduleRetransmit();
+    Destination* destination(uint8_t address);
+    Source* source(uint8_t address);
+    void receivedSignal(uint8_t address, const uint8_t* message, size_t size);
+    void receivedAck(uint8_t address, const uint8_t* message, size_t size);
+
+public:
+    size_t retransmissions; // Statistics only
+    size_t duplicates;
+    size_t acksSent;
+
+    /** Transport of the device with the tableId of its signal table. */
+    SignalTransport(uint8_t tableId, SendCallback sendCallback, SignalCallback signalCallback,
+                    FailedCallback failedCallback);
+
+    /**
+     * Sends the signal from the destination's table with the given tableId. Returns false if the window to
+     * the destination is full or there is no free destination, the caller should try again after some ACK.
+     */
+    bool send(uint8_t address, uint8_t destinationTableId, uint8_t id, const uint8_t* params, size_t size);
+
+    /** Processes received SIGNAL or SIGNAL_ACK. Returns false for other messages. */
+    bool receive(uint8_t address, const uint8_t* message, size_t size);
+
+    /** Number of signals to the address waiting for ACK. */
+    int inFlight(uint8_t address) const;
+};
+
+
+#endif // SIGNALTRANSPORT_HH
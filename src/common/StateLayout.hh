@@ -0,0 +1,204 @@
+#ifndef STATELAYOUT_HH
+#define STATELAYOUT_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "StateTable.hh"
+#include "CRC32.hh"
+
+
+/**
+ * State table layout and export name table computed at compile time.
+ *
+ * The application declares its exports once as a constexpr array, ExportTable assigns the bit locations
+ * of the data objects in order. The table is const, so it stays in flash, and StateField accessors use
+ * the constant location and width, which compile to fixed shifts and masks:
+ *
+ *      constexpr ExportTable exports({
+ *          exportData<bool>("light-switch"),
+ *          exportData<uint8_t>("light-level", 7),
+ *          exportSignal("room-cloud-switch"),
+ *      });
+ *      StateTable state(TABLE_ID, exports.bits);
+ *      StateField<exports, 1, uint8_t>::set(state, 100);
+ *
+ * Each name has its CRC32 computed at compile time. IMPORT_BY_HASH carries just the hash, so the frame
+ * does not depend on the name length:
+ *
+ *      IMPORT:         | Type = 1 | name len | NAME |
+ *      IMPORT_BY_HASH: | Type = 8 | name hash (4, LE) |
+ *
+ * The table keeps its indexes sorted by hash, so both are looked up by a binary search. IMPORT compares
+ * the names only when the hash matches. A hash alone may match other name, so the importer must compare
+ * the name in EXPORT with its own.
+ */
+
+enum ExportKind: uint8_t {
+    EXPORT_KIND_DATA = 0,
+    EXPORT_KIND_SIGNAL = 1,
+};
+
+template<typename T>
+struct TypeInfo { };
+
+template<>
+struct TypeInfo<bool> {
+    static constexpr uint8_t id = 1;
+    static constexpr uint8_t bits = 1;
+};
+
+template<>
+struct TypeInfo<uint8_t> {
+    static constexpr uint8_t id = 2;
+    static constexpr uint8_t bits = 8;
+};
+
+template<>
+struct TypeInfo<uint16_t> {
+    static constexpr uint8_t id = 3;
+    static constexpr uint8_t bits = 16;
+};
+
+template<>
+struct TypeInfo<uint32_t> {
+    static constexpr uint8_t id = 4;
+    static constexpr uint8_t bits = 32;
+};
+
+constexpr size_t nameLength(const char* name)
+{
+    size_t length = 0;
+    while (name[length] != 0) {
+        length++;
+    }
+    return length;
+}
+
+constexpr uint32_t nameHash(const char* name)
+{
+    return CRC32::calculateConstant(name, nameLength(name));
+}
+
+/* Item of the export name table, as reported in EXPORT */
+struct ExportInfo {
+    const char* name;
+    uint32_t nameHash;
+    ExportKind kind;
+    uint8_t typeId; // Data only
+    uint8_t bits;
+    uint16_t location; // Assigned by ExportTable
+};
+
+/** Data object of type T, the number of bits may be smaller than the type size. */
+template<typename T>
+constexpr ExportInfo exportData(const char* name, uint8_t bits = TypeInfo<T>::bits)
+{
+    return { name, nameHash(name), EXPORT_KIND_DATA, TypeInfo<T>::id, bits, 0 };
+}
+
+/** Signal object, it has no place in the state. */
+constexpr ExportInfo exportSignal(const char* name)
+{
+    return { name, nameHash(name), EXPORT_KIND_SIGNAL, 0, 0, 0 };
+}
+
+template<size_t N>
+struct ExportTable {
+    static_assert(N <= 255, "Index must fit in IMPORT_BY_INDEX");
+
+    static constexpr size_t count = N;
+    static constexpr uint8_t TYPE_IMPORT = 1;
+    static constexpr uint8_t TYPE_IMPORT_BY_HASH = 8;
+
+    ExportInfo items[N];
+    uint8_t byHash[N]; // Indexes sorted by name hash
+    size_t bits; // State size
+
+    constexpr ExportTable(const ExportInfo (&declared)[N]) :
+        items{},
+        byHash{},
+        bits(0)
+    {
+        for (size_t i = 0; i < N; i++) {
+            items[i] = declared[i];
+            if (items[i].kind == EXPORT_KIND_DATA) {
+                items[i].location = bits;
+                bits += items[i].bits;
+            }
+            size_t j = i;
+            for (; j > 0 && items[byHash[j - 1]].nameHash > items[i].nameHash; j--) {
+                byHash[j] = byHash[j - 1];
+            }
+            byHash[j] = (uint8_t)i;
+        }
+    }
+
+    constexpr const ExportInfo& operator[](size_t index) const { return items[index]; }
+
+    /** Returns the index of the export with the hash and the name (if not nullptr), or -1. */
+    constexpr int find(uint32_t hash, const char* name = nullptr, size_t length = 0) const
+    {
+        size_t low = 0;
+        size_t high = N;
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            if (items[byHash[middle]].nameHash < hash) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        for (; low < N && items[byHash[low]].nameHash == hash; low++) {
+            if (name == nullptr || sameName(items[byHash[low]].name, name, length)) {
+                return byHash[low];
+            }
+        }
+        return -1;
+    }
+
+    constexpr int find(const char* name, size_t length) const
+    {
+        return find(CRC32::calculateConstant(name, length), name, length);
+    }
+
+    /** Returns the index of the export requested by IMPORT or IMPORT_BY_HASH, or -1. */
+    int lookup(const uint8_t* message, size_t size) const
+    {
+        if (size >= 2 && message[0] == TYPE_IMPORT && size >= 2 + (size_t)message[1]) {
+            return find((const char*)&message[2], message[1]);
+        } else if (size >= 5 && message[0] == TYPE_IMPORT_BY_HASH) {
+            return find(message[1] | message[2] << 8 | message[3] << 16 | (uint32_t)message[4] << 24);
+        }
+        return -1;
+    }
+
+private:
+    static constexpr bool sameName(const char* name, const char* other, size_t length)
+    {
+        for (size_t i = 0; i < length; i++) {
+            if (name[i] == 0 || name[i] != other[i]) {
+                return false;
+            }
+        }
+        return name[length] == 0;
+    }
+};
+
+/** Accessors of a data object at a location known at compile time. */
+template<const auto& TABLE, size_t INDEX, typename T>
+struct StateField {
+    static_assert(INDEX < TABLE.count, "No such export");
+    static_assert(TABLE[INDEX].kind == EXPORT_KIND_DATA, "Signals are not in the state");
+    static_assert(TABLE[INDEX].typeId == TypeInfo<T>::id, "Type does not match the export");
+    static_assert(TABLE.bits <= StateTable::MAX_SIZE * 8, "State does not fit in STATE packet");
+
+    static constexpr size_t LOCATION = TABLE[INDEX].location;
+    static constexpr size_t BITS = TABLE[INDEX].bits;
+
+    static void set(StateTable& table, T value) { table.setField<LOCATION, BITS>(value); }
+    static T get(const StateTable& table) { return (T)table.getField<LOCATION, BITS>(); }
+};
+
+
+#endif // STATELAYOUT_HH
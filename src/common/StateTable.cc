@@ -0,0 +1,147 @@
+
+#include "StateTable.hh"
+#include <cstring>
+
+
+StateTable::StateTable(uint8_t tableId, size_t bits) :
+    size((bits + 7) / 8),
+    counter(0),
+    tableId(tableId),
+    valid(false),
+    missedDeltas(0)
+{
+    std::memset(data, 0, sizeof(data));
+    std::memset(dirty, 0, sizeof(dirty));
+}
+
+void StateTable::set(size_t location, size_t bits, uint32_t value)
+{
+    for (size_t i = 0; i < bits; i++) {
+        size_t index = (location + i) / 8;
+        uint8_t mask = 1 << ((location + i) % 8);
+        uint8_t bit = (value >> i) & 1 ? mask : 0;
+        if ((data[index] & mask) != bit) {
+            data[index] ^= mask;
+            setDirty(index);
+        }
+    }
+}
+
+uint32_t StateTable::get(size_t location, size_t bits) const
+{
+    uint32_t value = 0;
+    for (size_t i = 0; i < bits; i++) {
+        size_t index = (location + i) / 8;
+        value |= (uint32_t)((data[index] >> ((location + i) % 8)) & 1) << i;
+    }
+    return value;
+}
+
+bool StateTable::changed() const
+{
+    for (auto word : dirty) {
+        if (word != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint8_t StateTable::nextCounter(uint8_t counter)
+{
+    // Zero is never sent, STATE resets the counter to it
+    return counter == 0xFF ? 1 : counter + 1;
+}
+
+size_t StateTable::buildUpdate(uint8_t* buffer)
+{
+    if (!changed()) {
+        return 0;
+    }
+    buffer[0] = TYPE_STATE_DELTA;
+    buffer[1] = tableId;
+    buffer[2] = nextCounter(counter);
+    size_t messageSize = 3;
+    size_t index = 0;
+    while (index < size) {
+        if (!isDirty(index)) {
+            index++;
+            continue;
+        }
+        // Unchanged bytes between two ranges are sent too if it is shorter than a new range header
+        size_t end = index + 1;
+        for (size_t next = end; next < size && next <= end + RANGE_HEADER_SIZE; next++) {
+            if (isDirty(next)) {
+                end = next + 1;
+            }
+        }
+        if (messageSize + RANGE_HEADER_SIZE + end - index >= 2 + size) {
+            // Not shorter than STATE
+            return buildFull(buffer);
+        }
+        buffer[messageSize++] = index;
+        buffer[messageSize++] = end - index;
+        std::memcpy(&buffer[messageSize], &data[index], end - index);
+        messageSize += end - index;
+        index = end;
+    }
+    counter = buffer[2];
+    std::memset(dirty, 0, sizeof(dirty));
+    return messageSize;
+}
+
+size_t StateTable::buildFull(uint8_t* buffer)
+{
+    buffer[0] = TYPE_STATE;
+    buffer[1] = tableId;
+    std::memcpy(&buffer[2], data, size);
+    std::memset(dirty, 0, sizeof(dirty));
+    counter = 0;
+    return 2 + size;
+}
+
+bool StateTable::receive(const uint8_t* message, size_t messageSize)
+{
+    if (messageSize < 2 || message[1] != tableId) {
+        valid = false;
+        return false;
+    }
+    if (message[0] == TYPE_STATE) {
+        if (messageSize - 2 > MAX_SIZE) {
+            valid = false;
+            return false;
+        }
+        size = messageSize - 2;
+        std::memcpy(data, &message[2], size);
+        counter = 0;
+        valid = true;
+        return true;
+    }
+    if (message[0] != TYPE_STATE_DELTA || messageSize < 3) {
+        return false;
+    }
+    if (valid && message[2] != nextCounter(counter)) {
+        missedDeltas++;
+        valid = false;
+    }
+    counter = message[2];
+    if (!valid) {
+        return false;
+    }
+    for (size_t i = 3; i < messageSize;) {
+        if (i + RANGE_HEADER_SIZE > messageSize) {
+            valid = false;
+            return false;
+        }
+        size_t offset = message[i];
+        size_t length = message[i + 1];
+        i += RANGE_HEADER_SIZE;
+        if (offset + length > size || i + length > messageSize) {
+            valid = false;
+            return false;
+        }
+        std::memcpy(&data[offset], &message[i], length);
+        i += length;
+    }
+    return true;
+}
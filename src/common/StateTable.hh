@@ -0,0 +1,109 @@
+#ifndef STATETABLE_HH
+#define STATETABLE_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/**
+ * Exported state of a device, the fields are packed as bit ranges (LSB first) at their locations.
+ *
+ * The table keeps a bitmap of the bytes changed since the last message. A change is sent as
+ * STATE_DELTA with just the changed byte ranges, the whole table is sent as STATE by a periodic timer,
+ * so a receiver that missed a delta is valid again after the next one.
+ *
+ *      STATE:       | Type = 4 | tableId | state data |
+ *      STATE_DELTA: | Type = 7 | tableId | counter | ranges: | offset | length | state data bytes | ... |
+ *
+ * The counter is 1 in the first STATE_DELTA after STATE and wraps from 255 to 1.
+ *
+ * The same class holds a copy of other device's state on the receiving side.
+ */
+class StateTable
+{
+public:
+    static constexpr size_t MAX_SIZE = 240; // State data bytes, STATE must fit in a packet
+    static constexpr size_t MAX_MESSAGE_SIZE = 3 + MAX_SIZE + 2; // STATE_DELTA with a single range
+    static constexpr uint8_t TYPE_STATE = 4;
+    static constexpr uint8_t TYPE_STATE_DELTA = 7;
+
+private:
+    static constexpr size_t RANGE_HEADER_SIZE = 2;
+
+    uint8_t data[MAX_SIZE];
+    uint32_t dirty[(MAX_SIZE + 31) / 32]; // One bit for each byte of data
+    size_t size;
+    uint8_t counter; // Of the last STATE_DELTA sent or received
+
+    bool isDirty(size_t index) const { return dirty[index / 32] & (1u << (index % 32)); }
+    void setDirty(size_t index) { dirty[index / 32] |= 1u << (index % 32); }
+    static uint8_t nextCounter(uint8_t counter);
+
+    /* Bits of the field in the byte at index */
+    static constexpr uint8_t fieldMask(size_t location, size_t bits, size_t index) {
+        size_t begin = location > index * 8 ? location - index * 8 : 0;
+        size_t end = location + bits < (index + 1) * 8 ? location + bits - index * 8 : 8;
+        return (0xFF << begin) & (0xFF >> (8 - end));
+    }
+
+public:
+    uint8_t tableId;
+    bool valid; // Receiving side: values are up to date
+    size_t missedDeltas; // Statistics only
+
+    /** Table of the given size in bits, the size is 0 on the receiving side until the first STATE. */
+    StateTable(uint8_t tableId, size_t bits = 0);
+
+    /** Sets the field and marks its bytes as changed if its value is different. */
+    void set(size_t location, size_t bits, uint32_t value);
+
+    /** Returns the field value. */
+    uint32_t get(size_t location, size_t bits) const;
+
+    /** Same as set(), but the constant location and size make it a few shifts and masks. */
+    template<size_t LOCATION, size_t BITS>
+    void setField(uint32_t value) {
+        static_assert(BITS > 0 && BITS <= 32 && LOCATION + BITS <= MAX_SIZE * 8, "Invalid field");
+        for (size_t index = LOCATION / 8; index <= (LOCATION + BITS - 1) / 8; index++) {
+            uint8_t mask = fieldMask(LOCATION, BITS, index);
+            uint8_t bits = index * 8 >= LOCATION ? value >> (index * 8 - LOCATION) : value << (LOCATION - index * 8);
+            if ((data[index] ^ bits) & mask) {
+                data[index] ^= (data[index] ^ bits) & mask;
+                setDirty(index);
+            }
+        }
+    }
+
+    /** Same as get(), but the constant location and size make it a few shifts and masks. */
+    template<size_t LOCATION, size_t BITS>
+    uint32_t getField() const {
+        static_assert(BITS > 0 && BITS <= 32 && LOCATION + BITS <= MAX_SIZE * 8, "Invalid field");
+        uint32_t value = 0;
+        for (size_t index = LOCATION / 8; index <= (LOCATION + BITS - 1) / 8; index++) {
+            uint32_t bits = data[index] & fieldMask(LOCATION, BITS, index);
+            value |= index * 8 >= LOCATION ? bits << (index * 8 - LOCATION) : bits >> (LOCATION - index * 8);
+        }
+        return value;
+    }
+
+    /** True if some field was changed since the last message. */
+    bool changed() const;
+
+    /**
+     * Writes STATE_DELTA with the changed bytes to the buffer of MAX_MESSAGE_SIZE bytes, or STATE if it is
+     * not longer. Returns the message size or 0 if nothing changed.
+     */
+    size_t buildUpdate(uint8_t* buffer);
+
+    /** Writes STATE with all fields to the buffer of MAX_MESSAGE_SIZE bytes. Returns the message size. */
+    size_t buildFull(uint8_t* buffer);
+
+    /**
+     * Applies STATE or STATE_DELTA received from the device exporting the table. Returns false if the message
+     * does not match the table or a STATE_DELTA was missed, then the table is invalid until the next STATE.
+     */
+    bool receive(const uint8_t* message, size_t messageSize);
+};
+
+
+#endif // STATETABLE_HH
@@ -70,6 +70,9 @@ void UART::consumeBytes()
             memcpy(tmp, &rxBuffer[rxReadIndex], rxBufferSize - rxReadIndex);
             tmp[rxBufferSize - rxReadIndex] = '\0';
             //myprintf("tail %d -> %d = %d '%s' %d\n", rxReadIndex, rxWriteIndex, rxBufferSize - rxReadIndex, tmp, uartIRQCalled);
+            if (rawCallback != nullptr) {
+                rawCallback(this, &rxBuffer[rxReadIndex], rxBufferSize - rxReadIndex);
+            }
             notify = rxQueue.write(&rxBuffer[rxReadIndex], rxBufferSize - rxReadIndex) || notify;
             totalBytesReceived += rxBufferSize - rxReadIndex;
             rxReadIndex = 0;
@@ -78,6 +81,9 @@ void UART::consumeBytes()
             memcpy(tmp, &rxBuffer[rxReadIndex], rxWriteIndex - rxReadIndex);
             tmp[rxWriteIndex - rxReadIndex] = '\0';
             //myprintf("buff %d -> %d = %d '%s' %d\n", rxReadIndex, rxWriteIndex, rxWriteIndex - rxReadIndex, tmp, uartIRQCalled);
+            if (rawCallback != nullptr) {
+                rawCallback(this, &rxBuffer[rxReadIndex], rxWriteIndex - rxReadIndex);
+            }
             notify = rxQueue.write(&rxBuffer[rxReadIndex], rxWriteIndex - rxReadIndex) || notify;
             totalBytesReceived += rxWriteIndex - rxReadIndex;
             rxReadIndex = rxWriteIndex;
@@ -93,7 +99,9 @@ void UART::consumeBytes()
 
     if (notify) {
         //myprintf("Received %d -> %d\n", rxQueue.readPos, rxQueue.writePos);
-        //receiveWork.run();
+        if (receiveWork != nullptr) {
+            receiveWork->run();
+        }
     }
 
     if (received) {
@@ -23,6 +23,10 @@ private:
 
 public:
     PacketInQueue rxQueue;
+    Work* receiveWork = nullptr; // Notified when a complete packet is in the rxQueue, e.g. Router processing
+
+    typedef void (*RawCallback)(UART* uart, const uint8_t* data, size_t size);
+    RawCallback rawCallback = nullptr; // Gets the bytes before the rxQueue, e.g. Router cut-through forwarding
 
     UART(UART_HandleTypeDef* huart);
 
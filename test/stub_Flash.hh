@@ -0,0 +1,79 @@
+#ifndef STUB_FLASH_HH
+#define STUB_FLASH_HH
+
+// Included in the isolated namespace, after <cstring> and <random>
+
+/* NOR flash, writes can only clear bits. Power is lost during the selected operation. */
+struct SimulatedFlash {
+    static constexpr size_t PAGE_SIZE = 1024;
+    static constexpr int NEVER = -1;
+
+    uint8_t memory[2 * PAGE_SIZE];
+    size_t pageErases[2];
+    int operationsLeft; // Operations completed before the power is lost
+    bool powerLost;
+    std::mt19937 random;
+
+    void reset(int powerLossAt = NEVER) {
+        std::memset(memory, 0xFF, sizeof(memory));
+        pageErases[0] = pageErases[1] = 0;
+        operationsLeft = powerLossAt;
+        powerLost = false;
+        random.seed(1234);
+    }
+
+    // Returns true if the operation is interrupted
+    bool interrupted() {
+        if (powerLost) {
+            return true;
+        }
+        if (operationsLeft == 0) {
+            powerLost = true;
+            return true;
+        }
+        if (operationsLeft > 0) {
+            operationsLeft--;
+        }
+        return false;
+    }
+};
+
+SimulatedFlash simulated;
+
+void simulatedErase(uint8_t* page, size_t size)
+{
+    if (simulated.powerLost) {
+        return;
+    }
+    if (simulated.interrupted()) {
+        for (size_t i = 0; i < size; i++) {
+            // Some bytes are erased already
+            if (simulated.random() & 1) {
+                page[i] = 0xFF;
+            }
+        }
+        return;
+    }
+    std::memset(page, 0xFF, size);
+    simulated.pageErases[(page - simulated.memory) / SimulatedFlash::PAGE_SIZE]++;
+}
+
+void simulatedWrite(uint8_t* address, uint64_t value)
+{
+    if (simulated.powerLost) {
+        return;
+    }
+    uint64_t current;
+    std::memcpy(&current, address, sizeof(current));
+    EXPECT_EQ(current, 0xFFFFFFFFFFFFFFFF) << "Writing to a not erased double word";
+    EXPECT_EQ((address - simulated.memory) % 8, 0u);
+    if (simulated.interrupted()) {
+        // Some bits are not programmed
+        value |= (uint64_t)simulated.random() << 32 | simulated.random();
+    }
+    current &= value;
+    std::memcpy(address, &current, sizeof(current));
+}
+
+
+#endif // STUB_FLASH_HH
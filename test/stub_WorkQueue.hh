@@ -0,0 +1,193 @@
+#ifndef STUB_WORKQUEUE_HH
+#define STUB_WORKQUEUE_HH
+
+// Included in the isolated namespace, after <algorithm>, <vector> and src/common/Time.hh
+
+#define WORKQUEUE_HH
+
+/*
+ * Work queue with the states and rescheduling rules of src/common/WorkQueue.cc, driven by the simulated
+ * time instead of the main loop. Delayed works are queued when Time::cachedTime reaches them.
+ */
+class Work;
+class DelayedWork;
+
+struct SimulatedWorkQueue {
+    std::vector<Work*> queued;
+    std::vector<DelayedWork*> delayed; // Sorted by the timestamp, same timestamps in the scheduling order
+
+    void reset() {
+        queued.clear();
+        delayed.clear();
+    }
+};
+
+SimulatedWorkQueue workQueue;
+
+class Work
+{
+public:
+    enum Priority: int8_t {
+        LOW = 0,
+        NORMAL = 1,
+        HIGH = 2,
+        DELAYED_IRQ = 3,
+    };
+
+protected:
+    enum {
+        IDLE = 0,
+        RUNNING = 1,
+        QUEUED = 2,
+        SCHEDULED = 3,
+    } state;
+    Priority priority;
+
+    void remove() {
+        auto& queued = workQueue.queued;
+        queued.erase(std::remove(queued.begin(), queued.end(), this), queued.end());
+    }
+
+public:
+    typedef void (*Callback)(Work*);
+    Callback callback;
+
+    Work(Callback callback, Priority priority = NORMAL) : state(IDLE), priority(priority), callback(callback) { }
+
+    ~Work() {
+        remove();
+    }
+
+    void run() {
+        if (state != QUEUED) {
+            workQueue.queued.push_back(this);
+            state = QUEUED;
+        }
+    }
+
+    void cancel() {
+        if (state == QUEUED) {
+            remove();
+            state = IDLE;
+        }
+    }
+
+    bool queued() const { return state == QUEUED; }
+
+    /* Runs the queued works, the highest priority first, until the queue is empty. Returns the number of runs. */
+    static int runQueued() {
+        int count = 0;
+        auto& queued = workQueue.queued;
+        while (!queued.empty()) {
+            auto work = queued.begin();
+            for (auto other = queued.begin(); other != queued.end(); other++) {
+                if ((*other)->priority > (*work)->priority) {
+                    work = other;
+                }
+            }
+            Work* running = *work;
+            queued.erase(work);
+            running->state = RUNNING;
+            running->callback(running);
+            if (running->state == RUNNING) {
+                running->state = IDLE;
+            }
+            count++;
+        }
+        return count;
+    }
+};
+
+class DelayedWork : public Work
+{
+private:
+    uint32_t timestamp;
+
+    void unschedule() {
+        auto& delayed = workQueue.delayed;
+        delayed.erase(std::remove(delayed.begin(), delayed.end(), this), delayed.end());
+        Work::remove();
+    }
+
+public:
+    typedef void (*Callback)(DelayedWork*);
+
+    DelayedWork(Callback callback, Priority priority = NORMAL) : Work((Work::Callback)(void*)callback, priority) { }
+
+    ~DelayedWork() {
+        unschedule();
+    }
+
+    void run() = delete;
+
+    void run(int32_t relativeTime, bool reschedule = true) {
+        uint32_t absoluteTime = Time::get32() + relativeTime;
+        if (state == RUNNING) {
+            absoluteTime = timestamp + relativeTime;
+        }
+        runAbs(absoluteTime, reschedule);
+    }
+
+    void runAbs(uint32_t absoluteTime, bool reschedule = true) {
+        if (state == QUEUED || state == SCHEDULED) {
+            if (!reschedule) {
+                return;
+            }
+            unschedule();
+            state = IDLE;
+        }
+        auto& delayed = workQueue.delayed;
+        auto item = delayed.begin();
+        while (item != delayed.end() && (int32_t)((*item)->timestamp - absoluteTime) <= 0) {
+            item++;
+        }
+        delayed.insert(item, this);
+        timestamp = absoluteTime;
+        state = SCHEDULED;
+    }
+
+    void cancel() {
+        if (state == SCHEDULED || state == QUEUED) {
+            unschedule();
+            state = IDLE;
+        }
+    }
+
+    bool scheduled() const { return state == SCHEDULED || state == QUEUED; }
+
+    /* Time of the first scheduled work, returns false if there is none. */
+    static bool next(uint32_t& time) {
+        if (workQueue.delayed.empty()) {
+            return false;
+        }
+        time = workQueue.delayed.front()->timestamp;
+        return true;
+    }
+
+    /* Queues the delayed works which are due now and runs all queued works. */
+    static int runDue() {
+        auto& delayed = workQueue.delayed;
+        while (!delayed.empty() && (int32_t)(delayed.front()->timestamp - Time::get32()) <= 0) {
+            auto work = delayed.front();
+            delayed.erase(delayed.begin());
+            work->state = IDLE;
+            work->Work::run();
+        }
+        return Work::runQueued();
+    }
+
+    /* Runs the works in time order up to the time, which becomes the current time. */
+    static void runUntil(uint32_t time) {
+        runDue();
+        uint32_t next;
+        while (DelayedWork::next(next) && (int32_t)(next - time) <= 0) {
+            if ((int32_t)(next - Time::get32()) > 0) {
+                Time::cachedTime = next;
+            }
+            runDue();
+        }
+        Time::cachedTime = time;
+    }
+};
+
+#endif // STUB_WORKQUEUE_HH
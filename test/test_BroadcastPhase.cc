@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "test_common.hh"
+
+BEGIN_ISOLATED_NAMESPACE
+
+#define private public
+#define protected public
+
+#include "src/common/BroadcastPhase.hh"
+#include "src/common/BroadcastPhase.cc"
+
+const uint32_t PERIOD = 1000;
+const int32_t MAX_STEP = PERIOD / BroadcastPhase::MAX_STEP_DIVIDER;
+
+TEST(BroadcastPhaseTest, noNeighbours) {
+    BroadcastPhase phase(PERIOD);
+    EXPECT_EQ(phase.sent(5000), 6000u);
+    // Too old
+    phase.received(4000);
+    EXPECT_EQ(phase.sent(5000), 6000u);
+}
+
+TEST(BroadcastPhaseTest, movesAwayWithBoundedSteps) {
+    BroadcastPhase phase(PERIOD);
+    // Neighbour broadcasts 10 ms after us
+    uint32_t time = 10000;
+    uint32_t neighbour = time + 10;
+    for (int i = 0; i < 20; i++) {
+        phase.received(neighbour - PERIOD);
+        uint32_t next = phase.sent(time);
+        EXPECT_LE(std::abs(phase.lastShift), MAX_STEP);
+        EXPECT_EQ(phase.lastShift, i < 7 ? -MAX_STEP : i == 7 ? -(490 - 7 * MAX_STEP) : 0);
+        time = next;
+        neighbour += PERIOD;
+    }
+    EXPECT_EQ(neighbour - time, PERIOD / 2);
+}
+
+TEST(BroadcastPhaseTest, evenlySpreadIsStable) {
+    BroadcastPhase phase(PERIOD);
+    for (int i = 1; i < 4; i++) {
+        phase.received(10000 - PERIOD + i * PERIOD / 4);
+    }
+    EXPECT_EQ(phase.sent(10000), 10000 + PERIOD);
+    EXPECT_EQ(phase.lastShift, 0);
+}
+
+/*
+ * Devices powered up at the same time share a bus. A frame started while other one is on the bus collides,
+ * the sender tries again after a random backoff. Collisions fall to zero in a few periods.
+ */
+TEST(BroadcastPhaseTest, collisionsFallOverTime) {
+    const int NODES = 10;
+    const int PERIODS = 40;
+    const uint32_t FRAME_MS = 3;
+    struct Node {
+        BroadcastPhase phase;
+        uint32_t due;
+        uint32_t lastSent;
+    };
+    struct Arrival {
+        uint32_t time;
+        int from;
+    };
+    std::mt19937 random(1);
+    std::vector<Node> nodes;
+    for (int i = 0; i < NODES; i++) {
+        nodes.push_back({ BroadcastPhase(PERIOD), (uint32_t)(random() % 4), 0 });
+    }
+    std::vector<Arrival> arrivals;
+    std::vector<int> collisions(PERIODS);
+    uint32_t busyUntil = 0;
+    for (uint32_t time = 0; time < PERIODS * PERIOD; time++) {
+        for (auto it = arrivals.begin(); it != arrivals.end();) {
+            if (it->time == time) {
+                for (int i = 0; i < NODES; i++) {
+                    if (i != it->from) {
+                        nodes[i].phase.received(time);
+                    }
+                }
+                it = arrivals.erase(it);
+            } else {
+                it++;
+            }
+        }
+        std::vector<int> starting;
+        for (int i = 0; i < NODES; i++) {
+            if (nodes[i].due == time) {
+                starting.push_back(i);
+            }
+        }
+        if (starting.empty()) {
+            continue;
+        }
+        if (starting.size() == 1 && time >= busyUntil) {
+            auto& node = nodes[starting[0]];
+            busyUntil = time + FRAME_MS;
+            arrivals.push_back({ busyUntil, starting[0] });
+            node.lastSent = time;
+            node.due = node.phase.sent(time);
+            continue;
+        }
+        for (int i : starting) {
+            collisions[time / PERIOD]++;
+            nodes[i].due = std::max(time, busyUntil) + 1 + random() % 8;
+        }
+    }
+    EXPECT_GT(collisions[0], NODES);
+    int late = 0;
+    for (int i = PERIODS - 10; i < PERIODS; i++) {
+        late += collisions[i];
+    }
+    EXPECT_EQ(late, 0);
+
+    // Spread over the period
+    std::vector<uint32_t> phases;
+    for (auto& node : nodes) {
+        phases.push_back(node.lastSent % PERIOD);
+    }
+    std::sort(phases.begin(), phases.end());
+    uint32_t smallest = phases[0] + PERIOD - phases.back();
+    for (int i = 1; i < NODES; i++) {
+        smallest = std::min(smallest, phases[i] - phases[i - 1]);
+    }
+    EXPECT_GT(smallest, PERIOD / NODES / 2);
+}
+
+END_ISOLATED_NAMESPACE
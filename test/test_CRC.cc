@@ -1,4 +1,3 @@
-
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
 
@@ -9,7 +8,31 @@ BEGIN_ISOLATED_NAMESPACE
 #define private public
 #define protected public
 
-#include "src/CRC.hh"
-#include "src/CRC.cc"
+#include "src/common/CRC32.hh"
+#include "src/common/CRC32.cc"
+
+TEST(CRC32, checkValue) {
+    // CRC-32/BZIP2 check value, the same as calculated by the STM32 CRC unit
+    EXPECT_EQ(CRC32::calculate("123456789", 9), 0xFC891918u);
+}
+
+TEST(CRC32, empty) {
+    EXPECT_EQ(CRC32::calculate(nullptr, 0), 0x00000000u);
+}
+
+TEST(CRC32, allBytes) {
+    uint8_t data[256];
+    for (int i = 0; i < 256; i++) {
+        data[i] = (uint8_t)i;
+    }
+    uint32_t expected = 0xFFFFFFFF;
+    for (int i = 0; i < 256; i++) {
+        expected ^= (uint32_t)data[i] << 24;
+        for (int bit = 0; bit < 8; bit++) {
+            expected = (expected & 0x80000000) ? (expected << 1) ^ 0x04C11DB7 : expected << 1;
+        }
+    }
+    EXPECT_EQ(CRC32::calculate(data, sizeof(data)), ~expected);
+}
 
 END_ISOLATED_NAMESPACE
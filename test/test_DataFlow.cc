@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "test_common.hh"
+
+BEGIN_ISOLATED_NAMESPACE
+
+#define private public
+#define protected public
+
+#include "src/common/Utils.hh"
+#include "src/common/Time.hh"
+
+uint64_t Time::cachedTime = 0;
+
+#include "stub_WorkQueue.hh"
+
+#include "src/common/DataFlow.hh"
+#include "src/common/DataFlow.cc"
+
+struct Output {
+    int node;
+    int32_t value;
+};
+
+std::vector<Output> outputs;
+
+static void outputCallback(DataFlow* flow, int node, int32_t value)
+{
+    outputs.push_back({ node, value });
+}
+
+/*
+ * Scene from drafts/cppmod-v2.cpp: each light has a switch input, a cloud signal and an output.
+ * A rule copies the switch to the output when it changes, otherwise the signal when it is triggered.
+ */
+struct Light {
+    int input;
+    int signal;
+    int output;
+};
+
+Light lights[DataFlow::MAX_RULES];
+
+static void normalLight(DataFlow* flow, int rule)
+{
+    auto& light = lights[rule];
+    if (flow->changed(light.input)) {
+        flow->set(light.output, flow->get(light.input));
+    } else if (flow->changed(light.signal)) {
+        flow->set(light.output, flow->get(light.signal));
+    }
+}
+
+static void addLights(DataFlow& flow, int count)
+{
+    for (int i = 0; i < count; i++) {
+        lights[i].input = flow.addNode(0);
+        lights[i].signal = flow.addNode(0);
+        lights[i].output = flow.addNode(0, outputCallback);
+        int inputs[] = { lights[i].input, lights[i].signal };
+        EXPECT_EQ(flow.addRule(normalLight, inputs, 2), i);
+    }
+}
+
+TEST(DataFlowTest, onlyDownstreamRules) {
+    workQueue.reset();
+    outputs.clear();
+    DataFlow flow;
+    addLights(flow, 10);
+    while (flow.nodeCount < DataFlow::MAX_NODES) {
+        flow.addNode(0);
+    }
+    EXPECT_EQ(flow.addNode(0), DataFlow::NO_NODE);
+
+    // Nothing changed, nothing runs
+    EXPECT_EQ(Work::runQueued(), 0);
+    flow.set(lights[5].input, 0);
+    EXPECT_EQ(Work::runQueued(), 0);
+
+    flow.set(lights[5].input, 1);
+    EXPECT_EQ(Work::runQueued(), 1);
+    EXPECT_EQ(flow.evaluations, 1u);
+    ASSERT_EQ(outputs.size(), 1u);
+    EXPECT_EQ(outputs[0].node, lights[5].output);
+    EXPECT_EQ(outputs[0].value, 1);
+    EXPECT_FALSE(flow.changed(lights[5].input));
+
+    // Changes before the work runs are handled in one pass
+    flow.set(lights[2].input, 1);
+    flow.set(lights[7].input, 1);
+    EXPECT_EQ(Work::runQueued(), 1);
+    EXPECT_EQ(flow.passes, 2u);
+    EXPECT_EQ(flow.evaluations, 3u);
+    EXPECT_EQ(outputs.size(), 3u);
+}
+
+TEST(DataFlowTest, signalsAreTriggered) {
+    workQueue.reset();
+    outputs.clear();
+    DataFlow flow;
+    addLights(flow, 1);
+
+    flow.set(lights[0].input, 1);
+    Work::runQueued();
+    // Cloud switches the light off with the same value as the signal had
+    flow.trigger(lights[0].signal, 0);
+    Work::runQueued();
+    EXPECT_EQ(flow.evaluations, 2u);
+    ASSERT_EQ(outputs.size(), 2u);
+    EXPECT_EQ(outputs[1].value, 0);
+    EXPECT_EQ(flow.get(lights[0].output), 0);
+}
+
+int stairsInput1;
+int stairsInput2;
+int stairsSignal;
+int stairsOutput;
+int stairsExported;
+
+static void stairsLight(DataFlow* flow, int rule)
+{
+    if (flow->changed(stairsInput1) || flow->changed(stairsInput2)) {
+        flow->set(stairsOutput, flow->get(stairsInput1) ^ flow->get(stairsInput2));
+    } else if (flow->changed(stairsSignal)) {
+        flow->set(stairsOutput, flow->get(stairsSignal));
+    }
+}
+
+static void exportOutput(DataFlow* flow, int rule)
+{
+    flow->set(stairsExported, flow->get(stairsOutput));
+}
+
+TEST(DataFlowTest, chainedRulesInOnePass) {
+    workQueue.reset();
+    outputs.clear();
+    DataFlow flow;
+    stairsInput1 = flow.addNode(0);
+    stairsInput2 = flow.addNode(0);
+    stairsSignal = flow.addNode(0);
+    stairsOutput = flow.addNode(0, outputCallback);
+    stairsExported = flow.addNode(0, outputCallback);
+    int inputs[] = { stairsInput1, stairsInput2, stairsSignal };
+    EXPECT_EQ(flow.addRule(stairsLight, inputs, 3), 0);
+    EXPECT_EQ(flow.addRule(exportOutput, &stairsOutput, 1), 1);
+    int invalid = 10;
+    EXPECT_EQ(flow.addRule(exportOutput, &invalid, 1), -1);
+
+    flow.set(stairsInput2, 1);
+    EXPECT_EQ(Work::runQueued(), 1);
+    EXPECT_EQ(flow.evaluations, 2u);
+    ASSERT_EQ(outputs.size(), 2u);
+    EXPECT_EQ(outputs[0].node, stairsOutput);
+    EXPECT_EQ(outputs[1].node, stairsExported);
+    EXPECT_EQ(flow.get(stairsExported), 1);
+
+    // Output does not change, so the export rule is not evaluated
+    flow.set(stairsInput1, 1);
+    flow.set(stairsInput2, 0);
+    EXPECT_EQ(Work::runQueued(), 1);
+    EXPECT_EQ(flow.evaluations, 3u);
+    EXPECT_EQ(outputs.size(), 2u);
+}
+
+int toggleNode;
+
+static void toggleTwice(DataFlow* flow, int rule)
+{
+    flow->set(toggleNode, !flow->get(toggleNode));
+    flow->set(toggleNode, !flow->get(toggleNode));
+}
+
+static void setOne(DataFlow* flow, int rule)
+{
+    flow->set(toggleNode, 1);
+}
+
+static void setTwo(DataFlow* flow, int rule)
+{
+    flow->set(toggleNode, 2);
+}
+
+TEST(DataFlowTest, outputsCoalesced) {
+    workQueue.reset();
+    outputs.clear();
+    DataFlow flow;
+    int input = flow.addNode(0);
+    toggleNode = flow.addNode(0, outputCallback);
+    flow.addRule(toggleTwice, &input, 1);
+    flow.set(input, 1);
+    Work::runQueued();
+    EXPECT_EQ(flow.evaluations, 1u);
+    EXPECT_EQ(outputs.size(), 0u);
+
+    // Two rules writing the same output
+    flow.addRule(setOne, &input, 1);
+    flow.addRule(setTwo, &input, 1);
+    flow.set(input, 2);
+    Work::runQueued();
+    EXPECT_EQ(flow.evaluations, 4u);
+    ASSERT_EQ(outputs.size(), 1u);
+    EXPECT_EQ(outputs[0].value, 2);
+}
+
+int cycleNodes[2];
+
+static void increment(DataFlow* flow, int rule)
+{
+    int32_t value = flow->get(cycleNodes[rule]);
+    if (value < 5) {
+        flow->set(cycleNodes[1 - rule], value + 1);
+    }
+}
+
+TEST(DataFlowTest, cycleRunsInNextPass) {
+    workQueue.reset();
+    outputs.clear();
+    DataFlow flow;
+    cycleNodes[0] = flow.addNode(0);
+    cycleNodes[1] = flow.addNode(0);
+    flow.addRule(increment, &cycleNodes[0], 1);
+    flow.addRule(increment, &cycleNodes[1], 1);
+
+    flow.schedule(0);
+    // Each pass evaluates both rules once, other work can run between the passes
+    EXPECT_EQ(Work::runQueued(), 3);
+    EXPECT_EQ(flow.evaluations, 6u);
+    EXPECT_EQ(flow.get(cycleNodes[0]), 4);
+    EXPECT_EQ(flow.get(cycleNodes[1]), 5);
+    EXPECT_EQ(flow.changedNodes, 0u);
+}
+
+/*
+ * Busy scene with 20 lights. Polling evaluates every rule in each 10 ms update, the dataflow only the ones
+ * with a changed input.
+ */
+TEST(DataFlowTest, costScalesWithActivity) {
+    workQueue.reset();
+    outputs.clear();
+    DataFlow flow;
+    const int LIGHTS = 20;
+    addLights(flow, LIGHTS);
+
+    const int UPDATES = 6000; // One minute
+    uint32_t polled = 0;
+    srand(1);
+    for (int i = 0; i < UPDATES; i++) {
+        // About one switch press per second in the whole scene
+        if (rand() % 100 == 0) {
+            int light = rand() % LIGHTS;
+            flow.set(lights[light].input, !flow.get(lights[light].input));
+        }
+        Work::runQueued();
+        polled += LIGHTS;
+    }
+    printf("Rule evaluations in one minute: polling %u, dataflow %u in %u passes, %u output updates\n",
+           polled, flow.evaluations, flow.passes, flow.outputUpdates);
+    EXPECT_EQ(flow.evaluations, flow.passes);
+    EXPECT_EQ(flow.outputUpdates, flow.evaluations);
+    EXPECT_LT(flow.evaluations * 1000, polled);
+}
+
+END_ISOLATED_NAMESPACE
@@ -0,0 +1,111 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "test_common.hh"
+
+BEGIN_ISOLATED_NAMESPACE
+
+#define private public
+#define protected public
+
+#include "src/common/CRC32.hh"
+#include "src/common/CRC32.cc"
+#include "bootloader/host/Frame.hh"
+#include "bootloader/host/Frame.cc"
+
+static std::vector<std::vector<uint8_t>> decodeAll(Frame::Decoder& decoder, const std::vector<uint8_t>& stream)
+{
+    std::vector<std::vector<uint8_t>> frames;
+    for (auto byte : stream) {
+        if (decoder.push(byte)) {
+            frames.push_back(decoder.data());
+        }
+    }
+    return frames;
+}
+
+TEST(Frame, plainData) {
+    std::vector<uint8_t> data = { 0x21, 0x88, 0x00, 0x01 };
+    std::vector<uint8_t> stream;
+    Frame::encode(data.data(), data.size(), true, stream);
+    ASSERT_EQ(stream.size(), data.size() + 8);
+    EXPECT_EQ(stream[0], Frame::ESC);
+    EXPECT_EQ(stream[1], 0);
+    EXPECT_EQ(stream[stream.size() - 2], Frame::ESC);
+    EXPECT_EQ(stream[stream.size() - 1], Frame::END);
+    Frame::Decoder decoder;
+    auto frames = decodeAll(decoder, stream);
+    ASSERT_EQ(frames.size(), 1);
+    EXPECT_EQ(frames[0], data);
+}
+
+TEST(Frame, maskedData) {
+    // All byte values except two, so the mask has to avoid many symbols
+    std::vector<uint8_t> data;
+    for (int i = 0; i < 256 && data.size() < Frame::MAX_DATA_SIZE; i++) {
+        if (i != 0x55 && i != 0xAA) {
+            data.push_back((uint8_t)(255 - i));
+        }
+    }
+    std::vector<uint8_t> stream;
+    Frame::encode(data.data(), data.size(), false, stream);
+    EXPECT_NE(stream[1], 0);
+    for (size_t i = 1; i < stream.size() - 1; i++) {
+        EXPECT_NE(stream[i], Frame::ESC);
+    }
+    Frame::Decoder decoder;
+    auto frames = decodeAll(decoder, stream);
+    ASSERT_EQ(frames.size(), 1);
+    EXPECT_EQ(frames[0], data);
+}
+
+TEST(Frame, crcOfOtherForm) {
+    std::vector<uint8_t> data = { 0x21, 0x88, 0x05, 0x30, 0xFF };
+    std::vector<uint8_t> forwarded = { 0x21, 0x88, 0x00, 0x01, 0xFF };
+    std::vector<uint8_t> stream;
+    Frame::encode(data.data(), data.size(), true, stream, forwarded.data());
+    // Replace the fields the same way as the router does, the CRC must match then
+    auto mask = stream[1];
+    stream[4] = forwarded[2] ^ mask;
+    stream[5] = forwarded[3] ^ mask;
+    for (size_t i = 1; i < stream.size() - 2; i++) {
+        EXPECT_NE(stream[i], Frame::ESC);
+    }
+    Frame::Decoder decoder;
+    auto frames = decodeAll(decoder, stream);
+    ASSERT_EQ(frames.size(), 1);
+    EXPECT_EQ(frames[0], forwarded);
+}
+
+TEST(Frame, consecutiveFramesAndNoise) {
+    std::vector<uint8_t> first = { 1, 2, 3 };
+    std::vector<uint8_t> second = { 4, 5, 6, 7 };
+    std::vector<uint8_t> stream = { 0x12, 0x34, Frame::END };
+    Frame::encode(first.data(), first.size(), false, stream);
+    // Closing ESC of the first frame starts the second one
+    stream.pop_back();
+    Frame::encode(second.data(), second.size(), true, stream);
+    Frame::Decoder decoder;
+    auto frames = decodeAll(decoder, stream);
+    ASSERT_EQ(frames.size(), 2);
+    EXPECT_EQ(frames[0], first);
+    EXPECT_EQ(frames[1], second);
+    EXPECT_EQ(decoder.errors(), 0);
+}
+
+TEST(Frame, corruptedFrame) {
+    std::vector<uint8_t> data = { 1, 2, 3, 4, 5 };
+    std::vector<uint8_t> stream;
+    Frame::encode(data.data(), data.size(), true, stream);
+    stream[4] ^= 0x10;
+    Frame::encode(data.data(), data.size(), true, stream);
+    Frame::Decoder decoder;
+    auto frames = decodeAll(decoder, stream);
+    ASSERT_EQ(frames.size(), 1);
+    EXPECT_EQ(frames[0], data);
+    EXPECT_EQ(decoder.errors(), 1);
+}
+
+END_ISOLATED_NAMESPACE
@@ -10,8 +10,11 @@ BEGIN_ISOLATED_NAMESPACE
 #define private public
 #define protected public
 
-#include "src/IRQ.hh"
-#include "src/IRQ.cc"
+#define HW_HH
+#define __COMPILER_BARRIER()
+
+#include "src/common/IRQ.hh"
+#include "src/common/IRQ.cc"
 
 TEST(IRQ, Guard) {
     {
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "test_common.hh"
+
+BEGIN_ISOLATED_NAMESPACE
+
+#define private public
+#define protected public
+
+#include "src/common/CRC32.hh"
+#include "src/common/CRC32.cc"
+#include "src/common/StateTable.hh"
+#include "src/common/StateLayout.hh"
+#include "src/common/FlashLog.hh"
+#include "src/common/FlashLog.cc"
+#include "src/common/ImportCache.hh"
+#include "src/common/ImportCache.cc"
+
+#include "stub_Flash.hh"
+
+const FlashArea flash = { simulated.memory, SimulatedFlash::PAGE_SIZE, simulatedErase, simulatedWrite };
+
+class ImportCacheTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        simulated.reset();
+    }
+};
+
+TEST_F(ImportCacheTest, resolveAndReload) {
+    ImportCache cache(flash);
+    cache.load();
+    EXPECT_EQ(cache.find("room-switch"), nullptr);
+    EXPECT_TRUE(cache.resolved("room-switch", 0x12, 3, 17, 1, 1));
+    EXPECT_TRUE(cache.resolved("hall.temperature", 0x20, 9, 40, 12, 3));
+    auto entry = cache.find("room-switch");
+    ASSERT_NE(entry, nullptr);
+    EXPECT_EQ(entry->state, ImportCache::VERIFIED);
+    // Same resolution again is not written
+    auto offset = cache.log.writeOffset;
+    EXPECT_TRUE(cache.resolved("room-switch", 0x12, 3, 17, 1, 1));
+    EXPECT_EQ(cache.log.writeOffset, offset);
+
+    ImportCache restarted(flash);
+    restarted.load();
+    entry = restarted.find("hall.temperature");
+    ASSERT_NE(entry, nullptr);
+    EXPECT_EQ(entry->state, ImportCache::CACHED);
+    EXPECT_EQ(entry->address, 0x20);
+    EXPECT_EQ(entry->tableId, 9);
+    EXPECT_EQ(entry->location, 40);
+    EXPECT_EQ(entry->bits, 12);
+    EXPECT_EQ(entry->typeId, 3);
+    EXPECT_EQ(restarted.log.writeOffset, offset);
+    EXPECT_EQ(restarted.find("hall"), nullptr);
+}
+
+/*
+ * Device imports 6 objects from 3 providers. After a reset it sends IMPORT only for the names
+ * that are not cached or whose provider reported a different tableId.
+ */
+TEST_F(ImportCacheTest, onlyMissingNamesAreResolved) {
+    struct Provider {
+        uint8_t address;
+        uint8_t tableId;
+    };
+    Provider providers[] = { { 0x10, 1 }, { 0x11, 1 }, { 0x12, 1 } };
+    const char* names[] = { "a.switch", "a.level", "b.switch", "b.relay", "c.temperature", "c.humidity" };
+    auto boot = [&]() {
+        ImportCache cache(flash);
+        cache.load();
+        int imports = 0;
+        for (int i = 0; i < 6; i++) {
+            auto& provider = providers[i / 2];
+            if (cache.find(names[i]) == nullptr) {
+                imports++;
+                cache.resolved(names[i], provider.address, provider.tableId, i % 2 * 8, 8, 2);
+            }
+        }
+        // STATE from each provider, entries of an updated one are resolved again
+        for (auto& provider : providers) {
+            if (cache.stateReceived(provider.address, provider.tableId)) {
+                for (int i = 0; i < 6; i++) {
+                    if (cache.find(names[i]) == nullptr) {
+                        imports++;
+                        cache.resolved(names[i], providers[i / 2].address, providers[i / 2].tableId, 0, 8, 2);
+                    }
+                }
+            }
+        }
+        for (int i = 0; i < 6; i++) {
+            auto entry = cache.find(names[i]);
+            EXPECT_NE(entry, nullptr);
+            EXPECT_EQ(entry->state, ImportCache::VERIFIED);
+            EXPECT_EQ(entry->tableId, providers[i / 2].tableId);
+        }
+        return imports;
+    };
+    EXPECT_EQ(boot(), 6);
+    EXPECT_EQ(boot(), 0);
+    providers[1].tableId = 2;
+    EXPECT_EQ(boot(), 2);
+    EXPECT_EQ(boot(), 0);
+}
+
+TEST_F(ImportCacheTest, invalidate) {
+    ImportCache cache(flash);
+    cache.load();
+    cache.resolved("x", 0x30, 1, 0, 1, 1);
+    cache.resolved("y", 0x30, 1, 1, 1, 1);
+    cache.invalidate("x");
+    cache.invalidate("z");
+    EXPECT_EQ(cache.find("x"), nullptr);
+    ImportCache restarted(flash);
+    restarted.load();
+    EXPECT_EQ(restarted.find("x"), nullptr);
+    EXPECT_NE(restarted.find("y"), nullptr);
+}
+
+TEST_F(ImportCacheTest, sameHashDifferentNames) {
+    static_assert(nameHash("room-14591828") == nameHash("room-40040200"));
+    ImportCache cache(flash);
+    cache.load();
+    cache.resolved("room-14591828", 0x10, 1, 8, 1, 1);
+    EXPECT_EQ(cache.find("room-40040200"), nullptr);
+    cache.resolved("room-40040200", 0x20, 2, 16, 8, 2);
+    cache.invalidate("room-14591828");
+    ImportCache restarted(flash);
+    restarted.load();
+    EXPECT_EQ(restarted.find("room-14591828"), nullptr);
+    auto entry = restarted.find("room-40040200");
+    ASSERT_NE(entry, nullptr);
+    EXPECT_EQ(entry->address, 0x20);
+    EXPECT_EQ(entry->tableId, 2);
+    EXPECT_EQ(entry->location, 16);
+}
+
+TEST_F(ImportCacheTest, full) {
+    ImportCache cache(flash);
+    cache.load();
+    for (int i = 0; i < ImportCache::MAX_ENTRIES; i++) {
+        EXPECT_TRUE(cache.resolved(std::to_string(i).c_str(), 0x40, 1, i, 1, 1));
+    }
+    EXPECT_FALSE(cache.resolved("more", 0x40, 1, 0, 1, 1));
+    cache.invalidate("3");
+    EXPECT_TRUE(cache.resolved("more", 0x40, 1, 0, 1, 1));
+    ImportCache restarted(flash);
+    restarted.load();
+    EXPECT_NE(restarted.find("more"), nullptr);
+    EXPECT_EQ(restarted.find("3"), nullptr);
+    EXPECT_NE(restarted.find("31"), nullptr);
+}
+
+TEST_F(ImportCacheTest, compaction) {
+    ImportCache cache(flash);
+    cache.load();
+    for (int i = 0; i < 250; i++) {
+        cache.resolved(std::to_string(i % 5).c_str(), 0x50, i, i, 1, 1);
+    }
+    EXPECT_GE(cache.log.erases, 3u);
+    // Erases alternate between the pages
+    EXPECT_GE(simulated.pageErases[0], 1u);
+    EXPECT_GE(simulated.pageErases[1], 1u);
+    ImportCache restarted(flash);
+    restarted.load();
+    for (int i = 245; i < 250; i++) {
+        auto entry = restarted.find(std::to_string(i % 5).c_str());
+        ASSERT_NE(entry, nullptr);
+        EXPECT_EQ(entry->tableId, i);
+    }
+}
+
+TEST_F(ImportCacheTest, powerLossDuringCompaction) {
+    // Active page full of resolutions, so the next one moves all entries to the other page
+    {
+        ImportCache cache(flash);
+        cache.load();
+        for (int i = 0; i < 10; i++) {
+            cache.resolved(std::to_string(i).c_str(), 0x20 + i, 1, i * 8, 8, 1);
+        }
+        for (int i = 0; cache.log.writeOffset + ImportCache::RECORD_SIZE <= flash.pageSize; i++) {
+            cache.resolved("x", 0x30, i, 0, 1, 1);
+        }
+    }
+    uint8_t full[sizeof(simulated.memory)];
+    std::memcpy(full, simulated.memory, sizeof(full));
+    uint8_t lastTableId;
+    {
+        ImportCache cache(flash);
+        cache.load();
+        lastTableId = cache.find("x")->tableId;
+    }
+    for (int lossAt = 0; ; lossAt++) {
+        simulated.reset(lossAt);
+        std::memcpy(simulated.memory, full, sizeof(full));
+        {
+            ImportCache cache(flash);
+            cache.load();
+            cache.resolved("x", 0x30, 200, 0, 1, 1);
+        }
+        bool interrupted = simulated.powerLost;
+        simulated.powerLost = false;
+        simulated.operationsLeft = SimulatedFlash::NEVER;
+        ImportCache restarted(flash);
+        restarted.load();
+        for (int i = 0; i < 10; i++) {
+            auto entry = restarted.find(std::to_string(i).c_str());
+            ASSERT_NE(entry, nullptr) << "Power lost at " << lossAt;
+            EXPECT_EQ(entry->address, 0x20 + i);
+            EXPECT_EQ(entry->location, i * 8);
+        }
+        auto entry = restarted.find("x");
+        ASSERT_NE(entry, nullptr) << "Power lost at " << lossAt;
+        if (interrupted) {
+            EXPECT_TRUE(entry->tableId == lastTableId || entry->tableId == 200) << "Power lost at " << lossAt;
+        } else {
+            EXPECT_EQ(entry->tableId, 200);
+            EXPECT_EQ(restarted.log.erases, 0u);
+            break;
+        }
+    }
+}
+
+TEST_F(ImportCacheTest, powerLoss) {
+    // Resolutions of each name are numbered by tableId, so any loaded one is known to be real
+    auto run = [](ImportCache& cache) {
+        for (int i = 0; i < 200; i++) {
+            if (i % 7 == 6) {
+                cache.invalidate(std::to_string(i % 4).c_str());
+            } else {
+                cache.resolved(std::to_string(i % 4).c_str(), 0x60 + i % 4, i, i % 4 * 16, 16, 3);
+            }
+            if (simulated.powerLost) {
+                return;
+            }
+        }
+    };
+    simulated.reset(1 << 30);
+    {
+        ImportCache cache(flash);
+        cache.load();
+        run(cache);
+    }
+    int operations = (1 << 30) - simulated.operationsLeft;
+    for (int lossAt = 0; lossAt < operations; lossAt++) {
+        simulated.reset(lossAt);
+        {
+            ImportCache cache(flash);
+            cache.load();
+            run(cache);
+        }
+        simulated.powerLost = false;
+        simulated.operationsLeft = SimulatedFlash::NEVER;
+        ImportCache restarted(flash);
+        restarted.load();
+        for (int name = 0; name < 4; name++) {
+            auto entry = restarted.find(std::to_string(name).c_str());
+            if (entry != nullptr) {
+                EXPECT_EQ(entry->address, 0x60 + name) << "Power lost at " << lossAt;
+                EXPECT_EQ(entry->tableId % 4, name) << "Power lost at " << lossAt;
+                EXPECT_EQ(entry->location, name * 16) << "Power lost at " << lossAt;
+                EXPECT_EQ(entry->bits, 16);
+            }
+        }
+        // Still works after the recovery
+        restarted.resolved("after", 0x70, 1, 0, 1, 1);
+        ImportCache again(flash);
+        again.load();
+        EXPECT_NE(again.find("after"), nullptr) << "Power lost at " << lossAt;
+    }
+}
+
+END_ISOLATED_NAMESPACE
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "test_common.hh"
+
+BEGIN_ISOLATED_NAMESPACE
+
+#define private public
+#define protected public
+
+#include "bootloader/lz.h"
+#include "bootloader/host/LZCompressor.hh"
+#include "bootloader/host/LZCompressor.cc"
+
+// Limits used by the programmer: bootloader buffer, payload space left for CMD_WRITE_LZ, flash write size.
+constexpr size_t MAX_OUTPUT = 1024;
+constexpr size_t MAX_COMPRESSED = 222;
+constexpr size_t ALIGN = 8;
+
+static std::vector<uint8_t> readImage(const char* path, size_t maxSize)
+{
+    std::vector<uint8_t> image;
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr) {
+        return image;
+    }
+    image.resize(maxSize);
+    image.resize(fread(image.data(), 1, maxSize, file));
+    fclose(file);
+    while (image.size() % ALIGN != 0) {
+        image.push_back(0xFF);
+    }
+    return image;
+}
+
+// Compresses the image as the programmer does and decompresses it as the bootloader does.
+static size_t roundTrip(const std::vector<uint8_t>& image, size_t historyBegin)
+{
+    std::vector<uint8_t> flash(image.size(), 0xFF);
+    std::vector<uint8_t> compressed;
+    uint8_t output[MAX_OUTPUT];
+    size_t totalCompressed = 0;
+    LZCompressor compressor(image.data(), image.size(), historyBegin);
+
+    size_t pos = historyBegin;
+    while (pos < image.size()) {
+        size_t chunkSize = compressor.compress(pos, MAX_OUTPUT, MAX_COMPRESSED, ALIGN, compressed);
+        EXPECT_GT(chunkSize, 0);
+        EXPECT_LE(compressed.size(), MAX_COMPRESSED);
+        EXPECT_EQ(chunkSize % ALIGN, 0);
+        if (chunkSize == 0) {
+            break;
+        }
+        int size = lzDecompress(output, sizeof(output), &flash[pos], pos, compressed.data(), compressed.size());
+        EXPECT_EQ(size, (int)chunkSize);
+        if (size > 0) {
+            memcpy(&flash[pos], output, size);
+        }
+        totalCompressed += compressed.size();
+        pos += chunkSize;
+    }
+    // Bytes excluded from the history are written at the end without compression.
+    memcpy(flash.data(), image.data(), historyBegin);
+    totalCompressed += historyBegin;
+
+    EXPECT_TRUE(flash == image);
+    return totalCompressed;
+}
+
+TEST(LZ, emptyAndSmall) {
+    std::vector<uint8_t> compressed;
+    const uint8_t data[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    LZCompressor compressor(data, sizeof(data));
+    EXPECT_EQ(compressor.compress(0, MAX_OUTPUT, MAX_COMPRESSED, ALIGN, compressed), 8);
+    EXPECT_EQ(compressed.size(), 9);
+    EXPECT_EQ(compressed[0], 7);
+    EXPECT_EQ(compressor.compress(0, MAX_OUTPUT, 8, ALIGN, compressed), 0);
+    EXPECT_EQ(compressed.size(), 0);
+}
+
+TEST(LZ, repeatedData) {
+    std::vector<uint8_t> image(4096, 0xFF);
+    size_t total = roundTrip(image, 0);
+    EXPECT_LT(total, image.size() / 8);
+}
+
+TEST(LZ, randomData) {
+    std::vector<uint8_t> image(3000);
+    srand(1234);
+    for (auto& byte : image) {
+        byte = rand();
+    }
+    size_t total = roundTrip(image, 0);
+    // Literals only, one extra token byte per 128 bytes and some waste at chunk ends.
+    EXPECT_LT(total, image.size() + image.size() / 32);
+}
+
+TEST(LZ, deferredFirstUnit) {
+    std::vector<uint8_t> image(2048);
+    for (size_t i = 0; i < image.size(); i++) {
+        image[i] = (i % 24) * 3;
+    }
+    roundTrip(image, ALIGN);
+}
+
+// Application image next to this file, the comm-board firmware built for Cortex-M0+ with -Os.
+// It ends with .data, the ModuleApi table at the end of the application flash is left out.
+static std::string sampleImagePath()
+{
+    std::string source = __FILE__;
+    auto slash = source.rfind('/');
+    return (slash == std::string::npos ? "" : source.substr(0, slash + 1)) + "comm-board.bin";
+}
+
+TEST(LZ, realImage) {
+    // Other application binary may be provided in LZ_TEST_IMAGE
+    const char* path = getenv("LZ_TEST_IMAGE");
+    auto image = readImage(path ? path : sampleImagePath().c_str(), 24 * 1024);
+    ASSERT_GT(image.size(), 0) << "Cannot read " << (path ? path : sampleImagePath());
+    size_t total = roundTrip(image, ALIGN);
+    printf("Image %d bytes, compressed %d bytes (%d%%)\n", (int)image.size(), (int)total, (int)(100 * total / image.size()));
+    EXPECT_LT(total, image.size());
+}
+
+TEST(LZ, malformedStream) {
+    uint8_t output[16];
+    const uint8_t history[4] = { 1, 2, 3, 4 };
+    const uint8_t truncatedMatch[] = { 0x80 };
+    const uint8_t truncatedLiterals[] = { 0x03, 0x00, 0x00 };
+    const uint8_t beforeHistory[] = { 0x80, 0x04 };
+    const uint8_t tooLong[] = { 0xF8, 0x00 };
+    const uint8_t fromHistory[] = { 0x00, 0x05, 0x80, 0x04 };
+    EXPECT_EQ(lzDecompress(output, sizeof(output), &history[4], 4, truncatedMatch, sizeof(truncatedMatch)), -1);
+    EXPECT_EQ(lzDecompress(output, sizeof(output), &history[4], 4, truncatedLiterals, sizeof(truncatedLiterals)), -1);
+    EXPECT_EQ(lzDecompress(output, sizeof(output), &history[4], 4, beforeHistory, sizeof(beforeHistory)), -1);
+    EXPECT_EQ(lzDecompress(output, sizeof(output), &history[4], 4, tooLong, sizeof(tooLong)), -1);
+    EXPECT_EQ(lzDecompress(output, sizeof(output), &history[4], 4, fromHistory, sizeof(fromHistory)), 4);
+    EXPECT_EQ(output[0], 5);
+    EXPECT_EQ(output[1], 1);
+    EXPECT_EQ(output[2], 2);
+    EXPECT_EQ(output[3], 3);
+}
+
+END_ISOLATED_NAMESPACE
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "test_common.hh"
+#include "stub_CMSIS.hh"
+
+BEGIN_ISOLATED_NAMESPACE
+
+#define private public
+#define protected public
+
+#define HW_HH
+#define __COMPILER_BARRIER()
+
+#include "src/common/CRC32.hh"
+#include "src/common/CRC32.cc"
+#include "src/common/PacketInQueue.hh"
+#include "src/common/PacketInQueue.cc"
+#include "src/common/PacketPool.hh"
+#include "src/common/PacketPool.cc"
+#include "src/common/PacketOutQueue.hh"
+#include "src/common/PacketOutQueue.cc"
+#include "src/common/Time.hh"
+#include "src/common/Router.hh"
+#include "src/common/Router.cc"
+#include "src/common/FlashLog.hh"
+#include "src/common/FlashLog.cc"
+#include "src/common/MapStore.hh"
+#include "src/common/MapStore.cc"
+
+uint64_t Time::cachedTime = 0;
+
+#include "stub_Flash.hh"
+
+const MapStore::Flash flash = { simulated.memory, SimulatedFlash::PAGE_SIZE, simulatedErase, simulatedWrite };
+
+class MapStoreTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        simulated.reset();
+    }
+};
+
+TEST_F(MapStoreTest, empty) {
+    MapStore store(flash);
+    uint8_t map[MapStore::MAP_SIZE];
+    std::memset(map, 0x55, sizeof(map));
+    EXPECT_FALSE(store.load(map));
+    for (auto byte : map) {
+        EXPECT_EQ(byte, 0);
+    }
+    // Nothing to save, the flash is left erased
+    store.save(map);
+    EXPECT_EQ(store.log.erases, 0u);
+}
+
+TEST_F(MapStoreTest, saveAndLoad) {
+    uint8_t map[MapStore::MAP_SIZE] = {};
+    MapStore store(flash);
+    store.load(map);
+    MapStore::setEntry(map, 0x02, 1);
+    MapStore::setEntry(map, 0x40, 3);
+    store.save(map);
+    EXPECT_EQ(store.log.erases, 1u);
+    MapStore::setEntry(map, 0x02, 2);
+    MapStore::setEntry(map, 0xFF, 1);
+    store.save(map);
+    EXPECT_EQ(store.log.erases, 1u);
+    EXPECT_EQ(store.entriesWritten, 2u);
+
+    MapStore restarted(flash);
+    uint8_t loaded[MapStore::MAP_SIZE];
+    EXPECT_TRUE(restarted.load(loaded));
+    EXPECT_EQ(std::memcmp(loaded, map, sizeof(map)), 0);
+}
+
+TEST_F(MapStoreTest, wearLevelling) {
+    uint8_t map[MapStore::MAP_SIZE] = {};
+    MapStore store(flash);
+    store.load(map);
+    const size_t entriesPerPage = (SimulatedFlash::PAGE_SIZE - (FlashLog::HEADER_SIZE + MapStore::MAP_SIZE)) / 8;
+    for (int i = 0; i < 1000; i++) {
+        MapStore::setEntry(map, i * 7, i % 4);
+        store.save(map);
+    }
+    // Each erase is followed by a full log
+    EXPECT_LE(store.log.erases, 1 + store.entriesWritten / entriesPerPage);
+    EXPECT_LE(std::abs((int)simulated.pageErases[0] - (int)simulated.pageErases[1]), 1);
+
+    MapStore restarted(flash);
+    uint8_t loaded[MapStore::MAP_SIZE];
+    EXPECT_TRUE(restarted.load(loaded));
+    EXPECT_EQ(std::memcmp(loaded, map, sizeof(map)), 0);
+}
+
+TEST_F(MapStoreTest, sequenceWrapsAround) {
+    uint8_t map[MapStore::MAP_SIZE] = {};
+    MapStore store(flash);
+    store.load(map);
+    store.log.sequence = 0xFFFE;
+    for (int i = 0; i < 3; i++) {
+        MapStore::setEntry(map, 0x10, i + 1);
+        store.compact(map);
+    }
+    EXPECT_EQ(store.log.sequence, 1);
+
+    MapStore restarted(flash);
+    uint8_t loaded[MapStore::MAP_SIZE];
+    EXPECT_TRUE(restarted.load(loaded));
+    EXPECT_EQ(restarted.log.sequence, 1);
+    EXPECT_EQ(MapStore::getEntry(loaded, 0x10), 3);
+}
+
+TEST_F(MapStoreTest, routerRestoresMap) {
+    PacketPool pool;
+    PacketInQueue rxQueue;
+    PacketOutQueue txQueue(pool);
+    PacketInQueue* rxQueues[] = { &rxQueue, &rxQueue };
+    PacketOutQueue* txQueues[] = { &txQueue, &txQueue };
+    Router router(rxQueues, txQueues, 2, pool);
+    MapStore store(flash);
+    uint8_t map[MapStore::MAP_SIZE];
+    store.load(map);
+    router.learn(0x02, 0);
+    router.learn(0x31, 1);
+    EXPECT_TRUE(router.mapChanged);
+    store.save(router.getMap());
+    router.mapChanged = false;
+
+    Router restarted(rxQueues, txQueues, 2, pool);
+    MapStore restartedStore(flash);
+    ASSERT_TRUE(restartedStore.load(map));
+    restarted.setMap(map);
+    EXPECT_FALSE(restarted.mapChanged);
+    EXPECT_EQ(restarted.lookup(0x02), 0);
+    EXPECT_EQ(restarted.lookup(0x31), 1);
+    EXPECT_EQ(restarted.lookup(0x32), Router::UNKNOWN_PORT);
+}
+
+// Same changes are repeated with the power lost at each flash operation in turn
+struct Scenario {
+    std::vector<std::vector<uint8_t>> maps;
+
+    Scenario() {
+        std::mt19937 random(42);
+        std::vector<uint8_t> map(MapStore::MAP_SIZE, 0);
+        for (int i = 0; i < 60; i++) {
+            if (i % 15 == 14) {
+                // Forgotten map
+                std::fill(map.begin(), map.end(), 0);
+            } else {
+                int changes = 1 + random() % 12;
+                for (int j = 0; j < changes; j++) {
+                    MapStore::setEntry(map.data(), random() % 256, random() % 4);
+                }
+            }
+            maps.push_back(map);
+        }
+    }
+};
+
+// Runs the scenario until the power is lost, returns index of the interrupted save
+static size_t run(const Scenario& scenario, std::vector<uint8_t>& initial)
+{
+    MapStore store(flash);
+    store.load(initial.data());
+    for (size_t i = 0; i < scenario.maps.size(); i++) {
+        store.save(scenario.maps[i].data());
+        if (simulated.powerLost) {
+            return i;
+        }
+    }
+    return scenario.maps.size();
+}
+
+TEST_F(MapStoreTest, powerLossRecovery) {
+    Scenario scenario;
+    std::vector<uint8_t> initial(MapStore::MAP_SIZE);
+    // Complete run counts the operations
+    simulated.reset(1 << 30);
+    run(scenario, initial);
+    size_t operations = (1 << 30) - simulated.operationsLeft;
+    ASSERT_GT(operations, 100u);
+
+    for (size_t lossAt = 0; lossAt < operations; lossAt++) {
+        simulated.reset(lossAt);
+        size_t interrupted = run(scenario, initial);
+        ASSERT_LT(interrupted, scenario.maps.size());
+        std::vector<uint8_t> empty(MapStore::MAP_SIZE, 0);
+        auto& before = interrupted == 0 ? empty : scenario.maps[interrupted - 1];
+        auto& after = scenario.maps[interrupted];
+
+        MapStore store(flash);
+        std::vector<uint8_t> loaded(MapStore::MAP_SIZE);
+        store.load(loaded.data());
+        // Entries are written in the address order, so the saved ones form a prefix of the changes
+        bool changed = true;
+        for (int address = 0; address < 256; address++) {
+            auto value = MapStore::getEntry(loaded.data(), address);
+            auto expected = changed ? MapStore::getEntry(after.data(), address) : MapStore::getEntry(before.data(), address);
+            if (changed && value != expected) {
+                changed = false;
+                expected = MapStore::getEntry(before.data(), address);
+            }
+            ASSERT_EQ(value, expected) << "Power lost at operation " << lossAt << ", address " << address;
+        }
+
+        // The store keeps working after the recovery
+        simulated.powerLost = false;
+        simulated.operationsLeft = SimulatedFlash::NEVER;
+        store.save(after.data());
+        MapStore restarted(flash);
+        ASSERT_TRUE(restarted.load(loaded.data()));
+        ASSERT_EQ(loaded, after) << "Power lost at operation " << lossAt;
+    }
+}
+
+END_ISOLATED_NAMESPACE
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "test_common.hh"
+
+BEGIN_ISOLATED_NAMESPACE
+
+#define private public
+#define protected public
+
+#include "src/common/Utils.hh"
+#include "src/common/Time.hh"
+
+uint64_t Time::cachedTime = 0;
+
+#include "stub_WorkQueue.hh"
+
+#include "src/common/MessageBatcher.hh"
+#include "src/common/MessageBatcher.cc"
+
+struct Frame {
+    uint32_t time;
+    std::vector<uint8_t> destinations;
+    std::vector<uint8_t> data;
+};
+
+struct Received {
+    uint8_t source;
+    std::vector<uint8_t> data;
+};
+
+std::vector<Frame> sent;
+std::vector<Received> received;
+
+static void sendCallback(MessageBatcher* batcher, const uint8_t* destinations, int count, const uint8_t* data,
+                         size_t size)
+{
+    sent.push_back({ Time::get32(), std::vector<uint8_t>(destinations, destinations + count),
+                     std::vector<uint8_t>(data, data + size) });
+}
+
+static void receiveCallback(MessageBatcher* batcher, uint8_t source, const uint8_t* data, size_t size)
+{
+    received.push_back({ source, std::vector<uint8_t>(data, data + size) });
+}
+
+class MessageBatcherTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        Time::cachedTime = 1000;
+        workQueue.reset();
+        sent.clear();
+        received.clear();
+    }
+};
+
+TEST_F(MessageBatcherTest, sameDestinationsBatched) {
+    MessageBatcher batcher(sendCallback, receiveCallback);
+    uint8_t destination[] = { 0x20 };
+    uint8_t signal1[] = { 5, 7, 1, 0x81, 1 };
+    uint8_t signal2[] = { 5, 7, 2, 0x02 };
+    uint8_t signal3[] = { 5, 7, 3, 0x03, 0, 1 };
+    EXPECT_TRUE(batcher.send(destination, 1, signal1, sizeof(signal1)));
+    DelayedWork::runUntil(1001);
+    EXPECT_TRUE(batcher.send(destination, 1, signal2, sizeof(signal2)));
+    EXPECT_TRUE(batcher.send(destination, 1, signal3, sizeof(signal3)));
+    EXPECT_EQ(sent.size(), 0u);
+
+    // Window starts with the first message
+    DelayedWork::runUntil(1010);
+    ASSERT_EQ(sent.size(), 1u);
+    EXPECT_EQ(sent[0].time, 1000 + MessageBatcher::WINDOW_MS);
+    EXPECT_THAT(sent[0].destinations, ::testing::ElementsAre(0x20));
+    EXPECT_THAT(sent[0].data, ::testing::ElementsAre(MessageBatcher::TYPE_BATCH, 5, 5, 7, 1, 0x81, 1, 4, 5, 7, 2, 2,
+                                                     6, 5, 7, 3, 3, 0, 1));
+    EXPECT_EQ(batcher.messages, 3u);
+    EXPECT_EQ(batcher.frames, 1u);
+
+    EXPECT_TRUE(batcher.receive(0x10, sent[0].data.data(), sent[0].data.size()));
+    ASSERT_EQ(received.size(), 3u);
+    EXPECT_EQ(received[0].source, 0x10);
+    EXPECT_EQ(received[0].data, std::vector<uint8_t>(signal1, signal1 + sizeof(signal1)));
+    EXPECT_EQ(received[1].data, std::vector<uint8_t>(signal2, signal2 + sizeof(signal2)));
+    EXPECT_EQ(received[2].data, std::vector<uint8_t>(signal3, signal3 + sizeof(signal3)));
+}
+
+TEST_F(MessageBatcherTest, destinationSets) {
+    MessageBatcher batcher(sendCallback, receiveCallback);
+    uint8_t first[] = { 0x30, 0x20 };
+    uint8_t second[] = { 0x20, 0x30 };
+    uint8_t other[] = { 0x20 };
+    uint8_t state[] = { 4, 1, 0xAA };
+    uint8_t delta[] = { 7, 1, 1, 0, 1, 0xAB };
+    batcher.send(first, 2, state, sizeof(state));
+    batcher.send(second, 2, state, sizeof(state));
+    batcher.send(other, 1, state, sizeof(state));
+    batcher.send(nullptr, 0, delta, sizeof(delta));
+    batcher.flush();
+    ASSERT_EQ(sent.size(), 3u);
+    EXPECT_THAT(sent[0].destinations, ::testing::ElementsAre(0x20, 0x30));
+    EXPECT_EQ(sent[0].data.size(), 1 + 2 * (1 + sizeof(state)));
+    // Single message is sent as it is
+    EXPECT_EQ(sent[1].data, std::vector<uint8_t>(state, state + sizeof(state)));
+    EXPECT_EQ(sent[2].destinations.size(), 0u);
+    EXPECT_EQ(sent[2].data, std::vector<uint8_t>(delta, delta + sizeof(delta)));
+    EXPECT_FALSE(batcher.flushWork.scheduled());
+
+    EXPECT_TRUE(batcher.receive(0x10, state, sizeof(state)));
+    ASSERT_EQ(received.size(), 1u);
+    EXPECT_EQ(received[0].data, std::vector<uint8_t>(state, state + sizeof(state)));
+}
+
+TEST_F(MessageBatcherTest, frameLimit) {
+    MessageBatcher batcher(sendCallback, receiveCallback);
+    uint8_t destinations[] = { 1, 2, 3 };
+    size_t capacity = MessageBatcher::MAX_FRAME_SIZE - MessageBatcher::NETWORK_HEADER_SIZE - 3;
+    std::vector<uint8_t> message(100, 3);
+    std::vector<uint8_t> full(capacity, 3);
+    std::vector<uint8_t> tooLong(capacity + 1, 3);
+    uint8_t batch[] = { MessageBatcher::TYPE_BATCH, 1, 3 };
+
+    EXPECT_FALSE(batcher.send(destinations, 3, tooLong.data(), tooLong.size()));
+    EXPECT_FALSE(batcher.send(destinations, 3, batch, sizeof(batch)));
+    EXPECT_FALSE(batcher.send(destinations, 3, message.data(), 0));
+
+    // Third message does not fit, so the first two are sent right away
+    batcher.send(destinations, 3, message.data(), message.size());
+    batcher.send(destinations, 3, message.data(), message.size());
+    batcher.send(destinations, 3, message.data(), message.size());
+    ASSERT_EQ(sent.size(), 1u);
+    EXPECT_EQ(sent[0].data.size(), 1 + 2 * 101u);
+    EXPECT_EQ(sent[0].time, 1000u);
+
+    // Full size message after it
+    batcher.send(destinations, 3, full.data(), full.size());
+    ASSERT_EQ(sent.size(), 2u);
+    EXPECT_EQ(sent[1].data, message);
+    DelayedWork::runUntil(1010);
+    ASSERT_EQ(sent.size(), 3u);
+    EXPECT_EQ(sent[2].data, full);
+
+    // More destinations than a batch has are not batched
+    uint8_t many[] = { 1, 2, 3, 4, 5 };
+    EXPECT_TRUE(batcher.send(many, 5, message.data(), message.size()));
+    EXPECT_EQ(sent.size(), 4u);
+    EXPECT_EQ(batcher.messages, 5u);
+    EXPECT_EQ(batcher.frames, 4u);
+}
+
+TEST_F(MessageBatcherTest, oldestBatchFlushedWhenFull) {
+    MessageBatcher batcher(sendCallback, receiveCallback);
+    uint8_t message[] = { 6, 0, 0, 0, 0, 0, 0 };
+    for (uint8_t i = 1; i <= MessageBatcher::MAX_BATCHES; i++) {
+        batcher.send(&i, 1, message, sizeof(message));
+    }
+    EXPECT_EQ(sent.size(), 0u);
+    uint8_t last = 0x40;
+    batcher.send(&last, 1, message, sizeof(message));
+    ASSERT_EQ(sent.size(), 1u);
+    EXPECT_EQ(sent[0].destinations[0], 1);
+    batcher.send(&last, 1, message, sizeof(message));
+    batcher.send(&last, 1, message, sizeof(message));
+    DelayedWork::runUntil(Time::get32() + 10);
+    ASSERT_EQ(sent.size(), 5u);
+    auto batch = std::find_if(sent.begin(), sent.end(), [&](const Frame& frame) { return frame.destinations[0] == last; });
+    ASSERT_NE(batch, sent.end());
+    EXPECT_EQ(batch->data.size(), 1 + 3 * (1 + sizeof(message)));
+}
+
+TEST_F(MessageBatcherTest, malformedBatchDropped) {
+    MessageBatcher batcher(sendCallback, receiveCallback);
+    uint8_t empty[] = { MessageBatcher::TYPE_BATCH };
+    uint8_t zeroLength[] = { MessageBatcher::TYPE_BATCH, 1, 4, 0 };
+    uint8_t truncated[] = { MessageBatcher::TYPE_BATCH, 1, 4, 3, 7, 1 };
+    uint8_t nested[] = { MessageBatcher::TYPE_BATCH, 1, 4, 3, MessageBatcher::TYPE_BATCH, 1, 4 };
+    EXPECT_FALSE(batcher.receive(0x10, empty, 0));
+    EXPECT_FALSE(batcher.receive(0x10, empty, sizeof(empty)));
+    EXPECT_FALSE(batcher.receive(0x10, zeroLength, sizeof(zeroLength)));
+    EXPECT_FALSE(batcher.receive(0x10, truncated, sizeof(truncated)));
+    EXPECT_FALSE(batcher.receive(0x10, nested, sizeof(nested)));
+    EXPECT_EQ(received.size(), 0u);
+}
+
+/*
+ * Busy scene on one bus segment with 16 devices for 10 seconds:
+ *  - each device broadcasts STATE every second,
+ *  - every 250 ms the scene controller sends two SIGNALs to each of 6 lights, each light broadcasts
+ *    two STATE_DELTAs and sends one SIGNAL_ACK back,
+ *  - at start, one device imports 10 names by hash and two devices respond with 5 EXPORTs each.
+ * Each frame costs 20 bytes of the data link layer (arbitration, ESC/MASK, CRC, ESC/STOP), the network
+ * header and the application messages.
+ */
+struct Message {
+    uint32_t time;
+    uint8_t source;
+    std::vector<uint8_t> destinations;
+    size_t size;
+};
+
+static const size_t DATA_LINK_OVERHEAD = 20;
+
+static size_t busBytes(const std::vector<uint8_t>& destinations, size_t size)
+{
+    return DATA_LINK_OVERHEAD + MessageBatcher::NETWORK_HEADER_SIZE + destinations.size() + size;
+}
+
+TEST_F(MessageBatcherTest, busyScene) {
+    const int DEVICES = 16;
+    const uint8_t CONTROLLER = 1;
+    const uint32_t DURATION = 10000;
+    std::vector<Message> scene;
+    for (uint8_t device = 1; device <= DEVICES; device++) {
+        for (uint32_t time = device * 61; time < DURATION; time += 1000) {
+            scene.push_back({ time, device, {}, 14 }); // STATE
+        }
+    }
+    for (uint32_t time = 100; time < DURATION; time += 250) {
+        for (uint8_t light = 2; light < 8; light++) {
+            scene.push_back({ time, CONTROLLER, { light }, 6 }); // SIGNAL on
+            scene.push_back({ time, CONTROLLER, { light }, 6 }); // SIGNAL level
+            scene.push_back({ time + 5, light, {}, 8 }); // STATE_DELTA
+            scene.push_back({ time + 6, light, {}, 8 }); // STATE_DELTA
+            scene.push_back({ time + 7, light, { CONTROLLER }, 8 }); // SIGNAL_ACK
+        }
+    }
+    for (int i = 0; i < 10; i++) {
+        scene.push_back({ 0, DEVICES, {}, 5 }); // IMPORT_BY_HASH
+        scene.push_back({ 5, (uint8_t)(2 + i % 2), { DEVICES }, 22 }); // EXPORT
+    }
+    std::stable_sort(scene.begin(), scene.end(), [](const Message& a, const Message& b) { return a.time < b.time; });
+
+    size_t plainFrames = scene.size();
+    size_t plainBytes = 0;
+    size_t payload = 0;
+    for (auto& message : scene) {
+        plainBytes += busBytes(message.destinations, message.size);
+        payload += message.size;
+    }
+
+    Time::cachedTime = 0;
+    std::vector<MessageBatcher*> batchers;
+    for (int i = 0; i < DEVICES; i++) {
+        batchers.push_back(new MessageBatcher(sendCallback, receiveCallback));
+    }
+    for (auto& message : scene) {
+        DelayedWork::runUntil(message.time);
+        std::vector<uint8_t> data(message.size, 1);
+        ASSERT_TRUE(batchers[message.source - 1]->send(message.destinations.data(), message.destinations.size(),
+                                                       data.data(), data.size()));
+    }
+    DelayedWork::runUntil(DURATION + 10);
+    size_t batchedBytes = 0;
+    for (auto& frame : sent) {
+        batchedBytes += busBytes(frame.destinations, frame.data.size());
+    }
+    for (auto batcher : batchers) {
+        delete batcher;
+    }
+
+    printf("Busy scene, %zu messages with %zu bytes:\n", scene.size(), payload);
+    printf("  one frame per message: %zu frames, %zu bytes on the bus, %.0f%% efficiency\n", plainFrames,
+           plainBytes, 100.0 * payload / plainBytes);
+    printf("  batched:               %zu frames, %zu bytes on the bus, %.0f%% efficiency, "
+           "at most %u ms added latency\n", sent.size(), batchedBytes, 100.0 * payload / batchedBytes,
+           MessageBatcher::WINDOW_MS);
+    EXPECT_LT(sent.size() * 10, plainFrames * 7);
+    EXPECT_LT(batchedBytes * 10, plainBytes * 8);
+}
+
+END_ISOLATED_NAMESPACE
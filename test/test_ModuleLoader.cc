@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "test_common.hh"
+
+BEGIN_ISOLATED_NAMESPACE
+
+#define private public
+#define protected public
+
+#include "src/common/CRC32.hh"
+#include "src/common/CRC32.cc"
+#include "src/common/ModuleLoader.hh"
+#include "src/common/ModuleLoader.cc"
+
+constexpr size_t FLASH_SIZE = 2048;
+// Executable, so the module's functions can be jumps to the test functions
+uint8_t* const flash = (uint8_t*)mmap(nullptr, FLASH_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+alignas(8) uint8_t ram[256];
+std::string calls;
+
+/* Module built in memory the same way its linker script lays it out */
+struct TestModule {
+    ModuleHeader header;
+    void (*initArray[2])();
+    uint32_t dataInit[3];
+    uint8_t code[5][16];
+};
+
+void constructor1() { calls += "c1 "; }
+void constructor2() { calls += "c2 "; }
+void stop() { calls += "stop "; }
+void recvCallback(uint8_t srcAddress, const uint8_t* data, size_t size) { calls += "recv" + std::to_string(srcAddress) + " "; }
+void updateCallback(uint32_t ticks) { calls += "update" + std::to_string(ticks) + " "; }
+
+TestModule& module = *(TestModule*)flash;
+
+/* Module function at code[index], which jumps to the target */
+template<typename T>
+T thunk(int index, T target)
+{
+    auto code = module.code[index];
+    auto address = (uintptr_t)target;
+#if defined(__x86_64__)
+    code[0] = 0x48; // movabs rax, address
+    code[1] = 0xB8;
+    std::memcpy(&code[2], &address, 8);
+    code[10] = 0xFF; // jmp rax
+    code[11] = 0xE0;
+#elif defined(__i386__)
+    code[0] = 0xB8; // mov eax, address
+    std::memcpy(&code[1], &address, 4);
+    code[5] = 0xFF; // jmp eax
+    code[6] = 0xE0;
+#else
+#error "Jump to the test functions is not implemented for this host"
+#endif
+    return (T)(void*)code;
+}
+uint32_t* const data = (uint32_t*)&ram[0];
+uint32_t* const bss = (uint32_t*)&ram[64];
+
+void seal()
+{
+    size_t crcEnd = offsetof(ModuleHeader, crc) + sizeof(uint32_t);
+    module.header.crc = CRC32::calculate(flash + crcEnd, module.header.size - crcEnd);
+}
+
+class ModuleLoaderTest : public ::testing::Test {
+protected:
+    ModuleLoader loader;
+
+    ModuleLoaderTest() : loader({ flash, FLASH_SIZE }, { ram, sizeof(ram) }) { }
+
+    void SetUp() override {
+        calls.clear();
+        std::memset(flash, 0xFF, FLASH_SIZE);
+        std::memset(ram, 0xAA, sizeof(ram));
+        module.header = {
+            ModuleHeader::MAGIC, ModuleApi::ABI_VERSION, sizeof(ModuleHeader), sizeof(TestModule), 0,
+            module.dataInit, data, data + 3, bss, bss + 4, &module.initArray[0], &module.initArray[2],
+            thunk(0, stop), thunk(1, recvCallback), thunk(2, updateCallback),
+        };
+        module.initArray[0] = thunk(3, constructor1);
+        module.initArray[1] = thunk(4, constructor2);
+        module.dataInit[0] = 1;
+        module.dataInit[1] = 2;
+        module.dataInit[2] = 3;
+        seal();
+    }
+};
+
+TEST_F(ModuleLoaderTest, startAndDispatch) {
+    EXPECT_FALSE(loader.loaded());
+    loader.update(10);
+    EXPECT_EQ(loader.load(), ModuleLoader::OK);
+    EXPECT_TRUE(loader.loaded());
+    EXPECT_EQ(calls, "c1 c2 ");
+    EXPECT_EQ(data[0], 1u);
+    EXPECT_EQ(data[2], 3u);
+    EXPECT_EQ(bss[0], 0u);
+    EXPECT_EQ(bss[3], 0u);
+    EXPECT_EQ(ram[80], 0xAA);
+    loader.update(10);
+    uint8_t packet[] = { 1, 2 };
+    loader.receive(0x12, packet, sizeof(packet));
+    EXPECT_EQ(calls, "c1 c2 update10 recv18 ");
+    loader.unload();
+    EXPECT_FALSE(loader.loaded());
+    loader.update(10);
+    EXPECT_EQ(calls, "c1 c2 update10 recv18 stop ");
+}
+
+TEST_F(ModuleLoaderTest, optionalCallbacks) {
+    module.header.stop = nullptr;
+    module.header.recvCallback = nullptr;
+    seal();
+    EXPECT_EQ(loader.load(), ModuleLoader::OK);
+    loader.receive(0x12, nullptr, 0);
+    loader.update(5);
+    loader.unload();
+    EXPECT_EQ(calls, "c1 c2 update5 ");
+}
+
+TEST_F(ModuleLoaderTest, rejected) {
+    auto expectRejected = [&](ModuleLoader::Result result) {
+        calls.clear();
+        std::memset(ram, 0xAA, sizeof(ram));
+        EXPECT_EQ(loader.load(), result);
+        EXPECT_FALSE(loader.loaded());
+        EXPECT_EQ(calls, "");
+        EXPECT_EQ(data[0], 0xAAAAAAAA);
+        loader.update(1);
+        EXPECT_EQ(calls, "");
+    };
+    auto original = module.header;
+
+    module.header.magic = 0xFFFFFFFF;
+    expectRejected(ModuleLoader::NO_MODULE);
+
+    module.header = original;
+    module.header.abiVersion++;
+    seal();
+    expectRejected(ModuleLoader::BAD_ABI);
+
+    module.header = original;
+    module.header.size = FLASH_SIZE + 8;
+    expectRejected(ModuleLoader::BAD_SIZE);
+
+    module.header = original;
+    seal();
+    module.dataInit[1] ^= 0x100;
+    expectRejected(ModuleLoader::BAD_CRC);
+    module.dataInit[1] ^= 0x100;
+
+    // Linked for other RAM
+    module.header.bssEnd = (uint32_t*)&ram[sizeof(ram) + 4];
+    seal();
+    expectRejected(ModuleLoader::BAD_LAYOUT);
+
+    module.header = original;
+    module.header.dataEnd = data + 40;
+    seal();
+    expectRejected(ModuleLoader::BAD_LAYOUT);
+
+    module.header = original;
+    module.header.initArrayEnd = &module.initArray[0] - 1;
+    seal();
+    expectRejected(ModuleLoader::BAD_LAYOUT);
+
+    // Callbacks and constructors outside of the image
+    module.header = original;
+    module.header.updateCallback = updateCallback;
+    seal();
+    expectRejected(ModuleLoader::BAD_LAYOUT);
+
+    module.header = original;
+    module.header.stop = (void (*)())flash;
+    seal();
+    expectRejected(ModuleLoader::BAD_LAYOUT);
+
+    module.header = original;
+    module.header.recvCallback = (decltype(original.recvCallback))(flash + original.size);
+    seal();
+    expectRejected(ModuleLoader::BAD_LAYOUT);
+
+    module.header = original;
+    module.initArray[1] = constructor2;
+    seal();
+    expectRejected(ModuleLoader::BAD_LAYOUT);
+
+    module.initArray[1] = nullptr;
+    seal();
+    expectRejected(ModuleLoader::BAD_LAYOUT);
+
+    module.initArray[1] = (void (*)())((uintptr_t)module.code[4] | 1); // Thumb bit
+    seal();
+    EXPECT_EQ(loader.check(module.header), ModuleLoader::OK);
+
+    module.initArray[1] = thunk(4, constructor2);
+    seal();
+    EXPECT_EQ(loader.load(), ModuleLoader::OK);
+}
+
+TEST_F(ModuleLoaderTest, replace) {
+    EXPECT_EQ(loader.load(), ModuleLoader::OK);
+    loader.unload();
+    // Region rewritten by the programmer
+    module.dataInit[0] = 7;
+    seal();
+    EXPECT_EQ(loader.load(), ModuleLoader::OK);
+    EXPECT_EQ(data[0], 7u);
+    EXPECT_EQ(calls, "c1 c2 stop c1 c2 ");
+}
+
+END_ISOLATED_NAMESPACE
@@ -1,3 +1,5 @@
+#include <cstring>
+#include <vector>
 
 #include "gtest/gtest.h"
 #include "gmock/gmock.h"
@@ -11,8 +13,11 @@ BEGIN_ISOLATED_NAMESPACE
 #define private public
 #define protected public
 
-#include "src/PacketInQueue.hh"
-#include "src/PacketInQueue.cc"
+#define HW_HH
+#define __COMPILER_BARRIER()
+
+#include "src/common/PacketInQueue.hh"
+#include "src/common/PacketInQueue.cc"
 
 const uint8_t data[] = { 0x01, 0x02, 0x03, 0x04, 0x05 };
 
@@ -211,4 +216,62 @@ TEST(PacketInQueue, wrappedOverrunRead) {
     queue.drop(dataPtr, size);
 }
 
+TEST(PacketInQueue, markedRead) {
+    PacketInQueue queue;
+    bool marked;
+    queue.write(BYTE(ESC));
+    queue.write(maskedPacket, sizeof(maskedPacket));
+    queue.mark(0);
+    queue.write(BYTE(ESC));
+    queue.write(maskedPacket, sizeof(maskedPacket));
+    queue.write(BYTE(ESC));
+    queue.write(maskedPacket, sizeof(maskedPacket));
+    queue.mark(0);
+    queue.write(BYTE(ESC));
+    for (bool expected : { true, false, true }) {
+        int size = queue.peek(dataPtr, marked);
+        EXPECT_EQ(size, sizeof(samplePacket) - 1 - 4);
+        EXPECT_EQ(marked, expected);
+        queue.drop(dataPtr, size);
+    }
+    EXPECT_EQ(queue.markRead, queue.markWrite);
+    EXPECT_EQ(queue.peek(dataPtr, marked), PacketInQueue::NO_PACKET);
+}
+
+TEST(PacketInQueue, markedFull) {
+    PacketInQueue queue;
+    for (int i = 0; i < PacketInQueue::MAX_MARKS; i++) {
+        EXPECT_FALSE(queue.marksFull());
+        queue.mark(0);
+    }
+    EXPECT_TRUE(queue.marksFull());
+    queue.mark(0);
+    EXPECT_EQ((uint8_t)(queue.markWrite - queue.markRead), PacketInQueue::MAX_MARKS);
+}
+
+TEST(PacketInQueue, markedOverrun) {
+    // The marked packet is dropped, the packet which ends at the same position later is not marked
+    auto chunk = [](size_t junkSize) {
+        std::vector<uint8_t> chunk(junkSize, 0x00);
+        chunk.push_back(ESC);
+        chunk.insert(chunk.end(), maskedPacket, maskedPacket + sizeof(maskedPacket));
+        chunk.push_back(ESC);
+        return chunk;
+    };
+    PacketInQueue queue;
+    bool marked;
+    queue.readPos = 21;
+    auto dropped = chunk(40);
+    queue.mark(dropped.size() - 1);
+    EXPECT_TRUE(queue.write(dropped.data(), dropped.size()));
+    EXPECT_EQ(queue.writePos, 20);
+    queue.readPos = queue.writePos;
+    auto stored = chunk(20);
+    queue.write(stored.data(), stored.size());
+    int size = queue.peek(dataPtr, marked);
+    EXPECT_EQ(size, sizeof(samplePacket) - 1 - 4);
+    EXPECT_FALSE(marked);
+    EXPECT_EQ(queue.markRead, queue.markWrite);
+}
+
 END_ISOLATED_NAMESPACE
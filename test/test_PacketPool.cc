@@ -0,0 +1,143 @@
+#include <cstring>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "test_common.hh"
+#include "stub_CMSIS.hh"
+
+BEGIN_ISOLATED_NAMESPACE
+
+#define private public
+#define protected public
+
+#define HW_HH
+#define __COMPILER_BARRIER()
+
+#include "src/common/PacketPool.hh"
+#include "src/common/PacketPool.cc"
+#include "src/common/PacketOutQueue.hh"
+#include "src/common/PacketOutQueue.cc"
+
+const uint8_t data[] = { 0x11, 0x01, 0x02, 0x03 };
+
+TEST(PacketPool, allocateAndRelease) {
+    PacketPool pool;
+    EXPECT_EQ(pool.freeCount(), PacketPool::COUNT);
+    auto buffer = pool.allocate(data, sizeof(data));
+    ASSERT_NE(buffer, nullptr);
+    EXPECT_EQ(buffer->refCount, 1);
+    EXPECT_EQ(buffer->size, sizeof(data));
+    EXPECT_EQ(memcmp(buffer->data, data, sizeof(data)), 0);
+    EXPECT_EQ(pool.freeCount(), PacketPool::COUNT - 1);
+    pool.addRef(buffer);
+    pool.release(buffer);
+    EXPECT_EQ(pool.freeCount(), PacketPool::COUNT - 1);
+    pool.release(buffer);
+    EXPECT_EQ(pool.freeCount(), PacketPool::COUNT);
+}
+
+TEST(PacketPool, exhausted) {
+    PacketPool pool;
+    PacketPool::Buffer* buffers[PacketPool::COUNT];
+    for (int i = 0; i < PacketPool::COUNT - 1; i++) {
+        buffers[i] = pool.allocate(data, sizeof(data));
+        ASSERT_NE(buffers[i], nullptr);
+    }
+    EXPECT_EQ(pool.allocate(data, sizeof(data)), nullptr);
+    EXPECT_EQ(pool.allocationFailures, 1u);
+    buffers[PacketPool::COUNT - 1] = pool.allocate(data, sizeof(data), true);
+    ASSERT_NE(buffers[PacketPool::COUNT - 1], nullptr);
+    EXPECT_EQ(pool.allocate(data, sizeof(data), true), nullptr);
+    EXPECT_EQ(pool.allocationFailures, 2u);
+    pool.release(buffers[3]);
+    EXPECT_EQ(pool.allocate(data, sizeof(data), true), buffers[3]);
+}
+
+TEST(PacketPool, tooLarge) {
+    PacketPool pool;
+    uint8_t large[PacketPool::MAX_SIZE + 1] = { 0 };
+    EXPECT_NE(pool.allocate(large, PacketPool::MAX_SIZE), nullptr);
+    EXPECT_EQ(pool.allocate(large, sizeof(large)), nullptr);
+}
+
+TEST(PacketOutQueue, sharedBuffer) {
+    PacketPool pool;
+    PacketOutQueue first(pool);
+    PacketOutQueue second(pool);
+    auto buffer = pool.allocate(data, sizeof(data));
+    EXPECT_TRUE(first.push(buffer, PacketOutQueue::SIGNAL));
+    EXPECT_TRUE(second.push(buffer, PacketOutQueue::STATE));
+    pool.release(buffer);
+    EXPECT_EQ(buffer->refCount, 2);
+    EXPECT_EQ(first.peek(), buffer);
+    first.pop();
+    EXPECT_EQ(first.peek(), nullptr);
+    EXPECT_EQ(pool.freeCount(), PacketPool::COUNT - 1);
+    EXPECT_EQ(second.peek(), buffer);
+    second.pop();
+    EXPECT_EQ(pool.freeCount(), PacketPool::COUNT);
+    second.pop();
+    EXPECT_EQ(pool.freeCount(), PacketPool::COUNT);
+}
+
+TEST(PacketOutQueue, priorityOrder) {
+    PacketPool pool;
+    PacketOutQueue queue(pool);
+    auto state = pool.allocate(data, 1);
+    auto signal = pool.allocate(data, 2);
+    auto management = pool.allocate(data, 3);
+    queue.push(state, PacketOutQueue::STATE);
+    queue.push(signal, PacketOutQueue::SIGNAL);
+    EXPECT_EQ(queue.peek(), signal);
+    // Packet being transmitted stays the current one
+    queue.push(management, PacketOutQueue::MANAGEMENT);
+    EXPECT_EQ(queue.peek(), signal);
+    queue.pop();
+    EXPECT_EQ(queue.peek(), management);
+    queue.pop();
+    EXPECT_EQ(queue.peek(), state);
+    queue.pop();
+    EXPECT_EQ(queue.peek(), nullptr);
+    EXPECT_EQ(queue.size(), 0u);
+}
+
+TEST(PacketOutQueue, fullDropsLowerPriority) {
+    PacketPool pool;
+    PacketOutQueue queue(pool);
+    auto state = pool.allocate(data, 1);
+    auto signal = pool.allocate(data, 2);
+    auto management = pool.allocate(data, 3);
+    for (size_t i = 0; i < PacketOutQueue::LIMIT; i++) {
+        EXPECT_TRUE(queue.push(state, PacketOutQueue::STATE));
+    }
+    EXPECT_FALSE(queue.push(state, PacketOutQueue::STATE));
+    EXPECT_EQ(queue.droppedPackets, 1u);
+    // The oldest state is on the wire, the others may be replaced
+    EXPECT_EQ(queue.peek(), state);
+    for (size_t i = 0; i < PacketOutQueue::LIMIT - 2; i++) {
+        EXPECT_TRUE(queue.push(signal, PacketOutQueue::SIGNAL));
+    }
+    EXPECT_TRUE(queue.push(management, PacketOutQueue::MANAGEMENT));
+    EXPECT_FALSE(queue.push(signal, PacketOutQueue::SIGNAL));
+    EXPECT_TRUE(queue.push(management, PacketOutQueue::MANAGEMENT));
+    EXPECT_EQ(queue.size(), PacketOutQueue::LIMIT);
+    EXPECT_EQ(queue.droppedPackets, 1u + (PacketOutQueue::LIMIT - 1) + 1u + 1u);
+    EXPECT_EQ(state->refCount, 2);
+    EXPECT_EQ(queue.peek(), state);
+    queue.pop();
+    EXPECT_EQ(queue.peek(), management);
+    queue.pop();
+    EXPECT_EQ(queue.peek(), management);
+    queue.pop();
+    for (size_t i = 0; i < PacketOutQueue::LIMIT - 3; i++) {
+        EXPECT_EQ(queue.peek(), signal);
+        queue.pop();
+    }
+    EXPECT_EQ(queue.peek(), nullptr);
+    EXPECT_EQ(state->refCount, 1);
+    EXPECT_EQ(signal->refCount, 1);
+    EXPECT_EQ(management->refCount, 1);
+}
+
+END_ISOLATED_NAMESPACE
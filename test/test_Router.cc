@@ -0,0 +1,787 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "test_common.hh"
+#include "stub_CMSIS.hh"
+
+BEGIN_ISOLATED_NAMESPACE
+
+#define private public
+#define protected public
+
+#define HW_HH
+#define __COMPILER_BARRIER()
+
+#include "src/common/CRC32.hh"
+#include "src/common/CRC32.cc"
+#include "src/common/PacketInQueue.hh"
+#include "src/common/PacketInQueue.cc"
+#include "src/common/PacketPool.hh"
+#include "src/common/PacketPool.cc"
+#include "src/common/PacketOutQueue.hh"
+#include "src/common/PacketOutQueue.cc"
+#include "src/common/Time.hh"
+#include "src/common/Router.hh"
+#include "src/common/Router.cc"
+
+uint64_t Time::cachedTime = 0;
+
+struct Sent {
+    int port;
+    std::vector<uint8_t> data;
+};
+
+std::vector<Sent> sent;
+
+/* Takes all packets from the transmit queues, port by port */
+void collect(PacketOutQueue* const txQueues[], int portCount)
+{
+    for (int port = 0; port < portCount; port++) {
+        while (auto buffer = txQueues[port]->peek()) {
+            sent.push_back({ port, std::vector<uint8_t>(buffer->data, buffer->data + buffer->size) });
+            txQueues[port]->pop();
+        }
+    }
+}
+
+PacketPool pool;
+PacketInQueue* const noQueues[Router::MAX_PORTS] = { nullptr, nullptr, nullptr };
+PacketOutQueue* const noTxQueues[Router::MAX_PORTS] = { nullptr, nullptr, nullptr };
+
+uint32_t route(Router& router, int ingress, std::vector<uint8_t> packet)
+{
+    return router.route(ingress, packet.data(), packet.size());
+}
+
+TEST(Router, learnAndLookup) {
+    Router router(noQueues, noTxQueues, 3, pool);
+    EXPECT_EQ(router.lookup(0x12), Router::UNKNOWN_PORT);
+    router.learn(0x12, 2);
+    router.learn(0x13, 0);
+    router.learn(0x11, 1);
+    EXPECT_TRUE(router.mapChanged);
+    EXPECT_EQ(router.lookup(0x11), 1);
+    EXPECT_EQ(router.lookup(0x12), 2);
+    EXPECT_EQ(router.lookup(0x13), 0);
+    EXPECT_EQ(router.lookup(0x10), Router::UNKNOWN_PORT);
+    router.mapChanged = false;
+    router.learn(0x12, 2);
+    EXPECT_FALSE(router.mapChanged);
+    router.learn(0x12, 0);
+    EXPECT_TRUE(router.mapChanged);
+    EXPECT_EQ(router.lookup(0x12), 0);
+    router.learn(0xFF, 1);
+    EXPECT_EQ(router.lookup(0xFF), 1);
+    router.forget();
+    EXPECT_EQ(router.lookup(0x12), Router::UNKNOWN_PORT);
+    EXPECT_EQ(router.lookup(0xFF), Router::UNKNOWN_PORT);
+}
+
+TEST(Router, unknownAddressIsNeverLearned) {
+    Router router(noQueues, noTxQueues, 3, pool);
+    router.mapChanged = false;
+    router.learn(Router::UNKNOWN_ADDRESS, 1);
+    EXPECT_FALSE(router.mapChanged);
+    EXPECT_EQ(router.lookup(Router::UNKNOWN_ADDRESS), Router::UNKNOWN_PORT);
+    // Packet from a new device to a known one, the response back goes everywhere
+    router.learn(0x20, 2);
+    EXPECT_EQ(route(router, 0, { 0x11, 0x00, 0x20, 0xAB }), 0b100u);
+    EXPECT_EQ(route(router, 2, { 0x11, 0x20, 0x00, 0xAB }), 0b011u);
+}
+
+TEST(Router, floodUnknownDestination) {
+    Router router(noQueues, noTxQueues, 3, pool);
+    EXPECT_EQ(route(router, 1, { 0x11, 0x05, 0x06 }), 0b101u);
+    EXPECT_EQ(router.floodedPackets, 1u);
+    EXPECT_EQ(router.lookup(0x05), 1);
+    // Response is forwarded just to the port where the source was seen
+    EXPECT_EQ(route(router, 2, { 0x11, 0x06, 0x05 }), 0b010u);
+    EXPECT_EQ(router.floodedPackets, 1u);
+    EXPECT_EQ(router.forwardedPackets, 2u);
+}
+
+TEST(Router, broadcast) {
+    Router router(noQueues, noTxQueues, 3, pool);
+    EXPECT_EQ(route(router, 0, { 0x10, 0x05, 0xAB, 0xCD }), 0b110u);
+    EXPECT_EQ(route(router, 2, { 0x10, 0x06 }), 0b011u);
+    Router twoPorts(noQueues, noTxQueues, 2, pool);
+    EXPECT_EQ(route(twoPorts, 1, { 0x10, 0x05 }), 0b01u);
+}
+
+TEST(Router, duplicateBroadcast) {
+    Time::cachedTime = 1000;
+    Router router(noQueues, noTxQueues, 3, pool);
+    EXPECT_EQ(route(router, 0, { 0x00, 0x05, 0x01 }), 0b110u);
+    // Copy coming back through a redundant path is dropped and does not move the source
+    EXPECT_EQ(route(router, 1, { 0x00, 0x05, 0x01 }), 0u);
+    EXPECT_EQ(router.duplicatePackets, 1u);
+    EXPECT_EQ(router.lookup(0x05), 0);
+    // Other payload or other source is a different packet
+    EXPECT_EQ(route(router, 0, { 0x00, 0x05, 0x02 }), 0b110u);
+    EXPECT_EQ(route(router, 0, { 0x00, 0x06, 0x01 }), 0b110u);
+    // Unicast is not checked, a retransmission to an unknown destination is flooded again
+    EXPECT_EQ(route(router, 0, { 0x11, 0x05, 0x09, 0xAB }), 0b110u);
+    EXPECT_EQ(route(router, 0, { 0x11, 0x05, 0x09, 0xAB }), 0b110u);
+    EXPECT_EQ(route(router, 1, { 0x11, 0x07, 0x05, 0xAB }), 0b001u);
+    EXPECT_EQ(route(router, 1, { 0x11, 0x07, 0x05, 0xAB }), 0b001u);
+    EXPECT_EQ(router.duplicatePackets, 1u);
+    // Repeated after the window
+    Time::cachedTime += Router::DUPLICATE_WINDOW_MS;
+    EXPECT_EQ(route(router, 0, { 0x00, 0x05, 0x01 }), 0b110u);
+    Time::cachedTime = 0;
+}
+
+TEST(Router, duplicateCacheIsLimited) {
+    Router router(noQueues, noTxQueues, 3, pool);
+    for (uint8_t i = 0; i <= Router::RECENT_FLOOD_COUNT; i++) {
+        EXPECT_EQ(route(router, 0, { 0x10, 0x05, i }), 0b110u);
+    }
+    // The oldest one is forgotten
+    EXPECT_EQ(route(router, 1, { 0x10, 0x05, 0 }), 0b101u);
+    EXPECT_EQ(route(router, 1, { 0x10, 0x05, Router::RECENT_FLOOD_COUNT }), 0u);
+}
+
+TEST(Router, multipleDestinations) {
+    Router router(noQueues, noTxQueues, 3, pool);
+    router.learn(0x01, 0);
+    router.learn(0x02, 1);
+    router.learn(0x03, 2);
+    router.learn(0x04, 2);
+    EXPECT_EQ(route(router, 0, { 0x12, 0x01, 0x03, 0x04, 0xAB }), 0b100u);
+    EXPECT_EQ(route(router, 0, { 0x13, 0x01, 0x02, 0x03, 0x04 }), 0b110u);
+    // Same segment as the source, nothing to forward
+    EXPECT_EQ(route(router, 2, { 0x11, 0x03, 0x04 }), 0u);
+    EXPECT_EQ(router.forwardedPackets, 2u);
+    // One unknown destination floods
+    EXPECT_EQ(route(router, 1, { 0x12, 0x02, 0x01, 0x09 }), 0b101u);
+    EXPECT_EQ(router.floodedPackets, 1u);
+}
+
+TEST(Router, invalidPacket) {
+    Router router(noQueues, noTxQueues, 3, pool);
+    EXPECT_EQ(route(router, 0, { 0x13, 0x01, 0x02, 0x03 }), 0b000u);
+    EXPECT_EQ(router.droppedPackets, 1u);
+    EXPECT_EQ(router.lookup(0x01), Router::UNKNOWN_PORT);
+}
+
+std::vector<uint8_t> frame(std::vector<uint8_t> packet)
+{
+    // Test packets do not contain ESC, so no masking is needed
+    auto crc = CRC32::calculate(packet.data(), packet.size());
+    std::vector<uint8_t> frame = { ESC, 0x00 };
+    frame.insert(frame.end(), packet.begin(), packet.end());
+    for (int i = 0; i < 4; i++) {
+        frame.push_back(crc >> (8 * i));
+    }
+    frame.push_back(ESC);
+    frame.push_back(END);
+    return frame;
+}
+
+void writeFrame(PacketInQueue& queue, std::vector<uint8_t> packet)
+{
+    auto bytes = frame(packet);
+    queue.write(bytes.data(), bytes.size());
+}
+
+TEST(Router, process) {
+    PacketPool pool;
+    PacketInQueue queues[3];
+    PacketInQueue* const rxQueues[] = { &queues[0], &queues[1], &queues[2] };
+    PacketOutQueue outQueues[3] = { PacketOutQueue(pool), PacketOutQueue(pool), PacketOutQueue(pool) };
+    PacketOutQueue* const txQueues[] = { &outQueues[0], &outQueues[1], &outQueues[2] };
+    Router router(rxQueues, txQueues, 3, pool);
+    sent.clear();
+    writeFrame(queues[0], { 0x11, 0x01, 0x02, 0x55 });
+    writeFrame(queues[0], { 0x11, 0x01, 0x03, 0x56 });
+    writeFrame(queues[2], { 0x11, 0x02, 0x01, 0x57 });
+    router.process();
+    // Flooded packets are stored just once
+    EXPECT_EQ(pool.freeCount(), PacketPool::COUNT - 3);
+    collect(txQueues, 3);
+    EXPECT_EQ(pool.freeCount(), PacketPool::COUNT);
+    ASSERT_EQ(sent.size(), 5u);
+    EXPECT_EQ(sent[0].port, 0);
+    EXPECT_EQ(sent[0].data, std::vector<uint8_t>({ 0x11, 0x02, 0x01, 0x57 }));
+    EXPECT_EQ(sent[1].port, 1);
+    EXPECT_EQ(sent[1].data, std::vector<uint8_t>({ 0x11, 0x01, 0x02, 0x55 }));
+    EXPECT_EQ(sent[2].port, 1);
+    EXPECT_EQ(sent[2].data, std::vector<uint8_t>({ 0x11, 0x01, 0x03, 0x56 }));
+    EXPECT_EQ(sent[3].port, 2);
+    EXPECT_EQ(sent[3].data, std::vector<uint8_t>({ 0x11, 0x01, 0x02, 0x55 }));
+    EXPECT_EQ(sent[4].port, 2);
+    EXPECT_EQ(sent[4].data, std::vector<uint8_t>({ 0x11, 0x01, 0x03, 0x56 }));
+    sent.clear();
+    router.process();
+    collect(txQueues, 3);
+    EXPECT_EQ(sent.size(), 0u);
+}
+
+class QueueTest : public ::testing::Test
+{
+protected:
+    PacketPool pool;
+    PacketInQueue queues[2];
+    PacketInQueue* const rxQueues[2] = { &queues[0], &queues[1] };
+    PacketOutQueue outQueues[2] = { PacketOutQueue(pool), PacketOutQueue(pool) };
+    PacketOutQueue* const txQueues[2] = { &outQueues[0], &outQueues[1] };
+    Router router;
+
+    QueueTest() : router(rxQueues, txQueues, 2, pool)
+    {
+        sent.clear();
+        Time::cachedTime = 1000;
+        router.address = 0x40;
+        router.learn(0x02, 1);
+    }
+};
+
+TEST_F(QueueTest, priority) {
+    EXPECT_EQ(Router::priority((const uint8_t[]){ 0x00, 0x01, 0x00 }, 3), PacketOutQueue::MANAGEMENT);
+    EXPECT_EQ(Router::priority((const uint8_t[]){ 0x10, 0x01, 0x04, 0x00 }, 4), PacketOutQueue::STATE);
+    EXPECT_EQ(Router::priority((const uint8_t[]){ 0x11, 0x01, 0x02, 0x05, 0x00 }, 5), PacketOutQueue::SIGNAL);
+    EXPECT_EQ(Router::priority((const uint8_t[]){ 0x11, 0x01, 0x02 }, 3), PacketOutQueue::SIGNAL);
+    EXPECT_EQ(Router::priority((const uint8_t[]){ 0x21, 0x01, 0x02, 0x04 }, 4), PacketOutQueue::SIGNAL);
+}
+
+TEST(Router, poolExhausted) {
+    PacketPool pool;
+    PacketInQueue queues[3];
+    PacketInQueue* const rxQueues[] = { &queues[0], &queues[1], &queues[2] };
+    PacketOutQueue outQueues[3] = { PacketOutQueue(pool), PacketOutQueue(pool), PacketOutQueue(pool) };
+    PacketOutQueue* const txQueues[] = { &outQueues[0], &outQueues[1], &outQueues[2] };
+    Router router(rxQueues, txQueues, 3, pool);
+    router.address = 0x40;
+    router.learn(0x02, 1);
+    router.learn(0x03, 2);
+    for (int i = 0; i < PacketPool::COUNT; i++) {
+        writeFrame(queues[0], { 0x11, 0x01, (uint8_t)(i < 4 ? 0x02 : 0x03), 0x05, (uint8_t)i });
+    }
+    router.process();
+    // The last buffer is left for the notice
+    EXPECT_EQ(pool.freeCount(), 0);
+    EXPECT_EQ(router.droppedPackets, 1u);
+    EXPECT_EQ(router.lostNotices, 1u);
+    sent.clear();
+    collect(txQueues, 3);
+    ASSERT_EQ(sent.size(), (size_t)PacketPool::COUNT);
+    EXPECT_EQ(sent[0].port, 0);
+    EXPECT_EQ(sent[0].data, std::vector<uint8_t>({ 0x01, 0x40, 0x01, 0x06, Router::LOST_NO_BUFFER }));
+    EXPECT_EQ(pool.freeCount(), PacketPool::COUNT);
+}
+
+TEST_F(QueueTest, queueFullNotice) {
+    for (size_t i = 0; i < PacketOutQueue::LIMIT; i++) {
+        writeFrame(queues[0], { 0x10, 0x03, 0x04, (uint8_t)i });
+    }
+    router.process();
+    EXPECT_EQ(outQueues[1].size(), PacketOutQueue::LIMIT);
+    EXPECT_NE(outQueues[1].peek(), nullptr);
+    // State that does not fit is reported to its source
+    writeFrame(queues[0], { 0x10, 0x03, 0x04, 0x10 });
+    router.process();
+    EXPECT_EQ(router.lostNotices, 1u);
+    // Signals replace the queued states, except the one being transmitted
+    for (size_t i = 0; i < PacketOutQueue::LIMIT - 1; i++) {
+        writeFrame(queues[0], { 0x11, 0x01, 0x02, 0x05, (uint8_t)i });
+    }
+    router.process();
+    EXPECT_EQ(outQueues[1].droppedPackets, 1 + PacketOutQueue::LIMIT - 1);
+    EXPECT_EQ(router.lostNotices, 1u);
+    // Notices are rate-limited
+    writeFrame(queues[0], { 0x11, 0x01, 0x02, 0x05, 0x10 });
+    router.process();
+    EXPECT_EQ(router.lostNotices, 1u);
+    Time::cachedTime += Router::PACKET_LOST_INTERVAL_MS;
+    writeFrame(queues[0], { 0x11, 0x07, 0x02, 0x05, 0x11 });
+    router.process();
+    EXPECT_EQ(router.lostNotices, 2u);
+    collect(txQueues, 2);
+    ASSERT_EQ(sent.size(), 2 + PacketOutQueue::LIMIT);
+    EXPECT_EQ(sent[0].data, std::vector<uint8_t>({ 0x01, 0x40, 0x03, 0x06, Router::LOST_QUEUE_FULL }));
+    EXPECT_EQ(sent[1].data, std::vector<uint8_t>({ 0x01, 0x40, 0x07, 0x06, Router::LOST_QUEUE_FULL }));
+    EXPECT_EQ(sent[2].port, 1);
+    EXPECT_EQ(sent[2].data, std::vector<uint8_t>({ 0x10, 0x03, 0x04, 0x00 }));
+    EXPECT_EQ(sent[3].data, std::vector<uint8_t>({ 0x11, 0x01, 0x02, 0x05, 0x00 }));
+    EXPECT_EQ(pool.freeCount(), PacketPool::COUNT);
+}
+
+TEST_F(QueueTest, noNoticeForNotice) {
+    router.learn(0x01, 1);
+    for (size_t i = 0; i < PacketOutQueue::LIMIT + 1; i++) {
+        writeFrame(queues[0], { 0x01, 0x05, 0x01, 0x06, 0x01 });
+    }
+    writeFrame(queues[0], { 0x11, 0x00, 0x02, 0x05, 0x00 });
+    router.process();
+    EXPECT_EQ(outQueues[1].droppedPackets, 2u);
+    EXPECT_EQ(router.lostNotices, 0u);
+}
+
+std::vector<uint8_t> transmitted[Router::MAX_PORTS];
+
+void transmitCallback(Router* router, int port, const uint8_t* data, size_t size)
+{
+    transmitted[port].insert(transmitted[port].end(), data, data + size);
+}
+
+/* Feeds the bytes to the router the same way as UART does */
+void receive(Router& router, PacketInQueue& queue, int ingress, const std::vector<uint8_t>& bytes)
+{
+    router.received(ingress, bytes.data(), bytes.size());
+    queue.write(bytes.data(), bytes.size());
+}
+
+class CutThroughTest : public ::testing::Test
+{
+protected:
+    PacketPool pool;
+    PacketInQueue queues[3];
+    PacketInQueue* const rxQueues[3] = { &queues[0], &queues[1], &queues[2] };
+    PacketOutQueue outQueues[3] = { PacketOutQueue(pool), PacketOutQueue(pool), PacketOutQueue(pool) };
+    PacketOutQueue* const txQueues[3] = { &outQueues[0], &outQueues[1], &outQueues[2] };
+    Router router;
+
+    CutThroughTest() : router(rxQueues, txQueues, 3, pool, transmitCallback)
+    {
+        sent.clear();
+        for (auto& output : transmitted) {
+            output.clear();
+        }
+    }
+};
+
+TEST_F(CutThroughTest, streamAfterHeader) {
+    router.learn(0x02, 1);
+    auto bytes = frame({ 0x11, 0x01, 0x02, 0x55, 0x56 });
+    // ESC, mask, FLAGS and SRC are not enough to select the port
+    receive(router, queues[0], 0, std::vector<uint8_t>(bytes.begin(), bytes.begin() + 4));
+    EXPECT_EQ(transmitted[1].size(), 0u);
+    // DST is known, so the header goes out immediately and the rest follows byte by byte
+    receive(router, queues[0], 0, std::vector<uint8_t>(bytes.begin() + 4, bytes.begin() + 5));
+    EXPECT_EQ(transmitted[1], std::vector<uint8_t>(bytes.begin(), bytes.begin() + 5));
+    receive(router, queues[0], 0, std::vector<uint8_t>(bytes.begin() + 5, bytes.begin() + 6));
+    EXPECT_EQ(transmitted[1], std::vector<uint8_t>(bytes.begin(), bytes.begin() + 6));
+    receive(router, queues[0], 0, std::vector<uint8_t>(bytes.begin() + 6, bytes.end()));
+    EXPECT_EQ(transmitted[1], bytes);
+    EXPECT_EQ(transmitted[0].size(), 0u);
+    EXPECT_EQ(transmitted[2].size(), 0u);
+    EXPECT_EQ(router.cutThroughPackets, 1u);
+    // Already forwarded, process() only learns the source
+    EXPECT_EQ(router.lookup(0x01), Router::UNKNOWN_PORT);
+    router.process();
+    collect(txQueues, 3);
+    EXPECT_EQ(sent.size(), 0u);
+    EXPECT_EQ(router.lookup(0x01), 0);
+}
+
+TEST_F(CutThroughTest, busyEgressFallsBack) {
+    router.learn(0x05, 2);
+    auto first = frame({ 0x11, 0x01, 0x05, 0x55 });
+    auto second = frame({ 0x11, 0x02, 0x05, 0x56 });
+    auto third = frame({ 0x11, 0x03, 0x05, 0x57 });
+    // Second frame starts on other port while the first one is still streamed
+    receive(router, queues[0], 0, std::vector<uint8_t>(first.begin(), first.begin() + 6));
+    receive(router, queues[1], 1, second);
+    receive(router, queues[0], 0, std::vector<uint8_t>(first.begin() + 6, first.end()));
+    receive(router, queues[1], 1, third);
+    EXPECT_EQ(transmitted[2].size(), first.size() + third.size());
+    router.process();
+    collect(txQueues, 3);
+    ASSERT_EQ(sent.size(), 1u);
+    EXPECT_EQ(sent[0].port, 2);
+    EXPECT_EQ(sent[0].data, std::vector<uint8_t>({ 0x11, 0x02, 0x05, 0x56 }));
+    EXPECT_EQ(router.cutThroughPackets, 2u);
+    EXPECT_EQ(router.forwardedPackets, 3u);
+}
+
+TEST_F(CutThroughTest, queuedEgressFallsBack) {
+    router.learn(0x05, 2);
+    // Packet waiting in the egress queue goes out first
+    router.forward(1, std::vector<uint8_t>({ 0x11, 0x02, 0x05, 0x56 }).data(), 4);
+    receive(router, queues[0], 0, std::vector<uint8_t>(frame({ 0x11, 0x01, 0x05, 0x55 })));
+    EXPECT_EQ(transmitted[2].size(), 0u);
+    EXPECT_FALSE(router.isStreaming(2));
+    router.process();
+    collect(txQueues, 3);
+    ASSERT_EQ(sent.size(), 2u);
+    EXPECT_EQ(sent[0].data, std::vector<uint8_t>({ 0x11, 0x02, 0x05, 0x56 }));
+    EXPECT_EQ(sent[1].data, std::vector<uint8_t>({ 0x11, 0x01, 0x05, 0x55 }));
+    EXPECT_EQ(router.cutThroughPackets, 0u);
+    // Idle again
+    auto next = frame({ 0x11, 0x01, 0x05, 0x57 });
+    receive(router, queues[0], 0, std::vector<uint8_t>(next.begin(), next.begin() + 6));
+    EXPECT_TRUE(router.isStreaming(2));
+    receive(router, queues[0], 0, std::vector<uint8_t>(next.begin() + 6, next.end()));
+    EXPECT_FALSE(router.isStreaming(2));
+    EXPECT_EQ(transmitted[2], next);
+}
+
+TEST_F(CutThroughTest, abortOnInvalidCrc) {
+    router.learn(0x05, 2);
+    auto bytes = frame({ 0x11, 0x01, 0x05, 0x55 });
+    bytes[bytes.size() - 3] ^= 0x01;
+    receive(router, queues[0], 0, bytes);
+    ASSERT_GE(transmitted[2].size(), bytes.size() - 2);
+    EXPECT_EQ(std::vector<uint8_t>(transmitted[2].begin(), transmitted[2].begin() + bytes.size() - 2),
+              std::vector<uint8_t>(bytes.begin(), bytes.end() - 2));
+    EXPECT_EQ(router.abortedPackets, 1u);
+    EXPECT_EQ(router.cutThroughPackets, 0u);
+    router.process();
+    collect(txQueues, 3);
+    EXPECT_EQ(sent.size(), 0u);
+    EXPECT_EQ(router.lookup(0x01), Router::UNKNOWN_PORT);
+    // The port is free for the next frame
+    transmitted[2].clear();
+    auto next = frame({ 0x11, 0x01, 0x05, 0x56 });
+    receive(router, queues[0], 0, next);
+    EXPECT_EQ(transmitted[2], next);
+}
+
+TEST_F(CutThroughTest, abortTooLong) {
+    router.learn(0x05, 2);
+    std::vector<uint8_t> bytes = { ESC, 0x00, 0x11, 0x01, 0x05 };
+    bytes.resize(2 + 249 + 4 + 10, 0x33);
+    receive(router, queues[0], 0, bytes);
+    EXPECT_EQ(router.abortedPackets, 1u);
+    EXPECT_EQ(transmitted[2].size(), 2 + 249 + 4 + 4u);
+    receive(router, queues[0], 0, frame({ 0x11, 0x01, 0x05, 0x56 }));
+    router.process();
+    collect(txQueues, 3);
+    EXPECT_EQ(sent.size(), 0u);
+    EXPECT_EQ(router.cutThroughPackets, 1u);
+}
+
+TEST_F(CutThroughTest, manyFramesBeforeProcess) {
+    // Only frames which could be marked in the queue are cut through, each frame is forwarded once
+    router.learn(0x05, 2);
+    std::vector<uint8_t> all;
+    std::vector<uint8_t> payloads;
+    for (uint8_t i = 0; payloads.size() < PacketInQueue::MAX_MARKS + 4u; i++) {
+        auto bytes = frame({ 0x11, 0x01, 0x05, i });
+        // Skip frames with ESC in the CRC
+        if (std::find(bytes.begin() + 1, bytes.end() - 2, ESC) == bytes.end() - 2) {
+            payloads.push_back(i);
+            all.insert(all.end(), bytes.begin(), bytes.end());
+        }
+    }
+    receive(router, queues[0], 0, all);
+    EXPECT_EQ(router.cutThroughPackets, (uint32_t)PacketInQueue::MAX_MARKS);
+    router.process();
+    collect(txQueues, 3);
+    ASSERT_EQ(sent.size(), 4u);
+    for (size_t i = 0; i < sent.size(); i++) {
+        EXPECT_EQ(sent[i].data, std::vector<uint8_t>({ 0x11, 0x01, 0x05, payloads[PacketInQueue::MAX_MARKS + i] }));
+    }
+    EXPECT_EQ(router.forwardedPackets, PacketInQueue::MAX_MARKS + 4u);
+    // Marks are free again
+    transmitted[2].clear();
+    auto next = frame({ 0x11, 0x01, 0x05, 0x56 });
+    receive(router, queues[0], 0, next);
+    EXPECT_EQ(transmitted[2], next);
+}
+
+TEST_F(CutThroughTest, overrunDoesNotShiftMarks) {
+    router.learn(0x05, 2);
+    // Flooded frames fill the queue, the cut through frame is dropped by the overrun
+    std::vector<uint8_t> filler;
+    for (int i = 0; filler.size() < PacketInQueue::SIZE - 20; i++) {
+        auto bytes = frame({ 0x11, 0x01, 0x09, (uint8_t)i });
+        filler.insert(filler.end(), bytes.begin(), bytes.end());
+    }
+    receive(router, queues[0], 0, filler);
+    std::vector<uint8_t> packet = { 0x11, 0x01, 0x05 };
+    packet.resize(40, 0x55);
+    auto dropped = frame(packet);
+    uint32_t droppedEnd = queues[0].written + dropped.size() - 2;
+    receive(router, queues[0], 0, dropped);
+    EXPECT_NE(queues[0].overrunBytes, 0u);
+    EXPECT_EQ(router.cutThroughPackets, 1u);
+    router.process();
+    collect(txQueues, 3);
+    sent.clear();
+    // Next frame ends where the dropped one would, it is not cut through, so process() must forward it
+    auto next = frame({ 0x11, 0x01, 0x09, 0x56 });
+    std::vector<uint8_t> bytes(droppedEnd - queues[0].written - (next.size() - 2), 0x00);
+    bytes.insert(bytes.end(), next.begin(), next.end());
+    receive(router, queues[0], 0, bytes);
+    router.process();
+    collect(txQueues, 3);
+    EXPECT_EQ(sent.size(), 2u);
+}
+
+TEST_F(CutThroughTest, unknownDestinationAndBroadcast) {
+    // Flooded packets are checked for duplicates, so they are forwarded when complete
+    receive(router, queues[1], 1, frame({ 0x11, 0x01, 0x09, 0x55 }));
+    receive(router, queues[0], 0, frame({ 0x10, 0x07 }));
+    for (auto& bytes : transmitted) {
+        EXPECT_EQ(bytes.size(), 0u);
+    }
+    router.process();
+    collect(txQueues, 3);
+    ASSERT_EQ(sent.size(), 4u);
+    EXPECT_EQ(sent[0].port, 0);
+    EXPECT_EQ(sent[0].data, std::vector<uint8_t>({ 0x11, 0x01, 0x09, 0x55 }));
+    EXPECT_EQ(sent[1].port, 1);
+    EXPECT_EQ(sent[1].data, std::vector<uint8_t>({ 0x10, 0x07 }));
+    EXPECT_EQ(sent[2].port, 2);
+    EXPECT_EQ(sent[3].port, 2);
+    EXPECT_EQ(router.floodedPackets, 1u);
+    EXPECT_EQ(router.cutThroughPackets, 0u);
+    EXPECT_EQ(router.lookup(0x01), 1);
+    EXPECT_EQ(router.lookup(0x07), 0);
+}
+
+/*
+ * Light switch (address 0x01) behind two routers sends a packet to the relay board (address 0x02).
+ * Latency is the number of byte times between the first byte sent by the switch and the first
+ * byte that reaches the relay board.
+ */
+TEST(Router, cutThroughLatency) {
+    for (bool cutThroughEnabled : { false, true }) {
+        static PacketInQueue queues[2][2];
+        static PacketInQueue* const rxQueuesA[] = { &queues[0][0], &queues[0][1] };
+        static PacketInQueue* const rxQueuesB[] = { &queues[1][0], &queues[1][1] };
+        static std::vector<uint8_t> wire[2]; // Output of router A and router B
+        auto transmitA = [](Router*, int port, const uint8_t* data, size_t size) {
+            wire[0].insert(wire[0].end(), data, data + size);
+        };
+        auto transmitB = [](Router*, int port, const uint8_t* data, size_t size) {
+            wire[1].insert(wire[1].end(), data, data + size);
+        };
+        for (auto& queue : queues) {
+            queue[0] = PacketInQueue();
+            queue[1] = PacketInQueue();
+        }
+        wire[0].clear();
+        wire[1].clear();
+        PacketOutQueue outQueues[2][2] = { { PacketOutQueue(pool), PacketOutQueue(pool) },
+                                           { PacketOutQueue(pool), PacketOutQueue(pool) } };
+        PacketOutQueue* const txQueuesA[] = { &outQueues[0][0], &outQueues[0][1] };
+        PacketOutQueue* const txQueuesB[] = { &outQueues[1][0], &outQueues[1][1] };
+        Router routerA(rxQueuesA, txQueuesA, 2, pool, cutThroughEnabled ? (Router::TransmitCallback)transmitA : nullptr);
+        Router routerB(rxQueuesB, txQueuesB, 2, pool, cutThroughEnabled ? (Router::TransmitCallback)transmitB : nullptr);
+        // Store-and-forward packets are framed when their transmission starts
+        auto transmitQueued = [](PacketOutQueue& queue, std::vector<uint8_t>& output) {
+            while (auto buffer = queue.peek()) {
+                auto bytes = frame(std::vector<uint8_t>(buffer->data, buffer->data + buffer->size));
+                output.insert(output.end(), bytes.begin(), bytes.end());
+                queue.pop();
+            }
+        };
+        routerA.learn(0x02, 1);
+        routerB.learn(0x02, 1);
+
+        std::vector<uint8_t> packet = { 0x11, 0x01, 0x02, 0x01, 0x00, 0x00, 0x01 };
+        packet.resize(40, 0x00);
+        auto bytes = frame(packet);
+        // Each router forwards the byte it received in the previous byte time
+        size_t readA = 0;
+        size_t readB = 0;
+        size_t time = 0;
+        for (; wire[1].empty() && time < 10 * bytes.size(); time++) {
+            if (readB < wire[0].size()) {
+                receive(routerB, queues[1][0], 0, { wire[0][readB++] });
+            }
+            if (readA < wire[0].size() + bytes.size() && readA < bytes.size()) {
+                receive(routerA, queues[0][0], 0, { bytes[readA++] });
+            }
+            routerA.process();
+            routerB.process();
+            transmitQueued(outQueues[0][1], wire[0]);
+            transmitQueued(outQueues[1][1], wire[1]);
+        }
+        printf("Latency of %zu byte frame through 2 routers: %zu byte times (%s)\n",
+               bytes.size(), time, cutThroughEnabled ? "cut-through" : "store-and-forward");
+        if (cutThroughEnabled) {
+            EXPECT_LT(time, 12u);
+        } else {
+            EXPECT_GT(time, 2 * (bytes.size() - 2));
+        }
+    }
+}
+
+/*
+ * Network of routers connected with buses. Each transmission on a bus is received by every
+ * node connected to it. Routers are connected in a tree, so flooding always terminates.
+ *
+ *        bus 0: devices 1..4
+ *          |
+ *      router A --- bus 1: devices 5..8 --- router B --- bus 3: devices 13..16
+ *          |                                    |
+ *        bus 2: devices 9..12                 bus 4: devices 17..20 --- router C --- bus 5: devices 21..24
+ */
+class Network
+{
+public:
+    struct Attachment {
+        Router* router;
+        int port;
+    };
+
+    Router routers[3];
+    std::vector<int> routerBuses[3];
+    std::vector<Attachment> buses[6];
+    std::vector<int> deviceBus;
+    size_t transmissions = 0;
+    uint8_t sequence = 0; // Payload, so repeated packets are not duplicates
+
+    Network() : routers{
+            Router(noQueues, noTxQueues, 3, pool),
+            Router(noQueues, noTxQueues, 3, pool),
+            Router(noQueues, noTxQueues, 2, pool) },
+        deviceBus(25, 0)
+    {
+        connect(0, { 0, 1, 2 });
+        connect(1, { 1, 3, 4 });
+        connect(2, { 4, 5 });
+        for (int address = 1; address <= 24; address++) {
+            deviceBus[address] = (address - 1) / 4;
+        }
+    }
+
+    void connect(int router, std::vector<int> portBuses)
+    {
+        routerBuses[router] = portBuses;
+        for (int port = 0; port < (int)portBuses.size(); port++) {
+            buses[portBuses[port]].push_back({ &routers[router], port });
+        }
+    }
+
+    void transmit(int bus, const std::vector<uint8_t>& packet, const Router* sender)
+    {
+        transmissions++;
+        for (auto& attachment : buses[bus]) {
+            if (attachment.router == sender) {
+                continue;
+            }
+            auto mask = attachment.router->route(attachment.port, packet.data(), packet.size());
+            int index = attachment.router - routers;
+            for (int port = 0; port < attachment.router->portCount; port++) {
+                if (mask & (1 << port)) {
+                    transmit(routerBuses[index][port], packet, attachment.router);
+                }
+            }
+        }
+    }
+
+    void send(uint8_t src, uint8_t dst)
+    {
+        transmit(deviceBus[src], { 0x11, src, dst, 0x00, sequence++ }, nullptr);
+    }
+
+    /* Number of buses on the shortest path between the buses, this is what a perfect router would use */
+    size_t pathLength(int from, int to)
+    {
+        std::vector<size_t> distance(6, 0);
+        std::vector<int> pending = { from };
+        distance[from] = 1;
+        while (!pending.empty()) {
+            int bus = pending.front();
+            pending.erase(pending.begin());
+            for (auto& portBuses : routerBuses) {
+                if (std::find(portBuses.begin(), portBuses.end(), bus) == portBuses.end()) {
+                    continue;
+                }
+                for (int next : portBuses) {
+                    if (distance[next] == 0) {
+                        distance[next] = distance[bus] + 1;
+                        pending.push_back(next);
+                    }
+                }
+            }
+        }
+        return distance[to];
+    }
+};
+
+TEST(Router, floodingAvoidedInSimulation) {
+    constexpr int PACKETS = 2000;
+    Network network;
+    srand(1234);
+    size_t ideal[2] = { 0, 0 };
+    size_t total[2] = { 0, 0 };
+    for (int phase = 0; phase < 2; phase++) {
+        network.transmissions = 0;
+        for (int i = 0; i < PACKETS; i++) {
+            uint8_t src = 1 + rand() % 24;
+            uint8_t dst = 1 + rand() % 24;
+            network.send(src, dst);
+            ideal[phase] += network.pathLength(network.deviceBus[src], network.deviceBus[dst]);
+        }
+        total[phase] = network.transmissions;
+    }
+    size_t flooding = PACKETS * 6;
+    printf("Bus transmissions for %d random unicast packets, 24 devices on 6 buses, 3 routers:\n", PACKETS);
+    printf("    always flooding:      %zu\n", flooding);
+    printf("    learning from empty:  %zu (%zu ideal)\n", total[0], ideal[0]);
+    printf("    after learning:       %zu (%zu ideal), %.0f%% of flooding avoided\n",
+           total[1], ideal[1], 100.0 * (flooding - total[1]) / flooding);
+    EXPECT_LT(total[0], flooding);
+    EXPECT_EQ(total[1], ideal[1]);
+    EXPECT_EQ(network.routers[1].lookup(21), 2);
+    EXPECT_EQ(network.routers[2].lookup(1), 0);
+}
+
+/*
+ * Two routers both connect bus 0 and bus 1, so any flooded packet comes back to them.
+ * Without duplicate suppression a broadcast would circulate forever.
+ */
+TEST(Router, redundantRoutersDoNotMultiplyBroadcasts) {
+    Router routers[2] = { Router(noQueues, noTxQueues, 2, pool), Router(noQueues, noTxQueues, 2, pool) };
+    struct Transmission {
+        int bus;
+        const Router* sender;
+        std::vector<uint8_t> packet;
+    };
+    std::vector<Transmission> pending;
+    size_t transmissions = 0;
+    auto run = [&]() {
+        while (!pending.empty() && transmissions < 1000) {
+            auto transmission = pending.front();
+            pending.erase(pending.begin());
+            transmissions++;
+            for (auto& router : routers) {
+                if (&router == transmission.sender) {
+                    continue;
+                }
+                auto& packet = transmission.packet;
+                auto mask = router.route(transmission.bus, packet.data(), packet.size());
+                for (int port = 0; port < 2; port++) {
+                    if (mask & (1 << port)) {
+                        pending.push_back({ port, &router, packet });
+                    }
+                }
+            }
+        }
+    };
+    // DISCOVERY broadcast from the device 0x01 on bus 0
+    pending.push_back({ 0, nullptr, { 0x00, 0x01, 0x01, 0x00 } });
+    run();
+    EXPECT_EQ(transmissions, 3u);
+    for (auto& router : routers) {
+        EXPECT_EQ(router.duplicatePackets, 1u);
+        EXPECT_EQ(router.lookup(0x01), 0);
+    }
+    // Destination announced itself, so the unicast is not flooded
+    transmissions = 0;
+    pending.push_back({ 1, nullptr, { 0x00, 0x09, 0x01, 0x00 } });
+    run();
+    EXPECT_EQ(transmissions, 3u);
+    transmissions = 0;
+    pending.push_back({ 0, nullptr, { 0x11, 0x02, 0x09, 0x01 } });
+    run();
+    EXPECT_EQ(transmissions, 3u);
+    // Known destination, both routers forward it once
+    transmissions = 0;
+    pending.push_back({ 1, nullptr, { 0x11, 0x02, 0x01, 0x02 } });
+    run();
+    EXPECT_EQ(transmissions, 3u);
+}
+
+END_ISOLATED_NAMESPACE
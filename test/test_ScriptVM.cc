@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "test_common.hh"
+
+BEGIN_ISOLATED_NAMESPACE
+
+#define private public
+#define protected public
+
+#include "src/common/ScriptVM.hh"
+#include "src/common/ScriptVM.cc"
+
+/* Builds images the same way as the modscript compiler */
+struct Assembler {
+    struct Function {
+        uint16_t first;
+        uint16_t count;
+        uint8_t registers;
+        uint8_t params;
+    };
+    std::vector<Function> functions;
+    std::vector<uint8_t> code;
+
+    int begin(uint8_t registers, uint8_t params) {
+        functions.push_back({ (uint16_t)(code.size() / 4), 0, registers, params });
+        return functions.size() - 1;
+    }
+
+    void end() {
+        functions.back().count = code.size() / 4 - functions.back().first;
+    }
+
+    /* Index of the next instruction in the current function */
+    int here() {
+        return code.size() / 4 - functions.back().first;
+    }
+
+    void op(ScriptVM::Op op, int a, int b = 0, int imm = 0) {
+        code.insert(code.end(), { (uint8_t)op, (uint8_t)(a | b << 4), (uint8_t)imm, (uint8_t)(imm >> 8) });
+    }
+
+    void jump(ScriptVM::Op op, int a, int target) {
+        this->op(op, a, 0, target - here() - 1);
+    }
+
+    /* Sets the target of a forward jump at the index */
+    void patch(int at, int target) {
+        int offset = target - at - 1;
+        code[(functions.back().first + at) * 4 + 2] = offset;
+        code[(functions.back().first + at) * 4 + 3] = offset >> 8;
+    }
+
+    std::vector<uint8_t> image(uint16_t memorySize, uint8_t init = ScriptVM::NO_FUNCTION,
+                               uint8_t update = ScriptVM::NO_FUNCTION) {
+        std::vector<uint8_t> image = { 'M', 'S', ScriptVM::VERSION, (uint8_t)functions.size(), (uint8_t)memorySize,
+                                       (uint8_t)(memorySize >> 8), init, update };
+        for (auto& f : functions) {
+            image.insert(image.end(), { (uint8_t)f.first, (uint8_t)(f.first >> 8), (uint8_t)f.count,
+                                        (uint8_t)(f.count >> 8), f.registers, f.params });
+        }
+        image.insert(image.end(), code.begin(), code.end());
+        return image;
+    }
+};
+
+bool inputs[4];
+bool outputs[4];
+int nativeCalls;
+
+int32_t ioRead(ScriptVM* vm, const int32_t* params, int count)
+{
+    nativeCalls++;
+    return inputs[params[0]];
+}
+
+int32_t ioWrite(ScriptVM* vm, const int32_t* params, int count)
+{
+    nativeCalls++;
+    outputs[params[0]] = params[1];
+    return 0;
+}
+
+const ScriptVM::Native natives[] = { ioRead, ioWrite };
+
+enum {
+    IO_READ,
+    IO_WRITE,
+};
+
+TEST(ScriptVM, loopAndArithmetic) {
+    // function sum(n) { n: int32; s: int32; s = 0; while (n > 0) { s += n; n--; } return s; }
+    Assembler a;
+    a.begin(4, 1);
+    a.op(ScriptVM::OP_LOADK, 1, 0, 0);
+    a.op(ScriptVM::OP_LOADK, 2, 0, 1);
+    a.op(ScriptVM::OP_LOADK, 3, 0, 0);
+    int loop = a.here();
+    a.op(ScriptVM::OP_LT, 3, 3, 0); // 0 < n
+    int exit = a.here();
+    a.op(ScriptVM::OP_JZ, 3);
+    a.op(ScriptVM::OP_ADD, 1, 1, 0);
+    a.op(ScriptVM::OP_SUB, 0, 0, 2);
+    a.op(ScriptVM::OP_LOADK, 3, 0, 0);
+    a.jump(ScriptVM::OP_JMP, 0, loop);
+    a.patch(exit, a.here());
+    a.op(ScriptVM::OP_RET, 1);
+    a.end();
+    // function big(x) { return x / 0x12345 + (-7 % 3) + (1 / 0); }
+    a.begin(3, 1);
+    a.op(ScriptVM::OP_LOADK, 1, 0, 0x2345);
+    a.op(ScriptVM::OP_LOADKH, 1, 0, 0x0001);
+    a.op(ScriptVM::OP_DIV, 0, 0, 1);
+    a.op(ScriptVM::OP_LOADK, 1, 0, -7);
+    a.op(ScriptVM::OP_LOADK, 2, 0, 3);
+    a.op(ScriptVM::OP_MOD, 1, 1, 2);
+    a.op(ScriptVM::OP_ADD, 0, 0, 1);
+    a.op(ScriptVM::OP_LOADK, 1, 0, 1);
+    a.op(ScriptVM::OP_LOADK, 2, 0, 0);
+    a.op(ScriptVM::OP_DIV, 1, 1, 2);
+    a.op(ScriptVM::OP_ADD, 0, 0, 1);
+    a.op(ScriptVM::OP_RET, 0);
+    a.end();
+    auto image = a.image(0);
+    ScriptVM vm(natives, 2);
+    ASSERT_EQ(vm.load(image.data(), image.size()), ScriptVM::OK);
+    int32_t n = 10;
+    int32_t result = 0;
+    EXPECT_EQ(vm.call(0, &n, 1, &result), ScriptVM::OK);
+    EXPECT_EQ(result, 55);
+    EXPECT_EQ(vm.executed, 3u + 10 * 6 + 2 + 1);
+    n = 0x12345 * 5;
+    EXPECT_EQ(vm.call(1, &n, 1, &result), ScriptVM::OK);
+    EXPECT_EQ(result, 5 - 1);
+    EXPECT_EQ(vm.call(1, &n, 0, &result), ScriptVM::BAD_IMAGE);
+}
+
+TEST(ScriptVM, memoryTypes) {
+    // Stores each param with other type and loads it back
+    Assembler a;
+    a.begin(2, 1);
+    a.op(ScriptVM::OP_STORE, 0, ScriptVM::TYPE_INT8, 8);
+    a.op(ScriptVM::OP_STORE, 0, ScriptVM::TYPE_INT16, 16);
+    a.op(ScriptVM::OP_STORE, 0, ScriptVM::TYPE_INT32, 32);
+    a.op(ScriptVM::OP_STORE, 0, ScriptVM::TYPE_BOOL, 3);
+    a.op(ScriptVM::OP_LOAD, 1, ScriptVM::TYPE_UINT8, 8);
+    a.op(ScriptVM::OP_RET, 1);
+    a.end();
+    auto image = a.image(8);
+    ScriptVM vm(natives, 2);
+    ASSERT_EQ(vm.load(image.data(), image.size()), ScriptVM::OK);
+    int32_t value = -2;
+    int32_t result = 0;
+    EXPECT_EQ(vm.call(0, &value, 1, &result), ScriptVM::OK);
+    EXPECT_EQ(result, 254);
+    EXPECT_EQ(vm.memory[0], 0x08);
+    EXPECT_EQ(vm.load(ScriptVM::TYPE_INT8, 8), -2);
+    EXPECT_EQ(vm.load(ScriptVM::TYPE_UINT16, 16), 0xFFFE);
+    EXPECT_EQ(vm.load(ScriptVM::TYPE_INT16, 16), -2);
+    EXPECT_EQ(vm.load(ScriptVM::TYPE_INT32, 32), -2);
+    EXPECT_EQ(vm.load(ScriptVM::TYPE_BOOL, 3), 1);
+    EXPECT_EQ(vm.load(ScriptVM::TYPE_BOOL, 2), 0);
+    value = 0;
+    EXPECT_EQ(vm.call(0, &value, 1, &result), ScriptVM::OK);
+    EXPECT_EQ(vm.memory[0], 0x00);
+}
+
+TEST(ScriptVM, framesAndBudget) {
+    // function fact(n) { if (n <= 1) return 1; return n * fact(n - 1); }
+    Assembler a;
+    a.begin(3, 1);
+    a.op(ScriptVM::OP_LOADK, 1, 0, 1);
+    a.op(ScriptVM::OP_LE, 2, 0, 1);
+    int recurse = a.here();
+    a.op(ScriptVM::OP_JZ, 2);
+    a.op(ScriptVM::OP_RET, 1);
+    a.patch(recurse, a.here());
+    a.op(ScriptVM::OP_SUB, 2, 0, 1);
+    a.op(ScriptVM::OP_CALL, 2, 1, 0);
+    a.op(ScriptVM::OP_MUL, 0, 0, 2);
+    a.op(ScriptVM::OP_RET, 0);
+    a.end();
+    // function forever() { while (true) {} }
+    a.begin(1, 0);
+    a.jump(ScriptVM::OP_JMP, 0, 0);
+    a.end();
+    auto image = a.image(0);
+    ScriptVM vm(natives, 2);
+    ASSERT_EQ(vm.load(image.data(), image.size()), ScriptVM::OK);
+    int32_t n = ScriptVM::MAX_FRAMES;
+    int32_t result = 0;
+    EXPECT_EQ(vm.call(0, &n, 1, &result), ScriptVM::OK);
+    EXPECT_EQ(result, 720);
+    n = ScriptVM::MAX_FRAMES + 1;
+    EXPECT_EQ(vm.call(0, &n, 1, &result), ScriptVM::STACK_OVERFLOW);
+    vm.budget = 100;
+    EXPECT_EQ(vm.call(1, nullptr, 0), ScriptVM::OUT_OF_BUDGET);
+    EXPECT_EQ(vm.executed, 100u);
+    n = 3;
+    EXPECT_EQ(vm.call(0, &n, 1, &result), ScriptVM::OK);
+    EXPECT_EQ(result, 6);
+}
+
+TEST(ScriptVM, rejectedImages) {
+    auto build = [](std::function<void(Assembler&)> body, uint8_t nativeCount = 2) {
+        Assembler a;
+        a.begin(2, 1);
+        body(a);
+        a.end();
+        auto image = a.image(4);
+        ScriptVM vm(natives, nativeCount);
+        return vm.load(image.data(), image.size());
+    };
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_RET, 1); }), ScriptVM::OK);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_RET, 2); }), ScriptVM::BAD_IMAGE);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_MOVE, 0, 1); }), ScriptVM::BAD_IMAGE);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_ADD, 0, 1, 2); a.op(ScriptVM::OP_RET, 0); }),
+              ScriptVM::BAD_IMAGE);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_JMP, 0, 0, 1); }), ScriptVM::BAD_IMAGE);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_JMP, 0, 0, -2); }), ScriptVM::BAD_IMAGE);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_LOAD, 0, ScriptVM::TYPE_UINT32, 0); a.op(ScriptVM::OP_RET, 0); }),
+              ScriptVM::OK);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_LOAD, 0, ScriptVM::TYPE_UINT32, 8); a.op(ScriptVM::OP_RET, 0); }),
+              ScriptVM::BAD_IMAGE);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_LOAD, 0, ScriptVM::TYPE_UINT16, 24); a.op(ScriptVM::OP_RET, 0); }),
+              ScriptVM::BAD_IMAGE);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_LOAD, 0, 9, 0); a.op(ScriptVM::OP_RET, 0); }),
+              ScriptVM::BAD_IMAGE);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_CALL, 0, 1, 0); a.op(ScriptVM::OP_RET, 0); }), ScriptVM::OK);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_CALL, 0, 2, 0); a.op(ScriptVM::OP_RET, 0); }),
+              ScriptVM::BAD_IMAGE);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_CALL, 0, 1, 1); a.op(ScriptVM::OP_RET, 0); }),
+              ScriptVM::BAD_IMAGE);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_NATIVE, 0, 2, 1); a.op(ScriptVM::OP_RET, 0); }),
+              ScriptVM::OK);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_NATIVE, 0, 2, 1); a.op(ScriptVM::OP_RET, 0); }, 1),
+              ScriptVM::BAD_IMAGE);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_NATIVE, 1, 2, 1); a.op(ScriptVM::OP_RET, 0); }),
+              ScriptVM::BAD_IMAGE);
+    EXPECT_EQ(build([](Assembler& a) { a.op(ScriptVM::OP_COUNT, 0); a.op(ScriptVM::OP_RET, 0); }),
+              ScriptVM::BAD_IMAGE);
+
+    Assembler a;
+    a.begin(1, 0);
+    a.op(ScriptVM::OP_RET, 0);
+    a.end();
+    auto image = a.image(4, 0, 0);
+    ScriptVM vm(natives, 2);
+    EXPECT_EQ(vm.update(1), ScriptVM::NOT_LOADED);
+    EXPECT_EQ(vm.load(image.data(), image.size() - 1), ScriptVM::BAD_IMAGE);
+    EXPECT_EQ(vm.load(image.data(), 7), ScriptVM::BAD_IMAGE);
+    image[2]++;
+    EXPECT_EQ(vm.load(image.data(), image.size()), ScriptVM::BAD_IMAGE);
+    image[2]--;
+    image[5] = 1;
+    EXPECT_EQ(vm.load(image.data(), image.size()), ScriptVM::BAD_IMAGE);
+    image[5] = 0;
+    EXPECT_EQ(vm.load(image.data(), image.size()), ScriptVM::OK);
+    EXPECT_EQ(vm.init(), ScriptVM::OK);
+    EXPECT_EQ(vm.update(1), ScriptVM::OK);
+    EXPECT_EQ(vm.call(0, nullptr, 0), ScriptVM::OK);
+}
+
+/*
+ * stairsLight from drafts/cppmod-v2.cpp, drafts/modscript/stairs.js compiled by drafts/modscript/main.ts:
+ *
+ *      stairs: {
+ *          in1: bool; in2: bool; last1: bool; last2: bool; out: bool;
+ *          in1 = __io_read(0);
+ *          in2 = __io_read(1);
+ *          if (in1 != last1 || in2 != last2) {
+ *              out = in1 != in2;
+ *          }
+ *          last1 = in1;
+ *          last2 = in2;
+ *          __io_write(2, out);
+ *      }
+ */
+TEST(ScriptVM, stairsLight) {
+    const uint8_t image[] = {
+        0x4D, 0x53, 0x01, 0x01, 0x01, 0x00, 0xFF, 0x00, // Header
+        0x00, 0x00, 0x20, 0x00, 0x03, 0x00, // Function 0: 32 instructions, 3 registers
+        0x00, 0x01, 0x00, 0x00, 0x02, 0x10, 0x00, 0x00, 0x1D, 0x10, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00,
+        0x00, 0x01, 0x01, 0x00, 0x02, 0x10, 0x00, 0x00, 0x1D, 0x10, 0x00, 0x00, 0x04, 0x00, 0x01, 0x00,
+        0x03, 0x00, 0x00, 0x00, 0x03, 0x01, 0x02, 0x00, 0x11, 0x00, 0x01, 0x00, 0x1B, 0x00, 0x04, 0x00,
+        0x03, 0x01, 0x01, 0x00, 0x03, 0x02, 0x03, 0x00, 0x11, 0x11, 0x02, 0x00, 0x02, 0x10, 0x00, 0x00,
+        0x1A, 0x00, 0x04, 0x00, 0x03, 0x00, 0x00, 0x00, 0x03, 0x01, 0x01, 0x00, 0x11, 0x00, 0x01, 0x00,
+        0x04, 0x00, 0x04, 0x00, 0x03, 0x00, 0x00, 0x00, 0x04, 0x00, 0x02, 0x00, 0x03, 0x00, 0x01, 0x00,
+        0x04, 0x00, 0x03, 0x00, 0x00, 0x01, 0x02, 0x00, 0x02, 0x10, 0x00, 0x00, 0x03, 0x02, 0x04, 0x00,
+        0x02, 0x21, 0x00, 0x00, 0x1D, 0x20, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1E, 0x00, 0x00, 0x00,
+    };
+    EXPECT_EQ(sizeof(image), 142u);
+
+    ScriptVM vm(natives, 2);
+    ASSERT_EQ(vm.load(image, sizeof(image)), ScriptVM::OK);
+    ASSERT_EQ(vm.init(), ScriptVM::OK);
+    struct Step {
+        bool in1;
+        bool in2;
+        bool out;
+    };
+    Step steps[] = {
+        { false, false, false },
+        { true, false, true },
+        { true, false, true },
+        { true, true, false },
+        { false, true, true },
+        { false, false, false },
+    };
+    uint32_t maxExecuted = 0;
+    for (auto& step : steps) {
+        inputs[0] = step.in1;
+        inputs[1] = step.in2;
+        EXPECT_EQ(vm.update(10), ScriptVM::OK);
+        EXPECT_EQ(outputs[2], step.out);
+        maxExecuted = std::max(maxExecuted, vm.executed);
+    }
+    EXPECT_LE(maxExecuted, 32u);
+}
+
+END_ISOLATED_NAMESPACE
@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "test_common.hh"
+
+BEGIN_ISOLATED_NAMESPACE
+
+#define private public
+#define protected public
+
+#include "src/common/Utils.hh"
+#include "src/common/Time.hh"
+
+uint64_t Time::cachedTime = 0;
+
+#include "stub_WorkQueue.hh"
+
+#include "src/common/SignalTransport.hh"
+#include "src/common/SignalTransport.cc"
+
+struct Frame {
+    uint32_t time;
+    uint8_t from;
+    uint8_t to;
+    std::vector<uint8_t> data;
+};
+
+struct Delivered {
+    uint8_t address;
+    uint8_t source;
+    uint8_t id;
+    std::vector<uint8_t> params;
+};
+
+struct Failed {
+    uint8_t address;
+    uint8_t id;
+    SignalTransport::Status status;
+};
+
+/* Devices on a bus with fixed latency, frames may be lost */
+struct Network {
+    static constexpr uint32_t LATENCY_MS = 5;
+    std::vector<std::pair<uint8_t, SignalTransport*>> nodes;
+    std::vector<Frame> frames;
+    std::vector<Delivered> delivered;
+    std::vector<Failed> failed;
+    std::mt19937 random;
+    double lossRate;
+    int acksToLose;
+
+    void reset() {
+        nodes.clear();
+        frames.clear();
+        delivered.clear();
+        failed.clear();
+        random.seed(1);
+        lossRate = 0;
+        acksToLose = 0;
+    }
+
+    uint8_t address(SignalTransport* transport) {
+        for (auto& node : nodes) {
+            if (node.second == transport) {
+                return node.first;
+            }
+        }
+        return 0;
+    }
+
+    void send(SignalTransport* transport, uint8_t to, const uint8_t* data, size_t size) {
+        if (data[0] == SignalTransport::TYPE_SIGNAL_ACK && acksToLose > 0) {
+            acksToLose--;
+            return;
+        }
+        if (std::uniform_real_distribution<double>(0, 1)(random) < lossRate) {
+            return;
+        }
+        frames.push_back({ Time::get32() + LATENCY_MS, address(transport), to, std::vector<uint8_t>(data, data + size) });
+    }
+
+    /* Delivers frames and runs delayed works in time order */
+    void run(uint32_t until) {
+        while (true) {
+            uint32_t next = until;
+            Frame* frame = nullptr;
+            for (auto& f : frames) {
+                if ((int32_t)(f.time - next) <= 0 && (frame == nullptr || f.time < frame->time)) {
+                    frame = &f;
+                    next = f.time;
+                }
+            }
+            uint32_t workTime;
+            if (DelayedWork::next(workTime) && (int32_t)(workTime - next) < 0) {
+                if ((int32_t)(workTime - Time::get32()) > 0) {
+                    Time::cachedTime = workTime;
+                }
+                DelayedWork::runDue();
+            } else if (frame != nullptr) {
+                Frame copy = *frame;
+                frames.erase(frames.begin() + (frame - frames.data()));
+                Time::cachedTime = copy.time;
+                for (auto& node : nodes) {
+                    if (node.first == copy.to) {
+                        node.second->receive(copy.from, copy.data.data(), copy.data.size());
+                    }
+                }
+            } else {
+                Time::cachedTime = until;
+                return;
+            }
+        }
+    }
+
+    /* Runs until the sender has nothing in flight, returns the time it took */
+    uint32_t runUntilAcked(SignalTransport& sender, uint8_t address) {
+        uint32_t start = Time::get32();
+        while (sender.inFlight(address) > 0) {
+            run(Time::get32() + 1);
+        }
+        return Time::get32() - start;
+    }
+};
+
+Network network;
+
+void sendCallback(SignalTransport* transport, uint8_t address, const uint8_t* data, size_t size)
+{
+    network.send(transport, address, data, size);
+}
+
+void signalCallback(SignalTransport* transport, uint8_t source, uint8_t id, const uint8_t* params, size_t size)
+{
+    network.delivered.push_back({ network.address(transport), source, id, std::vector<uint8_t>(params, params + size) });
+}
+
+void failedCallback(SignalTransport* transport, uint8_t address, uint8_t id, SignalTransport::Status status)
+{
+    network.failed.push_back({ address, id, status });
+}
+
+const uint8_t SENDER = 0x10;
+const uint8_t RECEIVER = 0x20;
+const uint8_t RECEIVER_TABLE = 7;
+
+class SignalTransportTest : public ::testing::Test {
+protected:
+    SignalTransport sender;
+    SignalTransport receiver;
+
+    SignalTransportTest() :
+        sender(1, sendCallback, signalCallback, failedCallback),
+        receiver(RECEIVER_TABLE, sendCallback, signalCallback, failedCallback) { }
+
+    void SetUp() override {
+        Time::cachedTime = 1000;
+        workQueue.reset();
+        network.reset();
+        network.nodes.push_back({ SENDER, &sender });
+        network.nodes.push_back({ RECEIVER, &receiver });
+    }
+
+    bool send(uint8_t id, uint8_t tableId = RECEIVER_TABLE) {
+        uint8_t params[] = { id, (uint8_t)~id };
+        return sender.send(RECEIVER, tableId, id, params, sizeof(params));
+    }
+};
+
+TEST_F(SignalTransportTest, firstSignalSynchronizes) {
+    EXPECT_TRUE(send(1));
+    // Sequence is not known to the receiver until the first ACK
+    EXPECT_FALSE(send(2));
+    EXPECT_EQ(network.frames[0].data[3], 0x80);
+    network.runUntilAcked(sender, RECEIVER);
+    ASSERT_EQ(network.delivered.size(), 1u);
+    EXPECT_EQ(network.delivered[0].address, RECEIVER);
+    EXPECT_EQ(network.delivered[0].source, SENDER);
+    EXPECT_EQ(network.delivered[0].id, 1);
+    EXPECT_EQ(network.delivered[0].params, std::vector<uint8_t>({ 1, 0xFE }));
+    for (int i = 0; i < SignalTransport::WINDOW; i++) {
+        EXPECT_TRUE(send(10 + i));
+    }
+    EXPECT_FALSE(send(20));
+    EXPECT_EQ(sender.inFlight(RECEIVER), SignalTransport::WINDOW);
+    EXPECT_EQ(network.frames.back().data[3], SignalTransport::WINDOW);
+}
+
+/*
+ * A scene of WINDOW signals to one device is acknowledged by one SIGNAL_ACK in one round trip,
+ * while sending them one by one takes a round trip each.
+ */
+TEST_F(SignalTransportTest, sceneInOneRoundTrip) {
+    send(0);
+    network.runUntilAcked(sender, RECEIVER);
+    auto acks = receiver.acksSent;
+    for (int i = 1; i <= SignalTransport::WINDOW; i++) {
+        EXPECT_TRUE(send(i));
+    }
+    uint32_t windowed = network.runUntilAcked(sender, RECEIVER);
+    EXPECT_EQ(receiver.acksSent - acks, 1u);
+    EXPECT_EQ(windowed, 2 * Network::LATENCY_MS + SignalTransport::ACK_DELAY_MS);
+
+    acks = receiver.acksSent;
+    uint32_t oneByOne = 0;
+    for (int i = 1; i <= SignalTransport::WINDOW; i++) {
+        send(i);
+        oneByOne += network.runUntilAcked(sender, RECEIVER);
+    }
+    EXPECT_EQ(receiver.acksSent - acks, (size_t)SignalTransport::WINDOW);
+    EXPECT_EQ(oneByOne, SignalTransport::WINDOW * windowed);
+    EXPECT_EQ(network.delivered.size(), 1u + 2 * SignalTransport::WINDOW);
+    EXPECT_EQ(sender.retransmissions, 0u);
+}
+
+TEST_F(SignalTransportTest, lostAckIsNotDeliveredTwice) {
+    send(0);
+    network.runUntilAcked(sender, RECEIVER);
+    send(1);
+    send(2);
+    network.acksToLose = 2;
+    uint32_t time = network.runUntilAcked(sender, RECEIVER);
+    EXPECT_EQ(time, 2 * SignalTransport::RETRANSMIT_MS + 2 * Network::LATENCY_MS + SignalTransport::ACK_DELAY_MS);
+    EXPECT_EQ(sender.retransmissions, 4u);
+    EXPECT_EQ(receiver.duplicates, 4u);
+    ASSERT_EQ(network.delivered.size(), 3u);
+    EXPECT_EQ(network.delivered[1].id, 1);
+    EXPECT_EQ(network.delivered[2].id, 2);
+    EXPECT_TRUE(network.failed.empty());
+}
+
+TEST_F(SignalTransportTest, noAck) {
+    network.lossRate = 1;
+    send(5);
+    network.run(Time::get32() + 1000);
+    EXPECT_EQ(sender.retransmissions, (size_t)SignalTransport::MAX_RETRIES);
+    ASSERT_EQ(network.failed.size(), 1u);
+    EXPECT_EQ(network.failed[0].address, RECEIVER);
+    EXPECT_EQ(network.failed[0].id, 5);
+    EXPECT_EQ(network.failed[0].status, SignalTransport::STATUS_NO_ACK);
+    EXPECT_EQ(sender.inFlight(RECEIVER), 0);
+    EXPECT_FALSE(sender.retransmitWork.scheduled());
+    // Still not synchronized
+    network.lossRate = 0;
+    send(6);
+    EXPECT_EQ(network.frames.back().data[3] & 0x80, 0x80);
+}
+
+TEST_F(SignalTransportTest, tableMismatch) {
+    send(0);
+    network.runUntilAcked(sender, RECEIVER);
+    send(1, RECEIVER_TABLE + 1);
+    network.runUntilAcked(sender, RECEIVER);
+    EXPECT_EQ(network.delivered.size(), 1u);
+    ASSERT_EQ(network.failed.size(), 1u);
+    EXPECT_EQ(network.failed[0].id, 1);
+    EXPECT_EQ(network.failed[0].status, SignalTransport::STATUS_TABLE_MISMATCH);
+    // Next ACK is fine again
+    send(2);
+    network.runUntilAcked(sender, RECEIVER);
+    EXPECT_EQ(network.delivered.size(), 2u);
+    EXPECT_EQ(network.failed.size(), 1u);
+}
+
+TEST_F(SignalTransportTest, tableMismatchInWindow) {
+    send(0);
+    network.runUntilAcked(sender, RECEIVER);
+    // One ACK covers signals with both tableIds, only the stale one failed
+    send(1);
+    send(2, RECEIVER_TABLE + 1);
+    send(3);
+    auto acks = receiver.acksSent;
+    network.runUntilAcked(sender, RECEIVER);
+    EXPECT_EQ(receiver.acksSent, acks + 1);
+    ASSERT_EQ(network.delivered.size(), 3u);
+    EXPECT_EQ(network.delivered[1].id, 1);
+    EXPECT_EQ(network.delivered[2].id, 3);
+    ASSERT_EQ(network.failed.size(), 1u);
+    EXPECT_EQ(network.failed[0].id, 2);
+    EXPECT_EQ(network.failed[0].status, SignalTransport::STATUS_TABLE_MISMATCH);
+}
+
+TEST_F(SignalTransportTest, senderReset) {
+    for (int i = 0; i < 5; i++) {
+        send(i);
+        network.runUntilAcked(sender, RECEIVER);
+    }
+    // Restarted sender begins with sequence 0 again, which the receiver has already seen
+    SignalTransport restarted(1, sendCallback, signalCallback, failedCallback);
+    network.nodes[0].second = &restarted;
+    uint8_t params[] = { 0 };
+    restarted.send(RECEIVER, RECEIVER_TABLE, 100, params, 1);
+    network.runUntilAcked(restarted, RECEIVER);
+    restarted.send(RECEIVER, RECEIVER_TABLE, 101, params, 1);
+    network.runUntilAcked(restarted, RECEIVER);
+    ASSERT_EQ(network.delivered.size(), 7u);
+    EXPECT_EQ(network.delivered[5].id, 100);
+    EXPECT_EQ(network.delivered[6].id, 101);
+}
+
+TEST_F(SignalTransportTest, lossyBus) {
+    network.lossRate = 0.2;
+    std::vector<int> deliveries(200);
+    for (int id = 0; id < 200; id++) {
+        while (!send(id)) {
+            network.run(Time::get32() + 1);
+        }
+    }
+    network.run(Time::get32() + 10000);
+    for (auto& delivered : network.delivered) {
+        deliveries[delivered.id]++;
+    }
+    std::vector<int> failed(200);
+    for (auto& f : network.failed) {
+        EXPECT_EQ(f.status, SignalTransport::STATUS_NO_ACK);
+        failed[f.id]++;
+    }
+    for (int id = 0; id < 200; id++) {
+        EXPECT_LE(deliveries[id], 1) << "Signal " << id;
+        if (deliveries[id] == 0) {
+            EXPECT_EQ(failed[id], 1) << "Signal " << id;
+        }
+    }
+    EXPECT_GT(sender.retransmissions, 0u);
+    EXPECT_GT(receiver.duplicates, 0u);
+    EXPECT_GE(network.delivered.size(), 190u);
+}
+
+END_ISOLATED_NAMESPACE
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "test_common.hh"
+
+BEGIN_ISOLATED_NAMESPACE
+
+#define private public
+#define protected public
+
+#include "src/common/CRC32.hh"
+#include "src/common/CRC32.cc"
+#include "src/common/StateTable.hh"
+#include "src/common/StateTable.cc"
+#include "src/common/StateLayout.hh"
+
+constexpr ExportTable exports({
+    exportData<bool>("light-switch"),
+    exportSignal("room-cloud-switch"),
+    exportData<uint8_t>("light-level", 7),
+    exportData<bool>("light-output"),
+    exportData<uint16_t>("temperature", 12),
+    exportData<uint32_t>("energy"),
+});
+
+enum {
+    LIGHT_SWITCH,
+    CLOUD_SWITCH,
+    LIGHT_LEVEL,
+    LIGHT_OUTPUT,
+    TEMPERATURE,
+    ENERGY,
+};
+
+static_assert(exports.count == 6);
+static_assert(exports.bits == 1 + 7 + 1 + 12 + 32);
+static_assert(exports[LIGHT_LEVEL].location == 1);
+static_assert(exports[TEMPERATURE].location == 9);
+static_assert(StateField<exports, ENERGY, uint32_t>::LOCATION == 21);
+static_assert(StateTable::fieldMask(9, 12, 1) == 0xFE);
+static_assert(StateTable::fieldMask(9, 12, 2) == 0x1F);
+static_assert(StateTable::fieldMask(2, 3, 0) == 0x1C);
+static_assert(exports.find("light-level", 11) == LIGHT_LEVEL);
+static_assert(exports.find("light-leve", 10) == -1);
+static_assert(exports.find(nameHash("energy")) == ENERGY);
+
+TEST(StateLayout, exportTable) {
+    EXPECT_STREQ(exports[CLOUD_SWITCH].name, "room-cloud-switch");
+    EXPECT_EQ(exports[CLOUD_SWITCH].kind, EXPORT_KIND_SIGNAL);
+    EXPECT_EQ(exports[LIGHT_LEVEL].kind, EXPORT_KIND_DATA);
+    EXPECT_EQ(exports[LIGHT_LEVEL].typeId, TypeInfo<uint8_t>::id);
+    EXPECT_EQ(exports[LIGHT_LEVEL].bits, 7);
+    EXPECT_EQ(exports[LIGHT_OUTPUT].location, 8);
+}
+
+TEST(StateLayout, nameHashes) {
+    for (auto& item : exports.items) {
+        EXPECT_EQ(item.nameHash, CRC32::calculate(item.name, strlen(item.name))) << item.name;
+    }
+    for (size_t i = 1; i < exports.count; i++) {
+        EXPECT_LT(exports[exports.byHash[i - 1]].nameHash, exports[exports.byHash[i]].nameHash);
+    }
+    for (size_t i = 0; i < exports.count; i++) {
+        EXPECT_EQ(exports.find(exports[i].nameHash), (int)i);
+        EXPECT_EQ(exports.find(exports[i].name, strlen(exports[i].name)), (int)i);
+    }
+    EXPECT_EQ(exports.find(nameHash("light")), -1);
+    EXPECT_EQ(exports.find("light-switch-2", 14), -1);
+    // Same hash, other name
+    EXPECT_EQ(exports.find(exports[ENERGY].nameHash, "energz", 6), -1);
+}
+
+TEST(StateLayout, importLookup) {
+    uint8_t byName[] = { ExportTable<1>::TYPE_IMPORT, 11, 'l', 'i', 'g', 'h', 't', '-', 'l', 'e', 'v', 'e', 'l' };
+    EXPECT_EQ(exports.lookup(byName, sizeof(byName)), LIGHT_LEVEL);
+    EXPECT_EQ(exports.lookup(byName, sizeof(byName) - 1), -1);
+    uint32_t hash = nameHash("room-cloud-switch");
+    uint8_t byHash[] = { ExportTable<1>::TYPE_IMPORT_BY_HASH, (uint8_t)hash, (uint8_t)(hash >> 8), (uint8_t)(hash >> 16),
+                         (uint8_t)(hash >> 24) };
+    EXPECT_EQ(exports.lookup(byHash, sizeof(byHash)), CLOUD_SWITCH);
+    byHash[4] ^= 1;
+    EXPECT_EQ(exports.lookup(byHash, sizeof(byHash)), -1);
+    // The frame does not grow with the name
+    EXPECT_LT(sizeof(byHash), sizeof(byName));
+}
+
+TEST(StateLayout, fields) {
+    StateTable table(1, exports.bits);
+    StateField<exports, LIGHT_SWITCH, bool>::set(table, true);
+    StateField<exports, LIGHT_LEVEL, uint8_t>::set(table, 100);
+    StateField<exports, TEMPERATURE, uint16_t>::set(table, 0xABC);
+    StateField<exports, ENERGY, uint32_t>::set(table, 0x89ABCDEF);
+    EXPECT_TRUE((StateField<exports, LIGHT_SWITCH, bool>::get(table)));
+    EXPECT_FALSE((StateField<exports, LIGHT_OUTPUT, bool>::get(table)));
+    EXPECT_EQ((StateField<exports, LIGHT_LEVEL, uint8_t>::get(table)), 100);
+    EXPECT_EQ((StateField<exports, TEMPERATURE, uint16_t>::get(table)), 0xABC);
+    EXPECT_EQ((StateField<exports, ENERGY, uint32_t>::get(table)), 0x89ABCDEFu);
+    // Same bits as with the run time location
+    EXPECT_EQ(table.get(0, 1), 1u);
+    EXPECT_EQ(table.get(1, 7), 100u);
+    EXPECT_EQ(table.get(9, 12), 0xABCu);
+    EXPECT_EQ(table.get(21, 32), 0x89ABCDEFu);
+    // Bits above the width are not stored
+    StateField<exports, LIGHT_LEVEL, uint8_t>::set(table, 0xFF);
+    EXPECT_EQ((StateField<exports, LIGHT_LEVEL, uint8_t>::get(table)), 0x7F);
+    EXPECT_TRUE((StateField<exports, LIGHT_SWITCH, bool>::get(table)));
+    EXPECT_FALSE((StateField<exports, LIGHT_OUTPUT, bool>::get(table)));
+}
+
+TEST(StateLayout, dirtyBytes) {
+    StateTable table(1, exports.bits);
+    StateField<exports, TEMPERATURE, uint16_t>::set(table, 0);
+    EXPECT_FALSE(table.changed());
+    // Bit 12 is in the third byte only
+    StateField<exports, TEMPERATURE, uint16_t>::set(table, 0x800);
+    EXPECT_EQ(table.dirty[0], 0x04u);
+    StateField<exports, TEMPERATURE, uint16_t>::set(table, 0x801);
+    EXPECT_EQ(table.dirty[0], 0x06u);
+}
+
+template<size_t LOCATION, size_t BITS>
+void compareWithRunTime(StateTable& fixed, StateTable& runTime)
+{
+    for (int i = 0; i < 100; i++) {
+        uint32_t value = rand() ^ rand() << 16;
+        fixed.setField<LOCATION, BITS>(value);
+        runTime.set(LOCATION, BITS, value);
+        ASSERT_EQ(memcmp(fixed.data, runTime.data, sizeof(fixed.data)), 0) << LOCATION << ", " << BITS;
+        ASSERT_EQ(memcmp(fixed.dirty, runTime.dirty, sizeof(fixed.dirty)), 0) << LOCATION << ", " << BITS;
+        ASSERT_EQ((fixed.getField<LOCATION, BITS>()), runTime.get(LOCATION, BITS));
+    }
+}
+
+TEST(StateLayout, sameAsRunTime) {
+    StateTable fixed(1, 128);
+    StateTable runTime(1, 128);
+    srand(1234);
+    compareWithRunTime<0, 1>(fixed, runTime);
+    compareWithRunTime<7, 1>(fixed, runTime);
+    compareWithRunTime<3, 4>(fixed, runTime);
+    compareWithRunTime<5, 9>(fixed, runTime);
+    compareWithRunTime<16, 8>(fixed, runTime);
+    compareWithRunTime<30, 17>(fixed, runTime);
+    compareWithRunTime<64, 32>(fixed, runTime);
+    compareWithRunTime<67, 32>(fixed, runTime);
+}
+
+END_ISOLATED_NAMESPACE
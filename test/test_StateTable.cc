@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstring>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "test_common.hh"
+
+BEGIN_ISOLATED_NAMESPACE
+
+#define private public
+#define protected public
+
+#include "src/common/StateTable.hh"
+#include "src/common/StateTable.cc"
+
+std::vector<uint8_t> update(StateTable& table)
+{
+    uint8_t buffer[StateTable::MAX_MESSAGE_SIZE];
+    auto size = table.buildUpdate(buffer);
+    return std::vector<uint8_t>(buffer, buffer + size);
+}
+
+std::vector<uint8_t> full(StateTable& table)
+{
+    uint8_t buffer[StateTable::MAX_MESSAGE_SIZE];
+    auto size = table.buildFull(buffer);
+    return std::vector<uint8_t>(buffer, buffer + size);
+}
+
+bool receive(StateTable& table, const std::vector<uint8_t>& message)
+{
+    return table.receive(message.data(), message.size());
+}
+
+TEST(StateTable, fields) {
+    StateTable table(5, 40);
+    table.set(0, 1, 1);
+    table.set(3, 12, 0xABC);
+    table.set(31, 8, 0x81);
+    EXPECT_EQ(table.get(0, 1), 1u);
+    EXPECT_EQ(table.get(1, 2), 0u);
+    EXPECT_EQ(table.get(3, 12), 0xABCu);
+    EXPECT_EQ(table.get(31, 8), 0x81u);
+    EXPECT_EQ(table.data[0], 0xE1);
+    EXPECT_EQ(table.data[1], 0x55);
+    EXPECT_EQ(table.data[3], 0x80);
+    EXPECT_EQ(table.data[4], 0x40);
+    EXPECT_EQ(full(table), std::vector<uint8_t>({ 4, 5, 0xE1, 0x55, 0x00, 0x80, 0x40 }));
+}
+
+TEST(StateTable, delta) {
+    StateTable table(5, 8 * 20);
+    EXPECT_FALSE(table.changed());
+    EXPECT_EQ(update(table).size(), 0u);
+    table.set(9, 1, 1);
+    EXPECT_TRUE(table.changed());
+    EXPECT_EQ(update(table), std::vector<uint8_t>({ 7, 5, 1, 1, 1, 0x02 }));
+    EXPECT_FALSE(table.changed());
+    // Same value is not a change
+    table.set(9, 1, 1);
+    EXPECT_FALSE(table.changed());
+    // Close ranges are merged, distant ones are not
+    table.set(16, 8, 0x11);
+    table.set(40, 8, 0x33);
+    table.set(80, 8, 0x55);
+    EXPECT_EQ(update(table), std::vector<uint8_t>({ 7, 5, 2, 2, 4, 0x11, 0, 0, 0x33, 10, 1, 0x55 }));
+    // STATE is sent if it is not longer
+    for (int i = 0; i < 20; i += 2) {
+        table.set(i * 8, 8, 0xFF);
+    }
+    EXPECT_EQ(update(table).size(), 2 + 20u);
+    // Counter starts again after STATE
+    table.set(0, 8, 0);
+    EXPECT_EQ(update(table), std::vector<uint8_t>({ 7, 5, 1, 0, 1, 0x00 }));
+}
+
+TEST(StateTable, receive) {
+    StateTable sender(5, 8 * 10);
+    StateTable receiver(5);
+    sender.set(0, 8, 0x12);
+    // Nothing is known before STATE
+    EXPECT_FALSE(receive(receiver, update(sender)));
+    EXPECT_FALSE(receiver.valid);
+    EXPECT_TRUE(receive(receiver, full(sender)));
+    EXPECT_TRUE(receiver.valid);
+    EXPECT_EQ(receiver.get(0, 8), 0x12u);
+    sender.set(70, 4, 0x9);
+    EXPECT_TRUE(receive(receiver, update(sender)));
+    EXPECT_EQ(receiver.get(70, 4), 0x9u);
+    // Missed delta
+    sender.set(0, 8, 0x34);
+    update(sender);
+    sender.set(8, 8, 0x56);
+    EXPECT_FALSE(receive(receiver, update(sender)));
+    EXPECT_FALSE(receiver.valid);
+    EXPECT_EQ(receiver.missedDeltas, 1u);
+    sender.set(16, 8, 0x78);
+    EXPECT_FALSE(receive(receiver, update(sender)));
+    EXPECT_TRUE(receive(receiver, full(sender)));
+    EXPECT_EQ(memcmp(receiver.data, sender.data, 10), 0);
+    // First delta after STATE is missed
+    sender.set(0, 8, 0x01);
+    update(sender);
+    sender.set(8, 8, 0x02);
+    EXPECT_FALSE(receive(receiver, update(sender)));
+    // Other table or invalid message
+    EXPECT_TRUE(receive(receiver, full(sender)));
+    EXPECT_FALSE(receive(receiver, { 4, 6, 0, 0 }));
+    EXPECT_TRUE(receive(receiver, full(sender)));
+    EXPECT_FALSE(receive(receiver, { 7, 5, 1, 9, 2, 0, 0 }));
+    EXPECT_FALSE(receiver.valid);
+}
+
+/*
+ * Node exports 48 switches and relays (1 bit), 8 levels (8 bits) and 4 measurements (16 bits).
+ * Each event changes one field, a periodic STATE is sent every 50 events. Bus bytes include
+ * the broadcast network header (FLAGS, SRC) and the link layer framing (ESC, mask, CRC, ESC, END).
+ */
+TEST(StateTable, busBytesPerEvent) {
+    constexpr int EVENTS = 5000;
+    constexpr int PERIOD = 50;
+    constexpr size_t OVERHEAD = 2 + 8;
+    constexpr size_t BITS = 48 + 8 * 8 + 4 * 16;
+    size_t bytes[2] = { 0, 0 };
+    for (bool useDelta : { false, true }) {
+        StateTable sender(1, BITS);
+        StateTable receiver(1);
+        srand(1234);
+        for (int event = 0; event < EVENTS; event++) {
+            int field = rand() % 60;
+            if (field < 48) {
+                sender.set(field, 1, !sender.get(field, 1));
+            } else if (field < 56) {
+                sender.set(48 + (field - 48) * 8, 8, rand());
+            } else {
+                sender.set(112 + (field - 56) * 16, 16, rand());
+            }
+            auto message = useDelta && event % PERIOD != 0 ? update(sender) : full(sender);
+            if (message.empty()) {
+                // Same value
+                continue;
+            }
+            bytes[useDelta] += message.size() + OVERHEAD;
+            // Some frames are lost, a received one reveals a missed delta
+            if (rand() % 100 >= 2 && receive(receiver, message)) {
+                ASSERT_EQ(memcmp(receiver.data, sender.data, sender.size), 0) << "Event " << event;
+            }
+        }
+        receive(receiver, full(sender));
+        EXPECT_EQ(memcmp(receiver.data, sender.data, sender.size), 0);
+    }
+    printf("Bus bytes per event, %zu bytes of state: STATE %.1f, STATE_DELTA %.1f\n",
+           (BITS + 7) / 8, (double)bytes[0] / EVENTS, (double)bytes[1] / EVENTS);
+    EXPECT_LT(bytes[1] * 2, bytes[0]);
+}
+
+END_ISOLATED_NAMESPACE